@@ -0,0 +1,24 @@
+#ifndef BITPACK_H
+#define BITPACK_H
+
+#include <cstddef>
+#include <cstdint>
+
+/**
+* 12 bit packing as used by tiff with BitsPerSample=12: two pixels a, b are stored in three bytes,
+* most significant bits first: a[11:4], a[3:0] b[11:8], b[7:0].
+* An odd number of pixels ends with a half filled byte.
+*/
+
+/** Number of bytes num_pixels take up when packed */
+inline size_t packed12_size(size_t num_pixels) {
+    return (num_pixels * 3 + 1) / 2;
+}
+
+/** Packs num_pixels into dest, which must hold packed12_size(num_pixels) bytes. Values above 4095 are saturated. */
+void pack12(uint8_t* dest, const uint16_t* src, size_t num_pixels);
+
+/** Restores num_pixels 16 bit values from packed 12 bit data */
+void unpack12(uint16_t* dest, const uint8_t* src, size_t num_pixels);
+
+#endif //BITPACK_H
@@ -0,0 +1,255 @@
+#ifndef FRAME_OPS_H
+#define FRAME_OPS_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+/** Per pixel maximum of mip and image, stored in mip */
+void fold_max(uint16_t* mip, const uint16_t* image, size_t num_pixels);
+
+/** Adds image to the per pixel sum */
+void accumulate_sum(uint32_t* sum, const uint16_t* image, size_t num_pixels);
+
+/** Mean of count frames from their sum, rounded to the nearest integer */
+void sum_to_mean(uint16_t* mean, const uint32_t* sum, size_t num_pixels, uint32_t count);
+
+/** Number of bins of pixel_statistics histograms, each bin covers 16 values */
+constexpr unsigned int PIXEL_HISTOGRAM_BINS = 4096;
+
+struct PixelStatistics {
+    uint16_t min;
+    uint16_t max;
+    uint64_t sum;
+    /** Fast non cryptographic hash of the pixels, equal for equal images */
+    uint64_t hash;
+};
+
+/** Min, max, sum, hash and histogram of the image in one pass. histogram has to hold PIXEL_HISTOGRAM_BINS values and is overwritten. */
+PixelStatistics pixel_statistics(const uint16_t* image, size_t num_pixels, uint32_t* histogram);
+
+/** Set in FrameStatistics::flags if the frame has the same pixels as the previous frame, e.g. when the camera repeated a frame */
+constexpr uint16_t FRAME_DUPLICATE = 1;
+/** Set in FrameStatistics::flags if all pixels are 0 */
+constexpr uint16_t FRAME_BLANK = 2;
+
+/** Statistics of one frame as computed by StatisticsSink, written as is to binary statistics files */
+struct FrameStatistics {
+    /** Range and index of the frame, see Frame */
+    uint32_t range;
+    uint32_t index;
+    uint16_t min;
+    uint16_t max;
+    /** FRAME_DUPLICATE, FRAME_BLANK */
+    uint16_t flags;
+    /** Always 0, keeps the struct free of padding */
+    uint16_t reserved;
+    double mean;
+    /** Hash of the pixels, see pixel_statistics */
+    uint64_t hash;
+};
+
+/** Sum of |a - b| over all pixels, e.g. how much a frame differs from a background */
+uint64_t sum_abs_difference(const uint16_t* a, const uint16_t* b, size_t num_pixels);
+
+/** Number of pixels above threshold */
+size_t count_above(const uint16_t* image, size_t num_pixels, uint16_t threshold);
+
+/**
+* Moves every background pixel by 1 / 2^shift of its difference to the image, rounded to the nearest integer.
+* The exponential moving average follows slow changes, e.g. of the illumination, but hardly short events. shift is at most 15.
+*/
+void update_background(uint16_t* background, const uint16_t* image, size_t num_pixels, unsigned int shift);
+
+enum class MipBackground {
+    /** Plain MIP */
+    none,
+    /** Subtracts an exponential moving average of the frames, see update_background */
+    ema,
+    /** Subtracts the per pixel minimum over the previous frames of the last one to two windows */
+    minimum
+};
+
+/** "none", "ema" or "min" */
+MipBackground parse_mip_background(const std::string& name);
+
+/**
+* fold_max of image - background, saturated at 0, then moves the background towards the image as update_background does.
+* One pass over the pixels, the background subtracted from each frame only depends on the frames before it.
+*/
+void fold_max_minus_ema(uint16_t* mip, uint16_t* background, const uint16_t* image, size_t num_pixels, unsigned int shift);
+
+/**
+* fold_max of image - min(previous_min, current_min), saturated at 0, then folds the image into current_min. One pass over the pixels.
+* At the end of every window current_min becomes previous_min and starts again at 65535,
+* so each frame has the minimum of the frames of the previous and the current window before it subtracted.
+*/
+void fold_max_minus_min(uint16_t* mip, const uint16_t* previous_min, uint16_t* current_min, const uint16_t* image, size_t num_pixels);
+
+/**
+* fold_max of image into mip, and in the same pass the maximum of every column into xz_row (width values)
+* and the maximum of every row into yz_column (height values), e.g. the side views of one plane of a z-stack.
+* xz_row and yz_column are overwritten.
+*/
+void fold_max_orthogonal(uint16_t* mip, uint16_t* xz_row, uint16_t* yz_column, const uint16_t* image, unsigned int width, unsigned int height);
+
+enum class PyramidReduction {
+    /** Brightest of the 2 x 2 pixels, keeps small bright structures of a MIP visible */
+    max,
+    /** Rounded mean of the 2 x 2 pixels */
+    mean
+};
+
+/** "max" or "mean" */
+PyramidReduction parse_pyramid_reduction(const std::string& name);
+
+/**
+* Halves width and height, every pixel of dest joins 2 x 2 pixels of image.
+* dest has to hold (width / 2) * (height / 2) pixels, an odd last row or column is dropped.
+*/
+void reduce_2x2(uint16_t* dest, const uint16_t* image, unsigned int width, unsigned int height, PyramidReduction reduction);
+
+enum class EventMetric {
+    /** Mean absolute difference of the region to its running background */
+    difference,
+    /** Number of pixels of the region above EventTrigger::pixel_threshold */
+    count
+};
+
+/** "difference" or "count" */
+EventMetric parse_event_metric(const std::string& name);
+
+/** When EventSink keeps frames */
+struct EventTrigger {
+    EventMetric metric = EventMetric::difference;
+    /** Frames scoring at least this belong to an event */
+    double threshold = 0;
+    /** count: pixels above this value are counted */
+    uint16_t pixel_threshold = 0;
+    /**
+    * Region the score is computed in, index starts at 1 and is inclusive as for the camera ROI. All 0 uses the full frame.
+    * Refers to the frames as the sinks get them, i.e. after software crop and binning.
+    */
+    unsigned int roi_x0 = 0;
+    unsigned int roi_y0 = 0;
+    unsigned int roi_x1 = 0;
+    unsigned int roi_y1 = 0;
+    /** Frames kept before the first and after the last frame reaching the threshold */
+    unsigned int pre_trigger = 10;
+    unsigned int post_trigger = 10;
+    /** difference: the background moves by 1 / 2^background_shift towards every frame, at most 15 */
+    unsigned int background_shift = 4;
+};
+
+/** Fixed point flat field gain of 1.0, gains have 14 fractional bits and reach up to 4.0 */
+constexpr uint16_t FLAT_FIELD_GAIN_ONE = 1 << 14;
+
+/**
+* dest = (image - dark) * gain, saturated to 0 - 65535 and rounded.
+* gain is fixed point, see FLAT_FIELD_GAIN_ONE. If gain is nullptr only the dark frame is subtracted.
+*/
+void flat_field_correct(uint16_t* dest, const uint16_t* image, const uint16_t* dark, const uint16_t* gain, size_t num_pixels);
+
+/**
+* Gain map which scales flat - dark of every pixel to the mean of flat - dark over all pixels.
+* Pixels where flat is not above dark keep a gain of 1.0.
+*/
+std::vector<uint16_t> flat_field_gain(const uint16_t* dark, const uint16_t* flat, size_t num_pixels);
+
+/** Dark frame and gain map for flat field correction, with the size of the transferred images */
+struct FlatField {
+    unsigned int width = 0;
+    unsigned int height = 0;
+    std::vector<uint16_t> dark;
+    /** Fixed point gain per pixel, see FLAT_FIELD_GAIN_ONE. Empty to only subtract the dark frame. */
+    std::vector<uint16_t> gain;
+};
+
+/** Defective pixel, index starts at 0 */
+struct HotPixel {
+    unsigned int x;
+    unsigned int y;
+};
+
+enum class HotPixelReplacement {
+    /** Median of the neighbours, keeps edges sharp */
+    median,
+    /** Rounded mean of the neighbours */
+    mean
+};
+
+/** "median" or "mean" */
+HotPixelReplacement parse_hot_pixel_replacement(const std::string& name);
+
+/** Pixels replaced by their 8 neighbours which are not hot pixels themselves, create with make_hot_pixel_map */
+struct HotPixelMap {
+    /** Sorted by row, then column, without duplicates */
+    std::vector<HotPixel> pixels;
+    /** Per pixel, bit n is set if neighbour n (row major, without the pixel itself) is not a hot pixel */
+    std::vector<uint8_t> neighbours;
+    HotPixelReplacement replacement = HotPixelReplacement::median;
+};
+
+/** Sorts the pixels and looks up their neighbours once, so replacing them only touches the hot pixels and their neighbours */
+std::shared_ptr<HotPixelMap> make_hot_pixel_map(std::vector<HotPixel> pixels, HotPixelReplacement replacement);
+
+/**
+* Pixels of a dark frame that are more than threshold_sigma standard deviations above its median.
+* The standard deviation is estimated from the median absolute deviation, so the hot pixels themselves don't inflate it.
+*/
+std::vector<HotPixel> detect_hot_pixels(const uint16_t* dark, unsigned int width, unsigned int height, double threshold_sigma);
+
+/** Reads a text file with one "x y" pair per line, index starts at 1 as for the camera ROI. Lines starting with # are ignored. */
+std::vector<HotPixel> read_hot_pixels(const std::string& path);
+
+/** Writes pixels in the format of read_hot_pixels */
+void write_hot_pixels(const std::string& path, const std::vector<HotPixel>& pixels);
+
+enum class SpatialBinning {
+    /** Rounded mean of the binned pixels */
+    mean,
+    /** Sum of the binned pixels, saturated at 65535 */
+    sum
+};
+
+/** "mean" or "sum" */
+SpatialBinning parse_spatial_binning(const std::string& name);
+
+/** Correction, crop and binning applied to every frame before it is passed to the sinks, see FramePipeline */
+struct FrameProcessing {
+    /** Applied to the full image before cropping and binning, nullptr disables the correction */
+    std::shared_ptr<const FlatField> flat_field;
+    /** Replaced after the flat field correction, before cropping and binning. nullptr disables the replacement. */
+    std::shared_ptr<const HotPixelMap> hot_pixels;
+    /** Region to keep, index starts at 1 and is inclusive as for the camera ROI. All 0 keeps the full image. */
+    unsigned int roi_x0 = 0;
+    unsigned int roi_y0 = 0;
+    unsigned int roi_x1 = 0;
+    unsigned int roi_y1 = 0;
+    /**
+    * Joins bin x bin pixels of the region into one, 1 keeps all pixels.
+    * Pixels at the right and bottom edge which do not fill a bin are dropped.
+    */
+    unsigned int bin = 1;
+    SpatialBinning binning = SpatialBinning::mean;
+};
+
+/** True if the processing changes frames */
+bool frame_processing_active(const FrameProcessing& processing);
+
+/**
+* Size of a processed frame of width x height.
+* Throws if the region or a hot pixel does not fit into the frame or the flat field has a different size.
+*/
+void processed_frame_size(const FrameProcessing& processing, unsigned int width, unsigned int height, unsigned int& out_width, unsigned int& out_height);
+
+/**
+* Corrects, crops and bins image into dest, which has to hold processed_frame_size pixels.
+* Reads every pixel of the region once, pixels outside of it are not corrected.
+* The cost of the hot pixel replacement is proportional to the number of hot pixels.
+*/
+void process_frame(uint16_t* dest, const uint16_t* image, unsigned int width, unsigned int height, const FrameProcessing& processing);
+
+#endif //FRAME_OPS_H
@@ -0,0 +1,71 @@
+#ifndef FRAME_PIPELINE_H
+#define FRAME_PIPELINE_H
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "frame_ops.hpp"
+#include "pixel_buffer.hpp"
+
+/** One transferred image as seen by the sinks */
+struct Frame {
+    /** Index of the range (segment) the image was transferred from */
+    unsigned int range = 0;
+    /** Index of the image within the range */
+    unsigned int index = 0;
+    unsigned int width = 0;
+    unsigned int height = 0;
+    PixelVector data;
+};
+
+/** Consumer of transferred frames, e.g. a tiff file or a MIP. */
+class FrameSink {
+public:
+    virtual ~FrameSink() {}
+
+    /** Called for every frame in transfer order. Runs on the worker thread of the sink. */
+    virtual void consume(const Frame& frame) = 0;
+
+    /** Called after the last frame on the worker thread of the sink */
+    virtual void finish() {}
+};
+
+class FramePipelinePimpl;
+
+/**
+* Passes every frame to several sinks, so that images only have to be transferred from the camera once.
+* Each sink runs on its own worker thread. The frame is copied once and shared by all sinks,
+* so the transfer buffer can be reused immediately.
+*/
+class FramePipeline {
+public:
+    /**
+    * @param queue_depth - Number of frames that can be in flight.
+    *        push blocks if the slowest sink is this many frames behind.
+    * @param allocation - How the copies of the frames are allocated. They are written by the thread calling push.
+    * @param processing - Crop and binning applied while copying the images, the sinks only see the processed frames.
+    */
+    FramePipeline(std::vector<std::shared_ptr<FrameSink>> sinks, unsigned int queue_depth = 8, BufferAllocation allocation = BufferAllocation::standard,
+        FrameProcessing processing = FrameProcessing());
+
+    /** Stops the workers. Frames not yet consumed are dropped. */
+    ~FramePipeline();
+
+    /**
+    * Copies the image and queues it for all sinks. Rethrows exceptions that occurred in a sink.
+    * Throws if the crop region does not fit into the image.
+    */
+    void push(unsigned int range, unsigned int index, unsigned int width, unsigned int height, const uint16_t* data);
+
+    /** Waits until all sinks consumed all frames and are finished. Rethrows exceptions that occurred in a sink. */
+    void finish();
+
+    /** Number of frames pushed so far */
+    unsigned int frames_pushed() const;
+
+private:
+    std::unique_ptr<FramePipelinePimpl> p_impl;
+};
+
+#endif //FRAME_PIPELINE_H
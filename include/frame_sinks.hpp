@@ -0,0 +1,314 @@
+#ifndef FRAME_SINKS_H
+#define FRAME_SINKS_H
+
+#include "frame_pipeline.hpp"
+#include "frame_writer.hpp"
+#include "tiff_writer.hpp"
+
+#include <cstdio>
+#include <functional>
+#include <string>
+
+/** Writes every frame to a tiff file, or another format supported by open_frame_writer */
+class TiffSink : public FrameSink {
+public:
+    /**
+    * @param outpath - Filename, see TiffWriter for splitting of large files
+    * @param options - Compression of the written file
+    * @param format - File format, tiff unless given
+    */
+    TiffSink(std::string outpath, TiffWriterOptions options = TiffWriterOptions(), OutputFormat format = OutputFormat::tiff);
+    ~TiffSink();
+    void consume(const Frame& frame) override;
+    void finish() override;
+
+    unsigned int frames_written() const { return written; }
+
+private:
+    std::unique_ptr<FrameWriter> tif;
+    unsigned int written = 0;
+};
+
+/**
+* Folds every images_per_mip frames into a maximum intensity projection and writes it to a tiff file.
+* Optionally a running background is subtracted from every frame before it is folded, so static background doesn't dominate the MIP.
+* The background carries over from one MIP to the next.
+*/
+class MipSink : public FrameSink {
+public:
+    /**
+    * @param allocation - How the projection and background are allocated, they are first written on the sink's thread
+    * @param background_frames - ema: the background moves by 1 / background_frames towards every frame, rounded down to a power of two.
+    *        minimum: length of the windows the minimum is taken over.
+    */
+    MipSink(std::string outpath, unsigned int images_per_mip, TiffWriterOptions options = TiffWriterOptions(), OutputFormat format = OutputFormat::tiff,
+        BufferAllocation allocation = BufferAllocation::standard, MipBackground background = MipBackground::none, unsigned int background_frames = 16);
+    ~MipSink();
+    void consume(const Frame& frame) override;
+    void finish() override;
+
+    /**
+    * Also writes every MIP downsampled by 2, 4, ... 2^levels, each level to its own file, see pyramid_level_filename.
+    * Each level is reduced from the previous one, so all levels together cost about a third of the MIP.
+    * Call before the first frame.
+    */
+    void add_pyramid(unsigned int levels, PyramidReduction reduction = PyramidReduction::max);
+
+    /**
+    * Treats the frames of every MIP as a z-stack and also writes its side views, see projection_filename:
+    * XZ with the maximum of every column of a frame as one row, and YZ with the maximum of every row of a frame as one column.
+    * Computed in the same pass as the MIP. Not supported with background subtraction. Call before the first frame.
+    */
+    void add_orthogonal_projections();
+
+    unsigned int mips_written() const { return mips; }
+    unsigned int images_folded() const { return images; }
+
+private:
+    std::unique_ptr<FrameWriter> tif;
+    std::string outpath;
+    TiffWriterOptions options;
+    OutputFormat format;
+    unsigned int images_per_mip;
+    PixelVector mip;
+    unsigned int mips = 0;
+    unsigned int images = 0;
+    MipBackground background_mode;
+    unsigned int background_frames;
+    unsigned int background_shift = 0;
+    /** ema: the background. minimum: minimum of the previous window. */
+    PixelVector background;
+    PixelVector window_min;
+    unsigned int window_frames = 0;
+    PyramidReduction pyramid_reduction = PyramidReduction::max;
+    std::vector<std::unique_ptr<FrameWriter>> level_writers;
+    std::vector<std::vector<uint16_t>> levels;
+    std::unique_ptr<FrameWriter> xz_writer;
+    std::unique_ptr<FrameWriter> yz_writer;
+    /** One row per frame of the MIP */
+    std::vector<uint16_t> xz;
+    /** One column per frame of the MIP, stored frame by frame and transposed when written */
+    std::vector<uint16_t> yz_columns;
+    std::vector<uint16_t> yz;
+
+    void write_pyramid(unsigned int width, unsigned int height);
+};
+
+/** File of a pyramid level of MipSink, e.g. level 2 of file.tiff is file_4x.tiff. Paths separated by ';' get it appended to every path. */
+std::string pyramid_level_filename(const std::string& path, unsigned int level);
+
+/** File of an orthogonal projection of MipSink, plane "xz" or "yz", e.g. file.tiff -> file_xz.tiff */
+std::string projection_filename(const std::string& path, const std::string& plane);
+
+enum class BinOutput {
+    /** 16 bit mean of the frames, rounded to the nearest integer */
+    mean,
+    /** 32 bit sum of the frames, only for tiff */
+    sum
+};
+
+/** "mean" or "sum" */
+BinOutput parse_bin_output(const std::string& name);
+
+/** Sums every images_per_bin frames in a 32 bit accumulator and writes their mean or sum, e.g. to improve SNR */
+class BinSink : public FrameSink {
+public:
+    /**
+    * @param images_per_bin - At most 65537, so the sums can't overflow
+    * @param allocation - How the accumulator is allocated, it is first written on the sink's thread
+    */
+    BinSink(std::string outpath, unsigned int images_per_bin, BinOutput output = BinOutput::mean, TiffWriterOptions options = TiffWriterOptions(),
+        OutputFormat format = OutputFormat::tiff, BufferAllocation allocation = BufferAllocation::standard);
+    ~BinSink();
+    void consume(const Frame& frame) override;
+    void finish() override;
+
+    unsigned int bins_written() const { return bins; }
+    unsigned int images_binned() const { return images; }
+
+private:
+    std::unique_ptr<FrameWriter> tif;
+    unsigned int images_per_bin;
+    BinOutput output;
+    SumVector sum;
+    PixelVector mean;
+    unsigned int bins = 0;
+    unsigned int images = 0;
+};
+
+/**
+* Writes a small 8 bit tiff for a quick look at the acquisition: every frame, or the MIP of every images_per_preview frames,
+* binned downsample x downsample and mapped to 8 bits between running low and high percentiles of the previews.
+* All the work is done on the sink's thread, the transfer only hands over the frames.
+*/
+class PreviewSink : public FrameSink {
+public:
+    /**
+    * @param downsample - Pixels binned into one preview pixel in each direction (mean)
+    * @param images_per_preview - Frames projected into one preview image, 1 for a preview of every frame
+    * @param options - Compression of the preview, bits per sample are always 8
+    */
+    PreviewSink(std::string outpath, unsigned int downsample = 4, unsigned int images_per_preview = 1, TiffWriterOptions options = TiffWriterOptions());
+    ~PreviewSink();
+    void consume(const Frame& frame) override;
+    void finish() override;
+
+    unsigned int previews_written() const { return previews; }
+
+    /** Pixel values currently mapped to 0 and 255 */
+    double contrast_low() const { return low; }
+    double contrast_high() const { return high; }
+
+private:
+    std::unique_ptr<FrameWriter> tif;
+    FrameProcessing processing;
+    unsigned int images_per_preview;
+    std::vector<uint16_t> binned;
+    std::vector<uint16_t> mip;
+    std::vector<uint32_t> histogram;
+    std::vector<uint8_t> lut;
+    std::vector<uint8_t> preview;
+    double low = 0;
+    double high = 0;
+    double lut_low = -1;
+    double lut_high = -1;
+    unsigned int previews = 0;
+
+    void write_preview(unsigned int width, unsigned int height);
+};
+
+enum class StatisticsFormat {
+    /** One line per frame: range,index,min,max,mean,hash,duplicate,blank */
+    csv,
+    /**
+    * StatisticsFileHeader, then per frame a FrameStatistics followed by its histogram
+    * of histogram_bins uint32 values, each bin counting 16 consecutive pixel values.
+    */
+    binary
+};
+
+/** "csv" or "binary" */
+StatisticsFormat parse_statistics_format(const std::string& name);
+
+constexpr uint32_t STATISTICS_FILE_MAGIC = 0x54534350; // "PCST"
+constexpr uint16_t STATISTICS_FILE_VERSION = 1;
+
+struct StatisticsFileHeader {
+    uint32_t magic;
+    uint16_t version;
+    /** sizeof(FrameStatistics) */
+    uint16_t record_size;
+    uint32_t histogram_bins;
+};
+
+/**
+* Computes min, max, mean, a histogram and a hash of every frame in one pass, to notice blank, saturated or repeated frames
+* without opening the written files. Each frame's statistics are appended to the file when it arrives.
+*/
+class StatisticsSink : public FrameSink {
+public:
+    /** @param outpath - Statistics file, empty to only keep the statistics in memory */
+    StatisticsSink(std::string outpath, StatisticsFormat format = StatisticsFormat::csv);
+    ~StatisticsSink();
+    void consume(const Frame& frame) override;
+    void finish() override;
+
+    /** Statistics of all frames consumed so far */
+    const std::vector<FrameStatistics>& frame_statistics() const { return statistics; }
+    /** Histogram of all frames, PIXEL_HISTOGRAM_BINS bins of 16 values each */
+    const std::vector<uint64_t>& histogram() const { return total_histogram; }
+    unsigned int duplicate_frames() const { return duplicates; }
+    unsigned int blank_frames() const { return blanks; }
+
+private:
+    std::string outpath;
+    StatisticsFormat format;
+    FILE* file = nullptr;
+    std::vector<FrameStatistics> statistics;
+    std::vector<uint32_t> frame_histogram;
+    std::vector<uint64_t> total_histogram;
+    size_t previous_size = 0;
+    unsigned int duplicates = 0;
+    unsigned int blanks = 0;
+
+    void write(const void* data, size_t size);
+};
+
+/** Consecutive frames kept by EventSink */
+struct EventRecord {
+    unsigned int range = 0;
+    /** Indices of the first and last frame kept and of the first frame reaching the threshold */
+    unsigned int first_index = 0;
+    unsigned int trigger_index = 0;
+    unsigned int last_index = 0;
+    /** Position of the first frame in the written stack */
+    unsigned int first_frame = 0;
+    double peak_score = 0;
+};
+
+/** Events file written next to the stack of an EventSink, file.tiff -> file.tiff.events.csv */
+std::string event_index_filename(const std::string& path);
+
+/**
+* Writes only frames around events, for long recordings which are mostly idle.
+* Every frame gets a score from a cheap metric over a region. The last pre_trigger frames are kept in a ring buffer,
+* so when a frame reaches the threshold they are written before it, followed by all frames up to post_trigger frames after the
+* last one reaching the threshold. An index of the events with their position in the stack is written to event_index_filename.
+* Events and the background don't span ranges.
+*/
+class EventSink : public FrameSink {
+public:
+    EventSink(std::string outpath, EventTrigger trigger, TiffWriterOptions options = TiffWriterOptions(), OutputFormat format = OutputFormat::tiff);
+    ~EventSink();
+    void consume(const Frame& frame) override;
+    void finish() override;
+
+    const std::vector<EventRecord>& events() const { return event_records; }
+    unsigned int frames_written() const { return written; }
+    unsigned int frames_scored() const { return scored; }
+
+private:
+    std::unique_ptr<FrameWriter> tif;
+    EventTrigger trigger;
+    FILE* index_file = nullptr;
+    std::string index_path;
+    std::vector<EventRecord> event_records;
+    /** Frames before the current one, oldest at ring_start */
+    std::vector<Frame> ring;
+    size_t ring_start = 0;
+    size_t ring_count = 0;
+    std::vector<uint16_t> background;
+    bool has_background = false;
+    bool in_event = false;
+    unsigned int post_remaining = 0;
+    unsigned int current_range = 0;
+    unsigned int written = 0;
+    unsigned int scored = 0;
+
+    double score(const Frame& frame);
+    void write(const Frame& frame);
+    void end_event();
+};
+
+/** Passes each frame to a sink depending on the range it was transferred from, e.g. one file per segment */
+class RangeSink : public FrameSink {
+public:
+    RangeSink(std::vector<std::shared_ptr<FrameSink>> range_sinks);
+    void consume(const Frame& frame) override;
+    void finish() override;
+
+private:
+    std::vector<std::shared_ptr<FrameSink>> range_sinks;
+};
+
+/** Calls a function for every frame, for custom processing */
+class CallbackSink : public FrameSink {
+public:
+    CallbackSink(std::function<void(const Frame&)> callback);
+    void consume(const Frame& frame) override;
+
+private:
+    std::function<void(const Frame&)> callback;
+};
+
+#endif //FRAME_SINKS_H
@@ -0,0 +1,57 @@
+#ifndef FRAME_WRITER_H
+#define FRAME_WRITER_H
+
+#include <string>
+#include <memory>
+#include <cstdint>
+#include <vector>
+
+struct TiffWriterOptions;
+
+/** Destination for a stack of equally sized 16 bit images */
+class FrameWriter {
+public:
+    virtual ~FrameWriter() {}
+    virtual void write_frame(unsigned int width, unsigned int height, const uint16_t* data) = 0;
+    /** 32 bit frames, e.g. sums of frames. Only supported by tiff, the others throw. */
+    virtual void write_frame32(unsigned int width, unsigned int height, const uint32_t* data);
+    /** 8 bit frames, e.g. previews. Only supported by tiff, the others throw. */
+    virtual void write_frame8(unsigned int width, unsigned int height, const uint8_t* data);
+    /** Writes all remaining frames. Errors while finishing the output are only reported by close, not by the destructor. */
+    virtual void close() = 0;
+};
+
+enum class OutputFormat {
+    /** Multi page tiff, split into several files when large, see TiffWriter */
+    tiff,
+    /** Zarr v2 array chunked in (t, y, x), see ZarrWriter */
+    zarr
+};
+
+/** "tiff" or "zarr" */
+OutputFormat parse_output_format(const std::string& name);
+
+/**
+* Several output paths separated by ';' stripe the frames over several tiff stacks, see StripedWriter.
+* Returns the single path if there is no separator.
+*/
+std::vector<std::string> split_output_paths(const std::string& path);
+
+std::string join_output_paths(const std::vector<std::string>& paths);
+
+/** Path relative to the current working directory made absolute */
+std::string absolute_path(const std::string& path);
+
+/**
+* Every ';' separated path made absolute, e.g. before sending it to pco_daemon which has its own working directory.
+* An empty path stays empty.
+*/
+std::string absolute_output_paths(const std::string& path);
+
+/**
+* Creates a writer for the format. The compression options are used by both formats.
+* Paths separated by ';' create a StripedWriter, which is only supported for tiff.
+*/
+std::unique_ptr<FrameWriter> open_frame_writer(const std::string& path, OutputFormat format, const TiffWriterOptions& options);
+
+#endif //FRAME_WRITER_H
@@ -0,0 +1,178 @@
+#ifndef PCO_IPC_H
+#define PCO_IPC_H
+
+#include "pco_wrapper.hpp"
+#include "frame_sinks.hpp"
+
+#include <cstdint>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+/** Name of the named pipe the acquisition daemon listens on if no other name is given */
+constexpr const char* PCO_DAEMON_DEFAULT_PIPE = "\\\\.\\pipe\\pco_daemon";
+
+enum class JobType : uint16_t {
+    record = 1,        // Clear, arm and record into the segment
+    transfer_full = 2, // transfer_to_tiff
+    transfer_mip = 3,  // transfer_mip_to_tiff
+    shutdown = 4,      // Finish queued jobs and stop the daemon
+    transfer_bin = 5,  // transfer_bin_to_tiff
+    transfer_events = 6 // transfer_events_to_tiff
+};
+
+/** A unit of work for the camera, either run directly or sent to the daemon */
+struct Job {
+    JobType type = JobType::transfer_full;
+    /** Segments to transfer from in one go. Record jobs only use the first one. */
+    std::vector<WORD> segments = {1};
+    unsigned int skip_images = 0;
+    /** Number of images for full transfers, number of MIPs for MIP transfers, per segment */
+    unsigned int count = std::numeric_limits<unsigned int>::max();
+    /** Images per MIP, or per bin for bin transfers */
+    unsigned int images_per_mip = 0;
+    /** Bin transfers: write 32 bit sums instead of the mean */
+    bool bin_sum = false;
+    /** Timeout for record jobs, 0 waits forever */
+    unsigned int timeout_ms = 0;
+    std::string outpath;
+    /** Full transfers only: also write MIPs of images_per_mip images to this file */
+    std::string mip_outpath;
+    /** Background subtracted before MIPs, see PCOCamera::set_mip_background */
+    MipBackground mip_background = MipBackground::none;
+    unsigned int mip_background_frames = 16;
+    /** Downsampled MIP levels, see PCOCamera::set_mip_pyramid */
+    unsigned int mip_pyramid_levels = 0;
+    PyramidReduction mip_pyramid_reduction = PyramidReduction::max;
+    /** XZ and YZ projections of every MIP, see PCOCamera::set_orthogonal_projections */
+    bool orthogonal_projections = false;
+    /** Compression of the written tiff files */
+    TiffWriterOptions tiff_options;
+    OutputFormat format = OutputFormat::tiff;
+    BufferAllocation buffer_allocation = BufferAllocation::standard;
+    /** Software crop and binning of the transferred images. The flat field is loaded from the paths below. */
+    FrameProcessing processing;
+    /** Flat field correction, see PCOCamera::set_flat_field. Empty dark path disables it. */
+    std::string dark_path;
+    std::string flat_path;
+    /** Hot pixel list, or dark frame to detect them in if hot_pixels_from_dark. Empty disables the replacement. */
+    std::string hot_pixel_path;
+    bool hot_pixels_from_dark = false;
+    double hot_pixel_sigma = 6;
+    HotPixelReplacement hot_pixel_replacement = HotPixelReplacement::median;
+    /** Statistics of every image, see PCOCamera::set_frame_statistics */
+    bool statistics = false;
+    std::string statistics_path;
+    StatisticsFormat statistics_format = StatisticsFormat::csv;
+    /** 8 bit preview, see PCOCamera::set_preview. Empty path disables it. */
+    std::string preview_path;
+    unsigned int preview_downsample = 4;
+    unsigned int preview_images = 1;
+    /** Event transfers: which images are kept, see PCOCamera::set_event_trigger */
+    EventTrigger event_trigger;
+};
+
+struct JobResult {
+    bool ok = true;
+    /** Images or MIPs transferred, images recorded for record jobs, events found for event transfers */
+    unsigned int count = 0;
+    /** With statistics: images which repeated the previous image or were all 0 */
+    unsigned int duplicate_frames = 0;
+    unsigned int blank_frames = 0;
+    std::string message;
+};
+
+/** Runs a job on an opened camera. Exceptions are reported in the result. */
+JobResult run_job(PCOCamera& cam, const Job& job);
+
+/**
+* Wire format. All messages are a fixed size header followed by variable length data.
+* Requests are followed by the segment numbers (uint16_t each), the output path, the MIP output path,
+* the dark frame path, the flat frame path, the hot pixel path, the statistics path and the preview path,
+* responses by the message.
+* Client and daemon always run on the same machine so native (little endian) byte order is used.
+*/
+constexpr uint32_t PCO_IPC_MAGIC = 0x50434F31; // "PCO1"
+constexpr uint16_t PCO_IPC_VERSION = 19;
+
+#pragma pack(push, 1)
+struct JobRequestHeader {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t type;
+    uint16_t segment_count;
+    uint16_t path_length;
+    uint16_t mip_path_length;
+    uint32_t skip_images;
+    uint32_t count;
+    uint32_t images_per_mip;
+    uint32_t timeout_ms;
+    uint16_t compression;
+    int32_t compression_level;
+    uint32_t compression_threads;
+    uint16_t format;
+    uint16_t bits_per_sample;
+    /** Bit 0: write frame index, bit 1: write JSON summary */
+    uint16_t index_flags;
+    uint16_t write_backend;
+    uint16_t buffer_allocation;
+    uint16_t bin_sum;
+    /** Software ROI, see FrameProcessing */
+    uint16_t roi[4];
+    uint16_t spatial_bin;
+    uint16_t spatial_binning;
+    uint16_t dark_path_length;
+    uint16_t flat_path_length;
+    uint16_t hot_pixel_path_length;
+    uint16_t hot_pixels_from_dark;
+    uint16_t hot_pixel_replacement;
+    double hot_pixel_sigma;
+    uint16_t statistics;
+    uint16_t statistics_format;
+    uint16_t statistics_path_length;
+    uint16_t preview_path_length;
+    uint32_t preview_downsample;
+    uint32_t preview_images;
+    /** EventTrigger */
+    uint16_t event_metric;
+    uint16_t event_pixel_threshold;
+    uint16_t event_roi[4];
+    double event_threshold;
+    uint32_t event_pre_trigger;
+    uint32_t event_post_trigger;
+    uint16_t event_background_shift;
+    uint16_t mip_background;
+    uint32_t mip_background_frames;
+    uint16_t mip_pyramid_levels;
+    uint16_t mip_pyramid_reduction;
+    uint16_t orthogonal_projections;
+};
+
+struct JobResponseHeader {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t ok;
+    uint32_t count;
+    uint32_t duplicate_frames;
+    uint32_t blank_frames;
+    uint16_t message_length;
+};
+#pragma pack(pop)
+
+/** Thrown by receive_job for a completely received request with invalid values, which can still be answered */
+class InvalidJob : public std::runtime_error {
+public:
+    InvalidJob(const std::string& message) : std::runtime_error(message) {}
+};
+
+void send_job(HANDLE pipe, const Job& job);
+/** Throws InvalidJob if a value is out of range, std::runtime_error if the pipe fails or the message is not a request */
+Job receive_job(HANDLE pipe);
+void send_result(HANDLE pipe, const JobResult& result);
+JobResult receive_result(HANDLE pipe);
+
+/** Connects to the daemon, submits the job and blocks until the daemon has executed it */
+JobResult submit_job(const std::string& pipe_name, const Job& job);
+
+#endif //PCO_IPC_H
@@ -16,12 +16,22 @@
 #include <windows.h>
 #include <string>
 #include <functional>
+#include <memory>
+#include <vector>
+#include <limits>
+
+#include "tiff_writer.hpp"
+#include "pixel_buffer.hpp"
+#include "frame_ops.hpp"
 
 /** Opens the windows console window for MATLAB so that stdout and stderr can be displayed */
 void openConsole();
 
 void testStdout();
 
+/** Number of images needed for num_mips MIPs, all images (the maximum) if num_mips is the maximum or the product overflows */
+unsigned int mip_images(unsigned int images_per_mip, unsigned int num_mips);
+
 class PCOError : public std::exception {
 public:
     PCOError(int error_code);
@@ -33,7 +43,48 @@ private:
     char error_message[100];
 };
 
+/** Complete camera configuration for one kind of acquisition. Apply it with PCOCamera::apply. */
+struct AcquisitionProfile {
+    /** Region of interest, index starts at 1. All 0 selects the full sensor. */
+    WORD roiX0 = 0;
+    WORD roiY0 = 0;
+    WORD roiX1 = 0;
+    WORD roiY1 = 0;
+
+    /** See PCOCamera::set_framerate_exposure */
+    WORD frameRateMode = 1;
+    DWORD frameRate_mHz = 1000000;
+    DWORD expTime_ns = 1000000;
+
+    /** Set the recorder to sequence mode. If false the storage mode is left as it is. */
+    bool recorder_mode_sequence = true;
+
+    /** Segment sizes in number of images. All 0 leaves the segment sizes as they are. */
+    DWORD segment1 = 0;
+    DWORD segment2 = 0;
+    DWORD segment3 = 0;
+    DWORD segment4 = 0;
+
+    /** Segment to record into. 0 leaves the active segment as it is. */
+    WORD active_segment = 1;
+};
+
+/** Images to transfer from one camera memory segment */
+struct SegmentRange {
+    /** Camera memory segment (Index starts at 1) */
+    WORD segment = 1;
+    /** Number of images to skip before first image */
+    unsigned int skip_images = 0;
+    /** Number of images to transfer at most */
+    unsigned int max_images = std::numeric_limits<unsigned int>::max();
+};
+
 struct PCOBuffer;
+struct PCOBufferPool;
+class FrameSink;
+class StatisticsSink;
+class MipSink;
+struct PCOSettingsCache;
 
 class PCOCamera {
 public:
@@ -68,6 +119,16 @@ public:
     /** Validates the configuration of the camera and sets the camera ready for recording */
     void arm_camera();
 
+    /**
+    * Configures the camera with all settings of the profile and arms it.
+    * Only settings which differ from what was previously set are sent to the camera
+    * and the camera is armed only once, or not at all if nothing changed.
+    * So it is cheap to apply the same profile again before every recording.
+    * Call reset_camera_settings before the first apply if the camera state is unknown.
+    * @return true if the camera was armed
+    */
+    bool apply(const AcquisitionProfile& profile);
+
     /**
     * Set segment sizes in number of images.
     * Since the internal segment size depends on the size of a single image,
@@ -79,6 +140,9 @@ public:
 	/** Get camera segment sizes in **RAM pages** not images */
 	void get_segment_sizes_pages(DWORD segmentSizes[4]);
 
+    /** Resolution the camera is armed with and the maximum resolution of the sensor */
+    void get_sizes(WORD& xresAct, WORD& yresAct, WORD& xresMax, WORD& yresMax);
+
     void set_active_segment(WORD segment);
 
 	WORD get_active_segment();
@@ -114,6 +178,8 @@ public:
     *        If the tiff file is too large it will be split and a number appended to the name.
     *        E.g. file.tiff -> file_1.tiff -> file_2.tiff
     *        Make sure you consider this when naming files to avoid overwriting files.
+    *        Several paths separated by ';' (e.g. on different disks) get the images round robin,
+    *        with a manifest in the first path + ".stripes". This works for all transfer functions.
     * @return Number of images actually transferred
     */
     unsigned int transfer_to_tiff(unsigned int skip_images, unsigned int max_images, std::string outpath);
@@ -132,8 +198,207 @@ public:
     */
     unsigned int transfer_mip_to_tiff(unsigned int skip_images, unsigned int images_per_mip, unsigned int num_mips, std::string outpath);
 
+    /** Transfers images from the segment and averages or sums every images_per_bin images on the fly, e.g. to improve SNR
+    * @param skip_images - Number of images to skip before first image.
+    * @param images_per_bin - Number of images to join in one bin, at most 65537
+    * @param num_bins - Number of bins to transfer at most. Number of images transferred will be images_per_bin * num_bins.
+    * @param outpath - Filename of the resulting file, split as for transfer_to_tiff
+    * @param output - "mean" writes the rounded 16 bit mean, "sum" a 32 bit tiff with the sums
+    * @return Number of bins actually transferred
+    */
+    unsigned int transfer_bin_to_tiff(unsigned int skip_images, unsigned int images_per_bin, unsigned int num_bins, std::string outpath, std::string output = "mean");
+
+    /** Transfers images once and writes both the full images and MIPs of them
+    * @param skip_images - Number of images to skip before first image.
+    * @param max_images - Number of images to transfer at most
+    * @param outpath - Filename for the full images, empty to not write them
+    * @param images_per_mip - Number of images to join in one mip
+    * @param mip_outpath - Filename for the MIPs, empty to not write them
+    * @return Number of images actually transferred
+    */
+    unsigned int transfer_to_tiff_and_mip(unsigned int skip_images, unsigned int max_images, std::string outpath, unsigned int images_per_mip, std::string mip_outpath);
+
+    /** Transfers images and writes only those around events, for long recordings which are mostly idle. See EventSink and set_event_trigger.
+    * The events are listed in outpath.events.csv with their position in the written stack.
+    * @param skip_images - Number of images to skip before first image.
+    * @param max_images - Number of images to transfer at most
+    * @return Number of events found
+    */
+    unsigned int transfer_events_to_tiff(unsigned int skip_images, unsigned int max_images, std::string outpath);
+
+    /** Transfers images from several segments in one go, reusing the same transfer buffers for all of them.
+    * The active segment is switched as needed and is left at the last segment transferred from.
+    * @param ranges - Segments and images to transfer. Each segment can only be listed once.
+    * @param outpath - Filename of the resulting files. If more than one range is given,
+    *        the segment number is appended to the name, e.g. file.tiff -> file_seg1.tiff, file_seg2.tiff
+    *        Files are split when too large as for transfer_to_tiff.
+    * @return Number of images actually transferred from all segments
+    */
+    unsigned int transfer_segments_to_tiff(std::vector<SegmentRange> ranges, std::string outpath);
+
+    /** Transfers images from several segments and performs MIP on the fly, see transfer_segments_to_tiff.
+    * MIPs don't span segments, images at the end of a segment which do not fill a MIP are lost.
+    * max_images of the ranges is the number of images, not MIPs.
+    * @return Number of mips actually transferred from all segments
+    */
+    unsigned int transfer_segments_mip_to_tiff(std::vector<SegmentRange> ranges, unsigned int images_per_mip, std::string outpath);
+
     void close();
 
+    /**
+    * Settings set through this class are remembered and setting the same value again skips the call to the camera.
+    * Returns the number of calls to the camera that were avoided this way.
+    */
+    unsigned long long get_avoided_sdk_calls();
+
+    /** Forget all remembered settings. Call this if the camera was configured by something else, e.g. pco.camware. */
+    void invalidate_settings_cache();
+
+    /** Compression of tiff files written by the transfer functions.
+    * @param compression - "none", "deflate" or "zstd". Compressed files use a horizontal predictor.
+    * @param level - Compression level, 0 selects the fastest level
+    * @param threads - Number of threads compressing images, 0 uses one thread per core
+    */
+    void set_tiff_compression(std::string compression, int level = 0, unsigned int threads = 0);
+
+    /** 12 packs two pixels into three bytes for cameras delivering at most 12 significant bits, 16 (default) writes all bits.
+    * Values above 4095 are saturated when packing. Only supported for tiff output.
+    */
+    void set_tiff_bits_per_sample(unsigned int bits);
+
+    /** Whether tiff files get a frame index (file.tiff.idx, on by default) and a JSON summary (file.tiff.json) when closed.
+    * The index lets StackReader and other tools find any frame without reading through the files.
+    */
+    void set_tiff_index(bool write_index, bool write_json = false);
+
+    /** How tiff files are written.
+    * @param backend - "stdio" (default), or "io_uring" to keep several writes in flight on Linux.
+    *        Falls back to stdio where io_uring is not available.
+    */
+    void set_tiff_write_backend(std::string backend);
+
+    /** Same as the set_tiff_* functions, for use from C++ */
+    void set_tiff_options(TiffWriterOptions options);
+
+    /** Subtracts a running background from every image before it is folded into a MIP, for all MIP transfers.
+    * @param background - "none" (default), "ema" for an exponential moving average of the images,
+    *        or "min" for the per pixel minimum of the images of the last one to two windows
+    * @param frames - ema: the background moves by 1 / frames towards every image, rounded down to a power of two. min: window length.
+    */
+    void set_mip_background(std::string background, unsigned int frames = 16);
+
+    /** Also writes every MIP downsampled by 2, 4, ... 2^levels for overviews, for all MIP transfers.
+    * Each level goes to its own file, e.g. mip.tiff -> mip_2x.tiff, mip_4x.tiff, ...
+    * @param levels - Number of downsampled levels, 0 (default) only writes the MIP
+    * @param reduction - "max" (default) or "mean" of 2 x 2 pixels of the previous level
+    */
+    void set_mip_pyramid(unsigned int levels, std::string reduction = "max");
+
+    /** Also writes side views of every MIP for z-stacks, for all MIP transfers. The images of each MIP are the planes of a z-stack.
+    * mip_xz.tiff gets one row per image with the maximum of every column, mip_yz.tiff one column per image with the maximum of every row.
+    * Computed in the same pass over the images as the MIP. Can't be combined with set_mip_background.
+    */
+    void set_orthogonal_projections(bool enable);
+
+    /** File format written by the transfer functions, including the *_to_tiff ones.
+    * @param format - "tiff" or "zarr". Zarr writes a chunked Zarr v2 array into the directory given as output path,
+    *        compressed as set with set_tiff_compression. Zarr arrays are never split.
+    */
+    void set_output_format(std::string format);
+
+    /** Same as set_output_format, for use from C++ */
+    void set_output_format(OutputFormat format);
+
+    /** How the copies of transferred images and the MIP accumulators are allocated.
+    * @param allocation - "standard" (default), or "huge_pages" for 64 byte aligned buffers on 2 MiB pages,
+    *        placed on the NUMA node of the thread processing them. Reduces TLB misses and cross node traffic on multi socket PCs.
+    */
+    void set_buffer_allocation(std::string allocation);
+
+    /** Same as set_buffer_allocation, for use from C++ */
+    void set_buffer_allocation(BufferAllocation allocation);
+
+    /** Number of SDK buffers images are transferred into in turn, 1 to 16 (default 2).
+    * While one buffer is processed the others are being filled. pco_speedtest --buffers measures the effect.
+    */
+    void set_transfer_buffers(unsigned int num_buffers);
+
+    /** Crops transferred images in software before they are written or projected, e.g. when the camera ROI can't be set that small.
+    * Index starts at 1 and the region includes roiX1 and roiY1, as for set_roi. All 0 keeps the full image.
+    */
+    void set_transfer_roi(WORD roiX0, WORD roiY0, WORD roiX1, WORD roiY1);
+
+    /** Bins transferred images bin x bin after cropping, for all transfer functions.
+    * @param bin - 1 disables binning
+    * @param mode - "mean" (rounded) or "sum" (saturated at 65535)
+    */
+    void set_transfer_binning(unsigned int bin, std::string mode = "mean");
+
+    /** Corrects every transferred image as (image - dark) * gain before cropping, binning and writing it.
+    * The gain of each pixel scales flat - dark to its mean over the image. The files are read once here,
+    * and not again by later calls while they are unchanged.
+    * @param dark_path - Tiff with the dark frame, e.g. the mean of a bin transfer with the shutter closed. Empty disables the correction.
+    * @param flat_path - Tiff with the flat frame, taken of a uniformly illuminated field. Empty only subtracts the dark frame.
+    */
+    void set_flat_field(std::string dark_path, std::string flat_path = "");
+
+    /** Replaces hot pixels of every transferred image by the median or mean of their neighbours, before MIPs are taken.
+    * Applied after the flat field correction, so the replacement values are corrected.
+    * @param path - Text file with one "x y" per line, index starts at 1. Empty disables the replacement.
+    * @param replacement - "median" or "mean"
+    */
+    void set_hot_pixel_list(std::string path, std::string replacement = "median");
+
+    /** Finds hot pixels in a dark frame and replaces them as set_hot_pixel_list does.
+    * @param dark_path - Tiff with the dark frame, its first frame is used
+    * @param threshold_sigma - Pixels more than this many standard deviations above the median are hot
+    * @param list_path - If not empty, the hot pixels are also written to this file for set_hot_pixel_list
+    * @return Number of hot pixels found
+    */
+    unsigned int set_hot_pixels_from_dark(std::string dark_path, double threshold_sigma = 6, std::string replacement = "median", std::string list_path = "");
+
+    /** Same as set_transfer_roi, set_transfer_binning, set_flat_field and the hot pixel functions, for use from C++ */
+    void set_frame_processing(FrameProcessing processing);
+
+    /** When transfer_events_to_tiff keeps images.
+    * @param metric - "difference": mean absolute difference to a running background, "count": number of pixels above pixel_threshold
+    * @param threshold - Images scoring at least this are part of an event, has to be above 0
+    * @param pre_trigger_images - Images kept before the first image of an event
+    * @param post_trigger_images - Images kept after the last image reaching the threshold
+    */
+    void set_event_trigger(std::string metric, double threshold, WORD pixel_threshold = 0, unsigned int pre_trigger_images = 10, unsigned int post_trigger_images = 10);
+
+    /** Region of the images scored by transfer_events_to_tiff, after software crop and binning.
+    * Index starts at 1 and the region includes roiX1 and roiY1, as for set_roi. All 0 scores the full image.
+    */
+    void set_event_roi(WORD roiX0, WORD roiY0, WORD roiX1, WORD roiY1);
+
+    /** Same as set_event_trigger and set_event_roi, for use from C++ */
+    void set_event_trigger(EventTrigger trigger);
+
+    /** Computes min, max, mean and a hash of every transferred image in all following transfers, see StatisticsSink.
+    * Flags blank images and images repeating the previous one.
+    * @param path - File the statistics of each image are written to, empty to only keep them for get_frame_statistics
+    * @param format - "csv", or "binary" to also write a histogram of each image
+    */
+    void set_frame_statistics(bool enable, std::string path = "", std::string format = "csv");
+
+    /** Writes a small 8 bit preview tiff next to the output of all following transfers, see PreviewSink.
+    * @param path - Preview tiff, empty disables the preview
+    * @param downsample - Pixels binned into one preview pixel in each direction
+    * @param images_per_preview - MIP of this many images per preview image, 1 for a preview of every image
+    */
+    void set_preview(std::string path, unsigned int downsample = 4, unsigned int images_per_preview = 1);
+
+    /** Statistics of all images of the last transfer, if enabled with set_frame_statistics */
+    std::vector<FrameStatistics> get_frame_statistics();
+
+    /** Number of images of the last transfer which repeated the previous image */
+    unsigned int get_duplicate_frames();
+
+    /** Number of images of the last transfer which were all 0 */
+    unsigned int get_blank_frames();
+
 	/** Transfers images from the segment and performs operation given as callback
 	* @param segment - Camera memory segment to transfer from (Index starts at 1)
 	* @param skip_images - Number of images to skip before first image.
@@ -142,9 +407,58 @@ public:
 	*/
 	void transfer_internal(unsigned int skip_images, unsigned int max_images, std::function<void(unsigned int, const PCOBuffer&)> image_callback);
 
+	/** Transfers images from the active segment and passes each image to all sinks.
+	* Every sink runs on its own thread, so slow sinks don't hold up each other.
+	* @return Number of images actually transferred
+	*/
+	unsigned int transfer_to_sinks(unsigned int skip_images, unsigned int max_images, std::vector<std::shared_ptr<FrameSink>> sinks);
+
+	/** Transfers images from several segments and passes each image to all sinks, see transfer_to_sinks */
+	unsigned int transfer_segments_to_sinks(const std::vector<SegmentRange>& ranges, std::vector<std::shared_ptr<FrameSink>> sinks);
+
+	/** Transfers images from several segments and performs operation given as callback
+	* The callback gets the index of the range and the index of the image within the range.
+	*/
+	void transfer_segments_internal(const std::vector<SegmentRange>& ranges, std::function<void(size_t, unsigned int, const PCOBuffer&)> image_callback);
+
 private:
     HANDLE cam;
 
+    /** Transfer buffers are kept between transfers so back-to-back transfers don't reallocate them */
+    std::shared_ptr<PCOBufferPool> buffer_pool;
+
+    std::shared_ptr<PCOSettingsCache> settings_cache;
+    PCOSettingsCache& settings();
+
+    void set_segment_sizes_internal(WORD XResAct, WORD YResAct, const DWORD images[4]);
+
+    TiffWriterOptions tiff_options;
+    OutputFormat output_format = OutputFormat::tiff;
+    BufferAllocation buffer_allocation = BufferAllocation::standard;
+    unsigned int transfer_buffers = 2;
+    FrameProcessing frame_processing;
+    // Corrections loaded from files, reused while the files and settings are unchanged, e.g. by back-to-back daemon jobs
+    std::string flat_field_key;
+    std::shared_ptr<const FlatField> loaded_flat_field;
+    std::string hot_pixels_key;
+    std::shared_ptr<const HotPixelMap> loaded_hot_pixels;
+    bool statistics_enabled = false;
+    std::string statistics_path;
+    std::string statistics_format = "csv";
+    std::shared_ptr<StatisticsSink> statistics;
+    std::string preview_path;
+    unsigned int preview_downsample = 4;
+    unsigned int preview_images = 1;
+    EventTrigger event_trigger;
+    MipBackground mip_background = MipBackground::none;
+    unsigned int mip_background_frames = 16;
+    unsigned int mip_pyramid_levels = 0;
+    PyramidReduction mip_pyramid_reduction = PyramidReduction::max;
+    bool orthogonal_projections = false;
+
+    /** MipSink with the MIP settings of this camera */
+    std::shared_ptr<MipSink> make_mip_sink(const std::string& outpath, unsigned int images_per_mip);
+
 };
 
 #endif //PCO_WRAPPER_H
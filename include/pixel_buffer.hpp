@@ -0,0 +1,78 @@
+#ifndef PIXEL_BUFFER_H
+#define PIXEL_BUFFER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+/** How frame and projection buffers are allocated */
+enum class BufferAllocation {
+    /** Default heap allocation */
+    standard,
+    /**
+    * 64 byte aligned and backed by 2 MiB huge pages where the OS allows it, which cuts TLB misses when folding full frames.
+    * Memory is placed on the NUMA node of the allocating thread, which for projections is the thread folding into them.
+    * Falls back to normal pages if huge pages are not available (on Windows they need the "Lock pages in memory" privilege).
+    */
+    huge_pages
+};
+
+/** "standard" or "huge_pages" */
+BufferAllocation parse_buffer_allocation(const std::string& name);
+
+/** Allocates size bytes, throws std::bad_alloc on failure */
+void* allocate_buffer(size_t size, BufferAllocation allocation);
+
+/** Frees memory returned by allocate_buffer with the same size and allocation */
+void free_buffer(void* buffer, size_t size, BufferAllocation allocation);
+
+/** Number of huge_pages allocations which got normal pages. The first one also prints a warning. */
+uint64_t huge_page_fallbacks();
+
+/** Allocator for std containers using allocate_buffer, the allocation is chosen per container */
+template<class T>
+class PixelAllocator {
+public:
+    typedef T value_type;
+    typedef std::true_type propagate_on_container_move_assignment;
+    typedef std::true_type propagate_on_container_swap;
+
+    PixelAllocator(BufferAllocation allocation = BufferAllocation::standard) : allocation(allocation) {}
+
+    template<class U>
+    PixelAllocator(const PixelAllocator<U>& other) : allocation(other.allocation) {}
+
+    T* allocate(size_t n) {
+        if (n > static_cast<size_t>(-1) / sizeof(T)) {
+            throw std::bad_alloc();
+        }
+        return static_cast<T*>(allocate_buffer(n * sizeof(T), allocation));
+    }
+
+    void deallocate(T* p, size_t n) {
+        free_buffer(p, n * sizeof(T), allocation);
+    }
+
+    BufferAllocation allocation;
+};
+
+template<class T, class U>
+bool operator== (const PixelAllocator<T>& a, const PixelAllocator<U>& b) {
+    return a.allocation == b.allocation;
+}
+
+template<class T, class U>
+bool operator!= (const PixelAllocator<T>& a, const PixelAllocator<U>& b) {
+    return !(a == b);
+}
+
+/** Pixels of a frame or projection */
+typedef std::vector<uint16_t, PixelAllocator<uint16_t>> PixelVector;
+
+/** Per pixel sums of frames */
+typedef std::vector<uint32_t, PixelAllocator<uint32_t>> SumVector;
+
+#endif //PIXEL_BUFFER_H
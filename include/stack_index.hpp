@@ -0,0 +1,98 @@
+#ifndef STACK_INDEX_H
+#define STACK_INDEX_H
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+/** Location of one frame in a tiff stack, which may be split into several files */
+struct StackFrameInfo {
+    /** 0 for the stack's path, n for number_filename(path, n) */
+    uint32_t file;
+    uint32_t width;
+    uint32_t height;
+    uint16_t bits_per_sample;
+    /** Tiff compression tag value, 1 is uncompressed */
+    uint16_t compression;
+    /** Tiff predictor tag value, 1 is none */
+    uint16_t predictor;
+    /** 1 if all strips directly follow each other, so the frame is one block of data_size bytes */
+    uint16_t contiguous;
+    /** Always 0, keeps the struct free of padding as it is written to disk as is */
+    uint32_t reserved;
+    uint64_t ifd_offset;
+    /** Offset of the first strip */
+    uint64_t data_offset;
+    /** Sum of all strip sizes */
+    uint64_t data_size;
+};
+
+/** Used to detect if a cached index is out of date */
+struct StackFileInfo {
+    uint64_t size;
+    int64_t mtime;
+};
+
+struct StackIndex {
+    std::vector<StackFileInfo> files;
+    std::vector<StackFrameInfo> frames;
+};
+
+/** Files of the stack at path: path, path_1, path_2, ... as long as they exist */
+std::vector<std::string> stack_files(const std::string& path);
+
+/** The first num_files files of the stack at path, e.g. as listed by its index. Empty if any of them is missing. */
+std::vector<std::string> stack_files(const std::string& path, size_t num_files);
+
+/**
+* Deletes path_first_number, path_first_number+1, ... as long as they exist.
+* Writers call it for a new stack, so split files of a longer stack written to the same path before are not read as part of it.
+*/
+void remove_split_files(const std::string& path, unsigned int first_number);
+
+/** Size and modification time of a file. Throws if it does not exist. */
+StackFileInfo stack_file_info(const std::string& filename);
+
+/** Sidecar file caching the index of the stack at path */
+std::string stack_index_filename(const std::string& path);
+
+/** Reads a sidecar index. Returns false if it does not exist or is not a valid index. */
+bool read_stack_index(const std::string& filename, StackIndex& index);
+
+void write_stack_index(const std::string& filename, const StackIndex& index);
+
+/** Sidecar with a human readable summary of the stack at path */
+std::string stack_summary_filename(const std::string& path);
+
+/** Writes frame count, image format and the frames in each file of the stack at path as JSON */
+void write_stack_summary(const std::string& path, const StackIndex& index);
+
+/** Frame of a striped stack: the stripe holding it and its number in that stripe's stack */
+struct StripeFrame {
+    uint32_t stripe;
+    uint32_t frame;
+};
+
+/** Stacks written round robin by StripedWriter, and the stripe of every frame in acquisition order */
+struct StripeManifest {
+    /** Absolute path of each stripe's stack */
+    std::vector<std::string> stripes;
+    std::vector<StripeFrame> frames;
+};
+
+/** Manifest of a striped stack whose first stripe is written to path */
+std::string stripe_manifest_filename(const std::string& path);
+
+/** True if path names a stripe manifest, i.e. ends with ".stripes" */
+bool is_stripe_manifest(const std::string& path);
+
+/** Reads a manifest. Returns false if it does not exist or is not a valid manifest. */
+bool read_stripe_manifest(const std::string& filename, StripeManifest& manifest);
+
+/**
+* Text file: "pco_stripes 1", the number of stripes and one path per line,
+* then the number of frames and "stripe frame" for every frame.
+*/
+void write_stripe_manifest(const std::string& filename, const StripeManifest& manifest);
+
+#endif //STACK_INDEX_H
@@ -0,0 +1,52 @@
+#ifndef STACK_READER_H
+#define STACK_READER_H
+
+#include <string>
+#include <memory>
+#include <vector>
+#include <cstdint>
+
+class StackReaderPimpl;
+
+/**
+* Random access to the frames of a tiff stack written by this library, including stacks split into
+* file.tiff, file_1.tiff, file_2.tiff, ...
+* All files are memory mapped. The location of every frame is indexed once when the stack is opened,
+* and the index is cached next to the stack in file.tiff.idx, so opening it again does not walk the files.
+* The cache is rebuilt if any of the files changed.
+* Striped stacks written to several paths are opened through their manifest (file.tiff.stripes),
+* and read as a single stack in acquisition order.
+*/
+class StackReader {
+public:
+    /** @param path - First file of the stack, as given to the transfer functions, or the manifest of a striped stack */
+    StackReader(std::string path);
+    ~StackReader();
+
+    unsigned int get_num_frames();
+    /** Number of files the stack is split into, over all stripes */
+    unsigned int get_num_files();
+    unsigned int get_width(unsigned int index);
+    unsigned int get_height(unsigned int index);
+    unsigned int get_bits_per_sample(unsigned int index);
+
+    /** True if the index was loaded from the sidecar file instead of reading all files */
+    bool index_loaded_from_cache();
+
+    /**
+    * Returns the frame without copying, pointing into the mapped file. Valid as long as the reader exists.
+    * Only possible for uncompressed 16 bit frames, use read_frame for the others. Throws if the file holds less than width * height values.
+    */
+    const uint16_t* frame_data(unsigned int index);
+
+    /** Copies the frame into dest, which has to hold width * height values. Decompresses and unpacks as needed. */
+    void read_frame(unsigned int index, uint16_t* dest);
+
+    /** Returns a copy of the frame, width * height values in row major order */
+    std::vector<uint16_t> get_frame(unsigned int index);
+
+private:
+    std::unique_ptr<StackReaderPimpl> p_impl;
+};
+
+#endif //STACK_READER_H
@@ -0,0 +1,32 @@
+#ifndef STRIPED_WRITER_H
+#define STRIPED_WRITER_H
+
+#include <string>
+#include <memory>
+#include <vector>
+#include <cstdint>
+
+#include "frame_writer.hpp"
+#include "tiff_writer.hpp"
+
+class StripedWriterPimpl;
+
+/**
+* Writes consecutive frames round robin to several tiff stacks (stripes), e.g. one per disk, like RAID-0.
+* Each stripe has its own writer thread and queue, so all disks are written in parallel.
+* On close a manifest (first path + ".stripes", see stack_index.hpp) records which stripe holds each frame.
+* Open the manifest with StackReader, or merge the stripes into a single stack with pco_merge.
+*/
+class StripedWriter : public FrameWriter {
+public:
+    /** @param paths - Output path of each stripe, e.g. on different disks */
+    StripedWriter(std::vector<std::string> paths, TiffWriterOptions options);
+    ~StripedWriter();
+    void write_frame(unsigned int width, unsigned int height, const uint16_t* data) override;
+    /** Waits for all stripes, closes them and writes the manifest */
+    void close() override;
+private:
+    std::unique_ptr<StripedWriterPimpl> p_impl;
+};
+
+#endif //STRIPED_WRITER_H
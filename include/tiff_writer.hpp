@@ -1,14 +1,85 @@
+#ifndef TIFF_WRITER_H
+#define TIFF_WRITER_H
+
 #include <string>
 #include <memory>
 #include <cstdint>
 
+#include "frame_writer.hpp"
+
+enum class TiffCompression {
+    /** Uncompressed, written with TinyTIFF */
+    none,
+    /** Deflate (zlib) with horizontal predictor */
+    deflate,
+    /** Zstandard with horizontal predictor. Only available if built with libzstd. */
+    zstd
+};
+
+enum class TiffWriteBackend {
+    /** Buffered stdio. Uncompressed 16 bit frames are written with TinyTIFF. */
+    stdio,
+    /**
+    * Linux io_uring with several writes in flight, using registered buffers and files.
+    * Falls back to stdio if the kernel or the build does not support it.
+    */
+    io_uring
+};
+
+struct TiffWriterOptions {
+    TiffCompression compression = TiffCompression::none;
+    /** Compression level, 0 selects the fastest level */
+    int compression_level = 0;
+    /** Number of threads compressing or packing images, 0 uses one thread per core. No threads are started for uncompressed 16 bit. */
+    unsigned int compression_threads = 0;
+    /**
+    * 16, or 12 to pack two pixels into three bytes (BitsPerSample=12), saving 25% of disk bandwidth.
+    * Values above 4095 are saturated, so only use it if the camera delivers at most 12 significant bits.
+    * 32 for files written with write_frame32, e.g. sums of frames, 8 for files written with write_frame8, e.g. previews.
+    */
+    unsigned int bits_per_sample = 16;
+    /**
+    * Write the location of every frame to file.tiff.idx on close, so readers (e.g. StackReader) can find
+    * frame N in O(1) without walking the IFDs of all split files. See stack_index.hpp for the format.
+    * Failing to write the index only prints a warning, the stack can still be read without it.
+    */
+    bool write_index = true;
+    /** Additionally write a human readable summary of the stack to file.tiff.json */
+    bool write_index_json = false;
+    TiffWriteBackend write_backend = TiffWriteBackend::stdio;
+};
+
+/** Name of the split files of a large stack, e.g. file.tiff -> file_1.tiff */
+std::string number_filename(std::string filename, unsigned int number);
+
+/** "none", "deflate" or "zstd" */
+TiffCompression parse_tiff_compression(const std::string& name);
+
+/** "stdio" or "io_uring" */
+TiffWriteBackend parse_tiff_write_backend(const std::string& name);
+
+/** True if this build and the running kernel support the io_uring backend */
+bool tiff_io_uring_available();
+
 class TiffWriterPimpl;
 
-class TiffWriter {
+class TiffWriter : public FrameWriter {
 public:
     TiffWriter(std::string filename);
+    TiffWriter(std::string filename, TiffWriterOptions options);
     ~TiffWriter();
-    void write_frame(unsigned int width, unsigned int height, uint16_t* data);
+    void write_frame(unsigned int width, unsigned int height, const uint16_t* data) override;
+    /** Needs bits_per_sample = 32 in the options */
+    void write_frame32(unsigned int width, unsigned int height, const uint32_t* data) override;
+    /** Needs bits_per_sample = 8 in the options */
+    void write_frame8(unsigned int width, unsigned int height, const uint8_t* data) override;
+    /**
+    * Writes all remaining frames and closes the file.
+    * Called by the destructor, but only close reports errors that occur while writing the last frames.
+    */
+    void close() override;
 private:
     std::unique_ptr<TiffWriterPimpl> p_impl;
 };
+
+#endif //TIFF_WRITER_H
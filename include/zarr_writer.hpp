@@ -0,0 +1,38 @@
+#ifndef ZARR_WRITER_H
+#define ZARR_WRITER_H
+
+#include <string>
+#include <memory>
+#include <cstdint>
+
+#include "frame_writer.hpp"
+#include "tiff_writer.hpp"
+
+/** Chunk size of the written array. Chunks larger than the image are shrunk to the image size. */
+struct ZarrChunkShape {
+    unsigned int frames = 16;
+    unsigned int height = 256;
+    unsigned int width = 256;
+};
+
+class ZarrWriterPimpl;
+
+/**
+* Writes frames into a Zarr v2 array (directory store) of shape (t, y, x) and dtype uint16.
+* Each chunk is compressed and written to its own file by a thread pool, so reading a region over time
+* only has to touch the chunks containing it.
+* Deflate compression is stored as the "zlib" codec, zstd as "zstd". No compression writes raw chunks.
+* The shape in .zarray is written on close, when the number of frames is known.
+*/
+class ZarrWriter : public FrameWriter {
+public:
+    /** @param path - Directory of the array, created if it does not exist. Its parent directory has to exist. */
+    ZarrWriter(std::string path, TiffWriterOptions options = TiffWriterOptions(), ZarrChunkShape chunks = ZarrChunkShape());
+    ~ZarrWriter();
+    void write_frame(unsigned int width, unsigned int height, const uint16_t* data) override;
+    void close() override;
+private:
+    std::unique_ptr<ZarrWriterPimpl> p_impl;
+};
+
+#endif //ZARR_WRITER_H
@@ -5,10 +5,18 @@ delete("definepco_wrapper.m");
 delete("definepco_wrapper.mlx");
 delete("pco_wrapperData.xml");
 
+% zlib and, if meson found it, zstd for compressed tiffs. libtiff_writer.a needs the libraries meson linked it with.
+meson_deps = jsondecode(fileread("..\\builddir\\meson-info\\intro-dependencies.json"));
+zlib_libs = dependency_libraries(meson_deps, "zlib", "..\\builddir\\subprojects\\zlib-*\\*.a");
+if isempty(zlib_libs)
+    error("zlib not found, install it or run 'meson wrap install zlib' and rebuild");
+end
+zstd_libs = dependency_libraries(meson_deps, "libzstd", "");
+
 % Build library definition file
 clibgen.generateLibraryDefinition(...
-    "../include/pco_wrapper.hpp",...
-    "Libraries",[fullfile(sdk_path, "lib64\\SC2_Cam.lib"), "..\\builddir\\libpco_wrapper.a", "..\\builddir\\libtiff_writer.a", "..\\builddir\\subprojects\\TinyTIFF-3.0.0.0\\libtinytiff.a"],...
+    ["../include/pco_wrapper.hpp", "../include/stack_reader.hpp"],...
+    "Libraries",[fullfile(sdk_path, "lib64\\SC2_Cam.lib"), "..\\builddir\\libpco_wrapper.a", "..\\builddir\\libframe_pipeline.a", "..\\builddir\\libstack_reader.a", "..\\builddir\\libtiff_writer.a", "..\\builddir\\subprojects\\TinyTIFF-3.0.0.0\\libtinytiff.a", zlib_libs, zstd_libs],...
     "PackageName","pco_wrapper",...
     "IncludePath", fullfile(sdk_path, "include")...
 )
@@ -18,4 +26,48 @@ validate(definepco_wrapper);
 %% Build library
 % Build dll from library definition
 % Requires Visual Studio (2019?) to be installed.
-build(definepco_wrapper);
\ No newline at end of file
+build(definepco_wrapper);
+
+%% Helpers
+% Library files of a dependency meson found, built from a wrap subproject or given by the link arguments of an installed library.
+% Empty if meson did not find the dependency, error if it did but the library files can't be located.
+function libs = dependency_libraries(meson_deps, name, subproject_pattern)
+    libs = string.empty;
+    if subproject_pattern ~= ""
+        files = dir(subproject_pattern);
+        if ~isempty(files)
+            libs = string(fullfile({files.folder}, {files.name}));
+            return;
+        end
+    end
+    if ~iscell(meson_deps)
+        meson_deps = num2cell(meson_deps);
+    end
+    for i = 1:numel(meson_deps)
+        dep = meson_deps{i};
+        if string(dep.name) ~= name
+            continue;
+        end
+        link_args = string(dep.link_args);
+        search_dirs = string.empty;
+        for arg = link_args(:)'
+            if startsWith(arg, "-L")
+                search_dirs(end + 1) = extractAfter(arg, 2);
+            elseif startsWith(arg, "-l")
+                lib = extractAfter(arg, 2);
+                candidates = [fullfile(search_dirs, lib + ".lib"), fullfile(search_dirs, "lib" + lib + ".a"), fullfile(search_dirs, "lib" + lib + ".dll.a")];
+                found = candidates(isfile(candidates));
+                if isempty(found)
+                    error("Library %s of %s not found in %s", lib, name, strjoin(search_dirs, ", "));
+                end
+                libs(end + 1) = found(1);
+            elseif isfile(arg)
+                libs(end + 1) = arg;
+            end
+        end
+        if isempty(libs)
+            error("meson found %s but there is no library file in its link arguments: %s", name, strjoin(link_args, " "));
+        end
+        return;
+    end
+end
@@ -28,6 +28,17 @@ c.set_segment_sizes(500, 1000, 0, 0);
 c.set_active_segment(1);
 c.arm_camera();
 
+%% Alternatively configure everything at once
+% Only settings that changed are sent to the camera and it is armed once,
+% so applying the same profile before every recording is cheap.
+profile = clib.pco_wrapper.AcquisitionProfile();
+profile.frameRate_mHz = 1e6; % 1kHz
+profile.expTime_ns = 1e6; % 1ms
+profile.segment1 = 500;
+profile.segment2 = 1000;
+profile.active_segment = 1;
+c.apply(profile);
+
 %% Record something in segment 1 but transfer later
 c.start_recording();
 if ~c.wait_for_recording_done(5000)
@@ -54,4 +65,10 @@ c.set_active_segment(1);
 c.transfer_mip_to_tiff(0, 100, 5, "mip.tiff");
 
 %%
-c.close()
\ No newline at end of file
+c.close()
+
+%% Read the MIPs back
+% The files are memory mapped and the frame index is cached in mip.tiff.idx
+r = clib.pco_wrapper.StackReader("mip.tiff");
+first_mip = reshape(uint16(r.get_frame(0)), r.get_width(0), r.get_height(0))';
+clibRelease(r);
\ No newline at end of file
@@ -0,0 +1,87 @@
+#include "bitpack.hpp"
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define BITPACK_SSE2
+#endif
+
+static inline uint16_t saturate12(uint16_t val) {
+    return val > 0xFFF ? 0xFFF : val;
+}
+
+void pack12(uint8_t* dest, const uint16_t* src, size_t num_pixels) {
+    size_t pix = 0;
+#ifdef BITPACK_SSE2
+    // 8 pixels -> 12 bytes. The stores write 14 bytes, so stop while there are at least 2 more pixels to overwrite.
+    const __m128i max12 = _mm_set1_epi16(0xFFF);
+    const __m128i low16 = _mm_set1_epi32(0xFFFF);
+    const __m128i nibble = _mm_set1_epi32(0xF);
+    const __m128i mask_f00 = _mm_set1_epi32(0xF00);
+    const __m128i mask_ff = _mm_set1_epi32(0xFF);
+    const __m128i low32 = _mm_set_epi32(0, -1, 0, -1);
+    const __m128i mid24 = _mm_set_epi32(0xFFFF, (int)0xFF000000, 0xFFFF, (int)0xFF000000);
+    for (; pix + 10 <= num_pixels; pix += 8) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(src + pix));
+        // min(v, 4095) without SSE4.1
+        v = _mm_sub_epi16(v, _mm_subs_epu16(v, max12));
+        // Each 32 bit lane holds a pair, a in the low half
+        __m128i a = _mm_and_si128(v, low16);
+        __m128i b = _mm_srli_epi32(v, 16);
+        // Three output bytes in memory order in the low 24 bits of each lane
+        __m128i t = _mm_srli_epi32(a, 4);
+        t = _mm_or_si128(t, _mm_slli_epi32(_mm_and_si128(a, nibble), 12));
+        t = _mm_or_si128(t, _mm_and_si128(b, mask_f00));
+        t = _mm_or_si128(t, _mm_slli_epi32(_mm_and_si128(b, mask_ff), 16));
+        // Close the gap between the two lanes of each 64 bit half: 6 bytes per half
+        __m128i q = _mm_or_si128(_mm_and_si128(t, low32), _mm_and_si128(_mm_srli_epi64(t, 8), mid24));
+        uint8_t* out = dest + pix / 2 * 3;
+        _mm_storel_epi64((__m128i*)out, q);
+        _mm_storel_epi64((__m128i*)(out + 6), _mm_unpackhi_epi64(q, q));
+    }
+#endif
+    for (; pix + 1 < num_pixels; pix += 2) {
+        uint16_t a = saturate12(src[pix]);
+        uint16_t b = saturate12(src[pix + 1]);
+        uint8_t* out = dest + pix / 2 * 3;
+        out[0] = (uint8_t)(a >> 4);
+        out[1] = (uint8_t)(((a & 0xF) << 4) | (b >> 8));
+        out[2] = (uint8_t)(b & 0xFF);
+    }
+    if (pix < num_pixels) {
+        uint16_t a = saturate12(src[pix]);
+        uint8_t* out = dest + pix / 2 * 3;
+        out[0] = (uint8_t)(a >> 4);
+        out[1] = (uint8_t)((a & 0xF) << 4);
+    }
+}
+
+void unpack12(uint16_t* dest, const uint8_t* src, size_t num_pixels) {
+    size_t pix = 0;
+#ifdef BITPACK_SSE2
+    // 12 bytes -> 8 pixels. The loads read 14 bytes, so stop while there are at least 2 more pixels in src.
+    const __m128i mask24 = _mm_set_epi32(0, 0xFFFFFF, 0, 0xFFFFFF);
+    const __m128i high24 = _mm_set_epi32(0xFFFFFF, 0, 0xFFFFFF, 0);
+    const __m128i mask_f00 = _mm_set1_epi32(0xF00);
+    const __m128i mask_ff = _mm_set1_epi32(0xFF);
+    const __m128i mask_ff0 = _mm_set1_epi32(0xFF0);
+    const __m128i nibble = _mm_set1_epi32(0xF);
+    for (; pix + 10 <= num_pixels; pix += 8) {
+        const uint8_t* in = src + pix / 2 * 3;
+        __m128i q = _mm_unpacklo_epi64(_mm_loadl_epi64((const __m128i*)in), _mm_loadl_epi64((const __m128i*)(in + 6)));
+        // Spread the two 3 byte groups of each 64 bit half into 32 bit lanes
+        __m128i t = _mm_or_si128(_mm_and_si128(q, mask24), _mm_and_si128(_mm_slli_epi64(q, 8), high24));
+        __m128i a = _mm_or_si128(_mm_and_si128(_mm_slli_epi32(t, 4), mask_ff0), _mm_and_si128(_mm_srli_epi32(t, 12), nibble));
+        __m128i b = _mm_or_si128(_mm_and_si128(t, mask_f00), _mm_and_si128(_mm_srli_epi32(t, 16), mask_ff));
+        _mm_storeu_si128((__m128i*)(dest + pix), _mm_or_si128(a, _mm_slli_epi32(b, 16)));
+    }
+#endif
+    for (; pix + 1 < num_pixels; pix += 2) {
+        const uint8_t* in = src + pix / 2 * 3;
+        dest[pix] = (uint16_t)((in[0] << 4) | (in[1] >> 4));
+        dest[pix + 1] = (uint16_t)(((in[1] & 0xF) << 8) | in[2]);
+    }
+    if (pix < num_pixels) {
+        const uint8_t* in = src + pix / 2 * 3;
+        dest[pix] = (uint16_t)((in[0] << 4) | (in[1] >> 4));
+    }
+}
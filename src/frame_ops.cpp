@@ -0,0 +1,854 @@
+#include "frame_ops.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <sstream>
+#include <stdexcept>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define FRAME_OPS_SSE2
+#endif
+
+void fold_max(uint16_t* mip, const uint16_t* image, size_t num_pixels) {
+    size_t pix = 0;
+#ifdef FRAME_OPS_SSE2
+    for (; pix + 8 <= num_pixels; pix += 8) {
+        __m128i values = _mm_loadu_si128((const __m128i*)(image + pix));
+        __m128i* dest = (__m128i*)(mip + pix);
+        __m128i current = _mm_loadu_si128(dest);
+        // Unsigned max as mip + (image - mip) with saturation, SSE2 has no unsigned 16 bit max
+        _mm_storeu_si128(dest, _mm_adds_epu16(current, _mm_subs_epu16(values, current)));
+    }
+#endif
+    for (; pix < num_pixels; ++pix) {
+        uint16_t val = image[pix];
+        if (val > mip[pix]) {
+            mip[pix] = val;
+        }
+    }
+}
+
+void accumulate_sum(uint32_t* sum, const uint16_t* image, size_t num_pixels) {
+    size_t pix = 0;
+#ifdef FRAME_OPS_SSE2
+    const __m128i zero = _mm_setzero_si128();
+    for (; pix + 8 <= num_pixels; pix += 8) {
+        __m128i values = _mm_loadu_si128((const __m128i*)(image + pix));
+        __m128i* dest = (__m128i*)(sum + pix);
+        // Zero extend to 32 bit
+        _mm_storeu_si128(dest, _mm_add_epi32(_mm_loadu_si128(dest), _mm_unpacklo_epi16(values, zero)));
+        _mm_storeu_si128(dest + 1, _mm_add_epi32(_mm_loadu_si128(dest + 1), _mm_unpackhi_epi16(values, zero)));
+    }
+#endif
+    for (; pix < num_pixels; ++pix) {
+        sum[pix] += image[pix];
+    }
+}
+
+void sum_to_mean(uint16_t* mean, const uint32_t* sum, size_t num_pixels, uint32_t count) {
+    // Once per bin, the division is not worth vectorizing
+    uint64_t half = count / 2;
+    for (size_t pix = 0; pix < num_pixels; ++pix) {
+        mean[pix] = (uint16_t)((sum[pix] + half) / count);
+    }
+}
+
+static const uint64_t HASH_MULTIPLIER = 0x9E3779B97F4A7C15ull;
+
+static inline uint64_t hash_word(uint64_t hash, uint64_t word) {
+    hash = (hash ^ word) * HASH_MULTIPLIER;
+    return hash ^ (hash >> 29);
+}
+
+PixelStatistics pixel_statistics(const uint16_t* image, size_t num_pixels, uint32_t* histogram) {
+    // Four partial histograms, so runs of equal values don't wait for the previous increment of the same bin
+    std::vector<uint32_t> partial(4 * PIXEL_HISTOGRAM_BINS, 0);
+    // Four independent hash lanes, one 64 bit word each per 16 pixels
+    uint64_t lanes[4] = {1, 2, 3, 4};
+    uint16_t min = 0xFFFF;
+    uint16_t max = 0;
+    uint64_t sum = 0;
+    size_t pix = 0;
+#ifdef FRAME_OPS_SSE2
+    // SSE2 only compares signed 16 bit values, flip the sign bit to compare unsigned ones
+    const __m128i sign = _mm_set1_epi16((short)0x8000);
+    const __m128i zero = _mm_setzero_si128();
+    __m128i min_values = _mm_set1_epi16(0x7FFF);
+    __m128i max_values = _mm_set1_epi16((short)0x8000);
+    __m128i sums = _mm_setzero_si128();
+    // 32 bit lanes get 4 values per iteration, flush them before they can overflow
+    const size_t flush_interval = 8192;
+    size_t iterations = 0;
+    for (; pix + 16 <= num_pixels; pix += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i*)(image + pix));
+        __m128i b = _mm_loadu_si128((const __m128i*)(image + pix + 8));
+        __m128i signed_a = _mm_xor_si128(a, sign);
+        __m128i signed_b = _mm_xor_si128(b, sign);
+        min_values = _mm_min_epi16(min_values, _mm_min_epi16(signed_a, signed_b));
+        max_values = _mm_max_epi16(max_values, _mm_max_epi16(signed_a, signed_b));
+        sums = _mm_add_epi32(sums, _mm_add_epi32(_mm_unpacklo_epi16(a, zero), _mm_unpackhi_epi16(a, zero)));
+        sums = _mm_add_epi32(sums, _mm_add_epi32(_mm_unpacklo_epi16(b, zero), _mm_unpackhi_epi16(b, zero)));
+        if (++iterations == flush_interval) {
+            uint32_t values[4];
+            _mm_storeu_si128((__m128i*)values, sums);
+            sum += (uint64_t)values[0] + values[1] + values[2] + values[3];
+            sums = _mm_setzero_si128();
+            iterations = 0;
+        }
+        for (int lane = 0; lane < 4; ++lane) {
+            uint64_t word;
+            memcpy(&word, image + pix + lane * 4, sizeof(word));
+            lanes[lane] = hash_word(lanes[lane], word);
+        }
+        for (int i = 0; i < 16; i += 4) {
+            partial[image[pix + i] >> 4]++;
+            partial[PIXEL_HISTOGRAM_BINS + (image[pix + i + 1] >> 4)]++;
+            partial[2 * PIXEL_HISTOGRAM_BINS + (image[pix + i + 2] >> 4)]++;
+            partial[3 * PIXEL_HISTOGRAM_BINS + (image[pix + i + 3] >> 4)]++;
+        }
+    }
+    uint16_t values[8];
+    _mm_storeu_si128((__m128i*)values, _mm_xor_si128(min_values, sign));
+    for (uint16_t value : values) {
+        min = std::min(min, value);
+    }
+    _mm_storeu_si128((__m128i*)values, _mm_xor_si128(max_values, sign));
+    for (uint16_t value : values) {
+        max = std::max(max, value);
+    }
+    uint32_t lane_sums[4];
+    _mm_storeu_si128((__m128i*)lane_sums, sums);
+    sum += (uint64_t)lane_sums[0] + lane_sums[1] + lane_sums[2] + lane_sums[3];
+#else
+    for (; pix + 16 <= num_pixels; pix += 16) {
+        for (int lane = 0; lane < 4; ++lane) {
+            uint64_t word;
+            memcpy(&word, image + pix + lane * 4, sizeof(word));
+            lanes[lane] = hash_word(lanes[lane], word);
+        }
+        for (int i = 0; i < 16; ++i) {
+            uint16_t value = image[pix + i];
+            min = std::min(min, value);
+            max = std::max(max, value);
+            sum += value;
+            partial[(i % 4) * PIXEL_HISTOGRAM_BINS + (value >> 4)]++;
+        }
+    }
+#endif
+    for (; pix < num_pixels; ++pix) {
+        uint16_t value = image[pix];
+        min = std::min(min, value);
+        max = std::max(max, value);
+        sum += value;
+        partial[value >> 4]++;
+        lanes[0] = hash_word(lanes[0], value);
+    }
+    for (unsigned int bin = 0; bin < PIXEL_HISTOGRAM_BINS; ++bin) {
+        histogram[bin] = partial[bin] + partial[PIXEL_HISTOGRAM_BINS + bin] + partial[2 * PIXEL_HISTOGRAM_BINS + bin] + partial[3 * PIXEL_HISTOGRAM_BINS + bin];
+    }
+    PixelStatistics statistics;
+    statistics.min = num_pixels == 0 ? 0 : min;
+    statistics.max = max;
+    statistics.sum = sum;
+    statistics.hash = hash_word(hash_word(hash_word(hash_word(num_pixels, lanes[0]), lanes[1]), lanes[2]), lanes[3]);
+    return statistics;
+}
+
+uint64_t sum_abs_difference(const uint16_t* a, const uint16_t* b, size_t num_pixels) {
+    uint64_t sum = 0;
+    size_t pix = 0;
+#ifdef FRAME_OPS_SSE2
+    const __m128i zero = _mm_setzero_si128();
+    __m128i sums = _mm_setzero_si128();
+    // 32 bit lanes get 2 values per iteration, flush them before they can overflow
+    const size_t flush_interval = 16384;
+    size_t iterations = 0;
+    for (; pix + 8 <= num_pixels; pix += 8) {
+        __m128i values_a = _mm_loadu_si128((const __m128i*)(a + pix));
+        __m128i values_b = _mm_loadu_si128((const __m128i*)(b + pix));
+        // One of the saturated differences is 0
+        __m128i difference = _mm_or_si128(_mm_subs_epu16(values_a, values_b), _mm_subs_epu16(values_b, values_a));
+        sums = _mm_add_epi32(sums, _mm_add_epi32(_mm_unpacklo_epi16(difference, zero), _mm_unpackhi_epi16(difference, zero)));
+        if (++iterations == flush_interval || pix + 16 > num_pixels) {
+            uint32_t values[4];
+            _mm_storeu_si128((__m128i*)values, sums);
+            sum += (uint64_t)values[0] + values[1] + values[2] + values[3];
+            sums = _mm_setzero_si128();
+            iterations = 0;
+        }
+    }
+#endif
+    for (; pix < num_pixels; ++pix) {
+        sum += a[pix] > b[pix] ? a[pix] - b[pix] : b[pix] - a[pix];
+    }
+    return sum;
+}
+
+size_t count_above(const uint16_t* image, size_t num_pixels, uint16_t threshold) {
+    size_t count = 0;
+    size_t pix = 0;
+#ifdef FRAME_OPS_SSE2
+    const __m128i sign = _mm_set1_epi16((short)0x8000);
+    const __m128i signed_threshold = _mm_xor_si128(_mm_set1_epi16((short)threshold), sign);
+    __m128i counts = _mm_setzero_si128();
+    // 16 bit lanes count one pixel per iteration
+    const size_t flush_interval = 32768;
+    size_t iterations = 0;
+    for (; pix + 8 <= num_pixels; pix += 8) {
+        __m128i values = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(image + pix)), sign);
+        // Matching lanes are -1
+        counts = _mm_sub_epi16(counts, _mm_cmpgt_epi16(values, signed_threshold));
+        if (++iterations == flush_interval || pix + 16 > num_pixels) {
+            uint16_t values16[8];
+            _mm_storeu_si128((__m128i*)values16, counts);
+            for (uint16_t value : values16) {
+                count += value;
+            }
+            counts = _mm_setzero_si128();
+            iterations = 0;
+        }
+    }
+#endif
+    for (; pix < num_pixels; ++pix) {
+        count += image[pix] > threshold ? 1 : 0;
+    }
+    return count;
+}
+
+#ifdef FRAME_OPS_SSE2
+// Background moved by the rounded 1 / 2^shift of its difference to the values, see update_background
+static inline __m128i ema_step(__m128i background, __m128i values, __m128i half, __m128i count) {
+    const __m128i zero = _mm_setzero_si128();
+    __m128i old_low = _mm_unpacklo_epi16(background, zero);
+    __m128i old_high = _mm_unpackhi_epi16(background, zero);
+    // Signed 32 bit steps, the result stays between the old value and the image
+    __m128i step_low = _mm_sra_epi32(_mm_add_epi32(_mm_sub_epi32(_mm_unpacklo_epi16(values, zero), old_low), half), count);
+    __m128i step_high = _mm_sra_epi32(_mm_add_epi32(_mm_sub_epi32(_mm_unpackhi_epi16(values, zero), old_high), half), count);
+    // Unsigned pack through the signed one
+    const __m128i offset = _mm_set1_epi32(32768);
+    __m128i low = _mm_sub_epi32(_mm_add_epi32(old_low, step_low), offset);
+    __m128i high = _mm_sub_epi32(_mm_add_epi32(old_high, step_high), offset);
+    return _mm_xor_si128(_mm_packs_epi32(low, high), _mm_set1_epi16((short)0x8000));
+}
+#endif
+
+static inline uint16_t ema_step(uint16_t background, uint16_t value, int32_t rounding, unsigned int shift) {
+    return (uint16_t)(background + (((int32_t)value - background + rounding) >> shift));
+}
+
+static int32_t ema_rounding(unsigned int shift) {
+    if (shift > 15) {
+        throw std::runtime_error("Background shift has to be at most 15");
+    }
+    return shift == 0 ? 0 : 1 << (shift - 1);
+}
+
+void update_background(uint16_t* background, const uint16_t* image, size_t num_pixels, unsigned int shift) {
+    const int32_t rounding = ema_rounding(shift);
+    size_t pix = 0;
+#ifdef FRAME_OPS_SSE2
+    const __m128i half = _mm_set1_epi32(rounding);
+    const __m128i count = _mm_cvtsi32_si128((int)shift);
+    for (; pix + 8 <= num_pixels; pix += 8) {
+        __m128i values = _mm_loadu_si128((const __m128i*)(image + pix));
+        __m128i* dest = (__m128i*)(background + pix);
+        _mm_storeu_si128(dest, ema_step(_mm_loadu_si128(dest), values, half, count));
+    }
+#endif
+    for (; pix < num_pixels; ++pix) {
+        background[pix] = ema_step(background[pix], image[pix], rounding, shift);
+    }
+}
+
+MipBackground parse_mip_background(const std::string& name) {
+    if (name == "none") {
+        return MipBackground::none;
+    } else if (name == "ema") {
+        return MipBackground::ema;
+    } else if (name == "min") {
+        return MipBackground::minimum;
+    }
+    throw std::runtime_error("Unknown MIP background: " + name);
+}
+
+void fold_max_minus_ema(uint16_t* mip, uint16_t* background, const uint16_t* image, size_t num_pixels, unsigned int shift) {
+    const int32_t rounding = ema_rounding(shift);
+    size_t pix = 0;
+#ifdef FRAME_OPS_SSE2
+    const __m128i half = _mm_set1_epi32(rounding);
+    const __m128i count = _mm_cvtsi32_si128((int)shift);
+    for (; pix + 8 <= num_pixels; pix += 8) {
+        __m128i values = _mm_loadu_si128((const __m128i*)(image + pix));
+        __m128i* projection = (__m128i*)(mip + pix);
+        __m128i* dest = (__m128i*)(background + pix);
+        __m128i old = _mm_loadu_si128(dest);
+        // Unsigned max as mip + (signal - mip) with saturation, SSE2 has no unsigned 16 bit max
+        __m128i signal = _mm_subs_epu16(values, old);
+        __m128i current = _mm_loadu_si128(projection);
+        _mm_storeu_si128(projection, _mm_adds_epu16(current, _mm_subs_epu16(signal, current)));
+        _mm_storeu_si128(dest, ema_step(old, values, half, count));
+    }
+#endif
+    for (; pix < num_pixels; ++pix) {
+        uint16_t signal = image[pix] > background[pix] ? (uint16_t)(image[pix] - background[pix]) : 0;
+        mip[pix] = std::max(mip[pix], signal);
+        background[pix] = ema_step(background[pix], image[pix], rounding, shift);
+    }
+}
+
+void fold_max_minus_min(uint16_t* mip, const uint16_t* previous_min, uint16_t* current_min, const uint16_t* image, size_t num_pixels) {
+    size_t pix = 0;
+#ifdef FRAME_OPS_SSE2
+    for (; pix + 8 <= num_pixels; pix += 8) {
+        __m128i values = _mm_loadu_si128((const __m128i*)(image + pix));
+        __m128i previous = _mm_loadu_si128((const __m128i*)(previous_min + pix));
+        __m128i* dest = (__m128i*)(current_min + pix);
+        __m128i* projection = (__m128i*)(mip + pix);
+        __m128i minimum = _mm_loadu_si128(dest);
+        // Unsigned min as a - (a - b) with saturation
+        __m128i background = _mm_subs_epu16(previous, _mm_subs_epu16(previous, minimum));
+        __m128i signal = _mm_subs_epu16(values, background);
+        __m128i current = _mm_loadu_si128(projection);
+        _mm_storeu_si128(projection, _mm_adds_epu16(current, _mm_subs_epu16(signal, current)));
+        _mm_storeu_si128(dest, _mm_subs_epu16(minimum, _mm_subs_epu16(minimum, values)));
+    }
+#endif
+    for (; pix < num_pixels; ++pix) {
+        uint16_t background = std::min(previous_min[pix], current_min[pix]);
+        uint16_t signal = image[pix] > background ? (uint16_t)(image[pix] - background) : 0;
+        mip[pix] = std::max(mip[pix], signal);
+        current_min[pix] = std::min(current_min[pix], image[pix]);
+    }
+}
+
+void fold_max_orthogonal(uint16_t* mip, uint16_t* xz_row, uint16_t* yz_column, const uint16_t* image, unsigned int width, unsigned int height) {
+    std::fill(xz_row, xz_row + width, 0);
+    for (unsigned int y = 0; y < height; ++y) {
+        const uint16_t* row = image + (size_t)y * width;
+        uint16_t* mip_row = mip + (size_t)y * width;
+        uint16_t row_max = 0;
+        unsigned int x = 0;
+#ifdef FRAME_OPS_SSE2
+        // Unsigned max as a + (b - a) with saturation, SSE2 has no unsigned 16 bit max
+        __m128i row_maxima = _mm_setzero_si128();
+        for (; x + 8 <= width; x += 8) {
+            __m128i values = _mm_loadu_si128((const __m128i*)(row + x));
+            __m128i* projection = (__m128i*)(mip_row + x);
+            __m128i* side = (__m128i*)(xz_row + x);
+            __m128i current = _mm_loadu_si128(projection);
+            __m128i column = _mm_loadu_si128(side);
+            _mm_storeu_si128(projection, _mm_adds_epu16(current, _mm_subs_epu16(values, current)));
+            _mm_storeu_si128(side, _mm_adds_epu16(column, _mm_subs_epu16(values, column)));
+            row_maxima = _mm_adds_epu16(row_maxima, _mm_subs_epu16(values, row_maxima));
+        }
+        uint16_t maxima[8];
+        _mm_storeu_si128((__m128i*)maxima, row_maxima);
+        for (uint16_t value : maxima) {
+            row_max = std::max(row_max, value);
+        }
+#endif
+        for (; x < width; ++x) {
+            uint16_t value = row[x];
+            mip_row[x] = std::max(mip_row[x], value);
+            xz_row[x] = std::max(xz_row[x], value);
+            row_max = std::max(row_max, value);
+        }
+        yz_column[y] = row_max;
+    }
+}
+
+PyramidReduction parse_pyramid_reduction(const std::string& name) {
+    if (name == "max") {
+        return PyramidReduction::max;
+    } else if (name == "mean") {
+        return PyramidReduction::mean;
+    }
+    throw std::runtime_error("Unknown pyramid reduction: " + name);
+}
+
+void reduce_2x2(uint16_t* dest, const uint16_t* image, unsigned int width, unsigned int height, PyramidReduction reduction) {
+    unsigned int out_width = width / 2;
+    unsigned int out_height = height / 2;
+    for (unsigned int y = 0; y < out_height; ++y) {
+        const uint16_t* row0 = image + (size_t)2 * y * width;
+        const uint16_t* row1 = row0 + width;
+        uint16_t* out = dest + (size_t)y * out_width;
+        unsigned int x = 0;
+#ifdef FRAME_OPS_SSE2
+        const __m128i low_half = _mm_set1_epi32(0xFFFF);
+        const __m128i offset = _mm_set1_epi32(32768);
+        const __m128i sign = _mm_set1_epi16((short)0x8000);
+        const __m128i two = _mm_set1_epi32(2);
+        for (; x + 8 <= out_width; x += 8) {
+            __m128i a0 = _mm_loadu_si128((const __m128i*)(row0 + 2 * x));
+            __m128i b0 = _mm_loadu_si128((const __m128i*)(row0 + 2 * x + 8));
+            __m128i a1 = _mm_loadu_si128((const __m128i*)(row1 + 2 * x));
+            __m128i b1 = _mm_loadu_si128((const __m128i*)(row1 + 2 * x + 8));
+            __m128i low, high;
+            if (reduction == PyramidReduction::max) {
+                // Unsigned max as a + (b - a) with saturation, on 16 and then on zero extended 32 bit lanes
+                __m128i a = _mm_adds_epu16(a0, _mm_subs_epu16(a1, a0));
+                __m128i b = _mm_adds_epu16(b0, _mm_subs_epu16(b1, b0));
+                __m128i even_a = _mm_and_si128(a, low_half);
+                __m128i even_b = _mm_and_si128(b, low_half);
+                low = _mm_adds_epu16(even_a, _mm_subs_epu16(_mm_srli_epi32(a, 16), even_a));
+                high = _mm_adds_epu16(even_b, _mm_subs_epu16(_mm_srli_epi32(b, 16), even_b));
+            } else {
+                __m128i sum_a = _mm_add_epi32(_mm_add_epi32(_mm_and_si128(a0, low_half), _mm_srli_epi32(a0, 16)),
+                    _mm_add_epi32(_mm_and_si128(a1, low_half), _mm_srli_epi32(a1, 16)));
+                __m128i sum_b = _mm_add_epi32(_mm_add_epi32(_mm_and_si128(b0, low_half), _mm_srli_epi32(b0, 16)),
+                    _mm_add_epi32(_mm_and_si128(b1, low_half), _mm_srli_epi32(b1, 16)));
+                low = _mm_srli_epi32(_mm_add_epi32(sum_a, two), 2);
+                high = _mm_srli_epi32(_mm_add_epi32(sum_b, two), 2);
+            }
+            // Unsigned pack through the signed one
+            __m128i packed = _mm_packs_epi32(_mm_sub_epi32(low, offset), _mm_sub_epi32(high, offset));
+            _mm_storeu_si128((__m128i*)(out + x), _mm_xor_si128(packed, sign));
+        }
+#endif
+        for (; x < out_width; ++x) {
+            uint16_t p00 = row0[2 * x], p01 = row0[2 * x + 1], p10 = row1[2 * x], p11 = row1[2 * x + 1];
+            if (reduction == PyramidReduction::max) {
+                out[x] = std::max(std::max(p00, p01), std::max(p10, p11));
+            } else {
+                out[x] = (uint16_t)(((uint32_t)p00 + p01 + p10 + p11 + 2) >> 2);
+            }
+        }
+    }
+}
+
+EventMetric parse_event_metric(const std::string& name) {
+    if (name == "difference") {
+        return EventMetric::difference;
+    } else if (name == "count") {
+        return EventMetric::count;
+    }
+    throw std::runtime_error("Unknown event metric: " + name);
+}
+
+void flat_field_correct(uint16_t* dest, const uint16_t* image, const uint16_t* dark, const uint16_t* gain, size_t num_pixels) {
+    size_t pix = 0;
+    if (!gain) {
+#ifdef FRAME_OPS_SSE2
+        for (; pix + 8 <= num_pixels; pix += 8) {
+            __m128i values = _mm_loadu_si128((const __m128i*)(image + pix));
+            __m128i offsets = _mm_loadu_si128((const __m128i*)(dark + pix));
+            _mm_storeu_si128((__m128i*)(dest + pix), _mm_subs_epu16(values, offsets));
+        }
+#endif
+        for (; pix < num_pixels; ++pix) {
+            dest[pix] = image[pix] > dark[pix] ? (uint16_t)(image[pix] - dark[pix]) : 0;
+        }
+        return;
+    }
+#ifdef FRAME_OPS_SSE2
+    const __m128i rounding = _mm_set1_epi32(FLAT_FIELD_GAIN_ONE / 2);
+    const __m128i offset = _mm_set1_epi32(32768);
+    const __m128i sign = _mm_set1_epi16((short)0x8000);
+    for (; pix + 8 <= num_pixels; pix += 8) {
+        __m128i values = _mm_subs_epu16(_mm_loadu_si128((const __m128i*)(image + pix)), _mm_loadu_si128((const __m128i*)(dark + pix)));
+        __m128i gains = _mm_loadu_si128((const __m128i*)(gain + pix));
+        // Full 32 bit products from the low and high halves
+        __m128i low = _mm_mullo_epi16(values, gains);
+        __m128i high = _mm_mulhi_epu16(values, gains);
+        __m128i product0 = _mm_srli_epi32(_mm_add_epi32(_mm_unpacklo_epi16(low, high), rounding), 14);
+        __m128i product1 = _mm_srli_epi32(_mm_add_epi32(_mm_unpackhi_epi16(low, high), rounding), 14);
+        // SSE2 has no unsigned pack, shift into the signed range, which also saturates values above 65535
+        __m128i packed = _mm_packs_epi32(_mm_sub_epi32(product0, offset), _mm_sub_epi32(product1, offset));
+        _mm_storeu_si128((__m128i*)(dest + pix), _mm_xor_si128(packed, sign));
+    }
+#endif
+    for (; pix < num_pixels; ++pix) {
+        uint32_t value = image[pix] > dark[pix] ? (uint32_t)(image[pix] - dark[pix]) : 0;
+        value = (value * gain[pix] + FLAT_FIELD_GAIN_ONE / 2) >> 14;
+        dest[pix] = (uint16_t)std::min<uint32_t>(value, 65535);
+    }
+}
+
+std::vector<uint16_t> flat_field_gain(const uint16_t* dark, const uint16_t* flat, size_t num_pixels) {
+    uint64_t total = 0;
+    size_t count = 0;
+    for (size_t pix = 0; pix < num_pixels; ++pix) {
+        if (flat[pix] > dark[pix]) {
+            total += flat[pix] - dark[pix];
+            count++;
+        }
+    }
+    std::vector<uint16_t> gain(num_pixels, FLAT_FIELD_GAIN_ONE);
+    if (count == 0) {
+        return gain;
+    }
+    double mean = (double)total / count;
+    for (size_t pix = 0; pix < num_pixels; ++pix) {
+        if (flat[pix] > dark[pix]) {
+            double value = mean / (flat[pix] - dark[pix]) * FLAT_FIELD_GAIN_ONE + 0.5;
+            gain[pix] = (uint16_t)std::min(value, 65535.0);
+        }
+    }
+    return gain;
+}
+
+HotPixelReplacement parse_hot_pixel_replacement(const std::string& name) {
+    if (name == "median") {
+        return HotPixelReplacement::median;
+    } else if (name == "mean") {
+        return HotPixelReplacement::mean;
+    }
+    throw std::runtime_error("Unknown hot pixel replacement: " + name);
+}
+
+static bool hot_pixel_less(const HotPixel& a, const HotPixel& b) {
+    return a.y < b.y || (a.y == b.y && a.x < b.x);
+}
+
+static void sort_hot_pixels(std::vector<HotPixel>& pixels) {
+    std::sort(pixels.begin(), pixels.end(), hot_pixel_less);
+    pixels.erase(std::unique(pixels.begin(), pixels.end(), [](const HotPixel& a, const HotPixel& b) {
+        return a.x == b.x && a.y == b.y;
+    }), pixels.end());
+}
+
+std::shared_ptr<HotPixelMap> make_hot_pixel_map(std::vector<HotPixel> pixels, HotPixelReplacement replacement) {
+    auto map = std::make_shared<HotPixelMap>();
+    sort_hot_pixels(pixels);
+    map->pixels = std::move(pixels);
+    map->replacement = replacement;
+    map->neighbours.resize(map->pixels.size());
+    for (size_t i = 0; i < map->pixels.size(); ++i) {
+        const HotPixel& pixel = map->pixels[i];
+        uint8_t valid = 0;
+        unsigned int bit = 0;
+        for (int dy = -1; dy <= 1; ++dy) {
+            for (int dx = -1; dx <= 1; ++dx) {
+                if (dx == 0 && dy == 0) {
+                    continue;
+                }
+                // Pixels outside of the image are sorted out when replacing, the map doesn't know the image size
+                HotPixel neighbour = {pixel.x + dx, pixel.y + dy};
+                if (!std::binary_search(map->pixels.begin(), map->pixels.end(), neighbour, hot_pixel_less)) {
+                    valid |= 1 << bit;
+                }
+                bit++;
+            }
+        }
+        map->neighbours[i] = valid;
+    }
+    return map;
+}
+
+// Median of a 16 bit histogram with count entries
+static uint16_t histogram_median(const std::vector<size_t>& histogram, size_t count) {
+    size_t seen = 0;
+    for (size_t value = 0; value < histogram.size(); ++value) {
+        seen += histogram[value];
+        if (seen * 2 > count) {
+            return (uint16_t)value;
+        }
+    }
+    return 0;
+}
+
+std::vector<HotPixel> detect_hot_pixels(const uint16_t* dark, unsigned int width, unsigned int height, double threshold_sigma) {
+    size_t num_pixels = (size_t)width * height;
+    std::vector<HotPixel> pixels;
+    if (num_pixels == 0) {
+        return pixels;
+    }
+    std::vector<size_t> histogram(65536, 0);
+    for (size_t pix = 0; pix < num_pixels; ++pix) {
+        histogram[dark[pix]]++;
+    }
+    uint16_t median = histogram_median(histogram, num_pixels);
+    std::fill(histogram.begin(), histogram.end(), 0);
+    for (size_t pix = 0; pix < num_pixels; ++pix) {
+        histogram[std::abs((int)dark[pix] - median)]++;
+    }
+    // 1.4826 * MAD estimates the standard deviation of normally distributed values, at least 1 for very clean sensors
+    double sigma = std::max(1.4826 * histogram_median(histogram, num_pixels), 1.0);
+    double threshold = median + threshold_sigma * sigma;
+    for (unsigned int y = 0; y < height; ++y) {
+        for (unsigned int x = 0; x < width; ++x) {
+            if (dark[(size_t)y * width + x] > threshold) {
+                pixels.push_back({x, y});
+            }
+        }
+    }
+    return pixels;
+}
+
+std::vector<HotPixel> read_hot_pixels(const std::string& path) {
+    std::ifstream in(path);
+    if (!in) {
+        throw std::runtime_error("Could not open hot pixel list " + path);
+    }
+    std::vector<HotPixel> pixels;
+    std::string line;
+    while (std::getline(in, line)) {
+        if (line.empty() || line[0] == '#' || line.find_first_not_of(" \t\r") == std::string::npos) {
+            continue;
+        }
+        std::istringstream fields(line);
+        long long x, y;
+        if (!(fields >> x >> y) || x < 1 || y < 1 || x > std::numeric_limits<unsigned int>::max() || y > std::numeric_limits<unsigned int>::max()) {
+            throw std::runtime_error("Invalid line in hot pixel list " + path + ": " + line);
+        }
+        pixels.push_back({(unsigned int)(x - 1), (unsigned int)(y - 1)});
+    }
+    sort_hot_pixels(pixels);
+    return pixels;
+}
+
+void write_hot_pixels(const std::string& path, const std::vector<HotPixel>& pixels) {
+    std::ofstream out(path);
+    out << "# x y of hot pixels, index starts at 1\n";
+    for (const HotPixel& pixel : pixels) {
+        out << pixel.x + 1 << ' ' << pixel.y + 1 << '\n';
+    }
+    if (!out) {
+        throw std::runtime_error("Could not write hot pixel list " + path);
+    }
+}
+
+SpatialBinning parse_spatial_binning(const std::string& name) {
+    if (name == "mean") {
+        return SpatialBinning::mean;
+    } else if (name == "sum") {
+        return SpatialBinning::sum;
+    }
+    throw std::runtime_error("Unknown spatial binning: " + name);
+}
+
+static bool full_frame(const FrameProcessing& processing) {
+    return processing.roi_x0 == 0 && processing.roi_y0 == 0 && processing.roi_x1 == 0 && processing.roi_y1 == 0;
+}
+
+bool frame_processing_active(const FrameProcessing& processing) {
+    return processing.flat_field || processing.hot_pixels || !full_frame(processing) || processing.bin > 1;
+}
+
+// Region as 0 based offset and size
+static void crop_region(const FrameProcessing& processing, unsigned int width, unsigned int height,
+    unsigned int& x, unsigned int& y, unsigned int& crop_width, unsigned int& crop_height) {
+    if (full_frame(processing)) {
+        x = 0;
+        y = 0;
+        crop_width = width;
+        crop_height = height;
+        return;
+    }
+    if (processing.roi_x0 < 1 || processing.roi_y0 < 1 || processing.roi_x1 < processing.roi_x0 || processing.roi_y1 < processing.roi_y0
+        || processing.roi_x1 > width || processing.roi_y1 > height) {
+        throw std::runtime_error("Software ROI does not fit into the " + std::to_string(width) + " x " + std::to_string(height) + " image");
+    }
+    x = processing.roi_x0 - 1;
+    y = processing.roi_y0 - 1;
+    crop_width = processing.roi_x1 - processing.roi_x0 + 1;
+    crop_height = processing.roi_y1 - processing.roi_y0 + 1;
+}
+
+void processed_frame_size(const FrameProcessing& processing, unsigned int width, unsigned int height, unsigned int& out_width, unsigned int& out_height) {
+    unsigned int x, y, crop_width, crop_height;
+    crop_region(processing, width, height, x, y, crop_width, crop_height);
+    const FlatField* flat_field = processing.flat_field.get();
+    if (flat_field && (flat_field->width != width || flat_field->height != height)) {
+        throw std::runtime_error("Flat field correction is " + std::to_string(flat_field->width) + " x " + std::to_string(flat_field->height)
+            + " but the image is " + std::to_string(width) + " x " + std::to_string(height));
+    }
+    if (processing.hot_pixels) {
+        if (processing.hot_pixels->neighbours.size() != processing.hot_pixels->pixels.size()) {
+            throw std::runtime_error("Hot pixel map not created with make_hot_pixel_map");
+        }
+        for (const HotPixel& pixel : processing.hot_pixels->pixels) {
+            if (pixel.x >= width || pixel.y >= height) {
+                throw std::runtime_error("Hot pixel " + std::to_string(pixel.x + 1) + " " + std::to_string(pixel.y + 1) + " is outside of the image");
+            }
+        }
+    }
+    if (processing.bin == 0) {
+        throw std::runtime_error("Binning has to be at least 1");
+    }
+    out_width = crop_width / processing.bin;
+    out_height = crop_height / processing.bin;
+    if (out_width == 0 || out_height == 0) {
+        throw std::runtime_error("Binning is larger than the image");
+    }
+}
+
+// Sums of bin horizontally adjacent values of the row sums, as mean or saturated sum
+static void bin_row(uint16_t* dest, const uint32_t* row_sum, unsigned int out_width, unsigned int bin, SpatialBinning binning) {
+    unsigned int count = bin * bin;
+    unsigned int x = 0;
+#ifdef FRAME_OPS_SSE2
+    if (bin == 2) {
+        const __m128i offset = _mm_set1_epi32(32768);
+        const __m128i sign = _mm_set1_epi16((short)0x8000);
+        const __m128i rounding = _mm_set1_epi32(2);
+        for (; x + 8 <= out_width; x += 8) {
+            __m128 a = _mm_castsi128_ps(_mm_loadu_si128((const __m128i*)(row_sum + 2 * x)));
+            __m128 b = _mm_castsi128_ps(_mm_loadu_si128((const __m128i*)(row_sum + 2 * x + 4)));
+            __m128 c = _mm_castsi128_ps(_mm_loadu_si128((const __m128i*)(row_sum + 2 * x + 8)));
+            __m128 d = _mm_castsi128_ps(_mm_loadu_si128((const __m128i*)(row_sum + 2 * x + 12)));
+            // Even plus odd columns
+            __m128i lo = _mm_add_epi32(_mm_castps_si128(_mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0))), _mm_castps_si128(_mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1))));
+            __m128i hi = _mm_add_epi32(_mm_castps_si128(_mm_shuffle_ps(c, d, _MM_SHUFFLE(2, 0, 2, 0))), _mm_castps_si128(_mm_shuffle_ps(c, d, _MM_SHUFFLE(3, 1, 3, 1))));
+            if (binning == SpatialBinning::mean) {
+                lo = _mm_srli_epi32(_mm_add_epi32(lo, rounding), 2);
+                hi = _mm_srli_epi32(_mm_add_epi32(hi, rounding), 2);
+            }
+            // SSE2 has no unsigned pack, shift into the signed range, which also saturates sums above 65535
+            __m128i packed = _mm_packs_epi32(_mm_sub_epi32(lo, offset), _mm_sub_epi32(hi, offset));
+            _mm_storeu_si128((__m128i*)(dest + x), _mm_xor_si128(packed, sign));
+        }
+    }
+#endif
+    for (; x < out_width; ++x) {
+        uint32_t sum = 0;
+        for (unsigned int i = 0; i < bin; ++i) {
+            sum += row_sum[x * bin + i];
+        }
+        if (binning == SpatialBinning::mean) {
+            dest[x] = (uint16_t)((sum + count / 2) / count);
+        } else {
+            dest[x] = (uint16_t)std::min<uint32_t>(sum, 65535);
+        }
+    }
+}
+
+// Pixel of the image after the flat field correction
+static uint16_t corrected_pixel(const uint16_t* image, const FlatField* flat_field, size_t index) {
+    if (!flat_field) {
+        return image[index];
+    }
+    uint16_t value;
+    flat_field_correct(&value, image + index, flat_field->dark.data() + index, flat_field->gain.empty() ? nullptr : flat_field->gain.data() + index, 1);
+    return value;
+}
+
+// Median or mean of the corrected neighbours which are not hot pixels, the pixel itself if there are none
+static uint16_t hot_pixel_value(const uint16_t* image, unsigned int width, unsigned int height, const FlatField* flat_field,
+    const HotPixelMap& hot_pixels, size_t hot_pixel) {
+    const HotPixel& pixel = hot_pixels.pixels[hot_pixel];
+    uint8_t valid = hot_pixels.neighbours[hot_pixel];
+    uint16_t neighbours[8];
+    unsigned int count = 0;
+    unsigned int bit = 0;
+    for (int dy = -1; dy <= 1; ++dy) {
+        for (int dx = -1; dx <= 1; ++dx) {
+            if (dx == 0 && dy == 0) {
+                continue;
+            }
+            unsigned int neighbour_x = pixel.x + dx;
+            unsigned int neighbour_y = pixel.y + dy;
+            if ((valid & (1 << bit++)) && neighbour_x < width && neighbour_y < height) {
+                neighbours[count++] = corrected_pixel(image, flat_field, (size_t)neighbour_y * width + neighbour_x);
+            }
+        }
+    }
+    if (count == 0) {
+        return corrected_pixel(image, flat_field, (size_t)pixel.y * width + pixel.x);
+    }
+    if (hot_pixels.replacement == HotPixelReplacement::mean) {
+        uint32_t sum = 0;
+        for (unsigned int i = 0; i < count; ++i) {
+            sum += neighbours[i];
+        }
+        return (uint16_t)((sum + count / 2) / count);
+    }
+    // Insertion sort of at most 8 values
+    for (unsigned int i = 1; i < count; ++i) {
+        uint16_t value = neighbours[i];
+        unsigned int j = i;
+        for (; j > 0 && neighbours[j - 1] > value; --j) {
+            neighbours[j] = neighbours[j - 1];
+        }
+        neighbours[j] = value;
+    }
+    if (count % 2 == 1) {
+        return neighbours[count / 2];
+    }
+    return (uint16_t)((neighbours[count / 2 - 1] + neighbours[count / 2] + 1) / 2);
+}
+
+void process_frame(uint16_t* dest, const uint16_t* image, unsigned int width, unsigned int height, const FrameProcessing& processing) {
+    unsigned int x, y, crop_width, crop_height, out_width, out_height;
+    crop_region(processing, width, height, x, y, crop_width, crop_height);
+    processed_frame_size(processing, width, height, out_width, out_height);
+    size_t region_offset = (size_t)y * width + x;
+    const uint16_t* region = image + region_offset;
+    const FlatField* flat_field = processing.flat_field.get();
+    const uint16_t* dark = flat_field ? flat_field->dark.data() + region_offset : nullptr;
+    const uint16_t* gain = flat_field && !flat_field->gain.empty() ? flat_field->gain.data() + region_offset : nullptr;
+    // Copies a row of the region, corrected if there is a flat field
+    auto load_row = [&](uint16_t* row_dest, size_t offset, size_t length) {
+        if (dark) {
+            flat_field_correct(row_dest, region + offset, dark + offset, gain ? gain + offset : nullptr, length);
+        } else {
+            memcpy(row_dest, region + offset, length * sizeof(uint16_t));
+        }
+    };
+
+    // Rows are loaded in order, so a cursor through the sorted hot pixels finds the ones in each row
+    const HotPixelMap* hot_pixels = processing.hot_pixels.get();
+    std::vector<HotPixel>::const_iterator next_hot_pixel;
+    if (hot_pixels) {
+        next_hot_pixel = std::lower_bound(hot_pixels->pixels.begin(), hot_pixels->pixels.end(), HotPixel{0, y}, hot_pixel_less);
+    }
+    // True if the loaded row (index in the region) has hot pixels in its first length pixels
+    auto row_has_hot_pixels = [&](unsigned int row, size_t length) {
+        if (!hot_pixels) {
+            return false;
+        }
+        while (next_hot_pixel != hot_pixels->pixels.end() && (next_hot_pixel->y < y + row || (next_hot_pixel->y == y + row && next_hot_pixel->x < x))) {
+            ++next_hot_pixel;
+        }
+        return next_hot_pixel != hot_pixels->pixels.end() && next_hot_pixel->y == y + row && next_hot_pixel->x < x + length;
+    };
+    auto replace_hot_pixels = [&](uint16_t* row_dest, unsigned int row, size_t length) {
+        for (; next_hot_pixel != hot_pixels->pixels.end() && next_hot_pixel->y == y + row && next_hot_pixel->x < x + length; ++next_hot_pixel) {
+            row_dest[next_hot_pixel->x - x] = hot_pixel_value(image, width, height, flat_field, *hot_pixels, next_hot_pixel - hot_pixels->pixels.begin());
+        }
+    };
+
+    unsigned int bin = processing.bin;
+    if (bin == 1) {
+        for (unsigned int row = 0; row < out_height; ++row) {
+            uint16_t* row_dest = dest + (size_t)row * out_width;
+            load_row(row_dest, (size_t)row * width, out_width);
+            if (row_has_hot_pixels(row, out_width)) {
+                replace_hot_pixels(row_dest, row, out_width);
+            }
+        }
+        return;
+    }
+
+    // Rows are summed vertically into 32 bit first, then the sums of bin adjacent values are taken
+    size_t row_length = (size_t)out_width * bin;
+    std::vector<uint32_t> row_sum(row_length);
+    std::vector<uint16_t> corrected(dark || hot_pixels ? row_length : 0);
+    for (unsigned int out_row = 0; out_row < out_height; ++out_row) {
+        for (unsigned int i = 0; i < bin; ++i) {
+            unsigned int region_row = out_row * bin + i;
+            size_t offset = (size_t)region_row * width;
+            const uint16_t* row = region + offset;
+            bool has_hot_pixels = row_has_hot_pixels(region_row, row_length);
+            if (dark || has_hot_pixels) {
+                load_row(corrected.data(), offset, row_length);
+                row = corrected.data();
+            }
+            if (has_hot_pixels) {
+                replace_hot_pixels(corrected.data(), region_row, row_length);
+            }
+            if (i == 0) {
+                std::copy(row, row + row_length, row_sum.begin());
+            } else {
+                accumulate_sum(row_sum.data(), row, row_length);
+            }
+        }
+        bin_row(dest + (size_t)out_row * out_width, row_sum.data(), out_width, bin, processing.binning);
+    }
+}
@@ -0,0 +1,207 @@
+#include "frame_pipeline.hpp"
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <thread>
+
+// Frames are recycled so the pipeline doesn't allocate after the first queue_depth frames
+struct FramePool {
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::vector<std::unique_ptr<Frame>> free_frames;
+    unsigned int allocated = 0;
+    unsigned int capacity;
+    BufferAllocation allocation;
+};
+
+// Returns the frame to the pool when the last sink releases it
+static std::shared_ptr<const Frame> acquire_frame(const std::shared_ptr<FramePool>& pool) {
+    std::unique_lock<std::mutex> lock(pool->mutex);
+    pool->cv.wait(lock, [&pool]() { return !pool->free_frames.empty() || pool->allocated < pool->capacity; });
+    std::unique_ptr<Frame> frame;
+    if (!pool->free_frames.empty()) {
+        frame = std::move(pool->free_frames.back());
+        pool->free_frames.pop_back();
+    } else {
+        frame.reset(new Frame());
+        frame->data = PixelVector(PixelAllocator<uint16_t>(pool->allocation));
+        pool->allocated++;
+    }
+    return std::shared_ptr<const Frame>(frame.release(), [pool](const Frame* released) {
+        std::lock_guard<std::mutex> lock(pool->mutex);
+        pool->free_frames.emplace_back(const_cast<Frame*>(released));
+        pool->cv.notify_one();
+    });
+}
+
+struct SinkWorker {
+    std::shared_ptr<FrameSink> sink;
+    std::thread thread;
+    std::mutex mutex;
+    std::condition_variable cv;
+    // nullptr marks the end of the transfer
+    std::deque<std::shared_ptr<const Frame>> queue;
+};
+
+class FramePipelinePimpl {
+public:
+    std::shared_ptr<FramePool> pool;
+    FrameProcessing processing;
+    std::vector<std::unique_ptr<SinkWorker>> workers;
+    unsigned int frames_pushed = 0;
+    bool finished = false;
+
+    std::mutex error_mutex;
+    std::exception_ptr error;
+
+    void run(SinkWorker& worker);
+    void close_queues();
+    void join();
+    void rethrow();
+};
+
+void FramePipelinePimpl::run(SinkWorker& worker) {
+    bool failed = false;
+    while (true) {
+        std::shared_ptr<const Frame> frame;
+        {
+            std::unique_lock<std::mutex> lock(worker.mutex);
+            worker.cv.wait(lock, [&worker]() { return !worker.queue.empty(); });
+            frame = std::move(worker.queue.front());
+            worker.queue.pop_front();
+        }
+        if (!frame) {
+            break;
+        }
+        // After an error keep taking frames so the producer doesn't block, it will see the error on the next push
+        if (failed) {
+            continue;
+        }
+        try {
+            worker.sink->consume(*frame);
+        }
+        catch (...) {
+            failed = true;
+            std::lock_guard<std::mutex> lock(error_mutex);
+            if (!error) {
+                error = std::current_exception();
+            }
+        }
+    }
+    if (!failed && finished) {
+        try {
+            worker.sink->finish();
+        }
+        catch (...) {
+            std::lock_guard<std::mutex> lock(error_mutex);
+            if (!error) {
+                error = std::current_exception();
+            }
+        }
+    }
+}
+
+void FramePipelinePimpl::close_queues() {
+    for (auto& worker : workers) {
+        std::lock_guard<std::mutex> lock(worker->mutex);
+        worker->queue.push_back(nullptr);
+        worker->cv.notify_one();
+    }
+}
+
+void FramePipelinePimpl::join() {
+    for (auto& worker : workers) {
+        if (worker->thread.joinable()) {
+            worker->thread.join();
+        }
+    }
+}
+
+void FramePipelinePimpl::rethrow() {
+    std::lock_guard<std::mutex> lock(error_mutex);
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
+
+FramePipeline::FramePipeline(std::vector<std::shared_ptr<FrameSink>> sinks, unsigned int queue_depth, BufferAllocation allocation,
+    FrameProcessing processing)
+: p_impl(new FramePipelinePimpl())
+{
+    p_impl->processing = processing;
+    p_impl->pool = std::make_shared<FramePool>();
+    p_impl->pool->capacity = std::max(queue_depth, 1u);
+    p_impl->pool->allocation = allocation;
+    for (auto& sink : sinks) {
+        std::unique_ptr<SinkWorker> worker(new SinkWorker());
+        worker->sink = sink;
+        p_impl->workers.push_back(std::move(worker));
+    }
+    FramePipelinePimpl* impl = p_impl.get();
+    for (auto& worker : p_impl->workers) {
+        SinkWorker* w = worker.get();
+        worker->thread = std::thread([impl, w]() { impl->run(*w); });
+    }
+}
+
+FramePipeline::~FramePipeline() {
+    if (!p_impl->finished) {
+        // Drop queued frames, sinks are not finished
+        for (auto& worker : p_impl->workers) {
+            std::lock_guard<std::mutex> lock(worker->mutex);
+            worker->queue.clear();
+        }
+        p_impl->close_queues();
+        p_impl->join();
+    }
+}
+
+void FramePipeline::push(unsigned int range, unsigned int index, unsigned int width, unsigned int height, const uint16_t* data) {
+    p_impl->rethrow();
+
+    unsigned int out_width = width;
+    unsigned int out_height = height;
+    bool process = frame_processing_active(p_impl->processing);
+    if (process) {
+        processed_frame_size(p_impl->processing, width, height, out_width, out_height);
+    }
+
+    std::shared_ptr<const Frame> shared = acquire_frame(p_impl->pool);
+    // Only the producer writes to a frame, before it is handed to the sinks
+    Frame* frame = const_cast<Frame*>(shared.get());
+    frame->range = range;
+    frame->index = index;
+    frame->width = out_width;
+    frame->height = out_height;
+    if (process) {
+        // Cropped and binned while copying, so the full image is only read once
+        frame->data.resize((size_t)out_width * out_height);
+        process_frame(frame->data.data(), data, width, height, p_impl->processing);
+    } else {
+        frame->data.assign(data, data + (size_t)width * height);
+    }
+
+    for (auto& worker : p_impl->workers) {
+        std::lock_guard<std::mutex> lock(worker->mutex);
+        worker->queue.push_back(shared);
+        worker->cv.notify_one();
+    }
+    p_impl->frames_pushed++;
+}
+
+void FramePipeline::finish() {
+    if (p_impl->finished) {
+        return;
+    }
+    p_impl->finished = true;
+    p_impl->close_queues();
+    p_impl->join();
+    p_impl->rethrow();
+}
+
+unsigned int FramePipeline::frames_pushed() const {
+    return p_impl->frames_pushed;
+}
@@ -0,0 +1,599 @@
+#include "frame_sinks.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+#include "frame_ops.hpp"
+#include "tiff_writer.hpp"
+
+TiffSink::TiffSink(std::string outpath, TiffWriterOptions options, OutputFormat format)
+: tif(open_frame_writer(outpath, format, options))
+{ }
+
+TiffSink::~TiffSink() { }
+
+void TiffSink::finish() {
+    tif->close();
+}
+
+void TiffSink::consume(const Frame& frame) {
+    tif->write_frame(frame.width, frame.height, frame.data.data());
+    written++;
+}
+
+MipSink::MipSink(std::string outpath, unsigned int images_per_mip, TiffWriterOptions options, OutputFormat format, BufferAllocation allocation,
+    MipBackground background, unsigned int background_frames)
+: tif(open_frame_writer(outpath, format, options)), outpath(outpath), options(options), format(format),
+  images_per_mip(images_per_mip), mip(PixelAllocator<uint16_t>(allocation)),
+  background_mode(background), background_frames(background_frames),
+  background(PixelAllocator<uint16_t>(allocation)), window_min(PixelAllocator<uint16_t>(allocation))
+{
+    if (images_per_mip == 0) {
+        throw std::runtime_error("images_per_mip has to be at least 1");
+    }
+    if (background_frames == 0) {
+        throw std::runtime_error("background_frames has to be at least 1");
+    }
+    while (background_shift < 15 && (2u << background_shift) <= background_frames) {
+        background_shift++;
+    }
+}
+
+MipSink::~MipSink() { }
+
+void MipSink::finish() {
+    tif->close();
+    for (auto& writer : level_writers) {
+        writer->close();
+    }
+    if (xz_writer) {
+        xz_writer->close();
+        yz_writer->close();
+    }
+}
+
+// Inserts the suffix before the extension of every path
+static std::string suffixed_filename(const std::string& path, const std::string& suffix) {
+    std::vector<std::string> paths = split_output_paths(path);
+    for (std::string& filename : paths) {
+        std::size_t found = filename.find_last_of(".");
+        if (found == std::string::npos) {
+            filename += suffix;
+        } else {
+            filename = filename.substr(0, found) + suffix + filename.substr(found);
+        }
+    }
+    return join_output_paths(paths);
+}
+
+std::string pyramid_level_filename(const std::string& path, unsigned int level) {
+    return suffixed_filename(path, "_" + std::to_string(1u << level) + "x");
+}
+
+std::string projection_filename(const std::string& path, const std::string& plane) {
+    return suffixed_filename(path, "_" + plane);
+}
+
+void MipSink::add_orthogonal_projections() {
+    if (background_mode != MipBackground::none) {
+        throw std::runtime_error("Orthogonal projections can't be combined with background subtraction");
+    }
+    if (xz_writer) {
+        throw std::runtime_error("The orthogonal projections were already added");
+    }
+    xz_writer = open_frame_writer(projection_filename(outpath, "xz"), format, options);
+    yz_writer = open_frame_writer(projection_filename(outpath, "yz"), format, options);
+}
+
+// 2^15 x downsampled images would be empty for any camera
+static const unsigned int MAX_PYRAMID_LEVELS = 15;
+
+void MipSink::add_pyramid(unsigned int num_levels, PyramidReduction reduction) {
+    if (num_levels > MAX_PYRAMID_LEVELS) {
+        throw std::runtime_error("At most " + std::to_string(MAX_PYRAMID_LEVELS) + " pyramid levels are supported");
+    }
+    if (!level_writers.empty()) {
+        throw std::runtime_error("The pyramid was already added");
+    }
+    pyramid_reduction = reduction;
+    for (unsigned int level = 1; level <= num_levels; ++level) {
+        level_writers.push_back(open_frame_writer(pyramid_level_filename(outpath, level), format, options));
+    }
+    levels.resize(level_writers.size());
+}
+
+void MipSink::write_pyramid(unsigned int width, unsigned int height) {
+    const uint16_t* source = mip.data();
+    for (size_t level = 0; level < level_writers.size(); ++level) {
+        if (width < 2 || height < 2) {
+            throw std::runtime_error("MIP too small for " + std::to_string(level_writers.size()) + " pyramid levels");
+        }
+        levels[level].resize((size_t)(width / 2) * (height / 2));
+        reduce_2x2(levels[level].data(), source, width, height, pyramid_reduction);
+        width /= 2;
+        height /= 2;
+        level_writers[level]->write_frame(width, height, levels[level].data());
+        source = levels[level].data();
+    }
+}
+
+void MipSink::consume(const Frame& frame) {
+    if (frame.index % images_per_mip == 0) {
+        // Start new MIP, size is only known when the first image arrives
+        mip.assign(frame.data.size(), 0);
+    }
+    if (mip.size() != frame.data.size()) {
+        throw std::runtime_error("Image size changed within a MIP");
+    }
+
+    if (background_mode == MipBackground::ema) {
+        if (background.size() != mip.size()) {
+            // The first frame is the background
+            background.assign(frame.data.begin(), frame.data.end());
+        }
+        fold_max_minus_ema(mip.data(), background.data(), frame.data.data(), mip.size(), background_shift);
+    } else if (background_mode == MipBackground::minimum) {
+        if (background.size() != mip.size()) {
+            background.assign(mip.size(), 0xFFFF);
+            window_min.assign(mip.size(), 0xFFFF);
+            window_frames = 0;
+        }
+        fold_max_minus_min(mip.data(), background.data(), window_min.data(), frame.data.data(), mip.size());
+        if (++window_frames == background_frames) {
+            std::swap(background, window_min);
+            std::fill(window_min.begin(), window_min.end(), 0xFFFF);
+            window_frames = 0;
+        }
+    } else if (xz_writer) {
+        size_t z = frame.index % images_per_mip;
+        xz.resize((size_t)images_per_mip * frame.width);
+        yz_columns.resize((size_t)images_per_mip * frame.height);
+        fold_max_orthogonal(mip.data(), &xz[z * frame.width], &yz_columns[z * frame.height], frame.data.data(), frame.width, frame.height);
+    } else {
+        fold_max(mip.data(), frame.data.data(), mip.size());
+    }
+    images++;
+
+    if (frame.index % images_per_mip == images_per_mip - 1) {
+        tif->write_frame(frame.width, frame.height, mip.data());
+        write_pyramid(frame.width, frame.height);
+        if (xz_writer) {
+            xz_writer->write_frame(frame.width, images_per_mip, xz.data());
+            yz.resize(yz_columns.size());
+            for (size_t z = 0; z < images_per_mip; ++z) {
+                for (size_t y = 0; y < frame.height; ++y) {
+                    yz[y * images_per_mip + z] = yz_columns[z * frame.height + y];
+                }
+            }
+            yz_writer->write_frame(images_per_mip, frame.height, yz.data());
+        }
+        mips++;
+    }
+}
+
+BinOutput parse_bin_output(const std::string& name) {
+    if (name == "mean") {
+        return BinOutput::mean;
+    } else if (name == "sum") {
+        return BinOutput::sum;
+    }
+    throw std::runtime_error("Unknown bin output: " + name);
+}
+
+// Largest bin whose sum always fits into 32 bits
+static const unsigned int MAX_IMAGES_PER_BIN = 65537;
+
+static TiffWriterOptions bin_options(TiffWriterOptions options, BinOutput output, OutputFormat format) {
+    if (output == BinOutput::sum) {
+        if (format != OutputFormat::tiff) {
+            throw std::runtime_error("Sums of frames can only be written to tiff");
+        }
+        options.bits_per_sample = 32;
+    }
+    return options;
+}
+
+BinSink::BinSink(std::string outpath, unsigned int images_per_bin, BinOutput output, TiffWriterOptions options, OutputFormat format, BufferAllocation allocation)
+: images_per_bin(images_per_bin), output(output), sum(PixelAllocator<uint32_t>(allocation)), mean(PixelAllocator<uint16_t>(allocation))
+{
+    if (images_per_bin == 0 || images_per_bin > MAX_IMAGES_PER_BIN) {
+        throw std::runtime_error("images_per_bin has to be between 1 and " + std::to_string(MAX_IMAGES_PER_BIN));
+    }
+    // Opened after the checks so no empty file is left behind
+    tif = open_frame_writer(outpath, format, bin_options(options, output, format));
+}
+
+BinSink::~BinSink() { }
+
+void BinSink::finish() {
+    tif->close();
+}
+
+void BinSink::consume(const Frame& frame) {
+    if (frame.index % images_per_bin == 0) {
+        // The first frame initializes the sum, so every image is only read once
+        sum.assign(frame.data.begin(), frame.data.end());
+    } else if (sum.size() != frame.data.size()) {
+        throw std::runtime_error("Image size changed within a bin");
+    } else {
+        accumulate_sum(sum.data(), frame.data.data(), sum.size());
+    }
+    images++;
+
+    if (frame.index % images_per_bin == images_per_bin - 1) {
+        if (output == BinOutput::sum) {
+            tif->write_frame32(frame.width, frame.height, sum.data());
+        } else {
+            mean.resize(sum.size());
+            sum_to_mean(mean.data(), sum.data(), sum.size(), images_per_bin);
+            tif->write_frame(frame.width, frame.height, mean.data());
+        }
+        bins++;
+    }
+}
+
+static TiffWriterOptions preview_options(TiffWriterOptions options) {
+    options.bits_per_sample = 8;
+    return options;
+}
+
+PreviewSink::PreviewSink(std::string outpath, unsigned int downsample, unsigned int images_per_preview, TiffWriterOptions options)
+: images_per_preview(images_per_preview), histogram(PIXEL_HISTOGRAM_BINS), lut(65536)
+{
+    if (downsample == 0 || images_per_preview == 0) {
+        throw std::runtime_error("downsample and images_per_preview have to be at least 1");
+    }
+    processing.bin = downsample;
+    tif.reset(new TiffWriter(outpath, preview_options(options)));
+}
+
+PreviewSink::~PreviewSink() { }
+
+void PreviewSink::finish() {
+    tif->close();
+}
+
+void PreviewSink::consume(const Frame& frame) {
+    unsigned int width, height;
+    processed_frame_size(processing, frame.width, frame.height, width, height);
+    binned.resize((size_t)width * height);
+    process_frame(binned.data(), frame.data.data(), frame.width, frame.height, processing);
+
+    if (frame.index % images_per_preview == 0) {
+        mip.assign(binned.begin(), binned.end());
+    } else if (mip.size() != binned.size()) {
+        throw std::runtime_error("Image size changed within a preview");
+    } else {
+        fold_max(mip.data(), binned.data(), mip.size());
+    }
+    if (frame.index % images_per_preview == images_per_preview - 1) {
+        write_preview(width, height);
+    }
+}
+
+// Lowest value of the first bin where the histogram reaches the fraction of all pixels
+static double histogram_percentile(const std::vector<uint32_t>& histogram, size_t num_pixels, double fraction) {
+    size_t target = (size_t)(fraction * num_pixels);
+    size_t seen = 0;
+    for (size_t bin = 0; bin < histogram.size(); ++bin) {
+        seen += histogram[bin];
+        if (seen > target) {
+            return bin * 16.0;
+        }
+    }
+    return 65535;
+}
+
+// Weight of the newest preview in the running percentiles
+static const double PREVIEW_CONTRAST_WEIGHT = 0.2;
+// Percentiles mapped to 0 and 255
+static const double PREVIEW_LOW_PERCENTILE = 0.005;
+static const double PREVIEW_HIGH_PERCENTILE = 0.995;
+
+void PreviewSink::write_preview(unsigned int width, unsigned int height) {
+    pixel_statistics(mip.data(), mip.size(), histogram.data());
+    double frame_low = histogram_percentile(histogram, mip.size(), PREVIEW_LOW_PERCENTILE);
+    // Upper end of the bin, so a single bright bin still gets the full range
+    double frame_high = histogram_percentile(histogram, mip.size(), PREVIEW_HIGH_PERCENTILE) + 16;
+    if (previews == 0) {
+        low = frame_low;
+        high = frame_high;
+    } else {
+        low += PREVIEW_CONTRAST_WEIGHT * (frame_low - low);
+        high += PREVIEW_CONTRAST_WEIGHT * (frame_high - high);
+    }
+
+    // The lookup table only changes when the contrast moves by a full grey level
+    double scale = 255.0 / std::max(high - low, 1.0);
+    if (std::abs(low - lut_low) * scale >= 1 || std::abs(high - lut_high) * scale >= 1) {
+        for (size_t value = 0; value < lut.size(); ++value) {
+            lut[value] = (uint8_t)std::min(std::max((value - low) * scale + 0.5, 0.0), 255.0);
+        }
+        lut_low = low;
+        lut_high = high;
+    }
+    preview.resize(mip.size());
+    for (size_t pix = 0; pix < mip.size(); ++pix) {
+        preview[pix] = lut[mip[pix]];
+    }
+    tif->write_frame8(width, height, preview.data());
+    previews++;
+}
+
+StatisticsFormat parse_statistics_format(const std::string& name) {
+    if (name == "csv") {
+        return StatisticsFormat::csv;
+    } else if (name == "binary") {
+        return StatisticsFormat::binary;
+    }
+    throw std::runtime_error("Unknown statistics format: " + name);
+}
+
+StatisticsSink::StatisticsSink(std::string outpath, StatisticsFormat format)
+: outpath(outpath), format(format), frame_histogram(PIXEL_HISTOGRAM_BINS), total_histogram(PIXEL_HISTOGRAM_BINS, 0)
+{
+    if (outpath.empty()) {
+        return;
+    }
+    file = fopen(outpath.c_str(), format == StatisticsFormat::csv ? "w" : "wb");
+    if (!file) {
+        throw std::runtime_error("Could not open " + outpath + " for writing");
+    }
+    if (format == StatisticsFormat::csv) {
+        std::string header = "range,index,min,max,mean,hash,duplicate,blank\n";
+        write(header.data(), header.size());
+    } else {
+        StatisticsFileHeader header;
+        header.magic = STATISTICS_FILE_MAGIC;
+        header.version = STATISTICS_FILE_VERSION;
+        header.record_size = sizeof(FrameStatistics);
+        header.histogram_bins = PIXEL_HISTOGRAM_BINS;
+        write(&header, sizeof(header));
+    }
+}
+
+StatisticsSink::~StatisticsSink() {
+    if (file) {
+        fclose(file);
+    }
+}
+
+void StatisticsSink::write(const void* data, size_t size) {
+    if (fwrite(data, 1, size, file) != size) {
+        throw std::runtime_error("Writing " + outpath + " failed");
+    }
+}
+
+void StatisticsSink::consume(const Frame& frame) {
+    PixelStatistics pixels = pixel_statistics(frame.data.data(), frame.data.size(), frame_histogram.data());
+    FrameStatistics record;
+    record.range = frame.range;
+    record.index = frame.index;
+    record.min = pixels.min;
+    record.max = pixels.max;
+    record.flags = 0;
+    record.reserved = 0;
+    record.mean = frame.data.empty() ? 0 : (double)pixels.sum / frame.data.size();
+    record.hash = pixels.hash;
+    if (!statistics.empty() && statistics.back().hash == pixels.hash && previous_size == frame.data.size()) {
+        record.flags |= FRAME_DUPLICATE;
+        duplicates++;
+    }
+    if (pixels.max == 0) {
+        record.flags |= FRAME_BLANK;
+        blanks++;
+    }
+    statistics.push_back(record);
+    previous_size = frame.data.size();
+    for (unsigned int bin = 0; bin < PIXEL_HISTOGRAM_BINS; ++bin) {
+        total_histogram[bin] += frame_histogram[bin];
+    }
+
+    if (!file) {
+        return;
+    }
+    if (format == StatisticsFormat::csv) {
+        char line[160];
+        int length = snprintf(line, sizeof(line), "%u,%u,%u,%u,%.3f,%016llx,%d,%d\n", record.range, record.index,
+            record.min, record.max, record.mean, (unsigned long long)record.hash,
+            (record.flags & FRAME_DUPLICATE) ? 1 : 0, (record.flags & FRAME_BLANK) ? 1 : 0);
+        write(line, length);
+    } else {
+        write(&record, sizeof(record));
+        write(frame_histogram.data(), frame_histogram.size() * sizeof(uint32_t));
+    }
+}
+
+void StatisticsSink::finish() {
+    if (file) {
+        FILE* closing = file;
+        file = nullptr;
+        if (fclose(closing) != 0) {
+            throw std::runtime_error("Writing " + outpath + " failed");
+        }
+    }
+}
+
+std::string event_index_filename(const std::string& path) {
+    return path + ".events.csv";
+}
+
+EventSink::EventSink(std::string outpath, EventTrigger trigger, TiffWriterOptions options, OutputFormat format)
+: trigger(trigger), ring(trigger.pre_trigger)
+{
+    if (!(trigger.threshold > 0)) {
+        throw std::runtime_error("Event threshold has to be above 0");
+    }
+    if (trigger.background_shift > 15) {
+        throw std::runtime_error("Event background shift has to be at most 15");
+    }
+    bool full_frame = trigger.roi_x0 == 0 && trigger.roi_y0 == 0 && trigger.roi_x1 == 0 && trigger.roi_y1 == 0;
+    if (!full_frame && (trigger.roi_x0 < 1 || trigger.roi_y0 < 1 || trigger.roi_x1 < trigger.roi_x0 || trigger.roi_y1 < trigger.roi_y0)) {
+        throw std::runtime_error("Invalid event region");
+    }
+    tif = open_frame_writer(outpath, format, options);
+    index_path = event_index_filename(split_output_paths(outpath).front());
+    index_file = fopen(index_path.c_str(), "w");
+    if (!index_file) {
+        throw std::runtime_error("Could not open " + index_path + " for writing");
+    }
+    std::string header = "event,range,first_index,trigger_index,last_index,first_frame,frames,peak_score\n";
+    if (fwrite(header.data(), 1, header.size(), index_file) != header.size()) {
+        throw std::runtime_error("Writing " + index_path + " failed");
+    }
+}
+
+EventSink::~EventSink() {
+    if (index_file) {
+        fclose(index_file);
+    }
+}
+
+double EventSink::score(const Frame& frame) {
+    // Exclusive bounds, 0 based
+    unsigned int x0 = 0, y0 = 0, x1 = frame.width, y1 = frame.height;
+    if (trigger.roi_x1 != 0) {
+        if (trigger.roi_x1 > frame.width || trigger.roi_y1 > frame.height) {
+            throw std::runtime_error("Event region does not fit into the frame");
+        }
+        x0 = trigger.roi_x0 - 1;
+        y0 = trigger.roi_y0 - 1;
+        x1 = trigger.roi_x1;
+        y1 = trigger.roi_y1;
+    }
+    size_t row_pixels = x1 - x0;
+    size_t num_pixels = row_pixels * (y1 - y0);
+    const uint16_t* region = frame.data.data() + (size_t)y0 * frame.width + x0;
+    if (trigger.metric == EventMetric::count) {
+        size_t count = 0;
+        for (unsigned int y = 0; y < y1 - y0; ++y) {
+            count += count_above(region + (size_t)y * frame.width, row_pixels, trigger.pixel_threshold);
+        }
+        return (double)count;
+    }
+
+    if (!has_background || background.size() != num_pixels) {
+        // The first frame is the background, it can't be an event itself
+        background.resize(num_pixels);
+        for (unsigned int y = 0; y < y1 - y0; ++y) {
+            std::copy(region + (size_t)y * frame.width, region + (size_t)y * frame.width + row_pixels, &background[y * row_pixels]);
+        }
+        has_background = true;
+        return 0;
+    }
+    uint64_t difference = 0;
+    for (unsigned int y = 0; y < y1 - y0; ++y) {
+        uint16_t* background_row = &background[y * row_pixels];
+        const uint16_t* row = region + (size_t)y * frame.width;
+        difference += sum_abs_difference(background_row, row, row_pixels);
+        update_background(background_row, row, row_pixels, trigger.background_shift);
+    }
+    return num_pixels == 0 ? 0 : (double)difference / num_pixels;
+}
+
+void EventSink::write(const Frame& frame) {
+    tif->write_frame(frame.width, frame.height, frame.data.data());
+    written++;
+    event_records.back().last_index = frame.index;
+}
+
+void EventSink::end_event() {
+    if (!in_event) {
+        return;
+    }
+    in_event = false;
+    const EventRecord& record = event_records.back();
+    char line[160];
+    int length = snprintf(line, sizeof(line), "%u,%u,%u,%u,%u,%u,%u,%.3f\n", (unsigned int)event_records.size() - 1, record.range,
+        record.first_index, record.trigger_index, record.last_index, record.first_frame, written - record.first_frame, record.peak_score);
+    // Flushed per event, so the index of a transfer that fails later is still usable
+    if (fwrite(line, 1, length, index_file) != (size_t)length || fflush(index_file) != 0) {
+        throw std::runtime_error("Writing " + index_path + " failed");
+    }
+}
+
+void EventSink::consume(const Frame& frame) {
+    if (scored != 0 && frame.range != current_range) {
+        end_event();
+        ring_count = 0;
+        has_background = false;
+    }
+    current_range = frame.range;
+    double frame_score = score(frame);
+    scored++;
+
+    if (frame_score >= trigger.threshold) {
+        if (!in_event) {
+            EventRecord record;
+            record.range = frame.range;
+            record.first_index = ring_count != 0 ? ring[ring_start].index : frame.index;
+            record.trigger_index = frame.index;
+            record.first_frame = written;
+            event_records.push_back(record);
+            for (size_t i = 0; i < ring_count; ++i) {
+                write(ring[(ring_start + i) % ring.size()]);
+            }
+            ring_count = 0;
+            in_event = true;
+        }
+        event_records.back().peak_score = std::max(event_records.back().peak_score, frame_score);
+        write(frame);
+        post_remaining = trigger.post_trigger;
+    } else if (in_event && post_remaining > 0) {
+        write(frame);
+        post_remaining--;
+    } else {
+        end_event();
+        if (ring.empty()) {
+            return;
+        }
+        // Overwrites the oldest frame once the ring is full, the copies keep their allocation
+        size_t slot = (ring_start + ring_count) % ring.size();
+        if (ring_count == ring.size()) {
+            ring_start = (ring_start + 1) % ring.size();
+        } else {
+            ring_count++;
+        }
+        Frame& copy = ring[slot];
+        copy.range = frame.range;
+        copy.index = frame.index;
+        copy.width = frame.width;
+        copy.height = frame.height;
+        copy.data.assign(frame.data.begin(), frame.data.end());
+    }
+}
+
+void EventSink::finish() {
+    end_event();
+    tif->close();
+    if (index_file) {
+        FILE* closing = index_file;
+        index_file = nullptr;
+        if (fclose(closing) != 0) {
+            throw std::runtime_error("Writing " + index_path + " failed");
+        }
+    }
+}
+
+RangeSink::RangeSink(std::vector<std::shared_ptr<FrameSink>> range_sinks)
+: range_sinks(range_sinks)
+{ }
+
+void RangeSink::consume(const Frame& frame) {
+    range_sinks.at(frame.range)->consume(frame);
+}
+
+void RangeSink::finish() {
+    for (auto& sink : range_sinks) {
+        sink->finish();
+    }
+}
+
+CallbackSink::CallbackSink(std::function<void(const Frame&)> callback)
+: callback(callback)
+{ }
+
+void CallbackSink::consume(const Frame& frame) {
+    callback(frame);
+}
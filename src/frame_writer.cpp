@@ -0,0 +1,101 @@
+#include "frame_writer.hpp"
+
+#include <stdexcept>
+#include <vector>
+
+#ifdef _WIN32
+#include <stdlib.h>
+#else
+#include <unistd.h>
+#endif
+
+#include "tiff_writer.hpp"
+#include "striped_writer.hpp"
+#include "zarr_writer.hpp"
+
+OutputFormat parse_output_format(const std::string& name) {
+    if (name == "tiff") {
+        return OutputFormat::tiff;
+    } else if (name == "zarr") {
+        return OutputFormat::zarr;
+    }
+    throw std::runtime_error("Unknown output format: " + name);
+}
+
+void FrameWriter::write_frame32(unsigned int width, unsigned int height, const uint32_t* data) {
+    throw std::runtime_error("32 bit frames are only supported for a single tiff output");
+}
+
+void FrameWriter::write_frame8(unsigned int width, unsigned int height, const uint8_t* data) {
+    throw std::runtime_error("8 bit frames are only supported for a single tiff output");
+}
+
+static const char OUTPUT_PATH_SEPARATOR = ';';
+
+std::vector<std::string> split_output_paths(const std::string& path) {
+    std::vector<std::string> paths;
+    size_t start = 0;
+    while (true) {
+        size_t end = path.find(OUTPUT_PATH_SEPARATOR, start);
+        paths.push_back(path.substr(start, end == std::string::npos ? std::string::npos : end - start));
+        if (end == std::string::npos) {
+            return paths;
+        }
+        start = end + 1;
+    }
+}
+
+std::string join_output_paths(const std::vector<std::string>& paths) {
+    std::string joined;
+    for (size_t i = 0; i < paths.size(); ++i) {
+        if (i > 0) {
+            joined += OUTPUT_PATH_SEPARATOR;
+        }
+        joined += paths[i];
+    }
+    return joined;
+}
+
+std::string absolute_path(const std::string& path) {
+#ifdef _WIN32
+    char buffer[_MAX_PATH];
+    if (_fullpath(buffer, path.c_str(), _MAX_PATH) == nullptr) {
+        throw std::runtime_error("Invalid path " + path);
+    }
+    return buffer;
+#else
+    if (!path.empty() && path[0] == '/') {
+        return path;
+    }
+    std::vector<char> buffer(4096);
+    if (getcwd(buffer.data(), buffer.size()) == nullptr) {
+        throw std::runtime_error("Could not get current directory");
+    }
+    return std::string(buffer.data()) + "/" + path;
+#endif
+}
+
+std::string absolute_output_paths(const std::string& path) {
+    if (path.empty()) {
+        return path;
+    }
+    std::vector<std::string> paths = split_output_paths(path);
+    for (std::string& stripe : paths) {
+        stripe = absolute_path(stripe);
+    }
+    return join_output_paths(paths);
+}
+
+std::unique_ptr<FrameWriter> open_frame_writer(const std::string& path, OutputFormat format, const TiffWriterOptions& options) {
+    std::vector<std::string> paths = split_output_paths(path);
+    if (paths.size() > 1) {
+        if (format != OutputFormat::tiff) {
+            throw std::runtime_error("Striping over several output paths is only supported for tiff");
+        }
+        return std::unique_ptr<FrameWriter>(new StripedWriter(paths, options));
+    }
+    if (format == OutputFormat::zarr) {
+        return std::unique_ptr<FrameWriter>(new ZarrWriter(path, options));
+    }
+    return std::unique_ptr<FrameWriter>(new TiffWriter(path, options));
+}
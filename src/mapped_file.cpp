@@ -0,0 +1,76 @@
+#include "mapped_file.hpp"
+
+#include <stdexcept>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifdef _WIN32
+
+MappedFile::MappedFile(const std::string& filename) {
+    HANDLE f = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (f == INVALID_HANDLE_VALUE) {
+        throw std::runtime_error("Could not open " + filename);
+    }
+    LARGE_INTEGER file_size;
+    if (!GetFileSizeEx(f, &file_size) || file_size.QuadPart == 0) {
+        CloseHandle(f);
+        throw std::runtime_error("Could not map empty file " + filename);
+    }
+    HANDLE m = CreateFileMappingA(f, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (m == NULL) {
+        CloseHandle(f);
+        throw std::runtime_error("Could not map " + filename);
+    }
+    void* view = MapViewOfFile(m, FILE_MAP_READ, 0, 0, 0);
+    if (view == NULL) {
+        CloseHandle(m);
+        CloseHandle(f);
+        throw std::runtime_error("Could not map " + filename);
+    }
+    file = f;
+    mapping = m;
+    addr = static_cast<const uint8_t*>(view);
+    length = (size_t)file_size.QuadPart;
+}
+
+MappedFile::~MappedFile() {
+    UnmapViewOfFile(addr);
+    CloseHandle(mapping);
+    CloseHandle(file);
+}
+
+#else
+
+MappedFile::MappedFile(const std::string& filename) {
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw std::runtime_error("Could not open " + filename);
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        ::close(fd);
+        throw std::runtime_error("Could not map empty file " + filename);
+    }
+    void* view = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    // The mapping stays valid after closing the file
+    ::close(fd);
+    if (view == MAP_FAILED) {
+        throw std::runtime_error("Could not map " + filename);
+    }
+    addr = static_cast<const uint8_t*>(view);
+    length = (size_t)st.st_size;
+}
+
+MappedFile::~MappedFile() {
+    munmap(const_cast<uint8_t*>(addr), length);
+}
+
+#endif
@@ -0,0 +1,515 @@
+// Micro benchmarks of the image processing and writing code, no camera needed.
+// Run with `meson test --benchmark`, `ninja bench` or directly, see pco_bench --help for google-benchmark options.
+// With PCO_BENCH_SIM the transfer code is benchmarked against the simulated SDK of pco_sdk_sim.cpp.
+
+#include <benchmark/benchmark.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "bitpack.hpp"
+#include "frame_ops.hpp"
+#include "frame_writer.hpp"
+#include "pixel_buffer.hpp"
+#include "stack_index.hpp"
+#include "stack_reader.hpp"
+#include "tiff_writer.hpp"
+
+#ifdef PCO_BENCH_SIM
+#include "pco_wrapper.hpp"
+#include "pco_sdk_sim.hpp"
+#endif
+
+// Full sensor of a pco.edge
+static const unsigned int WIDTH = 2048;
+static const unsigned int HEIGHT = 2048;
+
+// Synthetic 12 bit image
+static std::vector<uint16_t> make_image() {
+    std::vector<uint16_t> image((size_t)WIDTH * HEIGHT);
+    for (size_t pix = 0; pix < image.size(); ++pix) {
+        image[pix] = (uint16_t)((pix * 7) % 4096);
+    }
+    return image;
+}
+
+static void BM_Pack12(benchmark::State& state) {
+    std::vector<uint16_t> image = make_image();
+    std::vector<uint8_t> packed(packed12_size(image.size()));
+    for (auto _ : state) {
+        pack12(packed.data(), image.data(), image.size());
+        benchmark::DoNotOptimize(packed.data());
+        benchmark::ClobberMemory();
+    }
+    state.SetBytesProcessed(state.iterations() * image.size() * sizeof(uint16_t));
+}
+BENCHMARK(BM_Pack12);
+
+static void BM_Unpack12(benchmark::State& state) {
+    std::vector<uint16_t> image = make_image();
+    std::vector<uint8_t> packed(packed12_size(image.size()));
+    pack12(packed.data(), image.data(), image.size());
+    for (auto _ : state) {
+        unpack12(image.data(), packed.data(), image.size());
+        benchmark::DoNotOptimize(image.data());
+        benchmark::ClobberMemory();
+    }
+    state.SetBytesProcessed(state.iterations() * image.size() * sizeof(uint16_t));
+}
+BENCHMARK(BM_Unpack12);
+
+// MIP fold of frames from a pool of staging buffers as in FramePipeline, allocated standard (0) or on huge pages (1).
+// The pool is larger than the caches so every fold streams from memory.
+static void BM_FoldMax(benchmark::State& state) {
+    BufferAllocation allocation = state.range(0) == 0 ? BufferAllocation::standard : BufferAllocation::huge_pages;
+    std::vector<uint16_t> image = make_image();
+    PixelAllocator<uint16_t> allocator(allocation);
+    std::vector<PixelVector> frames(8, PixelVector(allocator));
+    for (PixelVector& frame : frames) {
+        frame.assign(image.begin(), image.end());
+    }
+    PixelVector mip(image.size(), 0, allocator);
+    size_t next = 0;
+    for (auto _ : state) {
+        fold_max(mip.data(), frames[next].data(), mip.size());
+        next = (next + 1) % frames.size();
+        benchmark::DoNotOptimize(mip.data());
+        benchmark::ClobberMemory();
+    }
+    state.SetBytesProcessed(state.iterations() * image.size() * sizeof(uint16_t));
+}
+BENCHMARK(BM_FoldMax)->ArgName("huge_pages")->Arg(0)->Arg(1);
+
+// MIP fold of a single frame at the resolution of small ROIs up to a pco.edge 26 sensor.
+// Small frames stay in the caches, so this shows the kernel itself rather than the memory bandwidth.
+static void BM_FoldMaxResolution(benchmark::State& state) {
+    size_t pixels = (size_t)state.range(0) * state.range(1);
+    std::vector<uint16_t> image(pixels);
+    for (size_t pix = 0; pix < pixels; ++pix) {
+        image[pix] = (uint16_t)((pix * 7) % 4096);
+    }
+    std::vector<uint16_t> mip(pixels, 0);
+    for (auto _ : state) {
+        fold_max(mip.data(), image.data(), pixels);
+        benchmark::DoNotOptimize(mip.data());
+        benchmark::ClobberMemory();
+    }
+    state.SetBytesProcessed(state.iterations() * pixels * sizeof(uint16_t));
+}
+BENCHMARK(BM_FoldMaxResolution)->ArgNames({"width", "height"})->Args({256, 256})->Args({1024, 1024})->Args({2048, 2048})->Args({2560, 2160})->Args({5120, 5120});
+
+// MIP fold with the background subtracted: plain fold_max (0), exponential moving average (1) or windowed minimum (2)
+static void BM_FoldMaxBackground(benchmark::State& state) {
+    std::vector<uint16_t> image = make_image();
+    std::vector<uint16_t> mip(image.size(), 0);
+    std::vector<uint16_t> background(image.rbegin(), image.rend());
+    std::vector<uint16_t> window_min(image.size(), 0xFFFF);
+    for (auto _ : state) {
+        if (state.range(0) == 0) {
+            fold_max(mip.data(), image.data(), mip.size());
+        } else if (state.range(0) == 1) {
+            fold_max_minus_ema(mip.data(), background.data(), image.data(), mip.size(), 4);
+        } else {
+            fold_max_minus_min(mip.data(), background.data(), window_min.data(), image.data(), mip.size());
+        }
+        benchmark::DoNotOptimize(mip.data());
+        benchmark::ClobberMemory();
+    }
+    state.SetBytesProcessed(state.iterations() * image.size() * sizeof(uint16_t));
+}
+BENCHMARK(BM_FoldMaxBackground)->ArgName("background")->Arg(0)->Arg(1)->Arg(2);
+
+// MIP fold which also keeps the XZ row and YZ column of every frame, compare to BM_FoldMaxBackground/background:0
+static void BM_FoldMaxOrthogonal(benchmark::State& state) {
+    std::vector<uint16_t> image = make_image();
+    std::vector<uint16_t> mip(image.size(), 0);
+    std::vector<uint16_t> xz_row(WIDTH);
+    std::vector<uint16_t> yz_column(HEIGHT);
+    for (auto _ : state) {
+        fold_max_orthogonal(mip.data(), xz_row.data(), yz_column.data(), image.data(), WIDTH, HEIGHT);
+        benchmark::DoNotOptimize(mip.data());
+        benchmark::ClobberMemory();
+    }
+    state.SetBytesProcessed(state.iterations() * image.size() * sizeof(uint16_t));
+}
+BENCHMARK(BM_FoldMaxOrthogonal);
+
+// Three pyramid levels of a MIP, each reduced from the previous one. Bytes processed are the size of the MIP.
+static void BM_MipPyramid(benchmark::State& state) {
+    PyramidReduction reduction = state.range(0) == 0 ? PyramidReduction::max : PyramidReduction::mean;
+    std::vector<uint16_t> image = make_image();
+    std::vector<std::vector<uint16_t>> levels(3);
+    for (auto _ : state) {
+        const uint16_t* source = image.data();
+        unsigned int width = WIDTH, height = HEIGHT;
+        for (std::vector<uint16_t>& level : levels) {
+            level.resize((size_t)(width / 2) * (height / 2));
+            reduce_2x2(level.data(), source, width, height, reduction);
+            width /= 2;
+            height /= 2;
+            source = level.data();
+        }
+        benchmark::DoNotOptimize(levels.back().data());
+        benchmark::ClobberMemory();
+    }
+    state.SetBytesProcessed(state.iterations() * image.size() * sizeof(uint16_t));
+}
+BENCHMARK(BM_MipPyramid)->ArgName("mean")->Arg(0)->Arg(1);
+
+// Software crop of the central quarter (bin 1) or N x N mean binning of the full image. Bytes processed are the input image size.
+static void BM_ProcessFrame(benchmark::State& state) {
+    std::vector<uint16_t> image = make_image();
+    FrameProcessing processing;
+    processing.bin = (unsigned int)state.range(0);
+    if (processing.bin == 1) {
+        processing.roi_x0 = WIDTH / 4 + 1;
+        processing.roi_y0 = HEIGHT / 4 + 1;
+        processing.roi_x1 = WIDTH * 3 / 4;
+        processing.roi_y1 = HEIGHT * 3 / 4;
+    }
+    unsigned int out_width, out_height;
+    processed_frame_size(processing, WIDTH, HEIGHT, out_width, out_height);
+    std::vector<uint16_t> processed((size_t)out_width * out_height);
+    for (auto _ : state) {
+        process_frame(processed.data(), image.data(), WIDTH, HEIGHT, processing);
+        benchmark::DoNotOptimize(processed.data());
+        benchmark::ClobberMemory();
+    }
+    state.SetBytesProcessed(state.iterations() * image.size() * sizeof(uint16_t));
+}
+BENCHMARK(BM_ProcessFrame)->ArgName("bin")->Arg(1)->Arg(2)->Arg(3)->Arg(4);
+
+// Copy of a transferred frame without correction (0), with dark subtraction (1) or with dark and gain (2).
+static void BM_FlatField(benchmark::State& state) {
+    std::vector<uint16_t> image = make_image();
+    FrameProcessing processing;
+    if (state.range(0) > 0) {
+        auto flat_field = std::make_shared<FlatField>();
+        flat_field->width = WIDTH;
+        flat_field->height = HEIGHT;
+        flat_field->dark.assign(image.size(), 100);
+        if (state.range(0) > 1) {
+            std::vector<uint16_t> flat(image.size());
+            for (size_t pix = 0; pix < flat.size(); ++pix) {
+                flat[pix] = (uint16_t)(1000 + pix % 1000);
+            }
+            flat_field->gain = flat_field_gain(flat_field->dark.data(), flat.data(), flat.size());
+        }
+        processing.flat_field = flat_field;
+    }
+    std::vector<uint16_t> corrected(image.size());
+    for (auto _ : state) {
+        if (processing.flat_field) {
+            process_frame(corrected.data(), image.data(), WIDTH, HEIGHT, processing);
+        } else {
+            std::copy(image.begin(), image.end(), corrected.begin());
+        }
+        benchmark::DoNotOptimize(corrected.data());
+        benchmark::ClobberMemory();
+    }
+    state.SetBytesProcessed(state.iterations() * image.size() * sizeof(uint16_t));
+}
+BENCHMARK(BM_FlatField)->ArgName("correction")->Arg(0)->Arg(1)->Arg(2);
+
+// Copy of a transferred frame with the given number of hot pixels replaced by the median of their neighbours
+static void BM_HotPixels(benchmark::State& state) {
+    std::vector<uint16_t> image = make_image();
+    std::vector<HotPixel> pixels;
+    std::mt19937 random(42);
+    for (int64_t i = 0; i < state.range(0); ++i) {
+        pixels.push_back({(unsigned int)(random() % WIDTH), (unsigned int)(random() % HEIGHT)});
+    }
+    FrameProcessing processing;
+    processing.hot_pixels = make_hot_pixel_map(pixels, HotPixelReplacement::median);
+    std::vector<uint16_t> corrected(image.size());
+    for (auto _ : state) {
+        process_frame(corrected.data(), image.data(), WIDTH, HEIGHT, processing);
+        benchmark::DoNotOptimize(corrected.data());
+        benchmark::ClobberMemory();
+    }
+    state.SetBytesProcessed(state.iterations() * image.size() * sizeof(uint16_t));
+}
+BENCHMARK(BM_HotPixels)->ArgName("hot_pixels")->Arg(0)->Arg(1000)->Arg(100000);
+
+// Min, max, sum, hash and histogram of a frame as computed by StatisticsSink
+static void BM_PixelStatistics(benchmark::State& state) {
+    std::vector<uint16_t> image = make_image();
+    std::vector<uint32_t> histogram(PIXEL_HISTOGRAM_BINS);
+    for (auto _ : state) {
+        PixelStatistics statistics = pixel_statistics(image.data(), image.size(), histogram.data());
+        benchmark::DoNotOptimize(statistics);
+    }
+    state.SetBytesProcessed(state.iterations() * image.size() * sizeof(uint16_t));
+}
+BENCHMARK(BM_PixelStatistics);
+
+// Score of EventSink per full frame: difference to the background and its update, or the count of bright pixels
+static void BM_EventScore(benchmark::State& state) {
+    std::vector<uint16_t> image = make_image();
+    std::vector<uint16_t> background(image.rbegin(), image.rend());
+    for (auto _ : state) {
+        if (state.range(0) == 0) {
+            uint64_t difference = sum_abs_difference(background.data(), image.data(), image.size());
+            update_background(background.data(), image.data(), image.size(), 4);
+            benchmark::DoNotOptimize(difference);
+        } else {
+            size_t count = count_above(image.data(), image.size(), 30000);
+            benchmark::DoNotOptimize(count);
+        }
+    }
+    state.SetBytesProcessed(state.iterations() * image.size() * sizeof(uint16_t));
+}
+BENCHMARK(BM_EventScore)->ArgName("count")->Arg(0)->Arg(1);
+
+// Uncompressed tiff with 16 or 12 bits per sample, with and without the frame index sidecar.
+// The writer is the same with and without index (TinyTIFF for 16 bit, TiffEncoder for 12 bit), so the difference is the
+// sidecar. Every iteration writes and closes a short stack, as the index is written on close.
+// Bytes processed are the unpacked image size.
+static void BM_WriteTiff(benchmark::State& state) {
+    const unsigned int frames_per_stack = 16;
+    std::vector<uint16_t> image = make_image();
+    const char* filename = "pco_bench.tif";
+    TiffWriterOptions options;
+    options.bits_per_sample = (unsigned int)state.range(0);
+    options.write_index = state.range(1) != 0;
+    for (auto _ : state) {
+        TiffWriter tw(filename, options);
+        for (unsigned int i = 0; i < frames_per_stack; ++i) {
+            tw.write_frame(WIDTH, HEIGHT, image.data());
+        }
+        tw.close();
+    }
+    remove(filename);
+    remove(stack_index_filename(filename).c_str());
+    state.SetBytesProcessed(state.iterations() * frames_per_stack * image.size() * sizeof(uint16_t));
+}
+BENCHMARK(BM_WriteTiff)->ArgNames({"bits", "index"})->Args({16, 0})->Args({16, 1})->Args({12, 0})->Args({12, 1})->Unit(benchmark::kMillisecond)->UseRealTime();
+
+// Sustained uncompressed writing of full frames with stdio (TinyTIFF, 0) or io_uring (1).
+// Closing is included so data still in flight is counted.
+static void BM_WriteTiffBackend(benchmark::State& state) {
+    TiffWriteBackend backend = state.range(0) == 0 ? TiffWriteBackend::stdio : TiffWriteBackend::io_uring;
+    if (backend == TiffWriteBackend::io_uring && !tiff_io_uring_available()) {
+        state.SkipWithError("io_uring not available");
+        return;
+    }
+    std::vector<uint16_t> image = make_image();
+    const char* filename = "pco_bench_backend.tif";
+    {
+        TiffWriterOptions options;
+        options.write_backend = backend;
+        options.write_index = false;
+        TiffWriter tw(filename, options);
+        for (auto _ : state) {
+            tw.write_frame(WIDTH, HEIGHT, image.data());
+        }
+        tw.close();
+    }
+    // Files are split at 3 GiB on long runs
+    for (const std::string& file : stack_files(filename)) {
+        remove(file.c_str());
+    }
+    state.SetBytesProcessed(state.iterations() * image.size() * sizeof(uint16_t));
+}
+BENCHMARK(BM_WriteTiffBackend)->ArgName("io_uring")->Arg(0)->Arg(1)->Unit(benchmark::kMillisecond)->UseRealTime();
+
+// Directory of BM_WriteTiffTarget, empty if there is none.
+// Disk: PCO_BENCH_DISK_DIR or the working directory. Memory: PCO_BENCH_TMPFS_DIR, on Linux /dev/shm if not set.
+static std::string bench_directory(bool tmpfs) {
+    const char* dir = getenv(tmpfs ? "PCO_BENCH_TMPFS_DIR" : "PCO_BENCH_DISK_DIR");
+    if (dir != nullptr) {
+        return dir;
+    }
+#ifdef __linux__
+    return tmpfs ? "/dev/shm" : ".";
+#else
+    return tmpfs ? "" : ".";
+#endif
+}
+
+// Sustained writing of full frames to a real disk (0) or to memory (1).
+// The difference is the time spent in the file system and the drive, the rest is the cost of the writer.
+static void BM_WriteTiffTarget(benchmark::State& state) {
+    std::string dir = bench_directory(state.range(0) != 0);
+    if (dir.empty()) {
+        state.SkipWithError("Set PCO_BENCH_TMPFS_DIR to a RAM disk");
+        return;
+    }
+    std::vector<uint16_t> image = make_image();
+    std::string filename = dir + "/pco_bench_target.tif";
+    {
+        TiffWriterOptions options;
+        options.write_index = false;
+        TiffWriter tw(filename, options);
+        try {
+            // First frame creates the file
+            tw.write_frame(WIDTH, HEIGHT, image.data());
+        } catch (const std::exception& ex) {
+            state.SkipWithError(ex.what());
+            return;
+        }
+        for (auto _ : state) {
+            tw.write_frame(WIDTH, HEIGHT, image.data());
+        }
+        tw.close();
+    }
+    for (const std::string& file : stack_files(filename)) {
+        remove(file.c_str());
+    }
+    state.SetBytesProcessed(state.iterations() * image.size() * sizeof(uint16_t));
+}
+BENCHMARK(BM_WriteTiffTarget)->ArgName("tmpfs")->Arg(0)->Arg(1)->Unit(benchmark::kMillisecond)->UseRealTime();
+
+// Name of the next file of a split stack, computed whenever a file is full
+static void BM_NumberFilename(benchmark::State& state) {
+    std::string filename = "D:\\data\\experiment_01\\stack.tiff";
+    unsigned int number = 0;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(number_filename(filename, ++number));
+    }
+}
+BENCHMARK(BM_NumberFilename);
+
+// Splitting a striped output path into the paths of the stripes, done for every opened output
+static void BM_SplitOutputPaths(benchmark::State& state) {
+    std::vector<std::string> stripes;
+    for (int i = 0; i < state.range(0); ++i) {
+        stripes.push_back(std::string(1, (char)('D' + i)) + ":\\data\\experiment_01\\stack.tiff");
+    }
+    std::string path = join_output_paths(stripes);
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(split_output_paths(path));
+    }
+}
+BENCHMARK(BM_SplitOutputPaths)->ArgName("stripes")->Arg(1)->Arg(4);
+
+// Uncompressed stack written once for all reader benchmarks and deleted at exit
+class BenchStack {
+public:
+    static const unsigned int WIDTH = 1024;
+    static const unsigned int HEIGHT = 1024;
+    static const unsigned int FRAMES = 64;
+    const char* filename = "pco_bench_stack.tif";
+
+    static BenchStack& get() {
+        static BenchStack stack;
+        return stack;
+    }
+
+    ~BenchStack() {
+        remove(filename);
+        remove(stack_index_filename(filename).c_str());
+    }
+
+private:
+    BenchStack() {
+        std::vector<uint16_t> image((size_t)WIDTH * HEIGHT);
+        TiffWriter tw(filename);
+        for (unsigned int i = 0; i < FRAMES; ++i) {
+            for (size_t pix = 0; pix < image.size(); ++pix) {
+                image[pix] = (uint16_t)(i + pix);
+            }
+            tw.write_frame(WIDTH, HEIGHT, image.data());
+        }
+        tw.close();
+    }
+};
+
+// Opening a stack with the index cached in the sidecar (1) or built by walking the file (0)
+static void BM_StackReaderOpen(benchmark::State& state) {
+    BenchStack& stack = BenchStack::get();
+    for (auto _ : state) {
+        if (state.range(0) == 0) {
+            remove(stack_index_filename(stack.filename).c_str());
+        }
+        StackReader reader(stack.filename);
+        benchmark::DoNotOptimize(reader.get_num_frames());
+    }
+}
+BENCHMARK(BM_StackReaderOpen)->Arg(0)->Arg(1);
+
+// Frames in random order, copied into a buffer
+static void BM_StackReaderRandomRead(benchmark::State& state) {
+    BenchStack& stack = BenchStack::get();
+    StackReader reader(stack.filename);
+    std::mt19937 rng(42);
+    std::uniform_int_distribution<unsigned int> frame_index(0, BenchStack::FRAMES - 1);
+    std::vector<uint16_t> frame((size_t)BenchStack::WIDTH * BenchStack::HEIGHT);
+    for (auto _ : state) {
+        reader.read_frame(frame_index(rng), frame.data());
+        benchmark::DoNotOptimize(frame.data());
+        benchmark::ClobberMemory();
+    }
+    state.SetBytesProcessed(state.iterations() * frame.size() * sizeof(uint16_t));
+}
+BENCHMARK(BM_StackReaderRandomRead);
+
+// Frames in random order without copying, summing all pixels so every page is touched
+static void BM_StackReaderRandomZeroCopy(benchmark::State& state) {
+    BenchStack& stack = BenchStack::get();
+    StackReader reader(stack.filename);
+    std::mt19937 rng(42);
+    std::uniform_int_distribution<unsigned int> frame_index(0, BenchStack::FRAMES - 1);
+    size_t num_pixels = (size_t)BenchStack::WIDTH * BenchStack::HEIGHT;
+    for (auto _ : state) {
+        const uint16_t* frame = reader.frame_data(frame_index(rng));
+        uint64_t sum = 0;
+        for (size_t pix = 0; pix < num_pixels; ++pix) {
+            sum += frame[pix];
+        }
+        benchmark::DoNotOptimize(sum);
+    }
+    state.SetBytesProcessed(state.iterations() * num_pixels * sizeof(uint16_t));
+}
+BENCHMARK(BM_StackReaderRandomZeroCopy);
+
+#ifdef PCO_BENCH_SIM
+
+// Images recorded in the simulated camera, transferred in every iteration
+static const unsigned int SIM_IMAGES = 64;
+
+// Ring of PCOBuffers in transfer_internal without any processing.
+// Tiny images (64) show the overhead of managing the buffers, full frames (2048) include the copy of the simulated driver.
+static void BM_BufferRing(benchmark::State& state) {
+    unsigned int size = (unsigned int)state.range(0);
+    pco_sim_configure(size, size, SIM_IMAGES);
+    PCOCamera camera;
+    camera.open();
+    for (auto _ : state) {
+        camera.transfer_internal(0, SIM_IMAGES, [](unsigned int, const PCOBuffer&) {});
+    }
+    camera.close();
+    state.SetItemsProcessed(state.iterations() * SIM_IMAGES);
+    state.SetBytesProcessed(state.iterations() * SIM_IMAGES * size * size * sizeof(uint16_t));
+    // Buffers are kept between transfers, so this should stay at the number of buffers in the ring
+    state.counters["allocations"] = (double)pco_sim_allocations();
+}
+BENCHMARK(BM_BufferRing)->ArgName("size")->Arg(64)->Arg(2048)->UseRealTime();
+
+// Whole transfer_mip_to_tiff of synthetic full frames, with a MIP every 8 images or one MIP of all images
+static void BM_TransferMipToTiff(benchmark::State& state) {
+    unsigned int images_per_mip = (unsigned int)state.range(0);
+    pco_sim_configure(WIDTH, HEIGHT, SIM_IMAGES);
+    const char* filename = "pco_bench_mip.tif";
+    PCOCamera camera;
+    camera.open();
+    for (auto _ : state) {
+        camera.transfer_mip_to_tiff(0, images_per_mip, SIM_IMAGES / images_per_mip, filename);
+    }
+    camera.close();
+    for (const std::string& file : stack_files(filename)) {
+        remove(file.c_str());
+    }
+    remove(stack_index_filename(filename).c_str());
+    state.SetItemsProcessed(state.iterations() * SIM_IMAGES);
+    state.SetBytesProcessed(state.iterations() * SIM_IMAGES * WIDTH * HEIGHT * sizeof(uint16_t));
+}
+BENCHMARK(BM_TransferMipToTiff)->ArgName("images_per_mip")->Arg(8)->Arg(SIM_IMAGES)->Unit(benchmark::kMillisecond)->UseRealTime();
+
+#endif
+
+BENCHMARK_MAIN();
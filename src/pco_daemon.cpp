@@ -0,0 +1,275 @@
+#include <iostream>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "clipp.hpp"
+#include "pco_ipc.hpp"
+#include <sddl.h>
+
+using namespace clipp;
+
+struct QueuedJob {
+    Job job;
+    std::promise<JobResult> result;
+};
+
+// Jobs are executed one after another by a single worker that owns the camera.
+// Clients connecting while a job runs are queued so the camera and its transfer buffers stay warm between jobs.
+class JobQueue {
+public:
+    std::future<JobResult> push(const Job& job) {
+        std::lock_guard<std::mutex> lock(mutex);
+        QueuedJob item;
+        item.job = job;
+        std::future<JobResult> future = item.result.get_future();
+        if (stopped) {
+            JobResult rejected;
+            rejected.ok = false;
+            rejected.message = "Daemon is shutting down";
+            item.result.set_value(rejected);
+        } else {
+            jobs.push_back(std::move(item));
+            cv.notify_one();
+        }
+        return future;
+    }
+
+    /** Blocks until a job is available. Returns false if the queue was stopped and all jobs are done. */
+    bool pop(QueuedJob& item) {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [this]() { return stopped || !jobs.empty(); });
+        if (jobs.empty()) {
+            return false;
+        }
+        item = std::move(jobs.front());
+        jobs.pop_front();
+        return true;
+    }
+
+    size_t size() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return jobs.size();
+    }
+
+    void stop() {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopped = true;
+        cv.notify_all();
+    }
+
+private:
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<QueuedJob> jobs;
+    bool stopped = false;
+};
+
+struct DaemonState {
+    std::string pipe_name;
+    JobQueue queue;
+    std::atomic<bool> shutting_down{false};
+    std::atomic<int> active_clients{0};
+};
+
+const char* job_name(JobType type) {
+    switch (type) {
+    case JobType::record: return "record";
+    case JobType::transfer_full: return "full transfer";
+    case JobType::transfer_mip: return "MIP transfer";
+    case JobType::transfer_bin: return "bin transfer";
+    case JobType::transfer_events: return "event transfer";
+    case JobType::shutdown: return "shutdown";
+    }
+    return "unknown";
+}
+
+void handle_client(HANDLE pipe, DaemonState& state) {
+    try {
+        Job job;
+        try {
+            job = receive_job(pipe);
+        }
+        catch (const InvalidJob& ex) {
+            // Answered so the client reports the reason, logged below
+            JobResult rejected;
+            rejected.ok = false;
+            rejected.message = ex.what();
+            send_result(pipe, rejected);
+            FlushFileBuffers(pipe);
+            throw;
+        }
+        JobResult result;
+        if (job.type == JobType::shutdown) {
+            std::cout << "Shutdown requested, finishing " << state.queue.size() << " queued jobs" << std::endl;
+            state.shutting_down = true;
+            state.queue.stop();
+            // The accept loop is blocked waiting for the next client, connect once to wake it up.
+            // It always creates the next instance before checking shutting_down, so there is one to connect to.
+            // If that one is busy another client has connected, which wakes the loop as well.
+            HANDLE wake = CreateFileA(state.pipe_name.c_str(), GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, 0, NULL);
+            if (wake != INVALID_HANDLE_VALUE) {
+                CloseHandle(wake);
+            }
+        } else {
+            std::cout << "Queued " << job_name(job.type) << " job (" << state.queue.size() << " waiting)" << std::endl;
+            result = state.queue.push(job).get();
+        }
+        send_result(pipe, result);
+        FlushFileBuffers(pipe);
+    }
+    catch (const std::exception& ex) {
+        std::cerr << "Client error: " << ex.what() << std::endl;
+    }
+    DisconnectNamedPipe(pipe);
+    CloseHandle(pipe);
+    state.active_clients--;
+}
+
+// Lets only the user running the daemon and SYSTEM open the pipe.
+// Jobs write and delete files as this user, so other local users must not be able to submit them.
+class PipeSecurity {
+public:
+    PipeSecurity() {
+        HANDLE token;
+        if (!OpenProcessToken(GetCurrentProcess(), TOKEN_QUERY, &token)) {
+            throw std::runtime_error("Could not open process token");
+        }
+        DWORD size = 0;
+        GetTokenInformation(token, TokenUser, NULL, 0, &size);
+        std::vector<char> user(size);
+        bool ok = size > 0 && GetTokenInformation(token, TokenUser, user.data(), size, &size);
+        CloseHandle(token);
+        char* sid = NULL;
+        if (!ok || !ConvertSidToStringSidA(reinterpret_cast<TOKEN_USER*>(user.data())->User.Sid, &sid)) {
+            throw std::runtime_error("Could not get the user of the daemon");
+        }
+        // Protected DACL, full access for the user and SYSTEM only
+        std::string sddl = std::string("D:P(A;;GA;;;") + sid + ")(A;;GA;;;SY)";
+        LocalFree(sid);
+        attributes.nLength = sizeof(attributes);
+        attributes.bInheritHandle = FALSE;
+        attributes.lpSecurityDescriptor = NULL;
+        if (!ConvertStringSecurityDescriptorToSecurityDescriptorA(sddl.c_str(), SDDL_REVISION_1, &attributes.lpSecurityDescriptor, NULL)) {
+            throw std::runtime_error("Could not create the security descriptor of the pipe");
+        }
+    }
+
+    ~PipeSecurity() {
+        LocalFree(attributes.lpSecurityDescriptor);
+    }
+
+    PipeSecurity(const PipeSecurity&) = delete;
+    PipeSecurity& operator= (const PipeSecurity&) = delete;
+
+    SECURITY_ATTRIBUTES attributes;
+};
+
+int main(int argc, char** argv) {
+    //
+    // Command line options
+    //
+
+    bool help = false;
+    std::string pipe_name = PCO_DAEMON_DEFAULT_PIPE;
+
+    auto cli = (
+        option("-h", "--help").set(help) % "Show documentation." |
+        (
+            option("-p", "--pipe") & value("pipe name", pipe_name) % "Named pipe to listen on."
+        )
+    );
+
+    auto fmt = doc_formatting{}.doc_column(30);
+    const char* exe_name = "pco_daemon";
+    parsing_result parse_result = parse(argc, argv, cli);
+    if (!parse_result) {
+        std::cerr << "Invalid arguments. See arguments below or use " << exe_name << " -h for more info\n";
+        std::cerr << usage_lines(cli, exe_name, fmt) << '\n';
+        return 1;
+    }
+
+    if (help) {
+        std::cout << make_man_page(cli, exe_name, fmt) << '\n';
+        return 0;
+    }
+
+    //
+    // Execution
+    //
+    try {
+        PCOCamera cam;
+        cam.open();
+
+        DaemonState state;
+        state.pipe_name = pipe_name;
+        PipeSecurity security;
+
+        std::thread worker([&cam, &state]() {
+            QueuedJob item;
+            while (state.queue.pop(item)) {
+                auto begin = std::chrono::steady_clock::now();
+                JobResult result = run_job(cam, item.job);
+                auto end = std::chrono::steady_clock::now();
+                std::cout << "Finished " << job_name(item.job.type) << " job in "
+                    << std::chrono::duration_cast<std::chrono::milliseconds>(end - begin).count() << "ms";
+                if (!result.ok) {
+                    std::cout << " with error: " << result.message;
+                }
+                std::cout << std::endl;
+                item.result.set_value(result);
+            }
+        });
+
+        // Local clients only. The first instance fails if another process already owns the name.
+        auto create_pipe = [&pipe_name, &security](bool first) {
+            return CreateNamedPipeA(pipe_name.c_str(), PIPE_ACCESS_DUPLEX | (first ? FILE_FLAG_FIRST_PIPE_INSTANCE : 0),
+                PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS, PIPE_UNLIMITED_INSTANCES, 4096, 4096, 0,
+                &security.attributes);
+        };
+        // Client threads reference state and the worker references cam, both must be done before leaving this scope
+        auto finish = [&state, &worker]() {
+            state.queue.stop();
+            worker.join();
+            while (state.active_clients > 0) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            }
+        };
+
+        std::cout << "Listening on " << pipe_name << std::endl;
+        HANDLE pipe = create_pipe(true);
+        while (pipe != INVALID_HANDLE_VALUE) {
+            bool connected = ConnectNamedPipe(pipe, NULL) || GetLastError() == ERROR_PIPE_CONNECTED;
+            // Create the next instance before checking for shutdown, so a wake up connect always finds one
+            HANDLE next = create_pipe(false);
+            if (!connected || state.shutting_down) {
+                CloseHandle(pipe);
+            } else {
+                state.active_clients++;
+                std::thread(handle_client, pipe, std::ref(state)).detach();
+            }
+            if (state.shutting_down) {
+                if (next != INVALID_HANDLE_VALUE) {
+                    CloseHandle(next);
+                }
+                break;
+            }
+            pipe = next;
+        }
+
+        finish();
+        if (!state.shutting_down) {
+            throw std::runtime_error("Could not create named pipe " + pipe_name);
+        }
+        cam.close();
+        return 0;
+    }
+    catch (const std::exception& ex) {
+        std::cerr << ex.what() << std::endl;
+        return 1;
+    }
+}
@@ -0,0 +1,367 @@
+#include "pco_ipc.hpp"
+
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+
+static std::vector<SegmentRange> segment_ranges(const Job& job, unsigned int max_images) {
+    std::vector<SegmentRange> ranges;
+    for (WORD segment : job.segments) {
+        SegmentRange range;
+        range.segment = segment;
+        range.skip_images = job.skip_images;
+        range.max_images = max_images;
+        ranges.push_back(range);
+    }
+    return ranges;
+}
+
+JobResult run_job(PCOCamera& cam, const Job& job) {
+    JobResult result;
+    try {
+        cam.set_tiff_options(job.tiff_options);
+        cam.set_output_format(job.format);
+        cam.set_buffer_allocation(job.buffer_allocation);
+        cam.set_frame_processing(job.processing);
+        cam.set_flat_field(job.dark_path, job.flat_path);
+        std::string replacement = job.hot_pixel_replacement == HotPixelReplacement::mean ? "mean" : "median";
+        if (job.hot_pixel_path.empty()) {
+            // Disables the replacement, also with hot_pixels_from_dark
+            cam.set_hot_pixel_list("", replacement);
+        } else if (job.hot_pixels_from_dark) {
+            cam.set_hot_pixels_from_dark(job.hot_pixel_path, job.hot_pixel_sigma, replacement);
+        } else {
+            cam.set_hot_pixel_list(job.hot_pixel_path, replacement);
+        }
+        cam.set_preview(job.preview_path, job.preview_downsample, job.preview_images);
+        cam.set_event_trigger(job.event_trigger);
+        cam.set_mip_background(job.mip_background == MipBackground::ema ? "ema" : job.mip_background == MipBackground::minimum ? "min" : "none",
+            job.mip_background_frames);
+        cam.set_mip_pyramid(job.mip_pyramid_levels, job.mip_pyramid_reduction == PyramidReduction::mean ? "mean" : "max");
+        cam.set_orthogonal_projections(job.orthogonal_projections);
+        cam.set_frame_statistics(job.statistics, job.statistics_path, job.statistics_format == StatisticsFormat::binary ? "binary" : "csv");
+        switch (job.type) {
+        case JobType::record:
+            cam.set_active_segment(job.segments.at(0));
+            cam.clear_active_segment();
+            cam.arm_camera();
+            cam.start_recording();
+            if (!cam.wait_for_recording_done(job.timeout_ms)) {
+                cam.stop_recording();
+            }
+            result.count = cam.get_num_images_in_segment(job.segments.at(0));
+            break;
+        case JobType::transfer_full:
+            if (!job.mip_outpath.empty()) {
+                if (job.segments.size() != 1) {
+                    throw std::runtime_error("Writing MIPs during a full transfer only works for a single segment");
+                }
+                cam.set_active_segment(job.segments[0]);
+                result.count = cam.transfer_to_tiff_and_mip(job.skip_images, job.count, job.outpath, job.images_per_mip, job.mip_outpath);
+            } else if (job.segments.size() == 1) {
+                cam.set_active_segment(job.segments[0]);
+                result.count = cam.transfer_to_tiff(job.skip_images, job.count, job.outpath);
+            } else {
+                result.count = cam.transfer_segments_to_tiff(segment_ranges(job, job.count), job.outpath);
+            }
+            break;
+        case JobType::transfer_mip:
+            if (job.segments.size() == 1) {
+                cam.set_active_segment(job.segments[0]);
+                result.count = cam.transfer_mip_to_tiff(job.skip_images, job.images_per_mip, job.count, job.outpath);
+            } else {
+                result.count = cam.transfer_segments_mip_to_tiff(segment_ranges(job, mip_images(job.images_per_mip, job.count)), job.images_per_mip, job.outpath);
+            }
+            break;
+        case JobType::transfer_bin:
+            if (job.segments.size() != 1) {
+                throw std::runtime_error("Binning only works for a single segment");
+            }
+            cam.set_active_segment(job.segments[0]);
+            result.count = cam.transfer_bin_to_tiff(job.skip_images, job.images_per_mip, job.count, job.outpath, job.bin_sum ? "sum" : "mean");
+            break;
+        case JobType::transfer_events:
+            if (job.segments.size() != 1) {
+                throw std::runtime_error("Event transfers only work for a single segment");
+            }
+            cam.set_active_segment(job.segments[0]);
+            result.count = cam.transfer_events_to_tiff(job.skip_images, job.count, job.outpath);
+            break;
+        case JobType::shutdown:
+            break;
+        default:
+            throw std::runtime_error("Unknown job type");
+        }
+        if (job.type != JobType::record && job.type != JobType::shutdown) {
+            result.duplicate_frames = cam.get_duplicate_frames();
+            result.blank_frames = cam.get_blank_frames();
+        }
+    }
+    catch (const std::exception& ex) {
+        result.ok = false;
+        result.message = ex.what();
+    }
+    return result;
+}
+
+static void read_exact(HANDLE pipe, void* data, DWORD size) {
+    char* dest = static_cast<char*>(data);
+    while (size > 0) {
+        DWORD read = 0;
+        if (!ReadFile(pipe, dest, size, &read, NULL) || read == 0) {
+            throw std::runtime_error("Reading from pipe failed");
+        }
+        dest += read;
+        size -= read;
+    }
+}
+
+static void write_all(HANDLE pipe, const void* data, DWORD size) {
+    const char* src = static_cast<const char*>(data);
+    while (size > 0) {
+        DWORD written = 0;
+        if (!WriteFile(pipe, src, size, &written, NULL) || written == 0) {
+            throw std::runtime_error("Writing to pipe failed");
+        }
+        src += written;
+        size -= written;
+    }
+}
+
+static void check_header(uint32_t magic, uint16_t version) {
+    if (magic != PCO_IPC_MAGIC) {
+        throw std::runtime_error("Invalid message received on pipe");
+    }
+    if (version != PCO_IPC_VERSION) {
+        throw std::runtime_error("Client and daemon protocol versions do not match");
+    }
+}
+
+void send_job(HANDLE pipe, const Job& job) {
+    if (job.outpath.size() > std::numeric_limits<uint16_t>::max() || job.mip_outpath.size() > std::numeric_limits<uint16_t>::max()
+        || job.dark_path.size() > std::numeric_limits<uint16_t>::max() || job.flat_path.size() > std::numeric_limits<uint16_t>::max()
+        || job.hot_pixel_path.size() > std::numeric_limits<uint16_t>::max() || job.statistics_path.size() > std::numeric_limits<uint16_t>::max()
+        || job.preview_path.size() > std::numeric_limits<uint16_t>::max()) {
+        throw std::runtime_error("Output path too long");
+    }
+    if (job.segments.empty() || job.segments.size() > 4) {
+        throw std::runtime_error("Between 1 and 4 segments have to be given");
+    }
+    JobRequestHeader header;
+    header.magic = PCO_IPC_MAGIC;
+    header.version = PCO_IPC_VERSION;
+    header.type = static_cast<uint16_t>(job.type);
+    header.segment_count = static_cast<uint16_t>(job.segments.size());
+    header.path_length = static_cast<uint16_t>(job.outpath.size());
+    header.mip_path_length = static_cast<uint16_t>(job.mip_outpath.size());
+    header.skip_images = job.skip_images;
+    header.count = job.count;
+    header.images_per_mip = job.images_per_mip;
+    header.timeout_ms = job.timeout_ms;
+    header.compression = static_cast<uint16_t>(job.tiff_options.compression);
+    header.compression_level = job.tiff_options.compression_level;
+    header.compression_threads = job.tiff_options.compression_threads;
+    header.format = static_cast<uint16_t>(job.format);
+    header.bits_per_sample = static_cast<uint16_t>(job.tiff_options.bits_per_sample);
+    header.index_flags = (job.tiff_options.write_index ? 1 : 0) | (job.tiff_options.write_index_json ? 2 : 0);
+    header.write_backend = static_cast<uint16_t>(job.tiff_options.write_backend);
+    header.buffer_allocation = static_cast<uint16_t>(job.buffer_allocation);
+    header.bin_sum = job.bin_sum ? 1 : 0;
+    const FrameProcessing& processing = job.processing;
+    if (processing.roi_x1 > std::numeric_limits<uint16_t>::max() || processing.roi_y1 > std::numeric_limits<uint16_t>::max()
+        || processing.bin > std::numeric_limits<uint16_t>::max()) {
+        throw std::runtime_error("Software ROI or binning too large");
+    }
+    header.roi[0] = static_cast<uint16_t>(processing.roi_x0);
+    header.roi[1] = static_cast<uint16_t>(processing.roi_y0);
+    header.roi[2] = static_cast<uint16_t>(processing.roi_x1);
+    header.roi[3] = static_cast<uint16_t>(processing.roi_y1);
+    header.spatial_bin = static_cast<uint16_t>(processing.bin);
+    header.spatial_binning = static_cast<uint16_t>(processing.binning);
+    header.dark_path_length = static_cast<uint16_t>(job.dark_path.size());
+    header.flat_path_length = static_cast<uint16_t>(job.flat_path.size());
+    header.hot_pixel_path_length = static_cast<uint16_t>(job.hot_pixel_path.size());
+    header.hot_pixels_from_dark = job.hot_pixels_from_dark ? 1 : 0;
+    header.hot_pixel_replacement = static_cast<uint16_t>(job.hot_pixel_replacement);
+    header.hot_pixel_sigma = job.hot_pixel_sigma;
+    header.statistics = job.statistics ? 1 : 0;
+    header.statistics_format = static_cast<uint16_t>(job.statistics_format);
+    header.statistics_path_length = static_cast<uint16_t>(job.statistics_path.size());
+    header.preview_path_length = static_cast<uint16_t>(job.preview_path.size());
+    header.preview_downsample = job.preview_downsample;
+    header.preview_images = job.preview_images;
+    const EventTrigger& trigger = job.event_trigger;
+    if (trigger.roi_x1 > std::numeric_limits<uint16_t>::max() || trigger.roi_y1 > std::numeric_limits<uint16_t>::max()) {
+        throw std::runtime_error("Event region too large");
+    }
+    header.event_metric = static_cast<uint16_t>(trigger.metric);
+    header.event_pixel_threshold = trigger.pixel_threshold;
+    header.event_roi[0] = static_cast<uint16_t>(trigger.roi_x0);
+    header.event_roi[1] = static_cast<uint16_t>(trigger.roi_y0);
+    header.event_roi[2] = static_cast<uint16_t>(trigger.roi_x1);
+    header.event_roi[3] = static_cast<uint16_t>(trigger.roi_y1);
+    header.event_threshold = trigger.threshold;
+    header.event_pre_trigger = trigger.pre_trigger;
+    header.event_post_trigger = trigger.post_trigger;
+    header.event_background_shift = static_cast<uint16_t>(trigger.background_shift);
+    header.mip_background = static_cast<uint16_t>(job.mip_background);
+    header.mip_background_frames = job.mip_background_frames;
+    if (job.mip_pyramid_levels > std::numeric_limits<uint16_t>::max()) {
+        throw std::runtime_error("Too many pyramid levels");
+    }
+    header.mip_pyramid_levels = static_cast<uint16_t>(job.mip_pyramid_levels);
+    header.mip_pyramid_reduction = static_cast<uint16_t>(job.mip_pyramid_reduction);
+    header.orthogonal_projections = job.orthogonal_projections ? 1 : 0;
+    write_all(pipe, &header, sizeof(header));
+    for (WORD segment : job.segments) {
+        uint16_t value = segment;
+        write_all(pipe, &value, sizeof(value));
+    }
+    write_all(pipe, job.outpath.data(), header.path_length);
+    write_all(pipe, job.mip_outpath.data(), header.mip_path_length);
+    write_all(pipe, job.dark_path.data(), header.dark_path_length);
+    write_all(pipe, job.flat_path.data(), header.flat_path_length);
+    write_all(pipe, job.hot_pixel_path.data(), header.hot_pixel_path_length);
+    write_all(pipe, job.statistics_path.data(), header.statistics_path_length);
+    write_all(pipe, job.preview_path.data(), header.preview_path_length);
+}
+
+// Enum received as its value. An out of range value is noted in invalid instead of thrown,
+// so the rest of the request is still read and the client gets an answer.
+template<class E>
+static E decode_enum(uint16_t value, E first, E last, const char* name, std::string& invalid) {
+    if ((value < static_cast<uint16_t>(first) || value > static_cast<uint16_t>(last)) && invalid.empty()) {
+        invalid = std::string("Invalid ") + name + " " + std::to_string(value) + " received on pipe";
+    }
+    return static_cast<E>(value);
+}
+
+Job receive_job(HANDLE pipe) {
+    JobRequestHeader header;
+    read_exact(pipe, &header, sizeof(header));
+    check_header(header.magic, header.version);
+
+    Job job;
+    std::string invalid;
+    job.type = decode_enum(header.type, JobType::record, JobType::transfer_events, "job type", invalid);
+    if (header.segment_count == 0 || header.segment_count > 4) {
+        throw std::runtime_error("Invalid number of segments received on pipe");
+    }
+    job.segments.resize(header.segment_count);
+    for (WORD& segment : job.segments) {
+        uint16_t value;
+        read_exact(pipe, &value, sizeof(value));
+        segment = value;
+    }
+    job.skip_images = header.skip_images;
+    job.count = header.count;
+    job.images_per_mip = header.images_per_mip;
+    job.timeout_ms = header.timeout_ms;
+    job.tiff_options.compression = decode_enum(header.compression, TiffCompression::none, TiffCompression::zstd, "compression", invalid);
+    job.tiff_options.compression_level = header.compression_level;
+    job.tiff_options.compression_threads = header.compression_threads;
+    job.format = decode_enum(header.format, OutputFormat::tiff, OutputFormat::zarr, "output format", invalid);
+    job.tiff_options.bits_per_sample = header.bits_per_sample;
+    job.tiff_options.write_index = (header.index_flags & 1) != 0;
+    job.tiff_options.write_index_json = (header.index_flags & 2) != 0;
+    job.tiff_options.write_backend = decode_enum(header.write_backend, TiffWriteBackend::stdio, TiffWriteBackend::io_uring, "write backend", invalid);
+    job.buffer_allocation = decode_enum(header.buffer_allocation, BufferAllocation::standard, BufferAllocation::huge_pages, "buffer allocation", invalid);
+    job.bin_sum = header.bin_sum != 0;
+    job.processing.roi_x0 = header.roi[0];
+    job.processing.roi_y0 = header.roi[1];
+    job.processing.roi_x1 = header.roi[2];
+    job.processing.roi_y1 = header.roi[3];
+    job.processing.bin = header.spatial_bin;
+    job.processing.binning = decode_enum(header.spatial_binning, SpatialBinning::mean, SpatialBinning::sum, "binning mode", invalid);
+    job.outpath.resize(header.path_length);
+    read_exact(pipe, &job.outpath[0], header.path_length);
+    job.mip_outpath.resize(header.mip_path_length);
+    read_exact(pipe, &job.mip_outpath[0], header.mip_path_length);
+    job.dark_path.resize(header.dark_path_length);
+    read_exact(pipe, &job.dark_path[0], header.dark_path_length);
+    job.flat_path.resize(header.flat_path_length);
+    read_exact(pipe, &job.flat_path[0], header.flat_path_length);
+    job.hot_pixel_path.resize(header.hot_pixel_path_length);
+    read_exact(pipe, &job.hot_pixel_path[0], header.hot_pixel_path_length);
+    job.hot_pixels_from_dark = header.hot_pixels_from_dark != 0;
+    job.hot_pixel_replacement = decode_enum(header.hot_pixel_replacement, HotPixelReplacement::median, HotPixelReplacement::mean, "hot pixel replacement", invalid);
+    job.hot_pixel_sigma = header.hot_pixel_sigma;
+    job.statistics = header.statistics != 0;
+    job.statistics_format = decode_enum(header.statistics_format, StatisticsFormat::csv, StatisticsFormat::binary, "statistics format", invalid);
+    job.statistics_path.resize(header.statistics_path_length);
+    read_exact(pipe, &job.statistics_path[0], header.statistics_path_length);
+    job.preview_path.resize(header.preview_path_length);
+    read_exact(pipe, &job.preview_path[0], header.preview_path_length);
+    job.preview_downsample = header.preview_downsample;
+    job.preview_images = header.preview_images;
+    job.event_trigger.metric = decode_enum(header.event_metric, EventMetric::difference, EventMetric::count, "event metric", invalid);
+    job.event_trigger.pixel_threshold = header.event_pixel_threshold;
+    job.event_trigger.roi_x0 = header.event_roi[0];
+    job.event_trigger.roi_y0 = header.event_roi[1];
+    job.event_trigger.roi_x1 = header.event_roi[2];
+    job.event_trigger.roi_y1 = header.event_roi[3];
+    job.event_trigger.threshold = header.event_threshold;
+    job.event_trigger.pre_trigger = header.event_pre_trigger;
+    job.event_trigger.post_trigger = header.event_post_trigger;
+    job.event_trigger.background_shift = header.event_background_shift;
+    job.mip_background = decode_enum(header.mip_background, MipBackground::none, MipBackground::minimum, "MIP background", invalid);
+    job.mip_background_frames = header.mip_background_frames;
+    job.mip_pyramid_levels = header.mip_pyramid_levels;
+    job.mip_pyramid_reduction = decode_enum(header.mip_pyramid_reduction, PyramidReduction::max, PyramidReduction::mean, "pyramid reduction", invalid);
+    job.orthogonal_projections = header.orthogonal_projections != 0;
+    if (!invalid.empty()) {
+        throw InvalidJob(invalid);
+    }
+    return job;
+}
+
+void send_result(HANDLE pipe, const JobResult& result) {
+    std::string message = result.message.substr(0, std::numeric_limits<uint16_t>::max());
+    JobResponseHeader header;
+    header.magic = PCO_IPC_MAGIC;
+    header.version = PCO_IPC_VERSION;
+    header.ok = result.ok ? 1 : 0;
+    header.count = result.count;
+    header.duplicate_frames = result.duplicate_frames;
+    header.blank_frames = result.blank_frames;
+    header.message_length = static_cast<uint16_t>(message.size());
+    write_all(pipe, &header, sizeof(header));
+    write_all(pipe, message.data(), header.message_length);
+}
+
+JobResult receive_result(HANDLE pipe) {
+    JobResponseHeader header;
+    read_exact(pipe, &header, sizeof(header));
+    check_header(header.magic, header.version);
+
+    JobResult result;
+    result.ok = header.ok != 0;
+    result.count = header.count;
+    result.duplicate_frames = header.duplicate_frames;
+    result.blank_frames = header.blank_frames;
+    result.message.resize(header.message_length);
+    read_exact(pipe, &result.message[0], header.message_length);
+    return result;
+}
+
+JobResult submit_job(const std::string& pipe_name, const Job& job) {
+    HANDLE pipe = INVALID_HANDLE_VALUE;
+    while (true) {
+        pipe = CreateFileA(pipe_name.c_str(), GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, 0, NULL);
+        if (pipe != INVALID_HANDLE_VALUE) {
+            break;
+        }
+        // All pipe instances are busy, wait for the daemon to create a new one
+        if (GetLastError() != ERROR_PIPE_BUSY || !WaitNamedPipeA(pipe_name.c_str(), 5000)) {
+            throw std::runtime_error("Could not connect to daemon. Is pco_daemon running?");
+        }
+    }
+
+    // Close the pipe when leaving this function
+    std::shared_ptr<void> _1(nullptr, [pipe](...) {
+        CloseHandle(pipe);
+    });
+
+    send_job(pipe, job);
+    return receive_result(pipe);
+}
@@ -0,0 +1,76 @@
+#include <iostream>
+#include <vector>
+#include "clipp.hpp"
+#include "stack_reader.hpp"
+#include "tiff_writer.hpp"
+
+using namespace clipp;
+
+// Reassembles a striped stack into a single stack in acquisition order
+int main(int argc, char** argv) {
+    //
+    // Command line options
+    //
+
+    bool help = false;
+    std::string inpath;
+    std::string outpath;
+    std::string compression = "none";
+    int compression_level = 0;
+    unsigned int bits_per_sample = 16;
+
+    auto cli = (
+        option("-h", "--help").set(help) % "Show documentation." |
+        (
+            value("manifest", inpath) % "Manifest of the striped stack (file.tiff.stripes), or any stack readable by StackReader.",
+            value("output path", outpath) % "Merged tiff file. Split into several files like all large tiffs.",
+            option("--compression") & value("compression", compression) % "Tiff compression: none, deflate or zstd.",
+            option("--compression_level") & integer("level", compression_level) % "Compression level. 0 selects the fastest level.",
+            option("--bits") & integer("bits", bits_per_sample) % "Bits per pixel: 16, or 12 to pack pixels. Values above 4095 are saturated."
+        )
+    );
+
+    auto fmt = doc_formatting{}.doc_column(30);
+    const char* exe_name = "pco_merge";
+    parsing_result parse_result = parse(argc, argv, cli);
+    if (!parse_result) {
+        std::cerr << "Invalid arguments. See arguments below or use " << exe_name << " -h for more info\n";
+        std::cerr << usage_lines(cli, exe_name, fmt) << '\n';
+        return 1;
+    }
+
+    if (help) {
+        std::cout << make_man_page(cli, exe_name, fmt) << '\n';
+        return 0;
+    }
+
+    //
+    // Execution
+    //
+    try {
+        TiffWriterOptions options;
+        options.compression = parse_tiff_compression(compression);
+        options.compression_level = compression_level;
+        if (bits_per_sample != 16 && bits_per_sample != 12) {
+            throw std::runtime_error("--bits has to be 16 or 12");
+        }
+        options.bits_per_sample = bits_per_sample;
+
+        StackReader reader(inpath);
+        TiffWriter writer(outpath, options);
+        std::vector<uint16_t> frame;
+        unsigned int num_frames = reader.get_num_frames();
+        for (unsigned int i = 0; i < num_frames; ++i) {
+            frame.resize((size_t)reader.get_width(i) * reader.get_height(i));
+            reader.read_frame(i, frame.data());
+            writer.write_frame(reader.get_width(i), reader.get_height(i), frame.data());
+        }
+        writer.close();
+        std::cout << "Merged " << num_frames << " images from " << reader.get_num_files() << " files" << std::endl;
+    }
+    catch (const std::exception& ex) {
+        std::cerr << ex.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
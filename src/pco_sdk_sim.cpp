@@ -0,0 +1,406 @@
+// Simulated SC2_Cam with the functions used by pco_wrapper.cpp. Linked instead of the SDK for benchmarks
+// of the transfer code without a camera. SC2_CamExport.h is not included because it declares the functions
+// as imported from the DLL, the definitions here have the same C linkage.
+
+#define NOMINMAX
+#include <windows.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include "pco_err.h"
+#include "sc2_SDKStructures.h"
+#include "SC2_Defs.h"
+
+#include "pco_sdk_sim.hpp"
+
+#ifndef WINAPI
+#define WINAPI
+#endif
+
+// Error bit without a layer or code, the simulation has no finer errors
+static const int SIM_ERROR = (int)0x80000001;
+
+// Different synthetic frames so a MIP is not folding the same image
+static const unsigned int SIM_FRAMES = 8;
+
+struct SimBuffer {
+    std::vector<WORD> data;
+    HANDLE event = NULL;
+    bool allocated = false;
+    DWORD status_drv = PCO_NOERROR;
+};
+
+struct SimCamera {
+    bool open = false;
+    // Sensor
+    WORD xres = 2048;
+    WORD yres = 2048;
+    // Recorded images in segment 1, a recording fills the segment with capacity images of the ROI
+    WORD image_xres = 2048;
+    WORD image_yres = 2048;
+    DWORD images = 1000;
+    DWORD capacity = 1000;
+    WORD active_segment = 1;
+    WORD roi[4] = {1, 1, 2048, 2048};
+    DWORD segment_pages[4] = {};
+    std::vector<SimBuffer> buffers;
+    // Synthetic 12 bit images, generated when configuring or recording so benchmarks don't time it
+    std::vector<std::vector<WORD>> frames;
+    uint64_t transfers = 0;
+    uint64_t allocations = 0;
+};
+
+static SimCamera& sim() {
+    static SimCamera camera;
+    return camera;
+}
+
+static HANDLE sim_handle() {
+    return (HANDLE)&sim();
+}
+
+static bool valid(HANDLE ph) {
+    return ph == sim_handle() && sim().open;
+}
+
+static void generate_frames(SimCamera& s) {
+    size_t pixels = (size_t)s.image_xres * s.image_yres;
+    s.frames.assign(SIM_FRAMES, std::vector<WORD>(pixels));
+    for (unsigned int i = 0; i < SIM_FRAMES; ++i) {
+        for (size_t pix = 0; pix < pixels; ++pix) {
+            s.frames[i][pix] = (WORD)((pix * 7 + i * 131) % 4096);
+        }
+    }
+}
+
+void pco_sim_configure(unsigned int xres, unsigned int yres, unsigned int images) {
+    SimCamera& s = sim();
+    s.xres = (WORD)xres;
+    s.yres = (WORD)yres;
+    s.image_xres = s.xres;
+    s.image_yres = s.yres;
+    s.images = images;
+    s.capacity = images;
+    s.roi[0] = 1;
+    s.roi[1] = 1;
+    s.roi[2] = s.xres;
+    s.roi[3] = s.yres;
+    generate_frames(s);
+    s.transfers = 0;
+    s.allocations = 0;
+}
+
+uint64_t pco_sim_transfers() {
+    return sim().transfers;
+}
+
+uint64_t pco_sim_allocations() {
+    return sim().allocations;
+}
+
+extern "C" {
+
+void WINAPI PCO_GetErrorTextSDK(DWORD dwerr, char* pbuf, DWORD dwlen) {
+    snprintf(pbuf, dwlen, "Simulated SDK error 0x%08x", (unsigned int)dwerr);
+}
+
+int WINAPI PCO_OpenCamera(HANDLE* ph, WORD wCamNum) {
+    sim().open = true;
+    *ph = sim_handle();
+    return PCO_NOERROR;
+}
+
+int WINAPI PCO_OpenCameraEx(HANDLE* ph, PCO_OpenStruct* strOpenStruct) {
+    if (strOpenStruct->wCameraNumber != 0) {
+        return SIM_ERROR;
+    }
+    return PCO_OpenCamera(ph, 0);
+}
+
+int WINAPI PCO_CloseCamera(HANDLE ph) {
+    if (!valid(ph)) {
+        return SIM_ERROR;
+    }
+    sim().open = false;
+    return PCO_NOERROR;
+}
+
+int WINAPI PCO_GetCameraDescription(HANDLE ph, PCO_Description* strDescription) {
+    if (!valid(ph)) {
+        return SIM_ERROR;
+    }
+    WORD size = strDescription->wSize;
+    memset(strDescription, 0, size);
+    strDescription->wSize = size;
+    return PCO_NOERROR;
+}
+
+int WINAPI PCO_GetCameraType(HANDLE ph, PCO_CameraType* strCamType) {
+    if (!valid(ph)) {
+        return SIM_ERROR;
+    }
+    WORD size = strCamType->wSize;
+    memset(strCamType, 0, size);
+    strCamType->wSize = size;
+    return PCO_NOERROR;
+}
+
+int WINAPI PCO_GetTransferParameter(HANDLE ph, void* buffer, int ilen) {
+    if (!valid(ph)) {
+        return SIM_ERROR;
+    }
+    memset(buffer, 0, ilen);
+    return PCO_NOERROR;
+}
+
+int WINAPI PCO_GetCameraHealthStatus(HANDLE ph, DWORD* dwWarn, DWORD* dwErr, DWORD* dwStatus) {
+    if (!valid(ph)) {
+        return SIM_ERROR;
+    }
+    *dwWarn = 0;
+    *dwErr = 0;
+    *dwStatus = 0;
+    return PCO_NOERROR;
+}
+
+int WINAPI PCO_GetRecordingState(HANDLE ph, WORD* wRecState) {
+    if (!valid(ph)) {
+        return SIM_ERROR;
+    }
+    *wRecState = 0;
+    return PCO_NOERROR;
+}
+
+// Recording fills segment 1 at once, so the camera is never seen recording
+int WINAPI PCO_SetRecordingState(HANDLE ph, WORD wRecState) {
+    SimCamera& s = sim();
+    if (!valid(ph) || wRecState > 1) {
+        return SIM_ERROR;
+    }
+    if (wRecState == 1 && s.active_segment == 1) {
+        WORD xres = s.roi[2] - s.roi[0] + 1;
+        WORD yres = s.roi[3] - s.roi[1] + 1;
+        if (xres != s.image_xres || yres != s.image_yres || s.frames.empty()) {
+            s.image_xres = xres;
+            s.image_yres = yres;
+            generate_frames(s);
+        }
+        s.images = s.capacity;
+    }
+    return PCO_NOERROR;
+}
+
+int WINAPI PCO_ResetSettingsToDefault(HANDLE ph) {
+    return valid(ph) ? PCO_NOERROR : SIM_ERROR;
+}
+
+int WINAPI PCO_RebootCamera(HANDLE ph) {
+    return valid(ph) ? PCO_NOERROR : SIM_ERROR;
+}
+
+int WINAPI PCO_ArmCamera(HANDLE ph) {
+    return valid(ph) ? PCO_NOERROR : SIM_ERROR;
+}
+
+int WINAPI PCO_SetFrameRate(HANDLE ph, WORD* wFrameRateStatus, WORD wFramerateMode, DWORD* dwFramerate, DWORD* dwFramerateExposure) {
+    if (!valid(ph)) {
+        return SIM_ERROR;
+    }
+    *wFrameRateStatus = 0;
+    return PCO_NOERROR;
+}
+
+int WINAPI PCO_SetROI(HANDLE ph, WORD wRoiX0, WORD wRoiY0, WORD wRoiX1, WORD wRoiY1) {
+    SimCamera& s = sim();
+    if (!valid(ph) || wRoiX0 < 1 || wRoiY0 < 1 || wRoiX1 < wRoiX0 || wRoiY1 < wRoiY0 || wRoiX1 > s.xres || wRoiY1 > s.yres) {
+        return SIM_ERROR;
+    }
+    s.roi[0] = wRoiX0;
+    s.roi[1] = wRoiY0;
+    s.roi[2] = wRoiX1;
+    s.roi[3] = wRoiY1;
+    return PCO_NOERROR;
+}
+
+int WINAPI PCO_SetStorageMode(HANDLE ph, WORD wStorageMode) {
+    return valid(ph) ? PCO_NOERROR : SIM_ERROR;
+}
+
+int WINAPI PCO_SetRecorderSubmode(HANDLE ph, WORD wRecSubmode) {
+    return valid(ph) ? PCO_NOERROR : SIM_ERROR;
+}
+
+int WINAPI PCO_GetSizes(HANDLE ph, WORD* wXResAct, WORD* wYResAct, WORD* wXResMax, WORD* wYResMax) {
+    SimCamera& s = sim();
+    if (!valid(ph)) {
+        return SIM_ERROR;
+    }
+    *wXResAct = s.roi[2] - s.roi[0] + 1;
+    *wYResAct = s.roi[3] - s.roi[1] + 1;
+    *wXResMax = s.xres;
+    *wYResMax = s.yres;
+    return PCO_NOERROR;
+}
+
+int WINAPI PCO_GetCameraRamSize(HANDLE ph, DWORD* dwRamSize, WORD* wPageSize) {
+    if (!valid(ph)) {
+        return SIM_ERROR;
+    }
+    // 32 GiB in pages of 4096 pixels
+    *wPageSize = 4096;
+    *dwRamSize = 4 * 1024 * 1024;
+    return PCO_NOERROR;
+}
+
+int WINAPI PCO_SetCameraRamSegmentSize(HANDLE ph, DWORD* dwRamSegSize) {
+    if (!valid(ph)) {
+        return SIM_ERROR;
+    }
+    std::copy(dwRamSegSize, dwRamSegSize + 4, sim().segment_pages);
+    return PCO_NOERROR;
+}
+
+int WINAPI PCO_GetCameraRamSegmentSize(HANDLE ph, DWORD* dwRamSegSize) {
+    if (!valid(ph)) {
+        return SIM_ERROR;
+    }
+    std::copy(sim().segment_pages, sim().segment_pages + 4, dwRamSegSize);
+    return PCO_NOERROR;
+}
+
+int WINAPI PCO_SetActiveRamSegment(HANDLE ph, WORD wActSeg) {
+    if (!valid(ph) || wActSeg < 1 || wActSeg > 4) {
+        return SIM_ERROR;
+    }
+    sim().active_segment = wActSeg;
+    return PCO_NOERROR;
+}
+
+int WINAPI PCO_GetActiveRamSegment(HANDLE ph, WORD* wActSeg) {
+    if (!valid(ph)) {
+        return SIM_ERROR;
+    }
+    *wActSeg = sim().active_segment;
+    return PCO_NOERROR;
+}
+
+int WINAPI PCO_ClearRamSegment(HANDLE ph) {
+    if (!valid(ph)) {
+        return SIM_ERROR;
+    }
+    if (sim().active_segment == 1) {
+        sim().images = 0;
+    }
+    return PCO_NOERROR;
+}
+
+int WINAPI PCO_GetNumberOfImagesInSegment(HANDLE ph, WORD wSegment, DWORD* dwValidImageCnt, DWORD* dwMaxImageCnt) {
+    if (!valid(ph) || wSegment < 1 || wSegment > 4) {
+        return SIM_ERROR;
+    }
+    *dwValidImageCnt = wSegment == 1 ? sim().images : 0;
+    *dwMaxImageCnt = wSegment == 1 ? sim().images : 0;
+    return PCO_NOERROR;
+}
+
+int WINAPI PCO_GetSegmentImageSettings(HANDLE ph, WORD wSegment, WORD* wXRes, WORD* wYRes,
+    WORD* wBinHorz, WORD* wBinVert, WORD* wRoiX0, WORD* wRoiY0, WORD* wRoiX1, WORD* wRoiY1) {
+    SimCamera& s = sim();
+    if (!valid(ph) || wSegment < 1 || wSegment > 4) {
+        return SIM_ERROR;
+    }
+    *wXRes = s.image_xres;
+    *wYRes = s.image_yres;
+    *wBinHorz = 1;
+    *wBinVert = 1;
+    *wRoiX0 = 1;
+    *wRoiY0 = 1;
+    *wRoiX1 = s.image_xres;
+    *wRoiY1 = s.image_yres;
+    return PCO_NOERROR;
+}
+
+int WINAPI PCO_SetImageParameters(HANDLE ph, WORD wxres, WORD wyres, DWORD dwflags, void* param, int ilen) {
+    SimCamera& s = sim();
+    if (!valid(ph) || wxres != s.image_xres || wyres != s.image_yres) {
+        return SIM_ERROR;
+    }
+    return PCO_NOERROR;
+}
+
+int WINAPI PCO_AllocateBuffer(HANDLE ph, SHORT* sBufNr, DWORD size, WORD** wBuf, HANDLE* hEvent) {
+    SimCamera& s = sim();
+    if (!valid(ph) || *sBufNr != -1) {
+        return SIM_ERROR;
+    }
+    size_t num = 0;
+    while (num < s.buffers.size() && s.buffers[num].allocated) {
+        num++;
+    }
+    if (num == s.buffers.size()) {
+        s.buffers.emplace_back();
+    }
+    SimBuffer& buffer = s.buffers[num];
+    buffer.data.assign((size + 1) / sizeof(WORD), 0);
+    buffer.event = CreateEventA(NULL, TRUE, FALSE, NULL);
+    buffer.allocated = true;
+    *sBufNr = (SHORT)num;
+    *wBuf = buffer.data.data();
+    *hEvent = buffer.event;
+    s.allocations++;
+    return PCO_NOERROR;
+}
+
+int WINAPI PCO_FreeBuffer(HANDLE ph, SHORT sBufNr) {
+    SimCamera& s = sim();
+    if (ph != sim_handle() || sBufNr < 0 || (size_t)sBufNr >= s.buffers.size() || !s.buffers[sBufNr].allocated) {
+        return SIM_ERROR;
+    }
+    SimBuffer& buffer = s.buffers[sBufNr];
+    CloseHandle(buffer.event);
+    buffer = SimBuffer();
+    return PCO_NOERROR;
+}
+
+// Copies the synthetic image into the buffer and signals it, the driver would do this asynchronously
+int WINAPI PCO_AddBufferEx(HANDLE ph, DWORD dw1stImage, DWORD dwLastImage, SHORT sBufNr, WORD wXRes, WORD wYRes, WORD wBitPerPixel) {
+    SimCamera& s = sim();
+    if (!valid(ph) || sBufNr < 0 || (size_t)sBufNr >= s.buffers.size() || !s.buffers[sBufNr].allocated) {
+        return SIM_ERROR;
+    }
+    SimBuffer& buffer = s.buffers[sBufNr];
+    if (wXRes != s.image_xres || wYRes != s.image_yres || (size_t)wXRes * wYRes > buffer.data.size() || dw1stImage != dwLastImage) {
+        return SIM_ERROR;
+    }
+    DWORD valid_images = s.active_segment == 1 ? s.images : 0;
+    if (dw1stImage < 1 || dw1stImage > valid_images) {
+        buffer.status_drv = SIM_ERROR;
+    } else {
+        const std::vector<WORD>& frame = s.frames[(dw1stImage - 1) % SIM_FRAMES];
+        std::copy(frame.begin(), frame.end(), buffer.data.begin());
+        buffer.status_drv = PCO_NOERROR;
+    }
+    s.transfers++;
+    SetEvent(buffer.event);
+    return PCO_NOERROR;
+}
+
+int WINAPI PCO_GetBufferStatus(HANDLE ph, SHORT sBufNr, DWORD* dwStatusDll, DWORD* dwStatusDrv) {
+    SimCamera& s = sim();
+    if (!valid(ph) || sBufNr < 0 || (size_t)sBufNr >= s.buffers.size() || !s.buffers[sBufNr].allocated) {
+        return SIM_ERROR;
+    }
+    // Event set
+    *dwStatusDll = 0x00008000;
+    *dwStatusDrv = s.buffers[sBufNr].status_drv;
+    return PCO_NOERROR;
+}
+
+int WINAPI PCO_CancelImages(HANDLE ph) {
+    return valid(ph) ? PCO_NOERROR : SIM_ERROR;
+}
+
+}
@@ -0,0 +1,19 @@
+#ifndef PCO_SDK_SIM_H
+#define PCO_SDK_SIM_H
+
+#include <cstdint>
+
+// Simulated camera of pco_sdk_sim.cpp, which replaces SC2_Cam so pco_wrapper can run without a camera.
+// There is one camera with all images recorded in segment 1. Recording fills the segment at once
+// with images of the ROI and transfers complete inside PCO_AddBufferEx.
+
+/** Sets the sensor resolution and the number of images in segment 1 of the simulated camera, clears the counters */
+void pco_sim_configure(unsigned int xres, unsigned int yres, unsigned int images);
+
+/** Number of PCO_AddBufferEx calls since the last pco_sim_configure */
+uint64_t pco_sim_transfers();
+
+/** Number of PCO_AllocateBuffer calls since the last pco_sim_configure */
+uint64_t pco_sim_allocations();
+
+#endif //PCO_SDK_SIM_H
@@ -1,10 +1,150 @@
 #include <iostream>
+#include <fstream>
 #include <chrono>
+#include <cmath>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <stdexcept>
 #include "clipp.hpp"
 #include "pco_wrapper.hpp"
 
 using namespace clipp;
 
+// Phases of one record and transfer cycle, in the order they run. The cycle is the sum of all.
+static const char* const PHASES[] = {"arm", "record", "wait", "transfer", "clear", "cycle"};
+static const size_t NUM_PHASES = sizeof(PHASES) / sizeof(PHASES[0]);
+static const size_t TRANSFER_PHASE = 3;
+static const size_t CYCLE_PHASE = NUM_PHASES - 1;
+
+// One combination of the swept settings
+struct SpeedtestConfig {
+    WORD width;
+    WORD height;
+    unsigned int buffers;
+};
+
+// Durations of every phase of every cycle in ms
+struct SpeedtestRun {
+    SpeedtestConfig config;
+    std::vector<double> samples[NUM_PHASES];
+};
+
+struct PhaseSummary {
+    double min;
+    double mean;
+    double p50;
+    double p95;
+    double p99;
+    double max;
+};
+
+// Nearest rank percentile of sorted samples
+static double percentile(const std::vector<double>& sorted, double p) {
+    size_t rank = (size_t)std::ceil(p / 100 * sorted.size());
+    return sorted[std::max<size_t>(rank, 1) - 1];
+}
+
+static PhaseSummary summarize(std::vector<double> samples) {
+    std::sort(samples.begin(), samples.end());
+    double sum = 0;
+    for (double sample : samples) {
+        sum += sample;
+    }
+    return {samples.front(), sum / samples.size(), percentile(samples, 50), percentile(samples, 95), percentile(samples, 99), samples.back()};
+}
+
+// Parses "WIDTHxHEIGHT"
+static SpeedtestConfig parse_resolution(const std::string& resolution) {
+    size_t x = resolution.find('x');
+    try {
+        if (x != std::string::npos) {
+            int width = std::stoi(resolution.substr(0, x));
+            int height = std::stoi(resolution.substr(x + 1));
+            if (width > 0 && height > 0 && width <= 0xFFFF && height <= 0xFFFF) {
+                return {(WORD)width, (WORD)height, 0};
+            }
+        }
+    } catch (const std::logic_error&) {
+    }
+    throw std::runtime_error("Invalid resolution " + resolution + ", use WIDTHxHEIGHT");
+}
+
+static double elapsed_ms(std::chrono::high_resolution_clock::time_point begin, std::chrono::high_resolution_clock::time_point end) {
+    return std::chrono::duration<double, std::milli>(end - begin).count();
+}
+
+// Throughput is only reported for the phases moving images
+static bool has_throughput(size_t phase) {
+    return phase == TRANSFER_PHASE || phase == CYCLE_PHASE;
+}
+
+// Throughput of the images of one cycle in the median time of a phase
+static double mb_per_s(const SpeedtestRun& run, unsigned int num_images, const PhaseSummary& summary) {
+    return (double)run.config.width * run.config.height * sizeof(uint16_t) * num_images / 1e6 / (summary.p50 / 1000);
+}
+
+static double frames_per_s(unsigned int num_images, const PhaseSummary& summary) {
+    return num_images / (summary.p50 / 1000);
+}
+
+static void write_csv(const std::string& path, const std::vector<SpeedtestRun>& runs, unsigned int num_images) {
+    std::ofstream out(path);
+    if (!out) {
+        throw std::runtime_error("Could not open " + path);
+    }
+    out << "width,height,images,buffers,phase,iterations,min_ms,mean_ms,p50_ms,p95_ms,p99_ms,max_ms,mb_per_s,frames_per_s\n";
+    for (const SpeedtestRun& run : runs) {
+        for (size_t phase = 0; phase < NUM_PHASES; ++phase) {
+            PhaseSummary s = summarize(run.samples[phase]);
+            out << run.config.width << ',' << run.config.height << ',' << num_images << ',' << run.config.buffers << ','
+                << PHASES[phase] << ',' << run.samples[phase].size() << ','
+                << s.min << ',' << s.mean << ',' << s.p50 << ',' << s.p95 << ',' << s.p99 << ',' << s.max << ',';
+            if (has_throughput(phase)) {
+                out << mb_per_s(run, num_images, s) << ',' << frames_per_s(num_images, s);
+            } else {
+                out << ',';
+            }
+            out << '\n';
+        }
+    }
+    if (!out) {
+        throw std::runtime_error("Could not write " + path);
+    }
+}
+
+static void write_json(const std::string& path, const std::vector<SpeedtestRun>& runs, unsigned int num_images) {
+    std::ofstream out(path);
+    if (!out) {
+        throw std::runtime_error("Could not open " + path);
+    }
+    out << "{\n  \"images\": " << num_images << ",\n  \"runs\": [";
+    for (size_t i = 0; i < runs.size(); ++i) {
+        const SpeedtestRun& run = runs[i];
+        out << (i == 0 ? "" : ",") << "\n    {\"width\": " << run.config.width << ", \"height\": " << run.config.height
+            << ", \"buffers\": " << run.config.buffers << ", \"phases\": {";
+        for (size_t phase = 0; phase < NUM_PHASES; ++phase) {
+            PhaseSummary s = summarize(run.samples[phase]);
+            out << (phase == 0 ? "" : ",") << "\n      \"" << PHASES[phase] << "\": {"
+                << "\"min_ms\": " << s.min << ", \"mean_ms\": " << s.mean << ", \"p50_ms\": " << s.p50
+                << ", \"p95_ms\": " << s.p95 << ", \"p99_ms\": " << s.p99 << ", \"max_ms\": " << s.max;
+            if (has_throughput(phase)) {
+                out << ", \"mb_per_s\": " << mb_per_s(run, num_images, s) << ", \"frames_per_s\": " << frames_per_s(num_images, s);
+            }
+            out << ", \"samples_ms\": [";
+            for (size_t sample = 0; sample < run.samples[phase].size(); ++sample) {
+                out << (sample == 0 ? "" : ", ") << run.samples[phase][sample];
+            }
+            out << "]}";
+        }
+        out << "\n    }}";
+    }
+    out << "\n  ]\n}\n";
+    if (!out) {
+        throw std::runtime_error("Could not write " + path);
+    }
+}
+
 int main(int argc, char** argv) {
     //
     // Command line options
@@ -15,10 +155,18 @@ int main(int argc, char** argv) {
     //Common
     unsigned int num_transfers = 0;
     unsigned int num_images = 0;
+    std::vector<std::string> resolutions;
+    std::vector<unsigned int> buffers;
+    std::string csv_path;
+    std::string json_path;
 
     auto common_options = (
-        required("-n", "--num_transfers") & integer("num transfers", num_transfers) % "Number of record and transfer operations",
-        required("-i", "--num_images") & integer("num images", num_images) % "Number of images per record/transfer"
+        required("-n", "--num_transfers") & integer("num transfers", num_transfers) % "Number of record and transfer operations per setting",
+        required("-i", "--num_images") & integer("num images", num_images) % "Number of images per record/transfer",
+        option("--resolution") & values("WIDTHxHEIGHT", resolutions) % "Resolutions to test, with an ROI centered on the sensor. Default: full sensor.",
+        option("--buffers") & integers("buffers", buffers) % "Numbers of transfer buffers to test (1-16). Default: 2.",
+        option("--csv") & value("path", csv_path) % "Write the statistics of every phase to a CSV file",
+        option("--json") & value("path", json_path) % "Write the statistics and all measured durations to a JSON file"
     );
 
     auto cli = (
@@ -46,28 +194,96 @@ int main(int argc, char** argv) {
     // Execution
     //
     try {
+        if (num_transfers == 0 || num_images == 0) {
+            throw std::runtime_error("num_transfers and num_images must be at least 1");
+        }
+        if (buffers.empty()) {
+            buffers.push_back(2);
+        }
+
         PCOCamera cam;
         cam.open();
         cam.reset_camera_settings();
-        cam.set_recorder_mode_sequence();
-        cam.arm_camera();
-        cam.set_segment_sizes(num_images, 0, 0, 0);
-        cam.set_framerate_exposure(1, 4000000, 1000000);
-        cam.arm_camera();
-        cam.set_active_segment(1);
-        for (int i = 0; i < num_transfers; ++i) {
-            auto begin = std::chrono::high_resolution_clock::now();
-            cam.start_recording();
-            cam.wait_for_recording_done();
-            cam.transfer_internal(0, num_images, [](unsigned int, const PCOBuffer&){});
-            cam.clear_active_segment();
-            auto end = std::chrono::high_resolution_clock::now();
-            std::cout << std::chrono::duration_cast<std::chrono::milliseconds>(end-begin).count() << "ms" << std::endl;
+        AcquisitionProfile profile;
+        profile.frameRate_mHz = 4000000;
+        profile.expTime_ns = 1000000;
+        profile.segment1 = num_images;
+        profile.active_segment = 1;
+        cam.apply(profile);
+
+        WORD xres, yres, xres_max, yres_max;
+        cam.get_sizes(xres, yres, xres_max, yres_max);
+        std::vector<SpeedtestConfig> sizes;
+        for (const std::string& resolution : resolutions) {
+            sizes.push_back(parse_resolution(resolution));
+        }
+        if (sizes.empty()) {
+            sizes.push_back({xres_max, yres_max, 0});
+        }
+
+        std::vector<SpeedtestRun> runs;
+        for (const SpeedtestConfig& size : sizes) {
+            if (size.width > xres_max || size.height > yres_max) {
+                throw std::runtime_error("Resolution larger than the sensor");
+            }
+            profile.roiX0 = (WORD)((xres_max - size.width) / 2 + 1);
+            profile.roiY0 = (WORD)((yres_max - size.height) / 2 + 1);
+            profile.roiX1 = (WORD)(profile.roiX0 + size.width - 1);
+            profile.roiY1 = (WORD)(profile.roiY0 + size.height - 1);
+            cam.apply(profile);
+            cam.get_sizes(xres, yres, xres_max, yres_max);
+
+            for (unsigned int num_buffers : buffers) {
+                cam.set_transfer_buffers(num_buffers);
+                SpeedtestRun run;
+                run.config = {xres, yres, num_buffers};
+                std::cout << xres << "x" << yres << ", " << num_images << " images, " << num_buffers << " buffers" << std::endl;
+                for (unsigned int i = 0; i < num_transfers; ++i) {
+                    std::chrono::high_resolution_clock::time_point t[NUM_PHASES];
+                    auto begin = std::chrono::high_resolution_clock::now();
+                    cam.arm_camera();
+                    t[0] = std::chrono::high_resolution_clock::now();
+                    cam.start_recording();
+                    t[1] = std::chrono::high_resolution_clock::now();
+                    cam.wait_for_recording_done();
+                    t[2] = std::chrono::high_resolution_clock::now();
+                    cam.transfer_internal(0, num_images, [](unsigned int, const PCOBuffer&){});
+                    t[3] = std::chrono::high_resolution_clock::now();
+                    cam.clear_active_segment();
+                    t[4] = std::chrono::high_resolution_clock::now();
+                    t[CYCLE_PHASE] = t[4];
+
+                    std::cout << "  ";
+                    for (size_t phase = 0; phase < NUM_PHASES; ++phase) {
+                        double ms = elapsed_ms(phase == 0 || phase == CYCLE_PHASE ? begin : t[phase - 1], t[phase]);
+                        run.samples[phase].push_back(ms);
+                        std::cout << PHASES[phase] << " " << ms << "ms" << (phase + 1 < NUM_PHASES ? ", " : "\n");
+                    }
+                }
+
+                for (size_t phase = 0; phase < NUM_PHASES; ++phase) {
+                    PhaseSummary s = summarize(run.samples[phase]);
+                    std::cout << "  " << PHASES[phase] << ": p50 " << s.p50 << "ms, p95 " << s.p95 << "ms, p99 " << s.p99 << "ms";
+                    if (has_throughput(phase)) {
+                        std::cout << ", " << mb_per_s(run, num_images, s) << " MB/s, " << frames_per_s(num_images, s) << " frames/s";
+                    }
+                    std::cout << std::endl;
+                }
+                runs.push_back(run);
+            }
         }
         cam.close();
+
+        if (!csv_path.empty()) {
+            write_csv(csv_path, runs, num_images);
+        }
+        if (!json_path.empty()) {
+            write_json(json_path, runs, num_images);
+        }
         return 0;
     }
     catch (const std::exception& ex) {
         std::cerr << ex.what() << std::endl;
+        return 1;
     }
 }
@@ -1,6 +1,7 @@
 #include <iostream>
 #include "clipp.hpp"
 #include "pco_wrapper.hpp"
+#include "pco_ipc.hpp"
 
 using namespace clipp;
 
@@ -11,20 +12,69 @@ int main(int argc, char** argv) {
 
 	bool help = false;
 
-	enum class mode { none, mip, full_transfer };
+	enum class mode { none, mip, bin, full_transfer, events, record, shutdown };
 	mode selected = mode::none;
 
 	//MIP mode
 	unsigned int num_mips = std::numeric_limits<unsigned int>::max();
 	unsigned int images_per_mip = 0;
 
+	//Bin mode
+	unsigned int num_bins = std::numeric_limits<unsigned int>::max();
+	unsigned int images_per_bin = 0;
+	bool bin_sum = false;
+
 	//Full transfer
 	unsigned int num_images = std::numeric_limits<unsigned int>::max();
+	std::string mip_outpath = "";
+
+	//Events
+	double event_threshold = 0;
+	std::string event_metric = "difference";
+	unsigned int event_pixel_threshold = 0;
+	std::vector<int> event_roi;
+	unsigned int pre_trigger = 10;
+	unsigned int post_trigger = 10;
+
+	//Record
+	unsigned int timeout_ms = 0;
 
 	//Common
 	unsigned int skip_images = 0;
-	std::string outpath = "";
-	int segment = 1;
+	std::vector<std::string> outpaths;
+	std::vector<int> segments;
+	std::string compression = "none";
+	int compression_level = 0;
+	unsigned int compression_threads = 0;
+	std::string format = "tiff";
+	unsigned int bits_per_sample = 16;
+	bool no_index = false;
+	bool index_json = false;
+	std::string write_backend = "stdio";
+	bool huge_pages = false;
+	std::vector<int> crop;
+	unsigned int spatial_bin = 1;
+	bool spatial_bin_sum = false;
+	std::string dark_path = "";
+	std::string flat_path = "";
+	std::string hot_pixel_list = "";
+	std::string hot_pixel_dark = "";
+	double hot_pixel_sigma = 6;
+	std::string hot_pixel_replacement = "median";
+	std::string statistics_path = "";
+	std::string statistics_format = "csv";
+	std::string preview_path = "";
+	unsigned int preview_downsample = 4;
+	unsigned int preview_images = 1;
+	std::string mip_background = "none";
+	unsigned int mip_background_frames = 16;
+	unsigned int pyramid_levels = 0;
+	std::string pyramid_reduction = "max";
+	bool orthogonal = false;
+
+	//Client mode
+	bool use_daemon = false;
+	std::string pipe_name = PCO_DAEMON_DEFAULT_PIPE;
 
 	auto mip_command = (
 		command("mip").set(selected, mode::mip) % "MIP transfer",
@@ -32,22 +82,89 @@ int main(int argc, char** argv) {
 		option("-m", "--num_mips")& integer("num mips", num_mips) % "Number of MIPs to transfer"
 	);
 
+	auto bin_command = (
+		command("bin").set(selected, mode::bin) % "Average every images_per_bin images",
+		required("-i", "--images_per_bin") & integer("images per bin", images_per_bin) % "Number of images in each bin. num_bins * images_per_bin will be transferred.",
+		option("-m", "--num_bins") & integer("num bins", num_bins) % "Number of bins to transfer",
+		option("--sum").set(bin_sum) % "Write the 32 bit sums instead of the 16 bit means."
+	);
+
 	auto full_transfer_command = (
 		command("full").set(selected, mode::full_transfer) % "Full Transfer",
+		option("-n", "--num_images") & integer("num images", num_images) % "Number of images to transfer",
+		option("--mip_output") & value("mip path", mip_outpath) % "Additionally write MIPs of the same images to this file. Images are only transferred once.",
+		option("-i", "--images_per_mip") & integer("images per mip", images_per_mip) % "Number of images in each MIP for --mip_output."
+	);
+
+	auto events_command = (
+		command("events").set(selected, mode::events) % "Only write images around events and list the events in output.events.csv",
+		required("--threshold") & number("threshold", event_threshold) % "Images scoring at least this are part of an event.",
+		option("--metric") & value("metric", event_metric) % "Score of an image: difference (default) to a running background, or count of pixels above --pixel_threshold.",
+		option("--pixel_threshold") & integer("value", event_pixel_threshold) % "Pixels above this value are counted by the count metric.",
+		option("--event_roi") & integers("x0 y0 x1 y1", event_roi) % "Only score this region of the (cropped and binned) images. Index starts at 1, x1 and y1 are included.",
+		option("--pre_trigger") & integer("n", pre_trigger) % "Images kept before an event. Default 10.",
+		option("--post_trigger") & integer("n", post_trigger) % "Images kept after the last image reaching the threshold. Default 10.",
 		option("-n", "--num_images") & integer("num images", num_images) % "Number of images to transfer"
 	);
 
+	auto record_command = (
+		command("record").set(selected, mode::record) % "Clear the segment and record into it",
+		option("-t", "--timeout") & integer("timeout ms", timeout_ms) % "Stop recording after this time. 0 waits until the segment is full.",
+		option("--segment") & integers("segment", segments) % "Camera RAM segment. Index starts at 1."
+	);
+
+	auto shutdown_command = (
+		command("shutdown").set(selected, mode::shutdown) % "Stop the daemon after all queued jobs are done"
+	);
+
 	auto common_options = (
 		option("-s", "--skip_images") & integer("skip images", skip_images) % "Number of images to skip before first MIP.",
-		option("--segment") & integer("segment", segment) % "Camera RAM segment. Index starts at 1.",
-		value("output path", outpath)
+		option("--segment") & integers("segments", segments) % "Camera RAM segments. Index starts at 1. If more than one is given, all are transferred in one go into files with the segment number appended to the name.",
+		option("--compression") & value("compression", compression) % "Tiff compression: none, deflate or zstd. Compressed files use a horizontal predictor.",
+		option("--compression_level") & integer("level", compression_level) % "Compression level. 0 selects the fastest level.",
+		option("--compression_threads") & integer("threads", compression_threads) % "Number of threads compressing images. 0 uses one per core.",
+		option("--bits") & integer("bits", bits_per_sample) % "Bits per pixel in tiff files: 16, or 12 to pack pixels and save 25% disk bandwidth. Values above 4095 are saturated.",
+		option("--no_index").set(no_index) % "Don't write the frame index file.tiff.idx next to tiff files.",
+		option("--index_json").set(index_json) % "Also write a JSON summary of the written tiff files to file.tiff.json.",
+		option("--write_backend") & value("backend", write_backend) % "How tiff files are written: stdio, or io_uring to keep several writes in flight (Linux only, falls back to stdio).",
+		option("--huge_pages").set(huge_pages) % "Allocate image copies and MIPs on 2 MiB pages on the NUMA node processing them.",
+		option("--dark") & value("dark path", dark_path) % "Subtract the first frame of this tiff from all images, e.g. the mean of a bin transfer with the shutter closed.",
+		option("--flat") & value("flat path", flat_path) % "Flat field correction with this tiff of a uniformly illuminated field, needs --dark.",
+		option("--hot_pixels") & value("list path", hot_pixel_list) % "Replace the hot pixels in this text file (x y per line, index starts at 1) by their neighbours.",
+		option("--hot_pixels_from_dark") & value("dark path", hot_pixel_dark) % "Find hot pixels in the first frame of this tiff and replace them by their neighbours.",
+		option("--hot_pixel_sigma") & number("sigma", hot_pixel_sigma) % "Pixels of the dark frame this many standard deviations above the median are hot. Default 6.",
+		option("--hot_pixel_replacement") & value("replacement", hot_pixel_replacement) % "Replace hot pixels by the median (default) or mean of their neighbours.",
+		option("--crop") & integers("x0 y0 x1 y1", crop) % "Crop images in software before writing them. Index starts at 1, x1 and y1 are included.",
+		option("--spatial_bin") & integer("n", spatial_bin) % "Bin n x n pixels of the (cropped) images into one before writing them.",
+		option("--spatial_bin_sum").set(spatial_bin_sum) % "Binned pixels are the sum (saturated at 65535) instead of the rounded mean.",
+		option("--statistics") & value("statistics path", statistics_path) % "Write min, max, mean and a hash of every image to this file and warn about blank and repeated images.",
+		option("--statistics_format") & value("format", statistics_format) % "Statistics file format: csv, or binary to also write a histogram of every image.",
+		option("--preview") & value("preview path", preview_path) % "Also write a small 8 bit preview tiff with automatic contrast.",
+		option("--preview_downsample") & integer("n", preview_downsample) % "Bin n x n pixels into one preview pixel. Default 4.",
+		option("--preview_images") & integer("n", preview_images) % "Each preview image is the MIP of n images. Default 1.",
+		option("--background") & value("background", mip_background) % "Subtract a running background from every image before it is folded into a MIP: none (default), ema or min.",
+		option("--background_frames") & integer("n", mip_background_frames) % "ema: the background follows the images with weight 1/n (power of two). min: minimum over windows of n images. Default 16.",
+		option("--pyramid") & integer("levels", pyramid_levels) % "Also write MIPs downsampled by 2, 4, ... 2^levels to mip_2x.tiff, mip_4x.tiff, ...",
+		option("--pyramid_reduction") & value("reduction", pyramid_reduction) % "Pyramid levels keep the max (default) or mean of 2 x 2 pixels.",
+		option("--orthogonal").set(orthogonal) % "Treat the images of every MIP as a z-stack and also write its XZ and YZ max projections to mip_xz.tiff and mip_yz.tiff.",
+		option("--format") & value("format", format) % "Output format: tiff or zarr. zarr writes a chunked Zarr v2 array into the output path as directory.",
+		values("output paths", outpaths) % "Output file. With several paths the images are striped round robin over them, e.g. one per disk."
+	);
+
+	auto daemon_options = (
+		option("-d", "--daemon").set(use_daemon) % "Send the job to a running pco_daemon instead of opening the camera.",
+		option("--pipe") & value("pipe name", pipe_name) % "Named pipe of the daemon."
 	);
 
 	auto cli = (
 		option("-h", "--help").set(help) % "Show documentation." |
 		(
-			(mip_command | full_transfer_command),
-			common_options
+			(
+				((mip_command | bin_command | full_transfer_command | events_command), common_options) |
+				record_command |
+				shutdown_command
+			),
+			daemon_options
 		)
 	);
 
@@ -68,20 +185,186 @@ int main(int argc, char** argv) {
 	//
 	// Execution
 	//
+	if (selected == mode::full_transfer && !mip_outpath.empty() && images_per_mip == 0) {
+		std::cerr << "--mip_output needs --images_per_mip" << std::endl;
+		return 1;
+	}
+
+	Job job;
+	if (!segments.empty()) {
+		job.segments.assign(segments.begin(), segments.end());
+	}
+	if (selected == mode::record && job.segments.size() != 1) {
+		std::cerr << "Can only record into one segment" << std::endl;
+		return 1;
+	}
+	job.skip_images = skip_images;
+	job.outpath = join_output_paths(outpaths);
 	try {
-		PCOCamera cam;
-		cam.open();
-		cam.set_active_segment(segment);
-		if (selected == mode::mip) {
-			cam.transfer_mip_to_tiff(skip_images, images_per_mip, num_mips, outpath);
+		job.tiff_options.compression = parse_tiff_compression(compression);
+		job.format = parse_output_format(format);
+		job.tiff_options.write_backend = parse_tiff_write_backend(write_backend);
+		job.hot_pixel_replacement = parse_hot_pixel_replacement(hot_pixel_replacement);
+		job.statistics_format = parse_statistics_format(statistics_format);
+		job.event_trigger.metric = parse_event_metric(event_metric);
+		job.mip_background = parse_mip_background(mip_background);
+		job.mip_pyramid_reduction = parse_pyramid_reduction(pyramid_reduction);
+	}
+	catch (const std::exception& ex) {
+		std::cerr << ex.what() << std::endl;
+		return 1;
+	}
+	job.tiff_options.compression_level = compression_level;
+	job.tiff_options.compression_threads = compression_threads;
+	if (bits_per_sample != 16 && bits_per_sample != 12) {
+		std::cerr << "--bits has to be 16 or 12" << std::endl;
+		return 1;
+	}
+	job.tiff_options.bits_per_sample = bits_per_sample;
+	job.tiff_options.write_index = !no_index;
+	job.tiff_options.write_index_json = index_json;
+	job.buffer_allocation = huge_pages ? BufferAllocation::huge_pages : BufferAllocation::standard;
+	if (!crop.empty()) {
+		if (crop.size() != 4 || crop[0] < 1 || crop[1] < 1 || crop[2] < crop[0] || crop[3] < crop[1]) {
+			std::cerr << "--crop needs four values x0 y0 x1 y1 with 1 <= x0 <= x1 and 1 <= y0 <= y1" << std::endl;
+			return 1;
 		}
-		else if (selected == mode::full_transfer) {
-			cam.transfer_to_tiff(skip_images, num_images, outpath);
+		job.processing.roi_x0 = crop[0];
+		job.processing.roi_y0 = crop[1];
+		job.processing.roi_x1 = crop[2];
+		job.processing.roi_y1 = crop[3];
+	}
+	if (spatial_bin == 0) {
+		std::cerr << "--spatial_bin has to be at least 1" << std::endl;
+		return 1;
+	}
+	job.processing.bin = spatial_bin;
+	if (!flat_path.empty() && dark_path.empty()) {
+		std::cerr << "--flat needs --dark" << std::endl;
+		return 1;
+	}
+	job.dark_path = dark_path;
+	job.flat_path = flat_path;
+	if (!hot_pixel_list.empty() && !hot_pixel_dark.empty()) {
+		std::cerr << "Use either --hot_pixels or --hot_pixels_from_dark" << std::endl;
+		return 1;
+	}
+	job.hot_pixels_from_dark = !hot_pixel_dark.empty();
+	job.hot_pixel_path = job.hot_pixels_from_dark ? hot_pixel_dark : hot_pixel_list;
+	job.hot_pixel_sigma = hot_pixel_sigma;
+	job.statistics = !statistics_path.empty();
+	job.statistics_path = statistics_path;
+	if (preview_downsample == 0 || preview_images == 0) {
+		std::cerr << "--preview_downsample and --preview_images have to be at least 1" << std::endl;
+		return 1;
+	}
+	if (mip_background_frames == 0) {
+		std::cerr << "--background_frames has to be at least 1" << std::endl;
+		return 1;
+	}
+	job.mip_background_frames = mip_background_frames;
+	job.mip_pyramid_levels = pyramid_levels;
+	if (orthogonal && job.mip_background != MipBackground::none) {
+		std::cerr << "--orthogonal can't be combined with --background" << std::endl;
+		return 1;
+	}
+	job.orthogonal_projections = orthogonal;
+	job.preview_path = preview_path;
+	job.preview_downsample = preview_downsample;
+	job.preview_images = preview_images;
+	job.processing.binning = spatial_bin_sum ? SpatialBinning::sum : SpatialBinning::mean;
+	if (selected == mode::mip) {
+		job.type = JobType::transfer_mip;
+		job.images_per_mip = images_per_mip;
+		job.count = num_mips;
+	}
+	else if (selected == mode::bin) {
+		job.type = JobType::transfer_bin;
+		job.images_per_mip = images_per_bin;
+		job.count = num_bins;
+		job.bin_sum = bin_sum;
+	}
+	else if (selected == mode::full_transfer) {
+		job.type = JobType::transfer_full;
+		job.count = num_images;
+		job.images_per_mip = images_per_mip;
+		job.mip_outpath = mip_outpath;
+	}
+	else if (selected == mode::events) {
+		if (!(event_threshold > 0) || event_pixel_threshold > std::numeric_limits<uint16_t>::max()) {
+			std::cerr << "--threshold has to be above 0 and --pixel_threshold at most 65535" << std::endl;
+			return 1;
+		}
+		if (!event_roi.empty()) {
+			if (event_roi.size() != 4 || event_roi[0] < 1 || event_roi[1] < 1 || event_roi[2] < event_roi[0] || event_roi[3] < event_roi[1]) {
+				std::cerr << "--event_roi needs four values x0 y0 x1 y1 with 1 <= x0 <= x1 and 1 <= y0 <= y1" << std::endl;
+				return 1;
+			}
+			job.event_trigger.roi_x0 = event_roi[0];
+			job.event_trigger.roi_y0 = event_roi[1];
+			job.event_trigger.roi_x1 = event_roi[2];
+			job.event_trigger.roi_y1 = event_roi[3];
+		}
+		job.type = JobType::transfer_events;
+		job.count = num_images;
+		job.event_trigger.threshold = event_threshold;
+		job.event_trigger.pixel_threshold = (uint16_t)event_pixel_threshold;
+		job.event_trigger.pre_trigger = pre_trigger;
+		job.event_trigger.post_trigger = post_trigger;
+	}
+	else if (selected == mode::record) {
+		job.type = JobType::record;
+		job.timeout_ms = timeout_ms;
+	}
+	else if (selected == mode::shutdown) {
+		job.type = JobType::shutdown;
+	}
+
+	try {
+		JobResult result;
+		if (use_daemon) {
+			//The daemon resolves relative paths against its own working directory
+			job.outpath = absolute_output_paths(job.outpath);
+			job.mip_outpath = absolute_output_paths(job.mip_outpath);
+			for (std::string* path : {&job.dark_path, &job.flat_path, &job.hot_pixel_path, &job.statistics_path, &job.preview_path}) {
+				if (!path->empty()) {
+					*path = absolute_path(*path);
+				}
+			}
+			result = submit_job(pipe_name, job);
+		}
+		else {
+			if (job.type == JobType::shutdown) {
+				std::cerr << "shutdown can only be sent to a daemon, use --daemon" << std::endl;
+				return 1;
+			}
+			PCOCamera cam;
+			cam.open();
+			result = run_job(cam, job);
+			cam.close();
+		}
+		if (!result.ok) {
+			std::cerr << result.message << std::endl;
+			return 1;
+		}
+		if (job.type == JobType::record) {
+			std::cout << "Recorded " << result.count << " images" << std::endl;
+		}
+		else if (use_daemon && job.type != JobType::shutdown) {
+			if (job.type == JobType::transfer_events) {
+				std::cout << "Found " << result.count << " events" << std::endl;
+			}
+			else {
+				std::cout << "Transferred " << result.count << (job.type == JobType::transfer_mip ? " MIPs" : job.type == JobType::transfer_bin ? " bins" : " images") << std::endl;
+			}
+			if (result.duplicate_frames != 0 || result.blank_frames != 0) {
+				std::cout << "Warning: " << result.duplicate_frames << " images repeated the previous image, " << result.blank_frames << " images were blank" << std::endl;
+			}
 		}
-		cam.close();
 		return 0;
 	}
 	catch (const std::exception& ex) {
 		std::cerr << ex.what() << std::endl;
+		return 1;
 	}
 }
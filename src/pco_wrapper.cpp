@@ -3,11 +3,15 @@
 #include <cstdio>
 #include <iostream>
 #include <memory>
-#include <array>
 #include <chrono>
 #include <thread>
+#include <vector>
+#include <algorithm>
 
-#include "tiff_writer.hpp"
+#include "frame_pipeline.hpp"
+#include "frame_sinks.hpp"
+#include "stack_reader.hpp"
+#include "stack_index.hpp"
 
 #include "pco_err.h"
 #include "sc2_SDKStructures.h"
@@ -122,6 +126,122 @@ void PCOBuffer::wait_for_buffer() {
     }
 }
 
+//Transfer buffers of the last transfer, reused as long as the image size does not change
+struct PCOBufferPool {
+    std::vector<PCOBuffer> buffers;
+};
+
+static std::vector<PCOBuffer>& warm_buffers(HANDLE cam, std::shared_ptr<PCOBufferPool>& pool, WORD xres, WORD yres, size_t count) {
+    if (!pool) {
+        pool = std::make_shared<PCOBufferPool>();
+    }
+    std::vector<PCOBuffer>& buffers = pool->buffers;
+    if (buffers.size() != count || buffers[0].xres != xres || buffers[0].yres != yres) {
+        buffers.clear();
+        buffers.reserve(count);
+        for (size_t i = 0; i < count; ++i) {
+            buffers.emplace_back(cam, xres, yres);
+        }
+    }
+    return buffers;
+}
+
+//Shadow copy of what was set on and read from the camera.
+//Setters skip the SDK call if the value is already set and getters answer from here while the value is valid.
+//Everything the camera could have changed on its own is invalidated on arm, reset and reboot.
+struct PCOSettingsCache {
+    bool active_segment_valid = false;
+    WORD active_segment = 0;
+
+    bool framerate_valid = false;
+    WORD frameRateMode = 0;
+    DWORD frameRate_mHz = 0;
+    DWORD expTime_ns = 0;
+
+    bool roi_valid = false;
+    WORD roi[4] = {};
+
+    bool recorder_mode_sequence = false;
+
+    bool segment_sizes_valid = false;
+    DWORD segment_sizes_pages[4] = {};
+
+    //Never changes as long as the camera is not rebooted
+    bool ram_size_valid = false;
+    DWORD ram_size = 0;
+    WORD page_size = 0;
+
+    //Resolution the camera is armed with and sensor resolution
+    bool sizes_valid = false;
+    WORD xres_act = 0;
+    WORD yres_act = 0;
+    bool max_sizes_valid = false;
+    WORD xres_max = 0;
+    WORD yres_max = 0;
+
+    //Image count and resolution of the recorded images per segment
+    //Valid until the segment is recorded to, cleared or resized
+    struct SegmentInfo {
+        bool counts_valid = false;
+        DWORD valid_images = 0;
+        DWORD max_images = 0;
+        bool image_settings_valid = false;
+        WORD xres = 0;
+        WORD yres = 0;
+    };
+    SegmentInfo segments[4];
+
+    bool recording = false;
+
+    //Resolution last passed to PCO_SetImageParameters
+    bool image_parameters_valid = false;
+    WORD image_parameters_xres = 0;
+    WORD image_parameters_yres = 0;
+
+    unsigned long long avoided_calls = 0;
+
+    SegmentInfo* segment(WORD segment) {
+        if (segment < 1 || segment > 4) {
+            return nullptr;
+        }
+        return &segments[segment - 1];
+    }
+
+    void invalidate_segments() {
+        for (SegmentInfo& info : segments) {
+            info = SegmentInfo();
+        }
+    }
+
+    //Everything that depends on the armed configuration
+    void invalidate_armed() {
+        sizes_valid = false;
+        image_parameters_valid = false;
+        invalidate_segments();
+    }
+
+    void invalidate_all() {
+        unsigned long long avoided = avoided_calls;
+        *this = PCOSettingsCache();
+        avoided_calls = avoided;
+    }
+};
+
+PCOSettingsCache& PCOCamera::settings() {
+    if (!settings_cache) {
+        settings_cache = std::make_shared<PCOSettingsCache>();
+    }
+    return *settings_cache;
+}
+
+unsigned long long PCOCamera::get_avoided_sdk_calls() {
+    return settings().avoided_calls;
+}
+
+void PCOCamera::invalidate_settings_cache() {
+    settings().invalidate_all();
+}
+
 /** Connects to the camera */
 void PCOCamera::open() {
 
@@ -145,6 +265,7 @@ void PCOCamera::open() {
     {
         PCOCheck(PCO_SetRecordingState(cam, 0));
     }
+    settings().invalidate_all();
 }
 
 void PCOCamera::open(WORD interface_type) {
@@ -195,41 +316,107 @@ void PCOCamera::open(WORD interface_type) {
 	{
 		PCOCheck(PCO_SetRecordingState(cam, 0));
 	}
+	settings().invalidate_all();
 }
 
 void PCOCamera::reset_camera_settings() {
     //set camera to default state
+    settings().invalidate_all();
     PCOCheck(PCO_ResetSettingsToDefault(cam));
 }
 
 void PCOCamera::reboot() {
+	buffer_pool.reset();
+	settings().invalidate_all();
 	PCOCheck(PCO_RebootCamera(cam));
 }
 
 void PCOCamera::set_framerate_exposure(WORD frameRateMode, DWORD frameRate_mHz, DWORD expTime_ns) {
+    PCOSettingsCache& s = settings();
+    if (s.framerate_valid && s.frameRateMode == frameRateMode && s.frameRate_mHz == frameRate_mHz && s.expTime_ns == expTime_ns) {
+        s.avoided_calls++;
+        return;
+    }
+    s.framerate_valid = false;
+    //The camera may adjust the values, so remember what was requested
+    DWORD requestedFrameRate_mHz = frameRate_mHz;
+    DWORD requestedExpTime_ns = expTime_ns;
     WORD frameRateStatus;
     PCOCheck(PCO_SetFrameRate(cam, &frameRateStatus, frameRateMode, &frameRate_mHz, &expTime_ns));
+    s.frameRateMode = frameRateMode;
+    s.frameRate_mHz = requestedFrameRate_mHz;
+    s.expTime_ns = requestedExpTime_ns;
+    s.framerate_valid = true;
 }
 
 void PCOCamera::set_roi(WORD roiX0, WORD roiY0, WORD roiX1, WORD roiY1) {
+    PCOSettingsCache& s = settings();
+    if (s.roi_valid && s.roi[0] == roiX0 && s.roi[1] == roiY0 && s.roi[2] == roiX1 && s.roi[3] == roiY1) {
+        s.avoided_calls++;
+        return;
+    }
+    s.roi_valid = false;
+    s.sizes_valid = false;
     PCOCheck(PCO_SetROI(cam, roiX0, roiY0, roiX1, roiY1));
+    s.roi[0] = roiX0;
+    s.roi[1] = roiY0;
+    s.roi[2] = roiX1;
+    s.roi[3] = roiY1;
+    s.roi_valid = true;
 }
 
 void PCOCamera::set_recorder_mode_sequence() {
+	PCOSettingsCache& s = settings();
+	if (s.recorder_mode_sequence) {
+		s.avoided_calls += 2;
+		return;
+	}
 	PCOCheck(PCO_SetStorageMode(cam, 0));
 	PCOCheck(PCO_SetRecorderSubmode(cam, 0));
+	s.recorder_mode_sequence = true;
 }
 
 //TODO Check PCO_SetStorageMode - maybe allows transfer while recording
 
+//Reads armed and maximum resolution into the cache
+static void query_sizes(HANDLE cam, PCOSettingsCache& s) {
+    if (s.sizes_valid) {
+        s.avoided_calls++;
+        return;
+    }
+    PCOCheck(PCO_GetSizes(cam, &s.xres_act, &s.yres_act, &s.xres_max, &s.yres_max));
+    s.sizes_valid = true;
+    s.max_sizes_valid = true;
+}
+
+void PCOCamera::get_sizes(WORD& xresAct, WORD& yresAct, WORD& xresMax, WORD& yresMax) {
+    PCOSettingsCache& s = settings();
+    query_sizes(cam, s);
+    xresAct = s.xres_act;
+    yresAct = s.yres_act;
+    xresMax = s.xres_max;
+    yresMax = s.yres_max;
+}
+
 void PCOCamera::set_segment_sizes(DWORD segment1, DWORD segment2, DWORD segment3, DWORD segment4) {
     //This has to be called after PCO_ArmCamera
-    WORD XResAct, YResAct, XResMax, YResMax;
-    PCOCheck(PCO_GetSizes(cam, &XResAct, &YResAct, &XResMax, &YResMax));
+    PCOSettingsCache& s = settings();
+    query_sizes(cam, s);
+    DWORD images[4] = {segment1, segment2, segment3, segment4};
+    set_segment_sizes_internal(s.xres_act, s.yres_act, images);
+}
+
+void PCOCamera::set_segment_sizes_internal(WORD XResAct, WORD YResAct, const DWORD images[4]) {
+    PCOSettingsCache& s = settings();
 
-    DWORD RamSize; WORD PageSize;
     //Ram size in pages and page size in pixels
-    PCOCheck(PCO_GetCameraRamSize(cam, &RamSize, &PageSize));
+    if (s.ram_size_valid) {
+        s.avoided_calls++;
+    } else {
+        PCOCheck(PCO_GetCameraRamSize(cam, &s.ram_size, &s.page_size));
+        s.ram_size_valid = true;
+    }
+    WORD PageSize = s.page_size;
 
 	//PCO Docs:
 	//The number of CamRAM pages needed for one image is calculated as image size in pixel
@@ -249,33 +436,70 @@ void PCOCamera::set_segment_sizes(DWORD segment1, DWORD segment2, DWORD segment3
 
 	DEBUGPRINT std::cerr << "Set segment size - ImagePx: " << image_size_px << ", PageSize: " << PageSize << ", image_pages: " << image_size_pages << std::endl;
 
-    DWORD pagesPerSegment[4] = {segment1 * image_size_pages, segment2 * image_size_pages, segment3 * image_size_pages, segment4 * image_size_pages};
+    DWORD pagesPerSegment[4] = {images[0] * image_size_pages, images[1] * image_size_pages, images[2] * image_size_pages, images[3] * image_size_pages};
+    if (s.segment_sizes_valid && std::equal(pagesPerSegment, pagesPerSegment + 4, s.segment_sizes_pages)) {
+        s.avoided_calls++;
+        return;
+    }
+    //Resizing segments deletes the recorded images
+    s.segment_sizes_valid = false;
+    s.invalidate_segments();
     //This sets segment sizes in **RAM pages** not bytes or pixels
     PCOCheck(PCO_SetCameraRamSegmentSize(cam, pagesPerSegment));
+    std::copy(pagesPerSegment, pagesPerSegment + 4, s.segment_sizes_pages);
+    s.segment_sizes_valid = true;
 }
 
 void PCOCamera::get_segment_sizes_pages(DWORD segmentSizes[4])
 {
-	PCOCheck(PCO_GetCameraRamSegmentSize(cam, segmentSizes));
+	PCOSettingsCache& s = settings();
+	if (s.segment_sizes_valid) {
+		s.avoided_calls++;
+	} else {
+		PCOCheck(PCO_GetCameraRamSegmentSize(cam, s.segment_sizes_pages));
+		s.segment_sizes_valid = true;
+	}
+	std::copy(s.segment_sizes_pages, s.segment_sizes_pages + 4, segmentSizes);
 }
 
 void PCOCamera::set_active_segment(WORD segment) {
+    PCOSettingsCache& s = settings();
+    if (s.active_segment_valid && s.active_segment == segment) {
+        s.avoided_calls++;
+        return;
+    }
+    s.active_segment_valid = false;
     PCOCheck(PCO_SetActiveRamSegment(cam, segment));
+    s.active_segment = segment;
+    s.active_segment_valid = true;
 }
 
 WORD PCOCamera::get_active_segment()
 {
-	WORD segment;
-	PCOCheck(PCO_GetActiveRamSegment(cam, &segment));
-	return segment;
+	PCOSettingsCache& s = settings();
+	if (s.active_segment_valid) {
+		s.avoided_calls++;
+		return s.active_segment;
+	}
+	PCOCheck(PCO_GetActiveRamSegment(cam, &s.active_segment));
+	s.active_segment_valid = true;
+	return s.active_segment;
 }
 
 void PCOCamera::clear_active_segment() {
+    PCOSettingsCache& s = settings();
+    //Don't know for sure which segment is cleared if the active segment is not known
+    if (s.active_segment_valid && s.segment(s.active_segment)) {
+        *s.segment(s.active_segment) = PCOSettingsCache::SegmentInfo();
+    } else {
+        s.invalidate_segments();
+    }
     PCOCheck(PCO_ClearRamSegment(cam));
 }
 
 void PCOCamera::arm_camera() {
     //Arm camera - this makes sure any previous configuration changes are applied
+    settings().invalidate_armed();
     PCOCheck(PCO_ArmCamera(cam));
 
     //Check camera warning or error
@@ -291,6 +515,63 @@ void PCOCamera::arm_camera() {
     }
 }
 
+bool PCOCamera::apply(const AcquisitionProfile& profile) {
+    PCOSettingsCache& s = settings();
+    bool changed = false;
+
+    if (!(s.framerate_valid && s.frameRateMode == profile.frameRateMode && s.frameRate_mHz == profile.frameRate_mHz && s.expTime_ns == profile.expTime_ns)) {
+        set_framerate_exposure(profile.frameRateMode, profile.frameRate_mHz, profile.expTime_ns);
+        changed = true;
+    }
+
+    //ROI of all zeros means full sensor
+    WORD roi[4] = {profile.roiX0, profile.roiY0, profile.roiX1, profile.roiY1};
+    if (roi[0] == 0 && roi[1] == 0 && roi[2] == 0 && roi[3] == 0) {
+        //Sensor size doesn't change when arming, so it stays valid after invalidate_armed
+        if (s.max_sizes_valid) {
+            s.avoided_calls++;
+        } else {
+            query_sizes(cam, s);
+        }
+        roi[0] = 1;
+        roi[1] = 1;
+        roi[2] = s.xres_max;
+        roi[3] = s.yres_max;
+    }
+    if (!(s.roi_valid && std::equal(roi, roi + 4, s.roi))) {
+        set_roi(roi[0], roi[1], roi[2], roi[3]);
+        changed = true;
+    }
+
+    if (profile.recorder_mode_sequence && !s.recorder_mode_sequence) {
+        set_recorder_mode_sequence();
+        changed = true;
+    }
+
+    //Segment sizes are calculated from the ROI of the profile instead of the armed resolution,
+    //so the camera doesn't have to be armed once in between to apply the ROI
+    DWORD images[4] = {profile.segment1, profile.segment2, profile.segment3, profile.segment4};
+    if (images[0] != 0 || images[1] != 0 || images[2] != 0 || images[3] != 0) {
+        bool sizes_were_valid = s.segment_sizes_valid;
+        DWORD previous_pages[4];
+        std::copy(s.segment_sizes_pages, s.segment_sizes_pages + 4, previous_pages);
+        set_segment_sizes_internal(roi[2] - roi[0] + 1, roi[3] - roi[1] + 1, images);
+        if (!sizes_were_valid || !std::equal(previous_pages, previous_pages + 4, s.segment_sizes_pages)) {
+            changed = true;
+        }
+    }
+
+    if (profile.active_segment != 0 && !(s.active_segment_valid && s.active_segment == profile.active_segment)) {
+        set_active_segment(profile.active_segment);
+        changed = true;
+    }
+
+    if (changed) {
+        arm_camera();
+    }
+    return changed;
+}
+
 void PCOCamera::print_transferparameters()
 {
     PCO_CameraType strCamType;
@@ -309,11 +590,18 @@ void PCOCamera::print_transferparameters()
 }
 
 void PCOCamera::start_recording() {
+    PCOSettingsCache& s = settings();
+    //Images in the active segment change until the recording is stopped
+    s.recording = true;
+    s.invalidate_segments();
     PCOCheck(PCO_SetRecordingState(cam, 1));
 }
 
 void PCOCamera::stop_recording() {
     PCOCheck(PCO_SetRecordingState(cam, 0));
+    PCOSettingsCache& s = settings();
+    s.recording = false;
+    s.invalidate_segments();
 }
 
 bool PCOCamera::is_recording() {
@@ -322,18 +610,61 @@ bool PCOCamera::is_recording() {
     if (state > 1) {
         throw std::runtime_error("Invalid state returned by camera");
     }
+    PCOSettingsCache& s = settings();
+    if (s.recording && state == 0) {
+        //Recording stopped by itself, drop image counts read while it was running
+        s.recording = false;
+        s.invalidate_segments();
+    }
     return state == 1;
 }
 
+//Reads valid and maximum image count of a segment. Cached unless the camera is recording.
+static void segment_counts(HANDLE cam, PCOSettingsCache& s, WORD segment, DWORD& ValidImageCnt, DWORD& MaxImageCnt) {
+    PCOSettingsCache::SegmentInfo* info = s.segment(segment);
+    if (info && info->counts_valid && !s.recording) {
+        s.avoided_calls++;
+        ValidImageCnt = info->valid_images;
+        MaxImageCnt = info->max_images;
+        return;
+    }
+    PCOCheck(PCO_GetNumberOfImagesInSegment(cam, segment, &ValidImageCnt, &MaxImageCnt));
+    if (info && !s.recording) {
+        info->valid_images = ValidImageCnt;
+        info->max_images = MaxImageCnt;
+        info->counts_valid = true;
+    }
+}
+
+//Reads the resolution of the images recorded in a segment
+static void segment_resolution(HANDLE cam, PCOSettingsCache& s, WORD segment, WORD& XResAct, WORD& YResAct) {
+    PCOSettingsCache::SegmentInfo* info = s.segment(segment);
+    if (info && info->image_settings_valid && !s.recording) {
+        s.avoided_calls++;
+        XResAct = info->xres;
+        YResAct = info->yres;
+        return;
+    }
+    WORD XBin, YBin;
+    WORD RoiX0, RoiY0, RoiX1, RoiY1;
+    PCOCheck(PCO_GetSegmentImageSettings(cam, segment, &XResAct, &YResAct,
+        &XBin, &YBin, &RoiX0, &RoiY0, &RoiX1, &RoiY1));
+    if (info && !s.recording) {
+        info->xres = XResAct;
+        info->yres = YResAct;
+        info->image_settings_valid = true;
+    }
+}
+
 int PCOCamera::get_num_images_in_segment(WORD segment) {
 	DWORD ValidImageCnt, MaxImageCnt;
-	PCOCheck(PCO_GetNumberOfImagesInSegment(cam, segment, &ValidImageCnt, &MaxImageCnt));
+	segment_counts(cam, settings(), segment, ValidImageCnt, MaxImageCnt);
 	return ValidImageCnt;
 }
 
 int PCOCamera::get_max_num_images_in_segment(WORD segment) {
 	DWORD ValidImageCnt, MaxImageCnt;
-	PCOCheck(PCO_GetNumberOfImagesInSegment(cam, segment, &ValidImageCnt, &MaxImageCnt));
+	segment_counts(cam, settings(), segment, ValidImageCnt, MaxImageCnt);
 	return MaxImageCnt;
 }
 
@@ -350,94 +681,498 @@ bool PCOCamera::wait_for_recording_done(int timeout_ms) {
 }
 
 
+unsigned int mip_images(unsigned int images_per_mip, unsigned int num_mips) {
+    if (images_per_mip != 0 && num_mips > std::numeric_limits<unsigned int>::max() / images_per_mip) {
+        return std::numeric_limits<unsigned int>::max();
+    }
+    return images_per_mip * num_mips;
+}
+
+static void print_mip_result(const MipSink& mip, unsigned int images_per_mip) {
+    std::cout << "Transferred " << mip.images_folded() << " images into " << mip.mips_written() << " MIPs" << std::endl;
+    unsigned int lost_images = mip.images_folded() - (mip.mips_written() * images_per_mip);
+    if (lost_images != 0) {
+        std::cout << "Lost " << lost_images << " images which did not fill a MIP" << std::endl;
+    }
+}
+
+void PCOCamera::set_tiff_compression(std::string compression, int level, unsigned int threads) {
+    tiff_options.compression = parse_tiff_compression(compression);
+    tiff_options.compression_level = level;
+    tiff_options.compression_threads = threads;
+}
+
+void PCOCamera::set_tiff_bits_per_sample(unsigned int bits) {
+    if (bits != 16 && bits != 12) {
+        throw std::runtime_error("Only 16 and 12 bits per sample are supported");
+    }
+    tiff_options.bits_per_sample = bits;
+}
+
+void PCOCamera::set_tiff_index(bool write_index, bool write_json) {
+    tiff_options.write_index = write_index;
+    tiff_options.write_index_json = write_json;
+}
+
+void PCOCamera::set_tiff_write_backend(std::string backend) {
+    tiff_options.write_backend = parse_tiff_write_backend(backend);
+}
+
+void PCOCamera::set_tiff_options(TiffWriterOptions options) {
+    tiff_options = options;
+}
+
+void PCOCamera::set_buffer_allocation(std::string allocation) {
+    set_buffer_allocation(parse_buffer_allocation(allocation));
+}
+
+void PCOCamera::set_buffer_allocation(BufferAllocation allocation) {
+    buffer_allocation = allocation;
+}
+
+void PCOCamera::set_transfer_buffers(unsigned int num_buffers) {
+    //The SDK allocates at most 16 buffers per camera
+    if (num_buffers < 1 || num_buffers > 16) {
+        throw std::runtime_error("Number of transfer buffers must be between 1 and 16");
+    }
+    transfer_buffers = num_buffers;
+}
+
+void PCOCamera::set_transfer_roi(WORD roiX0, WORD roiY0, WORD roiX1, WORD roiY1) {
+    frame_processing.roi_x0 = roiX0;
+    frame_processing.roi_y0 = roiY0;
+    frame_processing.roi_x1 = roiX1;
+    frame_processing.roi_y1 = roiY1;
+}
+
+void PCOCamera::set_transfer_binning(unsigned int bin, std::string mode) {
+    if (bin == 0) {
+        throw std::runtime_error("Binning has to be at least 1");
+    }
+    frame_processing.binning = parse_spatial_binning(mode);
+    frame_processing.bin = bin;
+}
+
+// First frame of the stack, which has to have the given size if width is not 0
+static std::vector<uint16_t> read_correction_frame(const std::string& path, unsigned int& width, unsigned int& height) {
+    StackReader reader(path);
+    if (reader.get_num_frames() == 0) {
+        throw std::runtime_error("No frame in " + path);
+    }
+    if (width != 0 && (reader.get_width(0) != width || reader.get_height(0) != height)) {
+        throw std::runtime_error("Size of " + path + " does not match the dark frame");
+    }
+    width = reader.get_width(0);
+    height = reader.get_height(0);
+    return reader.get_frame(0);
+}
+
+// Identifies the contents of a correction file, so what was loaded from it can be reused while it is unchanged
+static std::string correction_file_key(const std::string& path) {
+    StackFileInfo info = stack_file_info(path);
+    return path + "|" + std::to_string(info.size) + "|" + std::to_string(info.mtime);
+}
+
+void PCOCamera::set_flat_field(std::string dark_path, std::string flat_path) {
+    if (dark_path.empty()) {
+        frame_processing.flat_field.reset();
+        return;
+    }
+    std::string key = correction_file_key(dark_path) + "|" + (flat_path.empty() ? "" : correction_file_key(flat_path));
+    if (key != flat_field_key) {
+        auto flat_field = std::make_shared<FlatField>();
+        flat_field->dark = read_correction_frame(dark_path, flat_field->width, flat_field->height);
+        if (!flat_path.empty()) {
+            std::vector<uint16_t> flat = read_correction_frame(flat_path, flat_field->width, flat_field->height);
+            flat_field->gain = flat_field_gain(flat_field->dark.data(), flat.data(), flat.size());
+        }
+        loaded_flat_field = flat_field;
+        flat_field_key = key;
+    }
+    frame_processing.flat_field = loaded_flat_field;
+}
+
+void PCOCamera::set_hot_pixel_list(std::string path, std::string replacement) {
+    if (path.empty()) {
+        frame_processing.hot_pixels.reset();
+        return;
+    }
+    std::string key = "list|" + correction_file_key(path) + "|" + replacement;
+    if (key != hot_pixels_key) {
+        loaded_hot_pixels = make_hot_pixel_map(read_hot_pixels(path), parse_hot_pixel_replacement(replacement));
+        hot_pixels_key = key;
+    }
+    frame_processing.hot_pixels = loaded_hot_pixels;
+}
+
+unsigned int PCOCamera::set_hot_pixels_from_dark(std::string dark_path, double threshold_sigma, std::string replacement, std::string list_path) {
+    std::string key = "dark|" + correction_file_key(dark_path) + "|" + std::to_string(threshold_sigma) + "|" + replacement;
+    if (key != hot_pixels_key) {
+        unsigned int width = 0;
+        unsigned int height = 0;
+        std::vector<uint16_t> dark = read_correction_frame(dark_path, width, height);
+        loaded_hot_pixels = make_hot_pixel_map(detect_hot_pixels(dark.data(), width, height, threshold_sigma), parse_hot_pixel_replacement(replacement));
+        hot_pixels_key = key;
+        std::cout << "Found " << loaded_hot_pixels->pixels.size() << " hot pixels in " << dark_path << std::endl;
+    }
+    if (!list_path.empty()) {
+        write_hot_pixels(list_path, loaded_hot_pixels->pixels);
+    }
+    frame_processing.hot_pixels = loaded_hot_pixels;
+    return (unsigned int)loaded_hot_pixels->pixels.size();
+}
+
+void PCOCamera::set_frame_processing(FrameProcessing processing) {
+    frame_processing = processing;
+}
+
+void PCOCamera::set_mip_background(std::string background, unsigned int frames) {
+    if (frames == 0) {
+        throw std::runtime_error("Background frames have to be at least 1");
+    }
+    mip_background = parse_mip_background(background);
+    mip_background_frames = frames;
+}
+
+void PCOCamera::set_mip_pyramid(unsigned int levels, std::string reduction) {
+    mip_pyramid_reduction = parse_pyramid_reduction(reduction);
+    mip_pyramid_levels = levels;
+}
+
+void PCOCamera::set_orthogonal_projections(bool enable) {
+    orthogonal_projections = enable;
+}
+
+std::shared_ptr<MipSink> PCOCamera::make_mip_sink(const std::string& outpath, unsigned int images_per_mip) {
+    auto mip = std::make_shared<MipSink>(outpath, images_per_mip, tiff_options, output_format, buffer_allocation, mip_background, mip_background_frames);
+    mip->add_pyramid(mip_pyramid_levels, mip_pyramid_reduction);
+    if (orthogonal_projections) {
+        mip->add_orthogonal_projections();
+    }
+    return mip;
+}
+
+void PCOCamera::set_output_format(std::string format) {
+    set_output_format(parse_output_format(format));
+}
+
+void PCOCamera::set_output_format(OutputFormat format) {
+    output_format = format;
+}
+
 unsigned int PCOCamera::transfer_to_tiff(unsigned int skip_images, unsigned int max_images, std::string outpath) {
-	TiffWriter tif(outpath);
-    unsigned int transferred_images = 0;
-    transfer_internal(skip_images, max_images, [&tif, outpath, &transferred_images](unsigned int transfer_image_index, const PCOBuffer& buffer) {
-        tif.write_frame(buffer.xres, buffer.yres, buffer.addr);
-        transferred_images += 1;
-    });
+    auto tif = std::make_shared<TiffSink>(outpath, tiff_options, output_format);
+    unsigned int transferred_images = transfer_to_sinks(skip_images, max_images, {tif});
     std::cout << "Transferred " << transferred_images << " images" << std::endl;
     return transferred_images;
 }
 
 unsigned int PCOCamera::transfer_mip_to_tiff(unsigned int skip_images, unsigned int images_per_mip, unsigned int num_mips, std::string outpath) {
-	TiffWriter tif(outpath);
-
-    std::unique_ptr<uint16_t[]> MIP_buffer;
-    unsigned int images_to_transfer = images_per_mip * num_mips;
-    if (num_mips == std::numeric_limits<unsigned int>::max()) {
-        images_to_transfer = std::numeric_limits<unsigned int>::max();
-    }
-    unsigned int transferred_images = 0;
-    unsigned int transferred_mips = 0;
-    transfer_internal(skip_images, images_per_mip * num_mips, [&tif, outpath, &MIP_buffer, images_per_mip, &transferred_images, &transferred_mips](unsigned int transfer_image_index, const PCOBuffer& buffer) {
-        int numPix = buffer.xres * buffer.yres;
-        if (transfer_image_index == 0) {
-            // Allocate buffer after we receive first image because then we know the image size
-            MIP_buffer = std::unique_ptr<uint16_t[]>(new uint16_t[numPix]);
-            memset(MIP_buffer.get(), 0, numPix * sizeof(uint16_t));
+    auto mip = make_mip_sink(outpath, images_per_mip);
+    transfer_to_sinks(skip_images, mip_images(images_per_mip, num_mips), {mip});
+    print_mip_result(*mip, images_per_mip);
+    return mip->mips_written();
+}
+
+unsigned int PCOCamera::transfer_bin_to_tiff(unsigned int skip_images, unsigned int images_per_bin, unsigned int num_bins, std::string outpath, std::string output) {
+    auto bin = std::make_shared<BinSink>(outpath, images_per_bin, parse_bin_output(output), tiff_options, output_format, buffer_allocation);
+    transfer_to_sinks(skip_images, mip_images(images_per_bin, num_bins), {bin});
+    std::cout << "Transferred " << bin->images_binned() << " images into " << bin->bins_written() << " bins" << std::endl;
+    unsigned int lost_images = bin->images_binned() - (bin->bins_written() * images_per_bin);
+    if (lost_images != 0) {
+        std::cout << "Lost " << lost_images << " images which did not fill a bin" << std::endl;
+    }
+    return bin->bins_written();
+}
+
+unsigned int PCOCamera::transfer_to_tiff_and_mip(unsigned int skip_images, unsigned int max_images, std::string outpath, unsigned int images_per_mip, std::string mip_outpath) {
+    std::vector<std::shared_ptr<FrameSink>> sinks;
+    std::shared_ptr<MipSink> mip;
+    if (!outpath.empty()) {
+        sinks.push_back(std::make_shared<TiffSink>(outpath, tiff_options, output_format));
+    }
+    if (!mip_outpath.empty()) {
+        mip = make_mip_sink(mip_outpath, images_per_mip);
+        sinks.push_back(mip);
+    }
+    unsigned int transferred_images = transfer_to_sinks(skip_images, max_images, sinks);
+    std::cout << "Transferred " << transferred_images << " images" << std::endl;
+    if (mip) {
+        print_mip_result(*mip, images_per_mip);
+    }
+    return transferred_images;
+}
+
+unsigned int PCOCamera::transfer_events_to_tiff(unsigned int skip_images, unsigned int max_images, std::string outpath) {
+    if (!(event_trigger.threshold > 0)) {
+        throw std::runtime_error("Set the event threshold with set_event_trigger first");
+    }
+    auto events = std::make_shared<EventSink>(outpath, event_trigger, tiff_options, output_format);
+    unsigned int transferred_images = transfer_to_sinks(skip_images, max_images, {events});
+    std::cout << "Transferred " << transferred_images << " images, kept " << events->frames_written() << " images of "
+        << events->events().size() << " events" << std::endl;
+    return (unsigned int)events->events().size();
+}
+
+//Appends the segment number to the filename, e.g. file.tiff -> file_seg2.tiff
+//Striped outputs get it appended to every path
+static std::string segment_filename(const std::string& outpath, WORD segment) {
+    std::string suffix = "_seg" + std::to_string(segment);
+    std::vector<std::string> paths = split_output_paths(outpath);
+    for (std::string& filename : paths) {
+        std::size_t found = filename.find_last_of(".");
+        if (found == std::string::npos) {
+            filename += suffix;
+        } else {
+            filename = filename.substr(0, found) + suffix + filename.substr(found);
         }
+    }
+    return join_output_paths(paths);
+}
 
-        // fold image into MIP
-        for (int pix = 0; pix < numPix; ++pix) {
-            uint16_t val = buffer.addr[pix];
-            uint16_t* mip_val = MIP_buffer.get() + pix;
-            if (val > * mip_val)
-            {
-                *mip_val = val;
+//Output filename for each range
+static std::vector<std::string> segment_filenames(const std::vector<SegmentRange>& ranges, const std::string& outpath) {
+    std::vector<std::string> filenames;
+    for (size_t i = 0; i < ranges.size(); ++i) {
+        for (size_t j = 0; j < i; ++j) {
+            if (ranges[i].segment == ranges[j].segment) {
+                throw std::runtime_error("Each segment can only be transferred once per call");
             }
         }
+        filenames.push_back(ranges.size() == 1 ? outpath : segment_filename(outpath, ranges[i].segment));
+    }
+    return filenames;
+}
 
-        if (transfer_image_index % images_per_mip == images_per_mip - 1) {
-            //Save image
-            tif.write_frame(buffer.xres, buffer.yres, MIP_buffer.get());
-            transferred_mips += 1;
+unsigned int PCOCamera::transfer_segments_to_tiff(std::vector<SegmentRange> ranges, std::string outpath) {
+    std::vector<std::shared_ptr<TiffSink>> tifs;
+    for (const std::string& filename : segment_filenames(ranges, outpath)) {
+        tifs.push_back(std::make_shared<TiffSink>(filename, tiff_options, output_format));
+    }
+    auto range_sink = std::make_shared<RangeSink>(std::vector<std::shared_ptr<FrameSink>>(tifs.begin(), tifs.end()));
+    unsigned int total = transfer_segments_to_sinks(ranges, {range_sink});
+    for (size_t i = 0; i < ranges.size(); ++i) {
+        std::cout << "Transferred " << tifs[i]->frames_written() << " images from segment " << ranges[i].segment << std::endl;
+    }
+    return total;
+}
 
-            //Reset MIP
-            memset(MIP_buffer.get(), 0, numPix * sizeof(uint16_t));
-        }
-        transferred_images += 1;
+unsigned int PCOCamera::transfer_segments_mip_to_tiff(std::vector<SegmentRange> ranges, unsigned int images_per_mip, std::string outpath) {
+    std::vector<std::shared_ptr<MipSink>> mips;
+    for (const std::string& filename : segment_filenames(ranges, outpath)) {
+        mips.push_back(make_mip_sink(filename, images_per_mip));
+    }
+    auto range_sink = std::make_shared<RangeSink>(std::vector<std::shared_ptr<FrameSink>>(mips.begin(), mips.end()));
+    transfer_segments_to_sinks(ranges, {range_sink});
+    unsigned int total = 0;
+    for (size_t i = 0; i < ranges.size(); ++i) {
+        std::cout << "Segment " << ranges[i].segment << ": ";
+        print_mip_result(*mips[i], images_per_mip);
+        total += mips[i]->mips_written();
+    }
+    return total;
+}
+
+unsigned int PCOCamera::transfer_to_sinks(unsigned int skip_images, unsigned int max_images, std::vector<std::shared_ptr<FrameSink>> sinks) {
+    SegmentRange range;
+    range.segment = get_active_segment();
+    range.skip_images = skip_images;
+    range.max_images = max_images;
+    return transfer_segments_to_sinks({range}, sinks);
+}
+
+unsigned int PCOCamera::transfer_segments_to_sinks(const std::vector<SegmentRange>& ranges, std::vector<std::shared_ptr<FrameSink>> sinks) {
+    statistics.reset();
+    if (statistics_enabled) {
+        statistics = std::make_shared<StatisticsSink>(statistics_path, parse_statistics_format(statistics_format));
+        sinks.push_back(statistics);
+    }
+    if (!preview_path.empty()) {
+        // Previews are always compressed, they are mostly used over the network
+        TiffWriterOptions options;
+        options.compression = TiffCompression::deflate;
+        options.compression_threads = 1;
+        options.write_index = false;
+        sinks.push_back(std::make_shared<PreviewSink>(preview_path, preview_downsample, preview_images, options));
+    }
+    FramePipeline pipeline(sinks, 8, buffer_allocation, frame_processing);
+    transfer_segments_internal(ranges, [&pipeline](size_t range_index, unsigned int transfer_image_index, const PCOBuffer& buffer) {
+        pipeline.push((unsigned int)range_index, transfer_image_index, buffer.xres, buffer.yres, buffer.addr);
     });
+    pipeline.finish();
+    if (statistics && (statistics->duplicate_frames() != 0 || statistics->blank_frames() != 0)) {
+        std::cout << "Warning: " << statistics->duplicate_frames() << " images repeated the previous image, "
+            << statistics->blank_frames() << " images were blank" << std::endl;
+    }
+    return pipeline.frames_pushed();
+}
 
-    std::cout << "Transferred " << transferred_images << " images into " << transferred_mips << " MIPs" << std::endl;
-    unsigned int lost_images = transferred_images - (transferred_mips * images_per_mip);
-    if (lost_images != 0) {
-        std::cout << "Lost " << lost_images << " images which did not fill a MIP" << std::endl;
+void PCOCamera::set_frame_statistics(bool enable, std::string path, std::string format) {
+    // Parsed here so an invalid format is reported before transferring
+    parse_statistics_format(format);
+    statistics_enabled = enable;
+    statistics_path = path;
+    statistics_format = format;
+}
+
+void PCOCamera::set_preview(std::string path, unsigned int downsample, unsigned int images_per_preview) {
+    if (downsample == 0 || images_per_preview == 0) {
+        throw std::runtime_error("downsample and images_per_preview have to be at least 1");
     }
-    return transferred_mips;
+    preview_path = path;
+    preview_downsample = downsample;
+    preview_images = images_per_preview;
 }
 
-void PCOCamera::transfer_internal(unsigned int skip_images, unsigned int max_images, std::function<void(unsigned int, const PCOBuffer &)> image_callback) {
-	WORD Segment = get_active_segment();
+void PCOCamera::set_event_trigger(std::string metric, double threshold, WORD pixel_threshold, unsigned int pre_trigger_images, unsigned int post_trigger_images) {
+    if (!(threshold > 0)) {
+        throw std::runtime_error("Event threshold has to be above 0");
+    }
+    event_trigger.metric = parse_event_metric(metric);
+    event_trigger.threshold = threshold;
+    event_trigger.pixel_threshold = pixel_threshold;
+    event_trigger.pre_trigger = pre_trigger_images;
+    event_trigger.post_trigger = post_trigger_images;
+}
 
-    DWORD ValidImageCnt, MaxImageCnt;
-    PCOCheck(PCO_GetNumberOfImagesInSegment(cam, Segment, &ValidImageCnt, &MaxImageCnt));
+void PCOCamera::set_event_roi(WORD roiX0, WORD roiY0, WORD roiX1, WORD roiY1) {
+    event_trigger.roi_x0 = roiX0;
+    event_trigger.roi_y0 = roiY0;
+    event_trigger.roi_x1 = roiX1;
+    event_trigger.roi_y1 = roiY1;
+}
+
+void PCOCamera::set_event_trigger(EventTrigger trigger) {
+    event_trigger = trigger;
+}
+
+std::vector<FrameStatistics> PCOCamera::get_frame_statistics() {
+    return statistics ? statistics->frame_statistics() : std::vector<FrameStatistics>();
+}
+
+unsigned int PCOCamera::get_duplicate_frames() {
+    return statistics ? statistics->duplicate_frames() : 0;
+}
 
-    if (skip_images >= ValidImageCnt) {
+unsigned int PCOCamera::get_blank_frames() {
+    return statistics ? statistics->blank_frames() : 0;
+}
+
+void PCOCamera::transfer_internal(unsigned int skip_images, unsigned int max_images, std::function<void(unsigned int, const PCOBuffer &)> image_callback) {
+    SegmentRange range;
+    range.segment = get_active_segment();
+    range.skip_images = skip_images;
+    range.max_images = max_images;
+    transfer_segments_internal({range}, [&image_callback](size_t, unsigned int transfer_image_index, const PCOBuffer& buffer) {
+        image_callback(transfer_image_index, buffer);
+    });
+}
+
+//Sets the resolution of images read from camera ram
+static void set_read_parameters(HANDLE cam, PCOSettingsCache& s, WORD XResAct, WORD YResAct) {
+    if (s.image_parameters_valid && s.image_parameters_xres == XResAct && s.image_parameters_yres == YResAct) {
+        s.avoided_calls++;
         return;
     }
+    s.image_parameters_valid = false;
+    PCOCheck(PCO_SetImageParameters(cam, XResAct, YResAct, IMAGEPARAMETERS_READ_FROM_SEGMENTS, NULL, 0));
+    s.image_parameters_xres = XResAct;
+    s.image_parameters_yres = YResAct;
+    s.image_parameters_valid = true;
+}
 
-    //Get image size and settings from camera
-    WORD XResAct, YResAct, XBin, YBin;
-    WORD RoiX0, RoiY0, RoiX1, RoiY1;
-    PCOCheck(PCO_GetSegmentImageSettings(cam, Segment, &XResAct, &YResAct,
-        &XBin, &YBin, &RoiX0, &RoiY0, &RoiX1, &RoiY1));
+void PCOCamera::transfer_segments_internal(const std::vector<SegmentRange>& ranges, std::function<void(size_t, unsigned int, const PCOBuffer&)> image_callback) {
+    PCOSettingsCache& s = settings();
+
+    //What is actually transferred from each range
+    struct RangeTransfer {
+        WORD segment;
+        unsigned int first_camera_image;
+        unsigned int num_images;
+        WORD xres;
+        WORD yres;
+    };
+    std::vector<RangeTransfer> transfers;
+    unsigned int num_images_to_transfer = 0;
+    for (const SegmentRange& range : ranges) {
+        RangeTransfer t = {range.segment, range.skip_images + 1, 0, 0, 0};
+        DWORD ValidImageCnt, MaxImageCnt;
+        segment_counts(cam, s, range.segment, ValidImageCnt, MaxImageCnt);
+        if (range.skip_images < ValidImageCnt) {
+            t.num_images = std::min(((unsigned int)ValidImageCnt) - range.skip_images, range.max_images);
+            //Get image size from camera
+            segment_resolution(cam, s, range.segment, t.xres, t.yres);
+        }
+        DEBUGPRINT printf("Grab %d recorded images from segment %d\n", t.num_images, t.segment);
+        transfers.push_back(t);
+        num_images_to_transfer += t.num_images;
+    }
 
-    //TODO check if this works correctly, i.e. allocates two buffers
-    //Number of buffers that will be used for transfering images in parallel
-    //It seems there is no advantage to using more than 2
-    constexpr int NUMBUF = 2;
-    std::array<PCOBuffer, NUMBUF> pco_buffers = { PCOBuffer(cam, XResAct, YResAct), PCOBuffer(cam, XResAct, YResAct) };
+    if (num_images_to_transfer == 0) {
+        return;
+    }
 
-    //Read from camera ram
-    PCOCheck(PCO_SetImageParameters(cam, XResAct, YResAct, IMAGEPARAMETERS_READ_FROM_SEGMENTS, NULL, 0));
+    //Position in the list of ranges, skipping empty ranges
+    struct Cursor {
+        size_t range = 0;
+        unsigned int index = 0;
+        void skip_empty(const std::vector<RangeTransfer>& transfers) {
+            while (range < transfers.size() && index >= transfers[range].num_images) {
+                range++;
+                index = 0;
+            }
+        }
+        void advance(const std::vector<RangeTransfer>& transfers) {
+            index++;
+            skip_empty(transfers);
+        }
+    };
 
-    DEBUGPRINT printf("Grab recorded images from camera actual valid %d\n", ValidImageCnt);
+    //Number of buffers that will be used for transfering images in parallel
+    //It seems there is no advantage to using more than 2, see set_transfer_buffers
+    const unsigned int NUMBUF = transfer_buffers;
+    std::vector<PCOBuffer>* pco_buffers = nullptr;
+    WORD current_segment = 0;
 
-    //Use two buffers. Start two transfers in the beginning.
+    //Transfer with index i always uses buffer i % NUMBUF.
     //Wait for the first one to finish, process the data, then start it again for the next image and switch the buffers.
     //This way always at least one buffer is transferring.
+    //Images are read from the active segment, so the active segment can only be switched when no transfer is running.
+    //In that case the first transfers of the next segment are started before the last image of the previous segment
+    //is processed, so processing the tail of one segment overlaps with transferring the head of the next.
+    unsigned int started = 0; // transfers started
+    unsigned int waited = 0; // transfers finished
+    unsigned int processed = 0; // images passed to the callback
+    Cursor start_cursor;
+    Cursor process_cursor;
+    start_cursor.skip_empty(transfers);
+    process_cursor.skip_empty(transfers);
+
+    auto start_transfers = [&]() {
+        while (started < num_images_to_transfer && started - processed < NUMBUF) {
+            const RangeTransfer& t = transfers[start_cursor.range];
+            if (t.segment != current_segment) {
+                if (started != waited) {
+                    break;
+                }
+                if (pco_buffers == nullptr || (*pco_buffers)[0].xres != t.xres || (*pco_buffers)[0].yres != t.yres) {
+                    //Can only reallocate if no buffer is being processed
+                    if (started != processed) {
+                        break;
+                    }
+                    pco_buffers = &warm_buffers(cam, buffer_pool, t.xres, t.yres, NUMBUF);
+                }
+                set_active_segment(t.segment);
+                //Read from camera ram
+                set_read_parameters(cam, s, t.xres, t.yres);
+                current_segment = t.segment;
+            }
+            DEBUGPRINT printf("start transfer %d @ buf %d\n", started, started % NUMBUF);
+            (*pco_buffers)[started % NUMBUF].start_transfer(t.first_camera_image + start_cursor.index);
+            started++;
+            start_cursor.advance(transfers);
+        }
+    };
 
     LARGE_INTEGER frequency;
     LARGE_INTEGER start;
@@ -445,45 +1180,40 @@ void PCOCamera::transfer_internal(unsigned int skip_images, unsigned int max_ima
     QueryPerformanceFrequency(&frequency);
     QueryPerformanceCounter(&start);
 
-    unsigned int num_images_to_transfer = std::min(((unsigned int)ValidImageCnt) - skip_images, max_images);
-
     // Cancel all image transfers when exiting from this function so that nothing is
     // transferred into freed buffers
     defer _1(nullptr, [this](...) {
         PCO_CancelImages(cam);
     });
 
-    // Start two image transfers
-    for (int transfer_image_index = 0; transfer_image_index < num_images_to_transfer && transfer_image_index < NUMBUF; ++transfer_image_index) {
-        DEBUGPRINT printf("Start transfer %d @ buf %d\n", transfer_image_index, transfer_image_index);
-        int camera_image_index = transfer_image_index + skip_images + 1;
-        pco_buffers[transfer_image_index].start_transfer(camera_image_index);
-    }
+    start_transfers();
 
     // Wait for transfers in order, when a transfer is finished use the buffer to start the next one
-    int currentBufferIdx = 0;
-    for (int transfer_image_index = 0; transfer_image_index < num_images_to_transfer; ++transfer_image_index) {
-        int camera_image_index = transfer_image_index + skip_images + 1;
+    while (processed < num_images_to_transfer) {
+        PCOBuffer& buffer = (*pco_buffers)[waited % NUMBUF];
 
         // wait for image transfer
-        DEBUGPRINT printf("wait for transfer %d @ buf %d\n", transfer_image_index, currentBufferIdx);
-        pco_buffers[currentBufferIdx].wait_for_buffer();
+        DEBUGPRINT printf("wait for transfer %d @ buf %d\n", waited, waited % NUMBUF);
+        buffer.wait_for_buffer();
+        waited++;
 
-        image_callback(transfer_image_index, pco_buffers[currentBufferIdx]);
-        DEBUGPRINT printf("processed image %d\n", transfer_image_index);
+        // start transfers which had to wait for the previous segment to finish
+        start_transfers();
 
-        // start next image transfer
-        if (transfer_image_index + NUMBUF < num_images_to_transfer) {
-            DEBUGPRINT printf("start transfer %d @ buf %d\n", transfer_image_index + NUMBUF, currentBufferIdx);
-            pco_buffers[currentBufferIdx].start_transfer(camera_image_index + NUMBUF);
-        }
+        image_callback(process_cursor.range, process_cursor.index, buffer);
+        DEBUGPRINT printf("processed image %d\n", processed);
+        processed++;
+        process_cursor.advance(transfers);
 
-        currentBufferIdx = (currentBufferIdx + 1) % NUMBUF; // Switch buffer
+        // start next image transfer
+        start_transfers();
     }
 
     QueryPerformanceCounter(&end);
     double interval = (double)(end.QuadPart - start.QuadPart) / frequency.QuadPart;
     DEBUGPRINT printf("Transferred %d images in %f seconds\n", num_images_to_transfer, interval);
+    WORD XResAct = (*pco_buffers)[0].xres;
+    WORD YResAct = (*pco_buffers)[0].yres;
     double mb_per_image = double(XResAct) * double(YResAct) * 3 / 2 / 1e6;
     DEBUGPRINT printf("Image size: %d x %d - %f MB\n", XResAct, YResAct, mb_per_image);
     double mb_per_sec = mb_per_image * num_images_to_transfer / interval;
@@ -491,5 +1221,7 @@ void PCOCamera::transfer_internal(unsigned int skip_images, unsigned int max_ima
 }
 
 void PCOCamera::close() {
+    // Buffers have to be freed while the camera is still open
+    buffer_pool.reset();
     PCOCheck(PCO_CloseCamera(cam));
 }
@@ -0,0 +1,175 @@
+#include "pixel_buffer.hpp"
+
+#include <atomic>
+#include <cstdlib>
+#include <iostream>
+#include <stdexcept>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
+BufferAllocation parse_buffer_allocation(const std::string& name) {
+    if (name == "standard") {
+        return BufferAllocation::standard;
+    } else if (name == "huge_pages") {
+        return BufferAllocation::huge_pages;
+    }
+    throw std::runtime_error("Unknown buffer allocation: " + name);
+}
+
+static size_t round_up(size_t size, size_t multiple) {
+    return (size + multiple - 1) / multiple * multiple;
+}
+
+static std::atomic<uint64_t> fallbacks(0);
+
+// Counts a huge page allocation that got normal pages, warns once
+static void huge_pages_fell_back(const char* reason) {
+    if (fallbacks++ == 0) {
+        std::cerr << "Huge pages not available, using normal pages: " << reason << std::endl;
+    }
+}
+
+uint64_t huge_page_fallbacks() {
+    return fallbacks;
+}
+
+#ifdef _WIN32
+
+// Node of the processor the calling thread runs on
+static DWORD current_numa_node() {
+    PROCESSOR_NUMBER processor;
+    GetCurrentProcessorNumberEx(&processor);
+    USHORT node = 0;
+    if (!GetNumaProcessorNodeEx(&processor, &node)) {
+        return NUMA_NO_PREFERRED_NODE;
+    }
+    return node;
+}
+
+// Large pages need SeLockMemoryPrivilege. The policy assigns it to the user, but it is disabled in the process token.
+static bool enable_lock_memory_privilege() {
+    HANDLE token;
+    if (!OpenProcessToken(GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY, &token)) {
+        return false;
+    }
+    TOKEN_PRIVILEGES privileges;
+    privileges.PrivilegeCount = 1;
+    privileges.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+    // AdjustTokenPrivileges also succeeds if the user does not hold the privilege, only GetLastError tells
+    bool enabled = LookupPrivilegeValueA(NULL, "SeLockMemoryPrivilege", &privileges.Privileges[0].Luid)
+        && AdjustTokenPrivileges(token, FALSE, &privileges, 0, NULL, NULL)
+        && GetLastError() == ERROR_SUCCESS;
+    CloseHandle(token);
+    return enabled;
+}
+
+static void* allocate_pages(size_t size) {
+    DWORD node = current_numa_node();
+    SIZE_T large_page = GetLargePageMinimum();
+    if (large_page != 0 && size >= large_page) {
+        // Enabled once, on the first allocation large enough for large pages
+        static const bool privilege = enable_lock_memory_privilege();
+        if (!privilege) {
+            huge_pages_fell_back("the process does not have the \"Lock pages in memory\" privilege");
+        } else {
+            void* p = VirtualAllocExNuma(GetCurrentProcess(), NULL, round_up(size, large_page), MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE, node);
+            if (p != NULL) {
+                return p;
+            }
+            // Large pages must be physically contiguous, which fails once memory is fragmented
+            huge_pages_fell_back("not enough contiguous physical memory");
+        }
+    }
+    return VirtualAllocExNuma(GetCurrentProcess(), NULL, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE, node);
+}
+
+static void free_pages(void* p, size_t size) {
+    VirtualFree(p, 0, MEM_RELEASE);
+}
+
+#else
+
+static const size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+
+// Sizes of at least one huge page are mapped in whole huge pages, so free_pages can compute the mapped size
+static size_t mapped_size(size_t size) {
+    return size >= HUGE_PAGE_SIZE ? round_up(size, HUGE_PAGE_SIZE) : size;
+}
+
+static void* allocate_pages(size_t size) {
+    size_t length = mapped_size(size);
+    if (size < HUGE_PAGE_SIZE) {
+        void* p = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        return p == MAP_FAILED ? nullptr : p;
+    }
+#ifdef MAP_HUGETLB
+    // Reserved huge pages, usually none are configured
+    void* p = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (p != MAP_FAILED) {
+        return p;
+    }
+#endif
+    // Transparent huge pages need a 2 MiB aligned mapping, map more and trim both ends
+    void* mapped = mmap(nullptr, length + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mapped == MAP_FAILED) {
+        return nullptr;
+    }
+    uintptr_t start = reinterpret_cast<uintptr_t>(mapped);
+    uintptr_t aligned = round_up(start, HUGE_PAGE_SIZE);
+    if (aligned > start) {
+        munmap(mapped, aligned - start);
+    }
+    if (aligned + length < start + length + HUGE_PAGE_SIZE) {
+        munmap(reinterpret_cast<void*>(aligned + length), start + HUGE_PAGE_SIZE - aligned);
+    }
+#ifdef MADV_HUGEPAGE
+    if (madvise(reinterpret_cast<void*>(aligned), length, MADV_HUGEPAGE) != 0) {
+        huge_pages_fell_back("the kernel does not support transparent huge pages");
+    }
+#else
+    huge_pages_fell_back("transparent huge pages are not supported");
+#endif
+    // Linux places pages on the node of the thread first writing them, which is the allocating thread for all users
+    return reinterpret_cast<void*>(aligned);
+}
+
+static void free_pages(void* p, size_t size) {
+    munmap(p, mapped_size(size));
+}
+
+#endif
+
+void* allocate_buffer(size_t size, BufferAllocation allocation) {
+    if (size == 0) {
+        size = 1;
+    }
+    void* p = nullptr;
+    if (allocation == BufferAllocation::huge_pages) {
+        // Page aligned, so also aligned to cache lines
+        p = allocate_pages(size);
+    } else {
+        p = malloc(size);
+    }
+    if (p == nullptr) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void free_buffer(void* buffer, size_t size, BufferAllocation allocation) {
+    if (buffer == nullptr) {
+        return;
+    }
+    if (size == 0) {
+        size = 1;
+    }
+    if (allocation == BufferAllocation::huge_pages) {
+        free_pages(buffer, size);
+    } else {
+        free(buffer);
+    }
+}
@@ -0,0 +1,256 @@
+#include "stack_index.hpp"
+
+#include <cstdio>
+#include <fstream>
+#include <limits>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "tiff_writer.hpp"
+
+/**
+* Binary sidecar format, native (little endian) byte order:
+* header, StackFileInfo for every file, StackFrameInfo for every frame.
+*/
+static const uint32_t STACK_INDEX_MAGIC = 0x58494350; // "PCIX"
+static const uint16_t STACK_INDEX_VERSION = 1;
+
+#pragma pack(push, 1)
+struct StackIndexHeader {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t frame_info_size;
+    uint32_t num_files;
+    uint32_t num_frames;
+};
+#pragma pack(pop)
+
+static bool file_exists(const std::string& filename) {
+    FILE* f = fopen(filename.c_str(), "rb");
+    if (f == nullptr) {
+        return false;
+    }
+    fclose(f);
+    return true;
+}
+
+std::vector<std::string> stack_files(const std::string& path) {
+    std::vector<std::string> files;
+    if (!file_exists(path)) {
+        return files;
+    }
+    files.push_back(path);
+    for (unsigned int number = 1; file_exists(number_filename(path, number)); ++number) {
+        files.push_back(number_filename(path, number));
+    }
+    return files;
+}
+
+std::vector<std::string> stack_files(const std::string& path, size_t num_files) {
+    std::vector<std::string> files;
+    for (size_t number = 0; number < num_files; ++number) {
+        std::string filename = number == 0 ? path : number_filename(path, (unsigned int)number);
+        if (!file_exists(filename)) {
+            return std::vector<std::string>();
+        }
+        files.push_back(filename);
+    }
+    return files;
+}
+
+void remove_split_files(const std::string& path, unsigned int first_number) {
+    for (unsigned int number = first_number; file_exists(number_filename(path, number)); ++number) {
+        if (remove(number_filename(path, number).c_str()) != 0) {
+            throw std::runtime_error("Could not delete old " + number_filename(path, number));
+        }
+    }
+}
+
+StackFileInfo stack_file_info(const std::string& filename) {
+    StackFileInfo info;
+#ifdef _WIN32
+    struct _stat64 st;
+    int err = _stat64(filename.c_str(), &st);
+#else
+    struct stat st;
+    int err = stat(filename.c_str(), &st);
+#endif
+    if (err != 0) {
+        throw std::runtime_error("Could not access " + filename);
+    }
+    info.size = (uint64_t)st.st_size;
+    info.mtime = (int64_t)st.st_mtime;
+    return info;
+}
+
+std::string stack_index_filename(const std::string& path) {
+    return path + ".idx";
+}
+
+bool read_stack_index(const std::string& filename, StackIndex& index) {
+    std::unique_ptr<FILE, int(*)(FILE*)> f(fopen(filename.c_str(), "rb"), fclose);
+    if (!f) {
+        return false;
+    }
+    StackIndexHeader header;
+    if (fread(&header, sizeof(header), 1, f.get()) != 1
+        || header.magic != STACK_INDEX_MAGIC
+        || header.version != STACK_INDEX_VERSION
+        || header.frame_info_size != sizeof(StackFrameInfo)) {
+        return false;
+    }
+    // Check the counts against the size before allocating, a corrupt index must not cause huge allocations
+    uint64_t expected_size = sizeof(header) + (uint64_t)header.num_files * sizeof(StackFileInfo) + (uint64_t)header.num_frames * sizeof(StackFrameInfo);
+    if (stack_file_info(filename).size != expected_size) {
+        return false;
+    }
+    index.files.resize(header.num_files);
+    index.frames.resize(header.num_frames);
+    if (fread(index.files.data(), sizeof(StackFileInfo), index.files.size(), f.get()) != index.files.size()
+        || fread(index.frames.data(), sizeof(StackFrameInfo), index.frames.size(), f.get()) != index.frames.size()) {
+        return false;
+    }
+    return true;
+}
+
+void write_stack_index(const std::string& filename, const StackIndex& index) {
+    std::unique_ptr<FILE, int(*)(FILE*)> f(fopen(filename.c_str(), "wb"), fclose);
+    if (!f) {
+        throw std::runtime_error("Could not open " + filename + " for writing");
+    }
+    StackIndexHeader header;
+    header.magic = STACK_INDEX_MAGIC;
+    header.version = STACK_INDEX_VERSION;
+    header.frame_info_size = sizeof(StackFrameInfo);
+    header.num_files = (uint32_t)index.files.size();
+    header.num_frames = (uint32_t)index.frames.size();
+    if (fwrite(&header, sizeof(header), 1, f.get()) != 1
+        || fwrite(index.files.data(), sizeof(StackFileInfo), index.files.size(), f.get()) != index.files.size()
+        || fwrite(index.frames.data(), sizeof(StackFrameInfo), index.frames.size(), f.get()) != index.frames.size()) {
+        throw std::runtime_error("Writing " + filename + " failed");
+    }
+    if (fclose(f.release()) != 0) {
+        throw std::runtime_error("Writing " + filename + " failed");
+    }
+}
+
+std::string stack_summary_filename(const std::string& path) {
+    return path + ".json";
+}
+
+// File name without directory, escaped for a JSON string
+static std::string json_filename(const std::string& filename) {
+    std::size_t found = filename.find_last_of("/\\");
+    std::string name = found == std::string::npos ? filename : filename.substr(found + 1);
+    std::string escaped;
+    for (char c : name) {
+        if (c == '"' || c == '\\') {
+            escaped += '\\';
+        }
+        escaped += c;
+    }
+    return escaped;
+}
+
+void write_stack_summary(const std::string& path, const StackIndex& index) {
+    std::ostringstream json;
+    json << "{\n"
+        << "    \"frames\": " << index.frames.size() << ",\n";
+    if (!index.frames.empty()) {
+        const StackFrameInfo& first = index.frames[0];
+        json << "    \"width\": " << first.width << ",\n"
+            << "    \"height\": " << first.height << ",\n"
+            << "    \"bits_per_sample\": " << first.bits_per_sample << ",\n"
+            << "    \"compression\": " << first.compression << ",\n";
+    }
+    json << "    \"index\": \"" << json_filename(stack_index_filename(path)) << "\",\n"
+        << "    \"files\": [\n";
+    size_t frame = 0;
+    for (size_t i = 0; i < index.files.size(); ++i) {
+        size_t first_frame = frame;
+        while (frame < index.frames.size() && index.frames[frame].file == i) {
+            frame++;
+        }
+        std::string name = i == 0 ? path : number_filename(path, (unsigned int)i);
+        json << "        {\"name\": \"" << json_filename(name) << "\", \"size\": " << index.files[i].size
+            << ", \"first_frame\": " << first_frame << ", \"frames\": " << frame - first_frame << "}"
+            << (i + 1 < index.files.size() ? ",\n" : "\n");
+    }
+    json << "    ]\n"
+        << "}\n";
+
+    std::string summary_filename = stack_summary_filename(path);
+    std::string content = json.str();
+    std::unique_ptr<FILE, int(*)(FILE*)> f(fopen(summary_filename.c_str(), "wb"), fclose);
+    if (!f || fwrite(content.data(), 1, content.size(), f.get()) != content.size()) {
+        throw std::runtime_error("Writing " + summary_filename + " failed");
+    }
+}
+
+static const char* STRIPE_MANIFEST_SUFFIX = ".stripes";
+static const unsigned int STRIPE_MANIFEST_VERSION = 1;
+
+std::string stripe_manifest_filename(const std::string& path) {
+    return path + STRIPE_MANIFEST_SUFFIX;
+}
+
+bool is_stripe_manifest(const std::string& path) {
+    std::string suffix(STRIPE_MANIFEST_SUFFIX);
+    return path.size() > suffix.size() && path.compare(path.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+bool read_stripe_manifest(const std::string& filename, StripeManifest& manifest) {
+    std::ifstream in(filename, std::ios::binary);
+    std::string magic;
+    unsigned int version = 0;
+    size_t num_stripes = 0;
+    if (!(in >> magic >> version >> num_stripes) || magic != "pco_stripes" || version != STRIPE_MANIFEST_VERSION) {
+        return false;
+    }
+    in.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+    manifest.stripes.resize(num_stripes);
+    for (std::string& stripe : manifest.stripes) {
+        // Paths are whole lines as they may contain spaces
+        if (!std::getline(in, stripe) || stripe.empty()) {
+            return false;
+        }
+        if (stripe.back() == '\r') {
+            stripe.pop_back();
+        }
+    }
+    size_t num_frames = 0;
+    if (!(in >> num_frames)) {
+        return false;
+    }
+    manifest.frames.resize(num_frames);
+    for (StripeFrame& frame : manifest.frames) {
+        if (!(in >> frame.stripe >> frame.frame) || frame.stripe >= num_stripes) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void write_stripe_manifest(const std::string& filename, const StripeManifest& manifest) {
+    std::ostringstream text;
+    text << "pco_stripes " << STRIPE_MANIFEST_VERSION << "\n" << manifest.stripes.size() << "\n";
+    for (const std::string& stripe : manifest.stripes) {
+        text << stripe << "\n";
+    }
+    text << manifest.frames.size() << "\n";
+    for (const StripeFrame& frame : manifest.frames) {
+        text << frame.stripe << " " << frame.frame << "\n";
+    }
+
+    std::string content = text.str();
+    std::unique_ptr<FILE, int(*)(FILE*)> f(fopen(filename.c_str(), "wb"), fclose);
+    if (!f || fwrite(content.data(), 1, content.size(), f.get()) != content.size()) {
+        throw std::runtime_error("Writing " + filename + " failed");
+    }
+    if (fclose(f.release()) != 0) {
+        throw std::runtime_error("Writing " + filename + " failed");
+    }
+}
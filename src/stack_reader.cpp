@@ -0,0 +1,257 @@
+#include "stack_reader.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+#include <zlib.h>
+#ifdef TIFF_WRITER_ZSTD
+#include <zstd.h>
+#endif
+
+#include "bitpack.hpp"
+#include "mapped_file.hpp"
+#include "stack_index.hpp"
+#include "tiff_ifd.hpp"
+
+class StackReaderPimpl {
+public:
+    std::string path;
+    std::vector<std::unique_ptr<MappedFile>> files;
+    StackIndex index;
+    bool from_cache = false;
+
+    const StackFrameInfo& frame(unsigned int index_) {
+        if (index_ >= index.frames.size()) {
+            throw std::out_of_range("Frame index out of range");
+        }
+        return index.frames[index_];
+    }
+};
+
+static bool index_matches_files(const StackIndex& index, const std::vector<StackFileInfo>& files) {
+    if (index.files.size() != files.size()) {
+        return false;
+    }
+    for (size_t i = 0; i < files.size(); ++i) {
+        if (index.files[i].size != files[i].size || index.files[i].mtime != files[i].mtime) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static std::vector<StackFileInfo> stack_file_infos(const std::vector<std::string>& filenames) {
+    std::vector<StackFileInfo> file_infos;
+    for (const std::string& filename : filenames) {
+        file_infos.push_back(stack_file_info(filename));
+    }
+    return file_infos;
+}
+
+// Maps the files of the stack at path and appends them and their frames to the index.
+// Returns true if the index came from the sidecar.
+static bool open_stack(const std::string& path, std::vector<std::unique_ptr<MappedFile>>& files, StackIndex& index) {
+    std::string index_filename = stack_index_filename(path);
+    StackIndex stack;
+    // A valid index knows how many files belong to the stack, so split files left over from an earlier,
+    // longer stack at the same path are not appended. Without it the files are probed until one is missing.
+    std::vector<std::string> filenames;
+    std::vector<StackFileInfo> file_infos;
+    bool from_cache = false;
+    if (read_stack_index(index_filename, stack)) {
+        filenames = stack_files(path, stack.files.size());
+        file_infos = stack_file_infos(filenames);
+        from_cache = !filenames.empty() && index_matches_files(stack, file_infos);
+    }
+    if (!from_cache) {
+        filenames = stack_files(path);
+        file_infos = stack_file_infos(filenames);
+    }
+    if (filenames.empty()) {
+        throw std::runtime_error("Could not open " + path);
+    }
+    std::vector<std::unique_ptr<MappedFile>> mapped;
+    for (const std::string& filename : filenames) {
+        mapped.emplace_back(new MappedFile(filename));
+    }
+
+    if (!from_cache) {
+        stack.files = file_infos;
+        stack.frames.clear();
+        for (size_t i = 0; i < mapped.size(); ++i) {
+            index_tiff_file(*mapped[i], (uint32_t)i, stack.frames);
+        }
+        try {
+            write_stack_index(index_filename, stack);
+        }
+        catch (const std::exception&) {
+            // The cache is optional, e.g. the directory may be read only
+        }
+    }
+
+    uint32_t first_file = (uint32_t)files.size();
+    for (auto& file : mapped) {
+        files.push_back(std::move(file));
+    }
+    index.files.insert(index.files.end(), stack.files.begin(), stack.files.end());
+    for (StackFrameInfo frame : stack.frames) {
+        frame.file += first_file;
+        index.frames.push_back(frame);
+    }
+    return from_cache;
+}
+
+StackReader::StackReader(std::string path)
+: p_impl(new StackReaderPimpl())
+{
+    p_impl->path = path;
+    if (!is_stripe_manifest(path)) {
+        p_impl->from_cache = open_stack(path, p_impl->files, p_impl->index);
+        return;
+    }
+
+    StripeManifest manifest;
+    if (!read_stripe_manifest(path, manifest)) {
+        throw std::runtime_error("Could not read stripe manifest " + path);
+    }
+    // The stripes are opened one after another into a common index, then the frames are put in manifest order
+    StackIndex stripes;
+    std::vector<size_t> first_frame;
+    std::vector<size_t> num_frames;
+    p_impl->from_cache = true;
+    for (const std::string& stripe : manifest.stripes) {
+        first_frame.push_back(stripes.frames.size());
+        p_impl->from_cache = open_stack(stripe, p_impl->files, stripes) && p_impl->from_cache;
+        num_frames.push_back(stripes.frames.size() - first_frame.back());
+    }
+    p_impl->index.files = stripes.files;
+    for (const StripeFrame& frame : manifest.frames) {
+        if (frame.frame >= num_frames[frame.stripe]) {
+            throw std::runtime_error("Stripe " + manifest.stripes[frame.stripe] + " has fewer frames than listed in " + path);
+        }
+        p_impl->index.frames.push_back(stripes.frames[first_frame[frame.stripe] + frame.frame]);
+    }
+}
+
+StackReader::~StackReader() { }
+
+unsigned int StackReader::get_num_frames() {
+    return (unsigned int)p_impl->index.frames.size();
+}
+
+unsigned int StackReader::get_num_files() {
+    return (unsigned int)p_impl->files.size();
+}
+
+unsigned int StackReader::get_width(unsigned int index) {
+    return p_impl->frame(index).width;
+}
+
+unsigned int StackReader::get_height(unsigned int index) {
+    return p_impl->frame(index).height;
+}
+
+unsigned int StackReader::get_bits_per_sample(unsigned int index) {
+    return p_impl->frame(index).bits_per_sample;
+}
+
+bool StackReader::index_loaded_from_cache() {
+    return p_impl->from_cache;
+}
+
+// Data of an uncompressed contiguous frame, which has to hold frame_bytes inside the file
+static const uint8_t* contiguous_frame(const MappedFile& file, const StackFrameInfo& info, size_t frame_bytes) {
+    if (info.data_size < frame_bytes || info.data_offset > file.size() || file.size() - info.data_offset < frame_bytes) {
+        throw std::runtime_error("Frame data is incomplete");
+    }
+    return file.data() + info.data_offset;
+}
+
+const uint16_t* StackReader::frame_data(unsigned int index) {
+    const StackFrameInfo& info = p_impl->frame(index);
+    if (info.compression != 1 || info.bits_per_sample != 16 || !info.contiguous) {
+        throw std::runtime_error("Only uncompressed 16 bit frames can be accessed without copying, use read_frame");
+    }
+    const MappedFile& file = *p_impl->files.at(info.file);
+    return reinterpret_cast<const uint16_t*>(contiguous_frame(file, info, (size_t)info.width * info.height * sizeof(uint16_t)));
+}
+
+// Decompresses all strips of the frame into raw
+static void decompress_frame(const MappedFile& file, const StackFrameInfo& info, std::vector<uint8_t>& raw) {
+    IfdValues values = parse_ifd(file, info.ifd_offset);
+    size_t pos = 0;
+    for (size_t i = 0; i < values.strip_offsets.size(); ++i) {
+        const uint8_t* strip = file.data() + values.strip_offsets[i];
+        size_t strip_size = (size_t)values.strip_sizes[i];
+        size_t available = raw.size() - pos;
+        if (info.compression == 1) {
+            size_t n = std::min(strip_size, available);
+            memcpy(raw.data() + pos, strip, n);
+            pos += n;
+        } else if (info.compression == 8) {
+            uLongf out_size = (uLongf)available;
+            int err = uncompress(raw.data() + pos, &out_size, strip, (uLong)strip_size);
+            if (err != Z_OK && err != Z_BUF_ERROR) {
+                throw std::runtime_error("Could not decompress frame");
+            }
+            pos += out_size;
+        }
+#ifdef TIFF_WRITER_ZSTD
+        else if (info.compression == 50000) {
+            size_t out_size = ZSTD_decompress(raw.data() + pos, available, strip, strip_size);
+            if (ZSTD_isError(out_size)) {
+                throw std::runtime_error("Could not decompress frame");
+            }
+            pos += out_size;
+        }
+#endif
+        else {
+            throw std::runtime_error("Unsupported tiff compression");
+        }
+    }
+    if (pos != raw.size()) {
+        throw std::runtime_error("Frame data is incomplete");
+    }
+}
+
+void StackReader::read_frame(unsigned int index, uint16_t* dest) {
+    const StackFrameInfo& info = p_impl->frame(index);
+    if (info.bits_per_sample != 16 && info.bits_per_sample != 12) {
+        throw std::runtime_error("Only frames with 16 or 12 bits per sample can be read");
+    }
+    const MappedFile& file = *p_impl->files.at(info.file);
+    size_t row_bytes = info.bits_per_sample == 12 ? packed12_size(info.width) : (size_t)info.width * sizeof(uint16_t);
+    size_t frame_bytes = row_bytes * info.height;
+
+    const uint8_t* raw = nullptr;
+    std::vector<uint8_t> buffer;
+    if (info.compression != 1 || !info.contiguous) {
+        buffer.resize(frame_bytes);
+        decompress_frame(file, info, buffer);
+        raw = buffer.data();
+    } else {
+        raw = contiguous_frame(file, info, frame_bytes);
+    }
+
+    for (uint32_t row = 0; row < info.height; ++row) {
+        uint16_t* dest_row = dest + (size_t)row * info.width;
+        if (info.bits_per_sample == 12) {
+            unpack12(dest_row, raw + row * row_bytes, info.width);
+        } else {
+            memcpy(dest_row, raw + row * row_bytes, row_bytes);
+        }
+        if (info.predictor == 2) {
+            for (uint32_t x = 1; x < info.width; ++x) {
+                dest_row[x] = (uint16_t)(dest_row[x] + dest_row[x - 1]);
+            }
+        }
+    }
+}
+
+std::vector<uint16_t> StackReader::get_frame(unsigned int index) {
+    const StackFrameInfo& info = p_impl->frame(index);
+    std::vector<uint16_t> frame((size_t)info.width * info.height);
+    read_frame(index, frame.data());
+    return frame;
+}
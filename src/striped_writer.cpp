@@ -0,0 +1,185 @@
+#include "striped_writer.hpp"
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdlib>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+
+#include "stack_index.hpp"
+
+// Frames waiting in the queue of each stripe before write_frame blocks
+static const size_t MAX_QUEUED_FRAMES = 4;
+
+struct StripeFrameBuffer {
+    unsigned int width;
+    unsigned int height;
+    std::vector<uint16_t> pixels;
+};
+
+// One output stack with its writer thread
+struct Stripe {
+    std::unique_ptr<TiffWriter> writer;
+    std::thread thread;
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<StripeFrameBuffer> queue;
+    // Buffers of written frames, reused to avoid allocating every frame
+    std::vector<std::vector<uint16_t>> free_buffers;
+    bool closing = false;
+    std::exception_ptr error;
+    uint32_t frames_queued = 0;
+
+    void run() {
+        while (true) {
+            StripeFrameBuffer* frame;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cv.wait(lock, [this]() { return closing || !queue.empty(); });
+                if (queue.empty()) {
+                    break;
+                }
+                frame = &queue.front();
+            }
+            try {
+                if (!error) {
+                    writer->write_frame(frame->width, frame->height, frame->pixels.data());
+                }
+            }
+            catch (...) {
+                std::lock_guard<std::mutex> lock(mutex);
+                error = std::current_exception();
+            }
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                free_buffers.push_back(std::move(queue.front().pixels));
+                queue.pop_front();
+            }
+            cv.notify_all();
+        }
+        // Stripes are closed in parallel, including writing their frame index
+        try {
+            writer->close();
+        }
+        catch (...) {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!error) {
+                error = std::current_exception();
+            }
+        }
+    }
+};
+
+class StripedWriterPimpl {
+public:
+    std::vector<std::unique_ptr<Stripe>> stripes;
+    StripeManifest manifest;
+    std::string manifest_filename;
+    bool closed = false;
+
+    void stop() {
+        for (auto& stripe : stripes) {
+            {
+                std::lock_guard<std::mutex> lock(stripe->mutex);
+                stripe->closing = true;
+            }
+            stripe->cv.notify_all();
+        }
+        for (auto& stripe : stripes) {
+            if (stripe->thread.joinable()) {
+                stripe->thread.join();
+            }
+        }
+    }
+};
+
+StripedWriter::StripedWriter(std::vector<std::string> paths, TiffWriterOptions options)
+: p_impl(new StripedWriterPimpl())
+{
+    if (paths.empty()) {
+        throw std::runtime_error("No output paths given");
+    }
+    for (size_t i = 0; i < paths.size(); ++i) {
+        if (std::find(paths.begin(), paths.begin() + i, paths[i]) != paths.begin() + i) {
+            throw std::runtime_error("Output path given twice: " + paths[i]);
+        }
+        // The manifest is read from other working directories, e.g. by pco_merge
+        p_impl->manifest.stripes.push_back(absolute_path(paths[i]));
+    }
+    p_impl->manifest_filename = stripe_manifest_filename(paths[0]);
+    try {
+        for (const std::string& path : paths) {
+            std::unique_ptr<Stripe> stripe(new Stripe());
+            stripe->writer.reset(new TiffWriter(path, options));
+            Stripe* s = stripe.get();
+            stripe->thread = std::thread([s]() { s->run(); });
+            p_impl->stripes.push_back(std::move(stripe));
+        }
+    }
+    catch (...) {
+        p_impl->stop();
+        throw;
+    }
+}
+
+StripedWriter::~StripedWriter() {
+    try {
+        close();
+    }
+    catch (...) {
+        // Destructor must not throw, use close to get errors
+    }
+    p_impl->stop();
+}
+
+void StripedWriter::write_frame(unsigned int width, unsigned int height, const uint16_t* data) {
+    if (p_impl->closed) {
+        throw std::runtime_error("Striped stack already closed");
+    }
+    uint32_t stripe_number = (uint32_t)(p_impl->manifest.frames.size() % p_impl->stripes.size());
+    Stripe& stripe = *p_impl->stripes[stripe_number];
+    StripeFrameBuffer frame;
+    frame.width = width;
+    frame.height = height;
+    {
+        std::unique_lock<std::mutex> lock(stripe.mutex);
+        stripe.cv.wait(lock, [&stripe]() { return stripe.error || stripe.queue.size() < MAX_QUEUED_FRAMES; });
+        if (stripe.error) {
+            std::rethrow_exception(stripe.error);
+        }
+        if (!stripe.free_buffers.empty()) {
+            frame.pixels = std::move(stripe.free_buffers.back());
+            stripe.free_buffers.pop_back();
+        }
+    }
+    // Copy outside the lock so the writer thread can keep going
+    frame.pixels.assign(data, data + (size_t)width * height);
+    StripeFrame location;
+    location.stripe = stripe_number;
+    {
+        std::lock_guard<std::mutex> lock(stripe.mutex);
+        location.frame = stripe.frames_queued++;
+        stripe.queue.push_back(std::move(frame));
+    }
+    stripe.cv.notify_all();
+    p_impl->manifest.frames.push_back(location);
+}
+
+void StripedWriter::close() {
+    if (p_impl->closed) {
+        return;
+    }
+    p_impl->closed = true;
+    p_impl->stop();
+    for (auto& stripe : p_impl->stripes) {
+        if (stripe->error) {
+            std::rethrow_exception(stripe->error);
+        }
+    }
+    if (!p_impl->manifest.frames.empty()) {
+        write_stripe_manifest(p_impl->manifest_filename, p_impl->manifest);
+    }
+}
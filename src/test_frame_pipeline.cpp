@@ -0,0 +1,702 @@
+#include <iostream>
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <stdexcept>
+#include "frame_pipeline.hpp"
+#include "frame_sinks.hpp"
+#include "frame_ops.hpp"
+#include "stack_index.hpp"
+
+// Synthetic image where every pixel is index + pixel number
+static std::vector<uint16_t> make_image(unsigned int index, unsigned int num_pixels) {
+    std::vector<uint16_t> image(num_pixels);
+    for (unsigned int pix = 0; pix < num_pixels; ++pix) {
+        image[pix] = (uint16_t)(index + pix);
+    }
+    return image;
+}
+
+class ThrowingSink : public FrameSink {
+public:
+    void consume(const Frame& frame) override {
+        if (frame.index == 3) {
+            throw std::runtime_error("Sink failed");
+        }
+    }
+};
+
+int main(int argc, char** argv) {
+    bool success = true;
+    const unsigned int width = 64;
+    const unsigned int height = 32;
+    const char* mip_filename = "testpipeline_mip.tif";
+
+    try {
+        std::cout << "Fan out to several sinks" << std::endl;
+        // One entry per sink, each sink runs on its own thread
+        unsigned int received[2] = {0, 0};
+        bool in_order[2] = {true, true};
+        bool data_correct[2] = {true, true};
+        std::vector<std::shared_ptr<FrameSink>> sinks;
+        for (int s = 0; s < 2; ++s) {
+            sinks.push_back(std::make_shared<CallbackSink>([&, s](const Frame& frame) {
+                in_order[s] = in_order[s] && frame.index == received[s];
+                data_correct[s] = data_correct[s] && std::vector<uint16_t>(frame.data.begin(), frame.data.end()) == make_image(frame.index, width * height);
+                received[s]++;
+            }));
+        }
+        auto mip = std::make_shared<MipSink>(mip_filename, 4, TiffWriterOptions(), OutputFormat::tiff, BufferAllocation::huge_pages);
+        sinks.push_back(mip);
+
+        FramePipeline pipeline(sinks, 3, BufferAllocation::huge_pages);
+        for (unsigned int i = 0; i < 10; ++i) {
+            std::vector<uint16_t> image = make_image(i, width * height);
+            pipeline.push(0, i, width, height, image.data());
+        }
+        pipeline.finish();
+
+        if (received[0] != 10 || received[1] != 10 || pipeline.frames_pushed() != 10) {
+            std::cerr << "Not all frames reached all sinks" << std::endl;
+            success = false;
+        }
+        if (!in_order[0] || !in_order[1] || !data_correct[0] || !data_correct[1]) {
+            std::cerr << "Frames out of order or corrupted" << std::endl;
+            success = false;
+        }
+        if (mip->mips_written() != 2 || mip->images_folded() != 10) {
+            std::cerr << "Wrong number of MIPs" << std::endl;
+            success = false;
+        }
+    } catch (const std::exception& ex) {
+        std::cerr << ex.what() << std::endl;
+        success = false;
+    }
+    if (remove(mip_filename) != 0 || remove(stack_index_filename(mip_filename).c_str()) != 0) {
+        std::cerr << "Could not delete temp file" << std::endl;
+    }
+
+    std::cout << "Binning frames" << std::endl;
+    {
+        // Odd number of pixels for the scalar tail of the SIMD loop, values that overflow 16 bit when summed
+        std::vector<uint16_t> image(67 * 3, 65535);
+        std::vector<uint32_t> sum(image.begin(), image.end());
+        accumulate_sum(sum.data(), image.data(), sum.size());
+        accumulate_sum(sum.data(), image.data(), sum.size());
+        std::vector<uint16_t> mean(sum.size());
+        sum_to_mean(mean.data(), sum.data(), sum.size(), 3);
+        if (sum.back() != 3 * 65535u || mean.back() != 65535) {
+            std::cerr << "Wrong sum or mean" << std::endl;
+            success = false;
+        }
+        const uint32_t halves[3] = {1, 2, 3};
+        uint16_t rounded[3];
+        sum_to_mean(rounded, halves, 3, 2);
+        if (rounded[0] != 1 || rounded[1] != 1 || rounded[2] != 2) {
+            std::cerr << "Mean not rounded to nearest" << std::endl;
+            success = false;
+        }
+    }
+    const char* bin_filenames[2] = {"testpipeline_mean.tif", "testpipeline_sum.tif"};
+    try {
+        auto mean = std::make_shared<BinSink>(bin_filenames[0], 3, BinOutput::mean);
+        auto sum = std::make_shared<BinSink>(bin_filenames[1], 3, BinOutput::sum);
+        FramePipeline pipeline({mean, sum}, 3);
+        for (unsigned int i = 0; i < 7; ++i) {
+            std::vector<uint16_t> image = make_image(i, width * height);
+            pipeline.push(0, i, width, height, image.data());
+        }
+        pipeline.finish();
+        if (mean->bins_written() != 2 || mean->images_binned() != 7 || sum->bins_written() != 2) {
+            std::cerr << "Wrong number of bins" << std::endl;
+            success = false;
+        }
+    } catch (const std::exception& ex) {
+        std::cerr << ex.what() << std::endl;
+        success = false;
+    }
+    for (const char* filename : bin_filenames) {
+        if (remove(filename) != 0 || remove(stack_index_filename(filename).c_str()) != 0) {
+            std::cerr << "Could not delete temp file" << std::endl;
+        }
+    }
+
+    std::cout << "Cropping and binning frames" << std::endl;
+    try {
+        // Values that saturate when summed, odd region for the scalar tail and dropped edge pixels
+        std::vector<uint16_t> image(width * height);
+        for (unsigned int pix = 0; pix < image.size(); ++pix) {
+            image[pix] = (uint16_t)(pix * 7919 % 65536);
+        }
+        for (unsigned int bin : {1u, 2u, 3u}) {
+            for (SpatialBinning binning : {SpatialBinning::mean, SpatialBinning::sum}) {
+                FrameProcessing processing;
+                processing.roi_x0 = 3;
+                processing.roi_y0 = 2;
+                processing.roi_x1 = 61;
+                processing.roi_y1 = 30;
+                processing.bin = bin;
+                processing.binning = binning;
+                unsigned int out_width, out_height;
+                processed_frame_size(processing, width, height, out_width, out_height);
+                std::vector<uint16_t> processed(out_width * out_height);
+                process_frame(processed.data(), image.data(), width, height, processing);
+                bool correct = out_width == 59 / bin && out_height == 29 / bin;
+                for (unsigned int y = 0; y < out_height; ++y) {
+                    for (unsigned int x = 0; x < out_width; ++x) {
+                        uint32_t sum = 0;
+                        for (unsigned int i = 0; i < bin * bin; ++i) {
+                            sum += image[(1 + y * bin + i / bin) * width + 2 + x * bin + i % bin];
+                        }
+                        uint32_t expected = binning == SpatialBinning::mean ? (sum + bin * bin / 2) / (bin * bin) : std::min<uint32_t>(sum, 65535);
+                        correct = correct && processed[y * out_width + x] == expected;
+                    }
+                }
+                if (!correct) {
+                    std::cerr << "Wrong result for " << bin << " x " << bin << " binning" << std::endl;
+                    success = false;
+                }
+            }
+        }
+
+        FrameProcessing processing;
+        processing.bin = 2;
+        unsigned int received = 0;
+        bool size_correct = true;
+        FramePipeline pipeline({std::make_shared<CallbackSink>([&](const Frame& frame) {
+            size_correct = size_correct && frame.width == width / 2 && frame.height == height / 2 && frame.data.size() == width * height / 4;
+            received++;
+        })}, 2, BufferAllocation::standard, processing);
+        for (unsigned int i = 0; i < 5; ++i) {
+            pipeline.push(0, i, width, height, image.data());
+        }
+        pipeline.finish();
+        if (received != 5 || !size_correct) {
+            std::cerr << "Sinks did not get the binned frames" << std::endl;
+            success = false;
+        }
+
+        processing.roi_x0 = 1;
+        processing.roi_y0 = 1;
+        processing.roi_x1 = width + 1;
+        processing.roi_y1 = height;
+        bool thrown = false;
+        try {
+            FramePipeline outside({std::make_shared<CallbackSink>([](const Frame&) {})}, 2, BufferAllocation::standard, processing);
+            outside.push(0, 0, width, height, image.data());
+        } catch (const std::runtime_error&) {
+            thrown = true;
+        }
+        if (!thrown) {
+            std::cerr << "ROI outside of the image not detected" << std::endl;
+            success = false;
+        }
+    } catch (const std::exception& ex) {
+        std::cerr << ex.what() << std::endl;
+        success = false;
+    }
+
+    std::cout << "Flat field correction" << std::endl;
+    try {
+        // Odd number of pixels for the scalar tail, values below the dark frame and gains that saturate
+        const size_t num_pixels = 203;
+        std::vector<uint16_t> image(num_pixels), dark(num_pixels), gain(num_pixels), corrected(num_pixels);
+        for (size_t pix = 0; pix < num_pixels; ++pix) {
+            image[pix] = (uint16_t)(pix * 7919 % 65536);
+            dark[pix] = (uint16_t)(pix * 31 % 1000);
+            gain[pix] = (uint16_t)(pix * 4099 % 65536);
+        }
+        flat_field_correct(corrected.data(), image.data(), dark.data(), gain.data(), num_pixels);
+        bool correct = true;
+        for (size_t pix = 0; pix < num_pixels; ++pix) {
+            double expected = std::max(0, image[pix] - dark[pix]) * (double)gain[pix] / FLAT_FIELD_GAIN_ONE;
+            correct = correct && corrected[pix] == (uint16_t)std::min(expected + 0.5, 65535.0);
+        }
+        flat_field_correct(corrected.data(), image.data(), dark.data(), nullptr, num_pixels);
+        for (size_t pix = 0; pix < num_pixels; ++pix) {
+            correct = correct && corrected[pix] == std::max(0, image[pix] - dark[pix]);
+        }
+        if (!correct) {
+            std::cerr << "Wrong flat field correction" << std::endl;
+            success = false;
+        }
+
+        // Flat with a gradient is corrected to its mean, corrected before binning
+        auto flat_field = std::make_shared<FlatField>();
+        flat_field->width = width;
+        flat_field->height = height;
+        flat_field->dark.assign(width * height, 100);
+        std::vector<uint16_t> flat(width * height);
+        for (unsigned int pix = 0; pix < flat.size(); ++pix) {
+            flat[pix] = (uint16_t)(1100 + pix % width * 20);
+        }
+        flat_field->gain = flat_field_gain(flat_field->dark.data(), flat.data(), flat.size());
+        FrameProcessing processing;
+        processing.flat_field = flat_field;
+        processing.bin = 2;
+        bool uniform = true;
+        FramePipeline pipeline({std::make_shared<CallbackSink>([&](const Frame& frame) {
+            for (uint16_t value : frame.data) {
+                uniform = uniform && value >= 1629 && value <= 1631;
+            }
+        })}, 2, BufferAllocation::standard, processing);
+        pipeline.push(0, 0, width, height, flat.data());
+        pipeline.finish();
+        if (!uniform) {
+            std::cerr << "Flat frame is not uniform after correction" << std::endl;
+            success = false;
+        }
+    } catch (const std::exception& ex) {
+        std::cerr << ex.what() << std::endl;
+        success = false;
+    }
+
+    std::cout << "Hot pixel replacement" << std::endl;
+    const char* hot_pixel_filename = "testpipeline_hot_pixels.txt";
+    try {
+        // Noisy dark frame with hot pixels at the corner, the edge, next to each other and in the middle
+        std::vector<uint16_t> dark(width * height);
+        for (unsigned int pix = 0; pix < dark.size(); ++pix) {
+            dark[pix] = (uint16_t)(100 + pix * 7919 % 7);
+        }
+        const HotPixel hot[5] = {{0, 0}, {width - 1, 5}, {10, 10}, {11, 10}, {30, 20}};
+        for (const HotPixel& pixel : hot) {
+            dark[pixel.y * width + pixel.x] = 4000;
+        }
+        std::vector<HotPixel> detected = detect_hot_pixels(dark.data(), width, height, 6);
+        write_hot_pixels(hot_pixel_filename, detected);
+        auto hot_pixels = make_hot_pixel_map(read_hot_pixels(hot_pixel_filename), HotPixelReplacement::median);
+        bool found = hot_pixels->pixels.size() == 5;
+        for (unsigned int i = 0; found && i < 5; ++i) {
+            found = hot_pixels->pixels[i].x == hot[i].x && hot_pixels->pixels[i].y == hot[i].y;
+        }
+        if (!found) {
+            std::cerr << "Hot pixels not detected" << std::endl;
+            success = false;
+        }
+
+        // Reference: replaced in the full image first, then processed without hot pixels
+        std::vector<uint16_t> replaced = dark;
+        auto median = [](std::vector<uint16_t> values) {
+            std::sort(values.begin(), values.end());
+            return values.size() % 2 == 1 ? values[values.size() / 2] : (uint16_t)((values[values.size() / 2 - 1] + values[values.size() / 2] + 1) / 2);
+        };
+        replaced[0] = median({dark[1], dark[width], dark[width + 1]});
+        replaced[5 * width + width - 1] = median({dark[4 * width + width - 2], dark[4 * width + width - 1], dark[5 * width + width - 2], dark[6 * width + width - 2], dark[6 * width + width - 1]});
+        replaced[10 * width + 10] = median({dark[9 * width + 9], dark[9 * width + 10], dark[9 * width + 11], dark[10 * width + 9], dark[11 * width + 9], dark[11 * width + 10], dark[11 * width + 11]});
+        replaced[10 * width + 11] = median({dark[9 * width + 10], dark[9 * width + 11], dark[9 * width + 12], dark[10 * width + 12], dark[11 * width + 10], dark[11 * width + 11], dark[11 * width + 12]});
+        replaced[20 * width + 30] = median({dark[19 * width + 29], dark[19 * width + 30], dark[19 * width + 31], dark[20 * width + 29], dark[20 * width + 31], dark[21 * width + 29], dark[21 * width + 30], dark[21 * width + 31]});
+        for (unsigned int bin : {1u, 2u}) {
+            FrameProcessing reference;
+            reference.roi_x0 = 1;
+            reference.roi_y0 = 2;
+            reference.roi_x1 = width - 1;
+            reference.roi_y1 = height;
+            reference.bin = bin;
+            FrameProcessing processing = reference;
+            processing.hot_pixels = hot_pixels;
+            unsigned int out_width, out_height;
+            processed_frame_size(processing, width, height, out_width, out_height);
+            std::vector<uint16_t> expected(out_width * out_height), processed(out_width * out_height);
+            process_frame(expected.data(), replaced.data(), width, height, reference);
+            process_frame(processed.data(), dark.data(), width, height, processing);
+            if (processed != expected) {
+                std::cerr << "Wrong hot pixel replacement with " << bin << " x " << bin << " binning" << std::endl;
+                success = false;
+            }
+        }
+    } catch (const std::exception& ex) {
+        std::cerr << ex.what() << std::endl;
+        success = false;
+    }
+    if (remove(hot_pixel_filename) != 0) {
+        std::cerr << "Could not delete temp file" << std::endl;
+    }
+
+    std::cout << "Preview" << std::endl;
+    const char* preview_filename = "testpipeline_preview.tif";
+    try {
+        TiffWriterOptions options;
+        options.compression = TiffCompression::deflate;
+        auto preview = std::make_shared<PreviewSink>(preview_filename, 4, 2, options);
+        FramePipeline pipeline({preview}, 2);
+        for (unsigned int i = 0; i < 7; ++i) {
+            std::vector<uint16_t> image = make_image(i * 100, width * height);
+            pipeline.push(0, i, width, height, image.data());
+        }
+        pipeline.finish();
+        StackIndex index;
+        if (preview->previews_written() != 3 || !read_stack_index(stack_index_filename(preview_filename), index) || index.frames.size() != 3
+            || index.frames[0].bits_per_sample != 8 || index.frames[0].width != width / 4 || index.frames[0].height != height / 4) {
+            std::cerr << "Wrong preview written" << std::endl;
+            success = false;
+        }
+        // Running percentiles follow the brightness of the frames
+        if (preview->contrast_low() < 100 || preview->contrast_high() > 500 + width * height || preview->contrast_low() >= preview->contrast_high()) {
+            std::cerr << "Wrong preview contrast " << preview->contrast_low() << " - " << preview->contrast_high() << std::endl;
+            success = false;
+        }
+    } catch (const std::exception& ex) {
+        std::cerr << ex.what() << std::endl;
+        success = false;
+    }
+    if (remove(preview_filename) != 0 || remove(stack_index_filename(preview_filename).c_str()) != 0) {
+        std::cerr << "Could not delete temp file" << std::endl;
+    }
+
+    std::cout << "Frame statistics" << std::endl;
+    const char* statistics_filenames[2] = {"testpipeline_statistics.csv", "testpipeline_statistics.bin"};
+    try {
+        // Longer than the interval in which the SIMD sums are flushed, odd length for the scalar tail
+        std::vector<uint16_t> image(300001);
+        for (size_t pix = 0; pix < image.size(); ++pix) {
+            image[pix] = (uint16_t)(pix % 3 == 0 ? 65535 : 3 + pix * 7919 % 60000);
+        }
+        image[123457] = 2;
+        std::vector<uint32_t> histogram(PIXEL_HISTOGRAM_BINS);
+        PixelStatistics pixels = pixel_statistics(image.data(), image.size(), histogram.data());
+        uint64_t sum = 0;
+        std::vector<uint32_t> expected_histogram(PIXEL_HISTOGRAM_BINS, 0);
+        for (uint16_t value : image) {
+            sum += value;
+            expected_histogram[value >> 4]++;
+        }
+        if (pixels.min != 2 || pixels.max != 65535 || pixels.sum != sum || histogram != expected_histogram) {
+            std::cerr << "Wrong pixel statistics" << std::endl;
+            success = false;
+        }
+        image.back()++;
+        if (pixel_statistics(image.data(), image.size(), histogram.data()).hash == pixels.hash) {
+            std::cerr << "Hash does not change with the last pixel" << std::endl;
+            success = false;
+        }
+
+        // Frames 2 and 5 repeat the previous frame, 4 and 5 are blank
+        auto csv = std::make_shared<StatisticsSink>(statistics_filenames[0]);
+        auto binary = std::make_shared<StatisticsSink>(statistics_filenames[1], StatisticsFormat::binary);
+        FramePipeline pipeline({csv, binary}, 2);
+        const unsigned int sources[6] = {0, 1, 1, 2, 100, 100};
+        std::vector<uint16_t> blank(width * height, 0);
+        for (unsigned int i = 0; i < 6; ++i) {
+            std::vector<uint16_t> frame = make_image(sources[i], width * height);
+            pipeline.push(0, i, width, height, sources[i] == 100 ? blank.data() : frame.data());
+        }
+        pipeline.finish();
+        const std::vector<FrameStatistics>& statistics = csv->frame_statistics();
+        if (statistics.size() != 6 || csv->duplicate_frames() != 2 || csv->blank_frames() != 2
+            || statistics[2].flags != FRAME_DUPLICATE || statistics[5].flags != (FRAME_DUPLICATE | FRAME_BLANK) || statistics[4].flags != FRAME_BLANK
+            || statistics[0].min != 0 || statistics[0].max != width * height - 1 || statistics[0].mean != (width * height - 1) / 2.0) {
+            std::cerr << "Wrong frame statistics" << std::endl;
+            success = false;
+        }
+        std::ifstream csv_file(statistics_filenames[0]);
+        std::string line;
+        unsigned int lines = 0;
+        while (std::getline(csv_file, line)) {
+            lines++;
+        }
+        std::ifstream binary_file(statistics_filenames[1], std::ios::binary);
+        StatisticsFileHeader header;
+        FrameStatistics record;
+        binary_file.read((char*)&header, sizeof(header));
+        binary_file.seekg(sizeof(header) + 5 * (sizeof(FrameStatistics) + PIXEL_HISTOGRAM_BINS * sizeof(uint32_t)));
+        binary_file.read((char*)&record, sizeof(record));
+        if (lines != 7 || header.magic != STATISTICS_FILE_MAGIC || header.histogram_bins != PIXEL_HISTOGRAM_BINS
+            || !binary_file || record.index != 5 || record.hash != statistics[5].hash) {
+            std::cerr << "Statistics files not written correctly" << std::endl;
+            success = false;
+        }
+    } catch (const std::exception& ex) {
+        std::cerr << ex.what() << std::endl;
+        success = false;
+    }
+    for (const char* filename : statistics_filenames) {
+        if (remove(filename) != 0) {
+            std::cerr << "Could not delete temp file" << std::endl;
+        }
+    }
+
+    std::cout << "Background subtracted MIP" << std::endl;
+    const char* background_filenames[2] = {"testpipeline_mip_ema.tif", "testpipeline_mip_min.tif"};
+    try {
+        // Odd length for the scalar tail
+        std::vector<uint16_t> image(1001), mip(1001, 7), background(1001), previous_min(1001), current_min(1001);
+        for (size_t pix = 0; pix < image.size(); ++pix) {
+            image[pix] = (uint16_t)(pix * 7919 % 65536);
+            background[pix] = (uint16_t)(pix * 104729 % 65536);
+            previous_min[pix] = (uint16_t)(pix * 15485863 % 65536);
+            current_min[pix] = (uint16_t)(pix * 32452843 % 65536);
+        }
+        std::vector<uint16_t> ema_mip = mip, min_mip = mip, ema_background = background, minimum = current_min;
+        fold_max_minus_ema(ema_mip.data(), ema_background.data(), image.data(), image.size(), 3);
+        fold_max_minus_min(min_mip.data(), previous_min.data(), minimum.data(), image.data(), image.size());
+        bool folds_ok = true;
+        for (size_t pix = 0; pix < image.size(); ++pix) {
+            int ema_signal = std::max((int)image[pix] - background[pix], 0);
+            int min_signal = std::max((int)image[pix] - std::min(previous_min[pix], current_min[pix]), 0);
+            folds_ok = folds_ok && ema_mip[pix] == std::max(ema_signal, 7) && min_mip[pix] == std::max(min_signal, 7)
+                && ema_background[pix] == background[pix] + (((int)image[pix] - background[pix] + 4) >> 3)
+                && minimum[pix] == std::min(current_min[pix], image[pix]);
+        }
+        if (!folds_ok) {
+            std::cerr << "Wrong background subtracted folds" << std::endl;
+            success = false;
+        }
+
+        // Static gradient with a spot moving through row 5 from frame 1 on, only the spot remains in the MIPs
+        auto ema = std::make_shared<MipSink>(background_filenames[0], 20, TiffWriterOptions(), OutputFormat::tiff, BufferAllocation::standard, MipBackground::ema);
+        auto minimum_sink = std::make_shared<MipSink>(background_filenames[1], 20, TiffWriterOptions(), OutputFormat::tiff, BufferAllocation::standard, MipBackground::minimum, 4);
+        FramePipeline pipeline({ema, minimum_sink}, 2);
+        for (unsigned int i = 0; i < 20; ++i) {
+            std::vector<uint16_t> frame(width * height);
+            for (unsigned int pix = 0; pix < frame.size(); ++pix) {
+                frame[pix] = (uint16_t)(1000 + 20 * (pix % width));
+            }
+            if (i > 0) {
+                frame[5 * width + 3 * i] += 300;
+            }
+            pipeline.push(0, i, width, height, frame.data());
+        }
+        pipeline.finish();
+        for (const char* filename : background_filenames) {
+            StackIndex index;
+            std::vector<uint16_t> written(width * height);
+            std::ifstream file(filename, std::ios::binary);
+            if (read_stack_index(stack_index_filename(filename), index) && index.frames.size() == 1) {
+                file.seekg(index.frames[0].data_offset);
+                file.read((char*)written.data(), written.size() * sizeof(uint16_t));
+            }
+            std::vector<uint16_t> expected(width * height, 0);
+            for (unsigned int i = 1; i < 20; ++i) {
+                expected[5 * width + 3 * i] = 300;
+            }
+            if (!file || written != expected) {
+                std::cerr << "Background not removed from " << filename << std::endl;
+                success = false;
+            }
+        }
+    } catch (const std::exception& ex) {
+        std::cerr << ex.what() << std::endl;
+        success = false;
+    }
+    for (const char* filename : background_filenames) {
+        if (remove(filename) != 0 || remove(stack_index_filename(filename).c_str()) != 0) {
+            std::cerr << "Could not delete temp file" << std::endl;
+        }
+    }
+
+    std::cout << "MIP pyramid" << std::endl;
+    const char* pyramid_filename = "testpipeline_pyramid.tif";
+    try {
+        // Odd size, the last column and row are dropped
+        const unsigned int odd_width = 37, odd_height = 9;
+        std::vector<uint16_t> image(odd_width * odd_height);
+        for (size_t pix = 0; pix < image.size(); ++pix) {
+            image[pix] = (uint16_t)(pix * 7919 % 65536);
+        }
+        for (PyramidReduction reduction : {PyramidReduction::max, PyramidReduction::mean}) {
+            std::vector<uint16_t> reduced((odd_width / 2) * (odd_height / 2));
+            reduce_2x2(reduced.data(), image.data(), odd_width, odd_height, reduction);
+            bool reduced_ok = true;
+            for (unsigned int y = 0; y < odd_height / 2; ++y) {
+                for (unsigned int x = 0; x < odd_width / 2; ++x) {
+                    uint16_t p[4] = {image[2 * y * odd_width + 2 * x], image[2 * y * odd_width + 2 * x + 1],
+                        image[(2 * y + 1) * odd_width + 2 * x], image[(2 * y + 1) * odd_width + 2 * x + 1]};
+                    uint16_t expected = reduction == PyramidReduction::max ? std::max(std::max(p[0], p[1]), std::max(p[2], p[3]))
+                        : (uint16_t)(((uint32_t)p[0] + p[1] + p[2] + p[3] + 2) / 4);
+                    reduced_ok = reduced_ok && reduced[y * (odd_width / 2) + x] == expected;
+                }
+            }
+            if (!reduced_ok) {
+                std::cerr << "Wrong 2 x 2 reduction" << std::endl;
+                success = false;
+            }
+        }
+
+        auto mip = std::make_shared<MipSink>(pyramid_filename, 2);
+        mip->add_pyramid(2);
+        FramePipeline pipeline({mip}, 2);
+        for (unsigned int i = 0; i < 6; ++i) {
+            std::vector<uint16_t> frame = make_image(i, width * height);
+            pipeline.push(0, i, width, height, frame.data());
+        }
+        pipeline.finish();
+        for (unsigned int level = 1; level <= 2; ++level) {
+            StackIndex index;
+            if (!read_stack_index(stack_index_filename(pyramid_level_filename(pyramid_filename, level)), index) || index.frames.size() != 3
+                || index.frames[0].width != width >> level || index.frames[0].height != height >> level) {
+                std::cerr << "Pyramid level " << level << " not written" << std::endl;
+                success = false;
+            }
+        }
+    } catch (const std::exception& ex) {
+        std::cerr << ex.what() << std::endl;
+        success = false;
+    }
+    for (unsigned int level = 0; level <= 2; ++level) {
+        std::string filename = level == 0 ? pyramid_filename : pyramid_level_filename(pyramid_filename, level);
+        if (remove(filename.c_str()) != 0 || remove(stack_index_filename(filename).c_str()) != 0) {
+            std::cerr << "Could not delete temp file" << std::endl;
+        }
+    }
+
+    std::cout << "Orthogonal projections" << std::endl;
+    const char* ortho_filename = "testpipeline_ortho.tif";
+    try {
+        // Width not a multiple of 8 for the scalar tail, two z-stacks of 5 planes
+        const unsigned int stack_width = 21, stack_height = 12, planes = 5;
+        auto mip = std::make_shared<MipSink>(ortho_filename, planes);
+        mip->add_orthogonal_projections();
+        FramePipeline pipeline({mip}, 2);
+        std::vector<std::vector<uint16_t>> frames;
+        for (unsigned int i = 0; i < 2 * planes; ++i) {
+            std::vector<uint16_t> frame(stack_width * stack_height);
+            for (unsigned int pix = 0; pix < frame.size(); ++pix) {
+                frame[pix] = (uint16_t)((i * 7919 + pix * 104729) % 65536);
+            }
+            pipeline.push(0, i, stack_width, stack_height, frame.data());
+            frames.push_back(frame);
+        }
+        pipeline.finish();
+        // Page of the second z-stack
+        auto read_page = [](const std::string& filename, size_t num_pixels) {
+            StackIndex index;
+            std::vector<uint16_t> page(num_pixels);
+            std::ifstream file(filename, std::ios::binary);
+            if (read_stack_index(stack_index_filename(filename), index) && index.frames.size() == 2) {
+                file.seekg(index.frames[1].data_offset);
+                file.read((char*)page.data(), page.size() * sizeof(uint16_t));
+            }
+            return file ? page : std::vector<uint16_t>();
+        };
+        std::vector<uint16_t> expected_xy(stack_width * stack_height, 0), expected_xz(stack_width * planes, 0), expected_yz(planes * stack_height, 0);
+        for (unsigned int z = 0; z < planes; ++z) {
+            for (unsigned int y = 0; y < stack_height; ++y) {
+                for (unsigned int x = 0; x < stack_width; ++x) {
+                    uint16_t value = frames[planes + z][y * stack_width + x];
+                    expected_xy[y * stack_width + x] = std::max(expected_xy[y * stack_width + x], value);
+                    expected_xz[z * stack_width + x] = std::max(expected_xz[z * stack_width + x], value);
+                    expected_yz[y * planes + z] = std::max(expected_yz[y * planes + z], value);
+                }
+            }
+        }
+        if (read_page(ortho_filename, expected_xy.size()) != expected_xy || read_page(projection_filename(ortho_filename, "xz"), expected_xz.size()) != expected_xz
+            || read_page(projection_filename(ortho_filename, "yz"), expected_yz.size()) != expected_yz) {
+            std::cerr << "Wrong orthogonal projections" << std::endl;
+            success = false;
+        }
+    } catch (const std::exception& ex) {
+        std::cerr << ex.what() << std::endl;
+        success = false;
+    }
+    for (const std::string& filename : {std::string(ortho_filename), projection_filename(ortho_filename, "xz"), projection_filename(ortho_filename, "yz")}) {
+        if (remove(filename.c_str()) != 0 || remove(stack_index_filename(filename).c_str()) != 0) {
+            std::cerr << "Could not delete temp file" << std::endl;
+        }
+    }
+
+    std::cout << "Event triggered saving" << std::endl;
+    const char* event_filenames[2] = {"testpipeline_events_difference.tif", "testpipeline_events_count.tif"};
+    try {
+        // Longer than the interval in which the SIMD sums are flushed, odd length for the scalar tail
+        std::vector<uint16_t> a(300001), b(300001), background(300001);
+        uint64_t difference = 0;
+        size_t above = 0;
+        for (size_t pix = 0; pix < a.size(); ++pix) {
+            a[pix] = (uint16_t)(pix * 7919 % 65536);
+            b[pix] = (uint16_t)(pix % 5 == 0 ? 65535 : pix * 104729 % 65536);
+            difference += a[pix] > b[pix] ? a[pix] - b[pix] : b[pix] - a[pix];
+            above += a[pix] > 40000 ? 1 : 0;
+        }
+        background = b;
+        update_background(background.data(), a.data(), a.size(), 3);
+        bool background_ok = true;
+        for (size_t pix = 0; pix < a.size(); ++pix) {
+            background_ok = background_ok && background[pix] == b[pix] + (((int)a[pix] - b[pix] + 4) >> 3);
+        }
+        if (sum_abs_difference(a.data(), b.data(), a.size()) != difference || count_above(a.data(), a.size(), 40000) != above || !background_ok) {
+            std::cerr << "Wrong event metrics" << std::endl;
+            success = false;
+        }
+
+        // Events in the region at frames 10 and 11 of range 0 and frame 1 of range 1, frame 30 only changes outside of the region
+        EventTrigger trigger;
+        trigger.roi_x0 = 1;
+        trigger.roi_y0 = 1;
+        trigger.roi_x1 = 16;
+        trigger.roi_y1 = 8;
+        trigger.pre_trigger = 3;
+        trigger.post_trigger = 2;
+        trigger.threshold = 100;
+        auto difference_sink = std::make_shared<EventSink>(event_filenames[0], trigger);
+        trigger.metric = EventMetric::count;
+        trigger.pixel_threshold = 2000;
+        trigger.threshold = 1;
+        auto count_sink = std::make_shared<EventSink>(event_filenames[1], trigger);
+        FramePipeline pipeline({difference_sink, count_sink}, 2);
+        for (unsigned int range = 0; range < 2; ++range) {
+            for (unsigned int i = 0; i < (range == 0 ? 40u : 6u); ++i) {
+                std::vector<uint16_t> image(width * height, 1000);
+                if ((range == 0 && (i == 10 || i == 11)) || (range == 1 && i == 1)) {
+                    for (unsigned int y = 2; y < 6; ++y) {
+                        std::fill(&image[y * width + 2], &image[y * width + 6], 5000);
+                    }
+                }
+                if (range == 0 && i == 30) {
+                    image[3 * width + 40] = 60000;
+                }
+                pipeline.push(range, i, width, height, image.data());
+            }
+        }
+        pipeline.finish();
+        for (int sink = 0; sink < 2; ++sink) {
+            const EventSink& events = sink == 0 ? *difference_sink : *count_sink;
+            const std::vector<EventRecord>& records = events.events();
+            StackIndex index;
+            if (records.size() != 2 || events.frames_written() != 11 || events.frames_scored() != 46
+                || records[0].range != 0 || records[0].first_index != 7 || records[0].trigger_index != 10 || records[0].last_index != 13 || records[0].first_frame != 0
+                || records[1].range != 1 || records[1].first_index != 0 || records[1].trigger_index != 1 || records[1].last_index != 3 || records[1].first_frame != 7
+                || !read_stack_index(stack_index_filename(event_filenames[sink]), index) || index.frames.size() != 11) {
+                std::cerr << "Wrong events kept by " << event_filenames[sink] << std::endl;
+                success = false;
+            }
+            std::ifstream csv_file(event_index_filename(event_filenames[sink]));
+            std::string line;
+            unsigned int lines = 0;
+            while (std::getline(csv_file, line)) {
+                lines++;
+            }
+            if (lines != 3) {
+                std::cerr << "Event index not written" << std::endl;
+                success = false;
+            }
+        }
+    } catch (const std::exception& ex) {
+        std::cerr << ex.what() << std::endl;
+        success = false;
+    }
+    for (const char* filename : event_filenames) {
+        if (remove(filename) != 0 || remove(stack_index_filename(filename).c_str()) != 0 || remove(event_index_filename(filename).c_str()) != 0) {
+            std::cerr << "Could not delete temp file" << std::endl;
+        }
+    }
+
+    std::cout << "Errors in a sink are reported" << std::endl;
+    bool thrown = false;
+    try {
+        FramePipeline pipeline({std::make_shared<ThrowingSink>()}, 2);
+        std::vector<uint16_t> image = make_image(0, width * height);
+        for (unsigned int i = 0; i < 10; ++i) {
+            pipeline.push(0, i, width, height, image.data());
+        }
+        pipeline.finish();
+    } catch (const std::runtime_error&) {
+        thrown = true;
+    }
+    if (!thrown) {
+        std::cerr << "Exception in sink was not propagated" << std::endl;
+        success = false;
+    }
+
+    return success? 0:1;
+}
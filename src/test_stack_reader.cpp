@@ -0,0 +1,259 @@
+#include <iostream>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <vector>
+#include "stack_reader.hpp"
+#include "stack_index.hpp"
+#include "tiff_writer.hpp"
+#include "frame_writer.hpp"
+
+static uint16_t pixel(unsigned int frame, unsigned int pix, uint16_t max_value) {
+    return (uint16_t)((frame * 1000 + pix % 3000) % (max_value + 1));
+}
+
+// Writes a stack with the options, reads it back twice and checks all frames
+static bool check_stack(const char* filename, TiffWriterOptions options, uint16_t max_value) {
+    const unsigned int width = 301;
+    const unsigned int height = 200;
+    const unsigned int num_frames = 12;
+    bool success = true;
+    try {
+        {
+            TiffWriter tw(filename, options);
+            std::vector<uint16_t> frame(width * height);
+            for (unsigned int i = 0; i < num_frames; ++i) {
+                for (unsigned int pix = 0; pix < frame.size(); ++pix) {
+                    frame[pix] = pixel(i, pix, max_value);
+                }
+                tw.write_frame(width, height, frame.data());
+            }
+            tw.close();
+        }
+
+        for (int pass = 0; pass < 2; ++pass) {
+            StackReader reader(filename);
+            // Without an index from the writer the reader builds and caches it on first open
+            if (reader.index_loaded_from_cache() != (options.write_index || pass == 1)) {
+                std::cerr << "Index cache not used as expected" << std::endl;
+                success = false;
+            }
+            if (reader.get_num_frames() != num_frames || reader.get_width(0) != width || reader.get_height(0) != height) {
+                std::cerr << "Wrong number or size of frames" << std::endl;
+                success = false;
+                continue;
+            }
+            // Backwards to not only test sequential access
+            for (unsigned int i = num_frames; i-- > 0; ) {
+                std::vector<uint16_t> frame = reader.get_frame(i);
+                for (unsigned int pix = 0; pix < frame.size(); ++pix) {
+                    if (frame[pix] != pixel(i, pix, max_value)) {
+                        std::cerr << "Wrong data in frame " << i << std::endl;
+                        success = false;
+                        break;
+                    }
+                }
+                if (options.compression == TiffCompression::none && options.bits_per_sample == 16
+                    && memcmp(reader.frame_data(i), frame.data(), frame.size() * sizeof(uint16_t)) != 0) {
+                    std::cerr << "Zero copy access returned wrong data" << std::endl;
+                    success = false;
+                }
+            }
+        }
+    } catch (const std::exception& ex) {
+        std::cerr << ex.what() << std::endl;
+        success = false;
+    }
+    if (remove(filename) != 0 || remove(stack_index_filename(filename).c_str()) != 0) {
+        std::cerr << "Could not delete temp files" << std::endl;
+    }
+    return success;
+}
+
+// Stripes frames over three stacks and reads them back in order through the manifest
+static bool check_striped_stack() {
+    const unsigned int width = 64;
+    const unsigned int height = 48;
+    // Not a multiple of the stripes, so they get different numbers of frames
+    const unsigned int num_frames = 13;
+    const std::vector<std::string> stripes = {"teststripe_a.tif", "teststripe_b.tif", "teststripe_c.tif"};
+    bool success = true;
+    try {
+        {
+            std::unique_ptr<FrameWriter> writer = open_frame_writer(join_output_paths(stripes), OutputFormat::tiff, TiffWriterOptions());
+            std::vector<uint16_t> frame(width * height);
+            for (unsigned int i = 0; i < num_frames; ++i) {
+                for (unsigned int pix = 0; pix < frame.size(); ++pix) {
+                    frame[pix] = pixel(i, pix, 0xFFFF);
+                }
+                writer->write_frame(width, height, frame.data());
+            }
+            writer->close();
+        }
+
+        std::vector<std::string> absolute = split_output_paths(absolute_output_paths(join_output_paths(stripes)));
+        if (absolute.size() != stripes.size() || absolute[1] != absolute_path(stripes[1]) || absolute[1].size() <= stripes[1].size()
+            || !absolute_output_paths("").empty()) {
+            std::cerr << "Stripe paths not made absolute" << std::endl;
+            success = false;
+        }
+
+        if (StackReader(stripes[1]).get_num_frames() != 4) {
+            std::cerr << "Frames not striped round robin" << std::endl;
+            success = false;
+        }
+        StackReader reader(stripe_manifest_filename(stripes[0]));
+        if (reader.get_num_frames() != num_frames || reader.get_num_files() != stripes.size()) {
+            std::cerr << "Wrong number of frames or files in striped stack" << std::endl;
+            success = false;
+        }
+        for (unsigned int i = 0; i < reader.get_num_frames(); ++i) {
+            std::vector<uint16_t> frame = reader.get_frame(i);
+            for (unsigned int pix = 0; pix < frame.size(); ++pix) {
+                if (frame[pix] != pixel(i, pix, 0xFFFF)) {
+                    std::cerr << "Wrong data in striped frame " << i << std::endl;
+                    success = false;
+                    break;
+                }
+            }
+        }
+    } catch (const std::exception& ex) {
+        std::cerr << ex.what() << std::endl;
+        success = false;
+    }
+    for (const std::string& stripe : stripes) {
+        if (remove(stripe.c_str()) != 0 || remove(stack_index_filename(stripe).c_str()) != 0) {
+            std::cerr << "Could not delete temp files" << std::endl;
+        }
+    }
+    if (remove(stripe_manifest_filename(stripes[0]).c_str()) != 0) {
+        std::cerr << "Could not delete stripe manifest" << std::endl;
+    }
+    return success;
+}
+
+static void write_small_stack(const std::string& filename, TiffWriterOptions options, unsigned int num_frames) {
+    TiffWriter tw(filename, options);
+    std::vector<uint16_t> frame(32 * 16);
+    for (unsigned int i = 0; i < num_frames; ++i) {
+        for (unsigned int pix = 0; pix < frame.size(); ++pix) {
+            frame[pix] = pixel(i, pix, 0xFFFF);
+        }
+        tw.write_frame(32, 16, frame.data());
+    }
+    tw.close();
+}
+
+static bool file_exists(const std::string& filename) {
+    FILE* f = fopen(filename.c_str(), "rb");
+    if (f != nullptr) {
+        fclose(f);
+    }
+    return f != nullptr;
+}
+
+// A split file left over from an earlier, longer stack at the same path must not be read as part of a new one
+static bool check_stale_split_files() {
+    const std::string filename = "teststack_stale.tif";
+    const std::string stale = number_filename(filename, 1);
+    TiffWriterOptions options;
+    options.write_index = true;
+    bool success = true;
+    try {
+        write_small_stack(filename, options, 3);
+        write_small_stack(stale, options, 5);
+        if (StackReader(filename).get_num_frames() != 3) {
+            std::cerr << "Split file not in the index was read" << std::endl;
+            success = false;
+        }
+        write_small_stack(filename, options, 2);
+        if (file_exists(stale)) {
+            std::cerr << "Old split file not deleted for a new stack" << std::endl;
+            success = false;
+        }
+    } catch (const std::exception& ex) {
+        std::cerr << ex.what() << std::endl;
+        success = false;
+    }
+    remove(stale.c_str());
+    remove(stack_index_filename(stale).c_str());
+    if (remove(filename.c_str()) != 0 || remove(stack_index_filename(filename).c_str()) != 0) {
+        std::cerr << "Could not delete temp files" << std::endl;
+    }
+    return success;
+}
+
+// An index with impossible counts is ignored and rebuilt instead of failing the reader
+static bool check_corrupt_index() {
+    const std::string filename = "teststack_corrupt.tif";
+    bool success = true;
+    try {
+        TiffWriterOptions options;
+        options.write_index = false;
+        write_small_stack(filename, options, 3);
+        {
+            std::ofstream index(stack_index_filename(filename), std::ios::binary);
+            const uint32_t magic = 0x58494350;
+            const uint16_t version = 1;
+            const uint16_t frame_info_size = sizeof(StackFrameInfo);
+            const uint32_t counts[2] = {0xFFFFFFFF, 0xFFFFFFFF};
+            index.write(reinterpret_cast<const char*>(&magic), sizeof(magic));
+            index.write(reinterpret_cast<const char*>(&version), sizeof(version));
+            index.write(reinterpret_cast<const char*>(&frame_info_size), sizeof(frame_info_size));
+            index.write(reinterpret_cast<const char*>(counts), sizeof(counts));
+        }
+        StackReader reader(filename);
+        if (reader.index_loaded_from_cache() || reader.get_num_frames() != 3) {
+            std::cerr << "Corrupt index not rebuilt" << std::endl;
+            success = false;
+        }
+    } catch (const std::exception& ex) {
+        std::cerr << ex.what() << std::endl;
+        success = false;
+    }
+    if (remove(filename.c_str()) != 0 || remove(stack_index_filename(filename).c_str()) != 0) {
+        std::cerr << "Could not delete temp files" << std::endl;
+    }
+    return success;
+}
+
+int main(int argc, char** argv) {
+    bool success = true;
+
+    std::cout << "Reading uncompressed stack" << std::endl;
+    success = check_stack("teststack.tif", TiffWriterOptions(), 0xFFFF) && success;
+
+    std::cout << "Reading deflate compressed stack" << std::endl;
+    TiffWriterOptions deflate;
+    deflate.compression = TiffCompression::deflate;
+    success = check_stack("teststack_deflate.tif", deflate, 0xFFFF) && success;
+
+    std::cout << "Reading stack written without index" << std::endl;
+    TiffWriterOptions no_index;
+    no_index.write_index = false;
+    success = check_stack("teststack_noindex.tif", no_index, 0xFFFF) && success;
+
+    std::cout << "Reading 12 bit stack" << std::endl;
+    TiffWriterOptions packed;
+    packed.bits_per_sample = 12;
+    success = check_stack("teststack_12bit.tif", packed, 0xFFF) && success;
+
+    std::cout << "Reading striped stack" << std::endl;
+    success = check_striped_stack() && success;
+
+    std::cout << "Old split files are ignored and deleted" << std::endl;
+    success = check_stale_split_files() && success;
+
+    std::cout << "Corrupt index is rebuilt" << std::endl;
+    success = check_corrupt_index() && success;
+
+    std::cout << "Missing stacks are reported" << std::endl;
+    try {
+        StackReader reader("does_not_exist.tif");
+        std::cerr << "No exception for missing stack" << std::endl;
+        success = false;
+    } catch (const std::runtime_error&) { }
+
+    return success? 0:1;
+}
@@ -1,7 +1,109 @@
 #include <iostream>
+#include <algorithm>
+#include <stdexcept>
 #include <cstring>
 #include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <vector>
+#include <zlib.h>
 #include "tiff_writer.hpp"
+#include "bitpack.hpp"
+#include "stack_index.hpp"
+
+static uint32_t read32(const std::vector<uint8_t>& file, size_t offset) {
+    return file[offset] | (file[offset + 1] << 8) | (file[offset + 2] << 16) | ((uint32_t)file[offset + 3] << 24);
+}
+
+static uint16_t read16(const std::vector<uint8_t>& file, size_t offset) {
+    return (uint16_t)(file[offset] | (file[offset + 1] << 8));
+}
+
+// Minimal reader for the tiffs written by TiffEncoder, returns the pixels of all pages
+static std::vector<std::vector<uint16_t>> read_encoded_tiff(const char* filename) {
+    std::ifstream in(filename, std::ios::binary);
+    std::vector<uint8_t> file((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    std::vector<std::vector<uint16_t>> pages;
+    for (uint32_t ifd = read32(file, 4); ifd != 0; ifd = read32(file, ifd + 2 + read16(file, ifd) * 12)) {
+        uint32_t width = 0, height = 0, bits = 0, compression = 0, predictor = 1, rows_per_strip = 0, num_strips = 0, offsets = 0, sizes = 0;
+        for (uint16_t i = 0; i < read16(file, ifd); ++i) {
+            size_t entry = ifd + 2 + i * 12;
+            uint16_t tag = read16(file, entry);
+            uint32_t value = read32(file, entry + 8);
+            if (tag == 256) width = value;
+            if (tag == 257) height = value;
+            if (tag == 258) bits = value & 0xFFFF;
+            if (tag == 259) compression = value & 0xFFFF;
+            if (tag == 278) rows_per_strip = value;
+            if (tag == 273) { num_strips = read32(file, entry + 4); offsets = value; }
+            if (tag == 279) sizes = value;
+            if (tag == 317) predictor = value & 0xFFFF;
+        }
+        size_t row_bytes = bits == 12 ? packed12_size(width) : width * 2;
+        std::vector<uint8_t> raw(row_bytes * height);
+        for (uint32_t strip = 0; strip < num_strips; ++strip) {
+            uint32_t offset = num_strips == 1 ? offsets : read32(file, offsets + strip * 4);
+            uint32_t size = num_strips == 1 ? sizes : read32(file, sizes + strip * 4);
+            uLongf out_size = (uLongf)(std::min(rows_per_strip, height - strip * rows_per_strip) * row_bytes);
+            uint8_t* dest = &raw[strip * rows_per_strip * row_bytes];
+            if (compression == 1) {
+                std::copy(&file[offset], &file[offset] + size, dest);
+            } else if (uncompress(dest, &out_size, &file[offset], size) != Z_OK) {
+                throw std::runtime_error("Could not decompress strip");
+            }
+        }
+        std::vector<uint16_t> pixels(width * height);
+        for (uint32_t row = 0; row < height; ++row) {
+            if (bits == 12) {
+                unpack12(&pixels[row * width], &raw[row * row_bytes], width);
+            } else {
+                std::copy(&raw[row * row_bytes], &raw[row * row_bytes] + row_bytes, (uint8_t*)&pixels[row * width]);
+            }
+            // Undo horizontal predictor
+            for (uint32_t x = 1; predictor == 2 && x < width; ++x) {
+                pixels[row * width + x] += pixels[row * width + x - 1];
+            }
+        }
+        pages.push_back(pixels);
+    }
+    return pages;
+}
+
+// Writes frames with the options and checks that they can be read back
+static bool check_encoded_tiff(const char* filename, TiffWriterOptions options, unsigned int width, unsigned int height, uint16_t max_value) {
+    bool success = true;
+    try {
+        std::vector<std::vector<uint16_t>> frames;
+        {
+            TiffWriter tw(filename, options);
+            for (unsigned int i = 0; i < 10; ++i) {
+                std::vector<uint16_t> frame(width * height);
+                for (unsigned int pix = 0; pix < frame.size(); ++pix) {
+                    frame[pix] = (uint16_t)((i * 1000 + pix % 4000) % (max_value + 1));
+                }
+                tw.write_frame(width, height, frame.data());
+                frames.push_back(frame);
+            }
+            tw.close();
+        }
+        if (read_encoded_tiff(filename) != frames) {
+            std::cerr << "Tiff does not contain the written frames" << std::endl;
+            success = false;
+        }
+        StackIndex index;
+        if (!read_stack_index(stack_index_filename(filename), index) || index.frames.size() != frames.size()) {
+            std::cerr << "Frame index not written" << std::endl;
+            success = false;
+        }
+    } catch (const std::exception& ex) {
+        std::cerr << ex.what() << std::endl;
+        success = false;
+    }
+    if (remove(filename) != 0 || remove(stack_index_filename(filename).c_str()) != 0) {
+        std::cerr << "Could not delete temp file" << std::endl;
+    }
+    return success;
+}
 
 int main(int argc, char** argv) {
     bool success = true;
@@ -9,7 +111,9 @@ int main(int argc, char** argv) {
     try {
         std::string filename_str(filename);
         std::cout << "Creating test tiff in " << filename_str << std::endl;
-        TiffWriter tw(filename_str);
+        TiffWriterOptions options;
+        options.write_index_json = true;
+        TiffWriter tw(filename_str, options);
         uint16_t* buffer = new uint16_t[1008*1008]();
         memset(buffer, 111, 1008*1008*2);
         for (int i = 0; i < 10; ++i) {
@@ -22,9 +126,58 @@ int main(int argc, char** argv) {
     } catch (...) {
         success = false;
     }
-    if (remove(filename) != 0) {
-        std::cerr << "Could not delete temp file" << std::endl;
+    for (const std::string& file : {std::string(filename), stack_index_filename(filename), stack_summary_filename(filename)}) {
+        if (remove(file.c_str()) != 0) {
+            std::cerr << "Could not delete temp file " << file << std::endl;
+        }
     }
 
+    std::cout << "Creating test tiff without index" << std::endl;
+    const char* no_index_filename = "testtiff_noindex.tif";
+    try {
+        TiffWriterOptions no_index;
+        no_index.write_index = false;
+        TiffWriter tw(no_index_filename, no_index);
+        std::vector<uint16_t> frame(640 * 480, 222);
+        for (int i = 0; i < 5; ++i) {
+            tw.write_frame(640, 480, frame.data());
+        }
+        tw.close();
+        // Uncompressed 16 bit without index is the TinyTIFF path
+        if (read_encoded_tiff(no_index_filename).size() != 5) {
+            std::cerr << "Wrong number of frames in tiff without index" << std::endl;
+            success = false;
+        }
+        StackIndex index;
+        if (read_stack_index(stack_index_filename(no_index_filename), index)) {
+            std::cerr << "Frame index written although disabled" << std::endl;
+            success = false;
+        }
+    } catch (const std::exception& ex) {
+        std::cerr << ex.what() << std::endl;
+        success = false;
+    }
+    if (remove(no_index_filename) != 0) {
+        std::cerr << "Could not delete temp file " << no_index_filename << std::endl;
+    }
+
+    std::cout << "Creating deflate compressed test tiff" << std::endl;
+    TiffWriterOptions deflate;
+    deflate.compression = TiffCompression::deflate;
+    deflate.compression_threads = 3;
+    success = check_encoded_tiff("testtiff_deflate.tif", deflate, 1008, 700, 0xFFFF) && success;
+
+    std::cout << "Creating 12 bit test tiff" << std::endl;
+    TiffWriterOptions packed;
+    packed.bits_per_sample = 12;
+    // Odd width to test padding at the end of rows
+    success = check_encoded_tiff("testtiff_12bit.tif", packed, 1007, 300, 0xFFF) && success;
+
+    std::cout << "Creating test tiff with io_uring" << (tiff_io_uring_available() ? "" : " (not available, using stdio)") << std::endl;
+    TiffWriterOptions uring;
+    uring.write_backend = TiffWriteBackend::io_uring;
+    // Frames larger than the io_uring buffers, odd width for padded IFDs
+    success = check_encoded_tiff("testtiff_uring.tif", uring, 1007, 1100, 0xFFFF) && success;
+
     return success? 0:1;
 }
@@ -58,6 +58,17 @@ int main(int argc, char** argv) {
 			success = false;
 		}
 
+		// Applying the same profile twice must not arm the camera again
+		AcquisitionProfile profile;
+		profile.segment1 = 500;
+		profile.segment2 = 20;
+		profile.active_segment = 1;
+		cam.apply(profile);
+		if (cam.apply(profile)) {
+			std::cerr << "Applying unchanged profile armed the camera" << std::endl;
+			success = false;
+		}
+
 		cam.reset_camera_settings();
 
 		cam.close();
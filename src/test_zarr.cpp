@@ -0,0 +1,107 @@
+#include <iostream>
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <zlib.h>
+#include "zarr_writer.hpp"
+
+#ifdef _WIN32
+#include <direct.h>
+#define rmdir _rmdir
+#else
+#include <unistd.h>
+#endif
+
+static std::string read_file(const std::string& filename) {
+    std::ifstream in(filename, std::ios::binary);
+    if (!in) {
+        throw std::runtime_error("Missing file " + filename);
+    }
+    return std::string((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+}
+
+static uint16_t pixel(unsigned int frame, unsigned int y, unsigned int x) {
+    return (uint16_t)(frame * 1000 + y * 10 + x);
+}
+
+int main(int argc, char** argv) {
+    bool success = true;
+    const std::string path = "testzarr.zarr";
+    const unsigned int width = 70;
+    const unsigned int height = 50;
+    const unsigned int num_frames = 10;
+    ZarrChunkShape chunks;
+    chunks.frames = 4;
+    chunks.height = 32;
+    chunks.width = 32;
+    std::vector<std::string> files = {path + "/.zarray", path + "/.zattrs"};
+    for (unsigned int t = 0; t < 3; ++t) {
+        for (unsigned int y = 0; y < 2; ++y) {
+            for (unsigned int x = 0; x < 3; ++x) {
+                files.push_back(path + "/" + std::to_string(t) + "." + std::to_string(y) + "." + std::to_string(x));
+            }
+        }
+    }
+
+    try {
+        std::cout << "Creating test zarr array in " << path << std::endl;
+        TiffWriterOptions options;
+        options.compression = TiffCompression::deflate;
+        options.compression_threads = 2;
+        ZarrWriter zarr(path, options, chunks);
+        std::vector<uint16_t> frame(width * height);
+        for (unsigned int i = 0; i < num_frames; ++i) {
+            for (unsigned int y = 0; y < height; ++y) {
+                for (unsigned int x = 0; x < width; ++x) {
+                    frame[y * width + x] = pixel(i, y, x);
+                }
+            }
+            zarr.write_frame(width, height, frame.data());
+        }
+        zarr.close();
+
+        if (read_file(path + "/.zarray").find("\"shape\": [10, 50, 70]") == std::string::npos) {
+            std::cerr << "Wrong shape in .zarray" << std::endl;
+            success = false;
+        }
+
+        // Last chunk in every dimension, partially filled
+        std::string compressed = read_file(path + "/2.1.2");
+        std::vector<uint16_t> chunk(chunks.frames * chunks.height * chunks.width);
+        uLongf size = (uLongf)(chunk.size() * sizeof(uint16_t));
+        if (uncompress((Bytef*)chunk.data(), &size, (const Bytef*)compressed.data(), (uLong)compressed.size()) != Z_OK) {
+            throw std::runtime_error("Could not decompress chunk");
+        }
+        for (unsigned int f = 0; f < chunks.frames; ++f) {
+            for (unsigned int y = 0; y < chunks.height; ++y) {
+                for (unsigned int x = 0; x < chunks.width; ++x) {
+                    unsigned int frame_index = 8 + f, image_y = 32 + y, image_x = 64 + x;
+                    bool inside = frame_index < num_frames && image_y < height && image_x < width;
+                    uint16_t expected = inside ? pixel(frame_index, image_y, image_x) : 0;
+                    if (chunk[(f * chunks.height + y) * chunks.width + x] != expected) {
+                        success = false;
+                    }
+                }
+            }
+        }
+        if (!success) {
+            std::cerr << "Wrong data in chunk" << std::endl;
+        }
+    } catch (const std::exception& ex) {
+        std::cerr << ex.what() << std::endl;
+        success = false;
+    }
+
+    for (const std::string& file : files) {
+        if (remove(file.c_str()) != 0) {
+            std::cerr << "Could not delete " << file << std::endl;
+            success = false;
+        }
+    }
+    rmdir(path.c_str());
+
+    return success? 0:1;
+}
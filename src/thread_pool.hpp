@@ -0,0 +1,82 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed number of worker threads executing tasks in submission order
+class ThreadPool {
+public:
+    /** @param num_threads - 0 uses one thread per hardware thread */
+    explicit ThreadPool(unsigned int num_threads = 0) {
+        if (num_threads == 0) {
+            num_threads = std::max(std::thread::hardware_concurrency(), 1u);
+        }
+        for (unsigned int i = 0; i < num_threads; ++i) {
+            workers.emplace_back([this]() { run(); });
+        }
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopped = true;
+        }
+        cv.notify_all();
+        for (std::thread& worker : workers) {
+            worker.join();
+        }
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator= (const ThreadPool&) = delete;
+
+    /** Queues the task. Exceptions thrown by the task are rethrown by the future. */
+    template<class F>
+    std::future<void> submit(F task) {
+        auto packaged = std::make_shared<std::packaged_task<void()>>(task);
+        std::future<void> future = packaged->get_future();
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            tasks.emplace_back([packaged]() { (*packaged)(); });
+        }
+        cv.notify_one();
+        return future;
+    }
+
+    unsigned int size() const {
+        return (unsigned int)workers.size();
+    }
+
+private:
+    void run() {
+        while (true) {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cv.wait(lock, [this]() { return stopped || !tasks.empty(); });
+                if (tasks.empty()) {
+                    return;
+                }
+                task = std::move(tasks.front());
+                tasks.pop_front();
+            }
+            task();
+        }
+    }
+
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<std::function<void()>> tasks;
+    bool stopped = false;
+};
+
+#endif //THREAD_POOL_H
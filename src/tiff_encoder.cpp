@@ -0,0 +1,504 @@
+#include "tiff_encoder.hpp"
+#include "bitpack.hpp"
+#include "stack_index.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <future>
+#include <stdexcept>
+#include <vector>
+
+#include <zlib.h>
+#ifdef TIFF_WRITER_ZSTD
+#include <zstd.h>
+#endif
+
+// Stay well below the 4GiB limit of classic tiff, same as the uncompressed writer
+static const uint64_t MAX_FILE_SIZE = (uint64_t)1024 * 1024 * 1024 * 3;
+
+// Strips are the unit of parallel compression, aim for this many bytes per strip
+static const size_t STRIP_BYTES = 256 * 1024;
+
+class StdioOutputFile : public TiffOutputFile {
+public:
+    StdioOutputFile(const std::string& filename) {
+        f = fopen(filename.c_str(), "wb");
+        if (f == nullptr) {
+            throw std::runtime_error("Could not open tiff file for writing");
+        }
+    }
+
+    ~StdioOutputFile() {
+        if (f != nullptr) {
+            fclose(f);
+        }
+    }
+
+    void write(uint64_t offset, const void* data, size_t size) override {
+        if (offset != position) {
+#ifdef _WIN32
+            int err = _fseeki64(f, (long long)offset, SEEK_SET);
+#else
+            int err = fseeko(f, (off_t)offset, SEEK_SET);
+#endif
+            if (err != 0) {
+                throw std::runtime_error("Seeking in tiff file failed");
+            }
+        }
+        if (fwrite(data, 1, size, f) != size) {
+            throw std::runtime_error("Writing frame failed");
+        }
+        position = offset + size;
+    }
+
+    void close() override {
+        FILE* closing = f;
+        f = nullptr;
+        if (fclose(closing) != 0) {
+            throw std::runtime_error("Closing tiff file failed");
+        }
+    }
+
+private:
+    FILE* f = nullptr;
+    uint64_t position = 0;
+};
+
+std::unique_ptr<TiffOutputFile> open_stdio_file(const std::string& filename) {
+    return std::unique_ptr<TiffOutputFile>(new StdioOutputFile(filename));
+}
+
+struct PendingFrame {
+    unsigned int width;
+    unsigned int height;
+    unsigned int rows_per_strip;
+    unsigned int num_strips;
+    // Bytes per row in the file
+    size_t row_bytes;
+    std::vector<uint16_t> pixels;
+    // Used instead of pixels for 32 and 8 bit frames
+    std::vector<uint32_t> pixels32;
+    std::vector<uint8_t> pixels8;
+    // Encoded strips, empty if the pixels are written as they are
+    std::vector<std::vector<uint8_t>> strips;
+    std::vector<std::future<void>> jobs;
+};
+
+// Horizontal differencing (tiff predictor 2), makes smooth images compress much better
+template<class T>
+static void apply_predictor(T* rows, unsigned int width, unsigned int num_rows) {
+    for (unsigned int row = 0; row < num_rows; ++row) {
+        T* pix = rows + (size_t)row * width;
+        T prev = 0;
+        for (unsigned int x = 0; x < width; ++x) {
+            T val = pix[x];
+            pix[x] = (T)(val - prev);
+            prev = val;
+        }
+    }
+}
+
+// The tiff predictor is only defined for 8, 16, 32 and 64 bit samples
+static bool use_predictor(const TiffWriterOptions& options) {
+    return options.compression != TiffCompression::none && options.bits_per_sample != 12;
+}
+
+static size_t row_bytes(const TiffWriterOptions& options, unsigned int width) {
+    return options.bits_per_sample == 12 ? packed12_size(width) : (size_t)width * (options.bits_per_sample / 8);
+}
+
+// Unencoded pixels of the frame starting at row
+static uint8_t* frame_rows(PendingFrame& frame, size_t row) {
+    if (!frame.pixels32.empty()) {
+        return (uint8_t*)(frame.pixels32.data() + row * frame.width);
+    }
+    if (!frame.pixels8.empty()) {
+        return frame.pixels8.data() + row * frame.width;
+    }
+    return (uint8_t*)(frame.pixels.data() + row * frame.width);
+}
+
+static void encode_strip(const TiffWriterOptions& options, PendingFrame& frame, unsigned int first_row, unsigned int num_rows, std::vector<uint8_t>& out) {
+    unsigned int width = frame.width;
+    uint8_t* rows = frame_rows(frame, first_row);
+    const uint8_t* data = rows;
+    size_t size = frame.row_bytes * num_rows;
+    std::vector<uint8_t> packed;
+    if (options.bits_per_sample == 12) {
+        // Rows start on a byte boundary
+        packed.resize(size);
+        for (unsigned int row = 0; row < num_rows; ++row) {
+            pack12(packed.data() + row * frame.row_bytes, (const uint16_t*)rows + (size_t)row * width, width);
+        }
+        data = packed.data();
+    }
+    if (use_predictor(options)) {
+        if (options.bits_per_sample == 32) {
+            apply_predictor((uint32_t*)rows, width, num_rows);
+        } else if (options.bits_per_sample == 8) {
+            apply_predictor(rows, width, num_rows);
+        } else {
+            apply_predictor((uint16_t*)rows, width, num_rows);
+        }
+    }
+
+    if (options.compression == TiffCompression::none) {
+        out.assign(data, data + size);
+    }
+    else if (options.compression == TiffCompression::deflate) {
+        int level = options.compression_level > 0 ? options.compression_level : Z_BEST_SPEED;
+        uLongf compressed_size = compressBound((uLong)size);
+        out.resize(compressed_size);
+        if (compress2(out.data(), &compressed_size, data, (uLong)size, level) != Z_OK) {
+            throw std::runtime_error("Deflate compression failed");
+        }
+        out.resize(compressed_size);
+    }
+#ifdef TIFF_WRITER_ZSTD
+    else if (options.compression == TiffCompression::zstd) {
+        int level = options.compression_level > 0 ? options.compression_level : 1;
+        out.resize(ZSTD_compressBound(size));
+        size_t compressed_size = ZSTD_compress(out.data(), out.size(), data, size, level);
+        if (ZSTD_isError(compressed_size)) {
+            throw std::runtime_error("Zstd compression failed");
+        }
+        out.resize(compressed_size);
+    }
+#endif
+    else {
+        throw std::runtime_error("Unsupported tiff compression");
+    }
+}
+
+static uint16_t compression_tag(TiffCompression compression) {
+    switch (compression) {
+    case TiffCompression::deflate: return 8; // Adobe deflate
+    case TiffCompression::zstd: return 50000; // as used by libtiff
+    default: return 1;
+    }
+}
+
+TiffEncoder::TiffEncoder(std::string filename, TiffWriterOptions options)
+: filename(filename), options(options), encode(options.compression != TiffCompression::none || options.bits_per_sample == 12)
+{
+#ifndef TIFF_WRITER_ZSTD
+    if (options.compression == TiffCompression::zstd) {
+        throw std::runtime_error("Zstd compression is not available, build with libzstd");
+    }
+#endif
+    if (options.bits_per_sample != 16 && options.bits_per_sample != 12 && options.bits_per_sample != 32 && options.bits_per_sample != 8) {
+        throw std::runtime_error("Only 16, 12, 32 and 8 bits per sample are supported");
+    }
+    if (encode) {
+        pool.reset(new ThreadPool(options.compression_threads));
+        // Enough frames to keep all compression threads busy while the writer is writing
+        max_frames_in_flight = pool->size() + 2;
+    } else {
+        // Nothing to wait for but the disk, one frame being written and the next one ready
+        max_frames_in_flight = 2;
+    }
+    writer = std::thread([this]() { run_writer(); });
+}
+
+TiffEncoder::~TiffEncoder() {
+    try {
+        close();
+    }
+    catch (...) {
+        // Destructor must not throw, use close to get errors
+    }
+}
+
+void TiffEncoder::rethrow() {
+    // The writer stops at the first error, so the error stays set for all later calls
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
+
+void TiffEncoder::write_frame(unsigned int width, unsigned int height, const uint16_t* data) {
+    if (options.bits_per_sample == 32 || options.bits_per_sample == 8) {
+        throw std::runtime_error(std::to_string(options.bits_per_sample) + " bit tiffs have to be written with write_frame" + std::to_string(options.bits_per_sample));
+    }
+    queue_frame(width, height, data);
+}
+
+void TiffEncoder::write_frame32(unsigned int width, unsigned int height, const uint32_t* data) {
+    if (options.bits_per_sample != 32) {
+        throw std::runtime_error("write_frame32 needs 32 bits per sample");
+    }
+    queue_frame(width, height, data);
+}
+
+void TiffEncoder::write_frame8(unsigned int width, unsigned int height, const uint8_t* data) {
+    if (options.bits_per_sample != 8) {
+        throw std::runtime_error("write_frame8 needs 8 bits per sample");
+    }
+    queue_frame(width, height, data);
+}
+
+void TiffEncoder::queue_frame(unsigned int width, unsigned int height, const void* data) {
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [this]() { return queue.size() < max_frames_in_flight || error; });
+        rethrow();
+        if (closing) {
+            throw std::runtime_error("Tiff file already closed");
+        }
+    }
+
+    std::unique_ptr<PendingFrame> frame(new PendingFrame());
+    frame->width = width;
+    frame->height = height;
+    frame->row_bytes = row_bytes(options, width);
+    frame->rows_per_strip = (unsigned int)std::max<size_t>(1, std::min<size_t>(height, STRIP_BYTES / std::max<size_t>(frame->row_bytes, 1)));
+    size_t num_pixels = (size_t)width * height;
+    if (options.bits_per_sample == 32) {
+        frame->pixels32.assign((const uint32_t*)data, (const uint32_t*)data + num_pixels);
+    } else if (options.bits_per_sample == 8) {
+        frame->pixels8.assign((const uint8_t*)data, (const uint8_t*)data + num_pixels);
+    } else {
+        frame->pixels.assign((const uint16_t*)data, (const uint16_t*)data + num_pixels);
+    }
+
+    frame->num_strips = (height + frame->rows_per_strip - 1) / frame->rows_per_strip;
+    frame->strips.resize(encode ? frame->num_strips : 0);
+    for (unsigned int strip = 0; encode && strip < frame->num_strips; ++strip) {
+        PendingFrame* f = frame.get();
+        const TiffWriterOptions* opts = &options;
+        frame->jobs.push_back(pool->submit([f, opts, strip]() {
+            unsigned int first_row = strip * f->rows_per_strip;
+            unsigned int num_rows = std::min(f->rows_per_strip, f->height - first_row);
+            encode_strip(*opts, *f, first_row, num_rows, f->strips[strip]);
+        }));
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    queue.push_back(std::move(frame));
+    cv.notify_all();
+}
+
+void TiffEncoder::close() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (closed) {
+            return;
+        }
+        closing = true;
+        closed = true;
+    }
+    cv.notify_all();
+    writer.join();
+    rethrow();
+}
+
+void TiffEncoder::run_writer() {
+    while (true) {
+        std::unique_ptr<PendingFrame> frame;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            cv.wait(lock, [this]() { return closing || !queue.empty(); });
+            if (queue.empty()) {
+                break;
+            }
+            frame = std::move(queue.front());
+            queue.pop_front();
+        }
+        try {
+            for (auto& job : frame->jobs) {
+                job.get();
+            }
+            write_page(*frame);
+        }
+        catch (...) {
+            std::lock_guard<std::mutex> lock(mutex);
+            error = std::current_exception();
+            // Drop remaining frames, compression jobs still reference them so wait for those
+            for (auto& queued : queue) {
+                for (auto& job : queued->jobs) {
+                    job.wait();
+                }
+            }
+            queue.clear();
+            cv.notify_all();
+            break;
+        }
+        cv.notify_all();
+    }
+
+    try {
+        if (file) {
+            file->close();
+        }
+    }
+    catch (...) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!error) {
+            error = std::current_exception();
+        }
+    }
+}
+
+void TiffEncoder::open_file() {
+    std::string name = file_number == 0 ? filename : number_filename(filename, file_number);
+    if (file_number == 0) {
+        remove_split_files(filename, 1);
+    }
+    if (options.write_backend == TiffWriteBackend::io_uring) {
+        file = open_uring_file(name);
+    }
+    if (!file) {
+        file = open_stdio_file(name);
+    }
+    // Little endian header, offset of first IFD follows at byte 4
+    const uint8_t header[8] = {'I', 'I', 42, 0, 0, 0, 0, 0};
+    file->write(0, header, sizeof(header));
+    file_size = sizeof(header);
+    next_ifd_pointer = 4;
+}
+
+// IFD entry as stored in the file
+struct IfdEntry {
+    uint16_t tag;
+    uint16_t type;
+    uint32_t count;
+    uint32_t value;
+};
+
+static const uint16_t TIFF_SHORT = 3;
+static const uint16_t TIFF_LONG = 4;
+
+static void put16(std::vector<uint8_t>& buf, uint16_t v) {
+    buf.push_back(v & 0xFF);
+    buf.push_back(v >> 8);
+}
+
+static void put32(std::vector<uint8_t>& buf, uint32_t v) {
+    put16(buf, v & 0xFFFF);
+    put16(buf, v >> 16);
+}
+
+// Data of strip i as written to the file
+static void strip_data(PendingFrame& frame, size_t i, const uint8_t*& data, size_t& size) {
+    if (!frame.strips.empty()) {
+        data = frame.strips[i].data();
+        size = frame.strips[i].size();
+        return;
+    }
+    size_t first_row = i * frame.rows_per_strip;
+    size_t num_rows = std::min<size_t>(frame.rows_per_strip, frame.height - first_row);
+    data = frame_rows(frame, first_row);
+    size = num_rows * frame.row_bytes;
+}
+
+void TiffEncoder::write_page(PendingFrame& frame) {
+    size_t num_strips = frame.num_strips;
+    // The predictor tag is only written if a predictor is used, libtiff warns about it otherwise
+    const uint16_t num_entries = use_predictor(options) ? 12 : 11;
+    size_t ifd_size = 2 + num_entries * 12 + 4;
+    size_t arrays_size = num_strips > 1 ? num_strips * 8 : 0;
+    uint64_t data_size = 0;
+    for (size_t i = 0; i < num_strips; ++i) {
+        const uint8_t* data;
+        size_t size;
+        strip_data(frame, i, data, size);
+        data_size += size;
+    }
+
+    if (file && file_size + data_size + ifd_size + arrays_size + 1 > MAX_FILE_SIZE) {
+        file->close();
+        file.reset();
+        file_number++;
+    }
+    if (!file) {
+        open_file();
+    }
+
+    // Strip data
+    std::vector<uint32_t> offsets(num_strips);
+    std::vector<uint32_t> sizes(num_strips);
+    uint64_t offset = file_size;
+    for (size_t i = 0; i < num_strips; ++i) {
+        const uint8_t* data;
+        size_t size;
+        strip_data(frame, i, data, size);
+        offsets[i] = (uint32_t)offset;
+        sizes[i] = (uint32_t)size;
+        file->write(offset, data, size);
+        offset += size;
+    }
+    // IFDs have to start on a word boundary. The padding is written so all writes are sequential.
+    if (offset % 2 != 0) {
+        const uint8_t padding = 0;
+        file->write(offset, &padding, 1);
+        offset++;
+    }
+    uint32_t ifd_offset = (uint32_t)offset;
+    uint32_t arrays_offset = ifd_offset + (uint32_t)ifd_size;
+
+    // Entries sorted by tag. Arrays of more than one value are stored after the IFD.
+    IfdEntry entries[] = {
+        {256, TIFF_LONG, 1, frame.width},
+        {257, TIFF_LONG, 1, frame.height},
+        {258, TIFF_SHORT, 1, options.bits_per_sample},
+        {259, TIFF_SHORT, 1, compression_tag(options.compression)},
+        {262, TIFF_SHORT, 1, 1}, // BlackIsZero
+        {273, TIFF_LONG, (uint32_t)num_strips, num_strips > 1 ? arrays_offset : offsets[0]},
+        {277, TIFF_SHORT, 1, 1},
+        {278, TIFF_LONG, 1, frame.rows_per_strip},
+        {279, TIFF_LONG, (uint32_t)num_strips, num_strips > 1 ? arrays_offset + (uint32_t)num_strips * 4 : sizes[0]},
+        {284, TIFF_SHORT, 1, 1},
+        {317, TIFF_SHORT, 1, 2},
+        {339, TIFF_SHORT, 1, 1}, // Unsigned integer
+    };
+
+    std::vector<uint8_t> ifd;
+    ifd.reserve(ifd_size + arrays_size);
+    put16(ifd, num_entries);
+    for (const IfdEntry& entry : entries) {
+        if (entry.tag == 317 && !use_predictor(options)) {
+            continue;
+        }
+        put16(ifd, entry.tag);
+        put16(ifd, entry.type);
+        put32(ifd, entry.count);
+        // Values smaller than 4 bytes are left aligned
+        if (entry.type == TIFF_SHORT && entry.count == 1) {
+            put16(ifd, (uint16_t)entry.value);
+            put16(ifd, 0);
+        } else {
+            put32(ifd, entry.value);
+        }
+    }
+    put32(ifd, 0); // No next IFD yet, patched when the next frame is written
+    if (num_strips > 1) {
+        for (uint32_t v : offsets) {
+            put32(ifd, v);
+        }
+        for (uint32_t v : sizes) {
+            put32(ifd, v);
+        }
+    }
+    file->write(ifd_offset, ifd.data(), ifd.size());
+
+    // Link previous IFD (or header) to this one
+    std::vector<uint8_t> link;
+    put32(link, ifd_offset);
+    file->write(next_ifd_pointer, link.data(), link.size());
+
+    next_ifd_pointer = ifd_offset + 2 + num_entries * 12;
+    file_size = ifd_offset + ifd.size();
+
+    StackFrameInfo info = {};
+    info.file = file_number;
+    info.width = frame.width;
+    info.height = frame.height;
+    info.bits_per_sample = (uint16_t)options.bits_per_sample;
+    info.compression = compression_tag(options.compression);
+    info.predictor = use_predictor(options) ? 2 : 1;
+    info.contiguous = 1;
+    info.ifd_offset = ifd_offset;
+    info.data_offset = offsets[0];
+    info.data_size = data_size;
+    written_frames.push_back(info);
+}
@@ -0,0 +1,81 @@
+#ifndef TIFF_ENCODER_H
+#define TIFF_ENCODER_H
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "tiff_writer.hpp"
+#include "thread_pool.hpp"
+#include "stack_index.hpp"
+
+// Destination of the encoded tiff data. All writes are positional so the writer can patch IFD offsets.
+class TiffOutputFile {
+public:
+    virtual ~TiffOutputFile() {}
+    virtual void write(uint64_t offset, const void* data, size_t size) = 0;
+    virtual void close() = 0;
+};
+
+std::unique_ptr<TiffOutputFile> open_stdio_file(const std::string& filename);
+/** Returns nullptr if io_uring is not available, see tiff_uring.cpp */
+std::unique_ptr<TiffOutputFile> open_uring_file(const std::string& filename);
+
+struct PendingFrame;
+
+// Writes multi page tiffs with compressed strips.
+// Strips are compressed on a thread pool while a single writer thread writes the frames to disk in order.
+class TiffEncoder {
+public:
+    TiffEncoder(std::string filename, TiffWriterOptions options);
+    ~TiffEncoder();
+    void write_frame(unsigned int width, unsigned int height, const uint16_t* data);
+    /** Only for 32 bits per sample */
+    void write_frame32(unsigned int width, unsigned int height, const uint32_t* data);
+    /** Only for 8 bits per sample */
+    void write_frame8(unsigned int width, unsigned int height, const uint8_t* data);
+    void close();
+
+    // Location of every written frame, only complete after close
+    const std::vector<StackFrameInfo>& frames() const { return written_frames; }
+    // Number of files the frames were split into
+    unsigned int num_files() const { return file ? file_number + 1 : file_number; }
+
+private:
+    void queue_frame(unsigned int width, unsigned int height, const void* data);
+    void run_writer();
+    void write_page(PendingFrame& frame);
+    void open_file();
+    void rethrow();
+
+    std::string filename;
+    TiffWriterOptions options;
+    // Strips are compressed or packed, otherwise written straight from the copy of the frame
+    bool encode;
+    // Only created if encode is set
+    std::unique_ptr<ThreadPool> pool;
+    unsigned int max_frames_in_flight;
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<std::unique_ptr<PendingFrame>> queue;
+    bool closing = false;
+    bool closed = false;
+    std::exception_ptr error;
+    std::thread writer;
+
+    // Only used by the writer thread
+    std::unique_ptr<TiffOutputFile> file;
+    unsigned int file_number = 0;
+    uint64_t file_size = 0;
+    // Where the offset of the next IFD has to be written
+    uint64_t next_ifd_pointer = 0;
+    std::vector<StackFrameInfo> written_frames;
+};
+
+#endif //TIFF_ENCODER_H
@@ -0,0 +1,113 @@
+#include "tiff_ifd.hpp"
+
+#include <stdexcept>
+
+static uint16_t read16(const MappedFile& file, uint64_t offset) {
+    if (offset + 2 > file.size()) {
+        throw std::runtime_error("Invalid tiff file, offset beyond end of file");
+    }
+    const uint8_t* p = file.data() + offset;
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static uint32_t read32(const MappedFile& file, uint64_t offset) {
+    if (offset + 4 > file.size()) {
+        throw std::runtime_error("Invalid tiff file, offset beyond end of file");
+    }
+    const uint8_t* p = file.data() + offset;
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+
+// Value number i of an IFD entry, SHORT or LONG only
+static uint32_t entry_value(const MappedFile& file, uint64_t entry, uint32_t i) {
+    uint16_t type = read16(file, entry + 2);
+    uint32_t count = read32(file, entry + 4);
+    if (type == 3) {
+        uint64_t values = count <= 2 ? entry + 8 : read32(file, entry + 8);
+        return read16(file, values + (uint64_t)i * 2);
+    } else if (type == 4) {
+        uint64_t values = count <= 1 ? entry + 8 : read32(file, entry + 8);
+        return read32(file, values + (uint64_t)i * 4);
+    }
+    throw std::runtime_error("Unsupported tiff tag type");
+}
+
+static std::vector<uint64_t> entry_values(const MappedFile& file, uint64_t entry) {
+    uint32_t count = read32(file, entry + 4);
+    // Every value takes at least 2 bytes in the file, this guards against garbage counts
+    if ((uint64_t)count * 2 > file.size()) {
+        throw std::runtime_error("Invalid tiff file, too many values in tag");
+    }
+    std::vector<uint64_t> values(count);
+    for (uint32_t i = 0; i < count; ++i) {
+        values[i] = entry_value(file, entry, i);
+    }
+    return values;
+}
+
+IfdValues parse_ifd(const MappedFile& file, uint64_t ifd) {
+    IfdValues values;
+    uint16_t num_entries = read16(file, ifd);
+    for (uint16_t i = 0; i < num_entries; ++i) {
+        uint64_t entry = ifd + 2 + (uint64_t)i * 12;
+        switch (read16(file, entry)) {
+        case 256: values.width = entry_value(file, entry, 0); break;
+        case 257: values.height = entry_value(file, entry, 0); break;
+        case 258: values.bits_per_sample = (uint16_t)entry_value(file, entry, 0); break;
+        case 259: values.compression = (uint16_t)entry_value(file, entry, 0); break;
+        case 273: values.strip_offsets = entry_values(file, entry); break;
+        case 277: values.samples_per_pixel = (uint16_t)entry_value(file, entry, 0); break;
+        case 279: values.strip_sizes = entry_values(file, entry); break;
+        case 317: values.predictor = (uint16_t)entry_value(file, entry, 0); break;
+        default: break;
+        }
+    }
+    values.next_ifd = read32(file, ifd + 2 + (uint64_t)num_entries * 12);
+
+    if (values.samples_per_pixel != 1 || (values.bits_per_sample != 16 && values.bits_per_sample != 12)) {
+        throw std::runtime_error("Only greyscale tiffs with 16 or 12 bits per sample are supported");
+    }
+    if (values.strip_offsets.empty() || values.strip_offsets.size() != values.strip_sizes.size()) {
+        throw std::runtime_error("Invalid tiff file, strips missing");
+    }
+    for (size_t i = 0; i < values.strip_offsets.size(); ++i) {
+        if (values.strip_offsets[i] + values.strip_sizes[i] > file.size()) {
+            throw std::runtime_error("Invalid tiff file, strip beyond end of file");
+        }
+    }
+    return values;
+}
+
+void index_tiff_file(const MappedFile& file, uint32_t file_number, std::vector<StackFrameInfo>& frames) {
+    if (file.size() < 8 || read16(file, 0) != 0x4949 || read16(file, 2) != 42) {
+        throw std::runtime_error("Not a little endian tiff file");
+    }
+    // IFDs are at least 6 bytes, more can't be in the file. Protects against IFD loops.
+    uint64_t max_ifds = file.size() / 6;
+    uint64_t num_ifds = 0;
+    for (uint32_t ifd = read32(file, 4); ifd != 0; ) {
+        if (++num_ifds > max_ifds) {
+            throw std::runtime_error("Invalid tiff file, IFDs form a loop");
+        }
+        IfdValues values = parse_ifd(file, ifd);
+        StackFrameInfo info = {};
+        info.file = file_number;
+        info.width = values.width;
+        info.height = values.height;
+        info.bits_per_sample = values.bits_per_sample;
+        info.compression = values.compression;
+        info.predictor = values.predictor;
+        info.ifd_offset = ifd;
+        info.data_offset = values.strip_offsets[0];
+        info.contiguous = 1;
+        for (size_t i = 0; i < values.strip_offsets.size(); ++i) {
+            if (values.strip_offsets[i] != info.data_offset + info.data_size) {
+                info.contiguous = 0;
+            }
+            info.data_size += values.strip_sizes[i];
+        }
+        frames.push_back(info);
+        ifd = values.next_ifd;
+    }
+}
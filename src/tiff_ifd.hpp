@@ -0,0 +1,28 @@
+#ifndef TIFF_IFD_H
+#define TIFF_IFD_H
+
+#include <cstdint>
+#include <vector>
+
+#include "mapped_file.hpp"
+#include "stack_index.hpp"
+
+// Tags of one tiff IFD needed to locate and decode a greyscale frame
+struct IfdValues {
+    uint32_t width = 0;
+    uint32_t height = 0;
+    uint16_t bits_per_sample = 1;
+    uint16_t compression = 1;
+    uint16_t predictor = 1;
+    uint16_t samples_per_pixel = 1;
+    std::vector<uint64_t> strip_offsets;
+    std::vector<uint64_t> strip_sizes;
+    uint32_t next_ifd = 0;
+};
+// Parses and validates the IFD at offset ifd. Only 16 and 12 bit greyscale images are supported.
+IfdValues parse_ifd(const MappedFile& file, uint64_t ifd);
+
+// Appends the location of every frame in the little endian tiff file to frames
+void index_tiff_file(const MappedFile& file, uint32_t file_number, std::vector<StackFrameInfo>& frames);
+
+#endif //TIFF_IFD_H
@@ -0,0 +1,355 @@
+#include "tiff_encoder.hpp"
+
+#ifdef TIFF_WRITER_URING
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+// Uses the kernel interface directly, the few calls needed don't justify a dependency on liburing
+
+static const unsigned int QUEUE_DEPTH = 16;
+// Sequential writes are collected into buffers of this size before they are submitted
+static const size_t BUFFER_SIZE = 1024 * 1024;
+
+static int io_uring_setup(unsigned int entries, io_uring_params* params) {
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int io_uring_enter(int ring_fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags) {
+    return (int)syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, nullptr, 0);
+}
+
+static int io_uring_register(int ring_fd, unsigned int opcode, const void* arg, unsigned int nr_args) {
+    return (int)syscall(__NR_io_uring_register, ring_fd, opcode, arg, nr_args);
+}
+
+// Writes through io_uring with up to QUEUE_DEPTH buffers in flight.
+// Buffers and the file are registered with the kernel when possible, which saves mapping them on every write.
+// Writes to a region that is still in flight wait for it first, so overlapping writes land in submission order.
+class UringOutputFile : public TiffOutputFile {
+public:
+    UringOutputFile(int fd, int ring_fd, const io_uring_params& params)
+    : fd(fd), ring_fd(ring_fd)
+    {
+        sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+        cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        if (params.features & IORING_FEAT_SINGLE_MMAP) {
+            sq_ring_size = cq_ring_size = std::max(sq_ring_size, cq_ring_size);
+        }
+        sq_ring = mmap(nullptr, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+        if (sq_ring == MAP_FAILED) {
+            sq_ring = nullptr;
+            release();
+            throw std::runtime_error("Could not map io_uring");
+        }
+        if (params.features & IORING_FEAT_SINGLE_MMAP) {
+            cq_ring = sq_ring;
+        } else {
+            cq_ring = mmap(nullptr, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+            if (cq_ring == MAP_FAILED) {
+                cq_ring = nullptr;
+                release();
+                throw std::runtime_error("Could not map io_uring");
+            }
+        }
+        sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+        void* sqes_map = mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+        if (sqes_map == MAP_FAILED) {
+            release();
+            throw std::runtime_error("Could not map io_uring");
+        }
+        sqes = static_cast<io_uring_sqe*>(sqes_map);
+
+        char* sq = static_cast<char*>(sq_ring);
+        sq_tail = reinterpret_cast<unsigned int*>(sq + params.sq_off.tail);
+        sq_mask = *reinterpret_cast<unsigned int*>(sq + params.sq_off.ring_mask);
+        sq_array = reinterpret_cast<unsigned int*>(sq + params.sq_off.array);
+        char* cq = static_cast<char*>(cq_ring);
+        cq_head = reinterpret_cast<unsigned int*>(cq + params.cq_off.head);
+        cq_tail = reinterpret_cast<unsigned int*>(cq + params.cq_off.tail);
+        cq_mask = *reinterpret_cast<unsigned int*>(cq + params.cq_off.ring_mask);
+        cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+
+        buffers.resize(QUEUE_DEPTH);
+        std::vector<iovec> iovecs(QUEUE_DEPTH);
+        for (unsigned int i = 0; i < QUEUE_DEPTH; ++i) {
+            void* mem = nullptr;
+            if (posix_memalign(&mem, 4096, BUFFER_SIZE) != 0) {
+                release();
+                throw std::runtime_error("Could not allocate io_uring buffers");
+            }
+            buffers[i].data = static_cast<uint8_t*>(mem);
+            iovecs[i].iov_base = mem;
+            iovecs[i].iov_len = BUFFER_SIZE;
+            free_buffers.push_back(i);
+        }
+        // Both can fail, e.g. if the locked memory limit is low. Plain writes work in that case.
+        fixed_buffers = io_uring_register(ring_fd, IORING_REGISTER_BUFFERS, iovecs.data(), QUEUE_DEPTH) == 0;
+        fixed_file = io_uring_register(ring_fd, IORING_REGISTER_FILES, &fd, 1) == 0;
+    }
+
+    ~UringOutputFile() {
+        if (fd >= 0) {
+            try {
+                wait_all();
+            }
+            catch (...) {
+                // Destructor must not throw, use close to get errors
+            }
+        }
+        release();
+    }
+
+    void write(uint64_t offset, const void* data, size_t size) override {
+        rethrow();
+        const uint8_t* src = static_cast<const uint8_t*>(data);
+        // Patch data which has not been submitted yet, e.g. the next IFD offset
+        if (current >= 0 && offset >= buffers[current].offset && offset + size <= buffers[current].offset + buffers[current].length) {
+            memcpy(buffers[current].data + (offset - buffers[current].offset), src, size);
+            return;
+        }
+        // Continue the current buffer if the write is sequential
+        if (current >= 0 && offset != buffers[current].offset + buffers[current].length) {
+            submit_current();
+        }
+        while (size > 0) {
+            if (current < 0) {
+                wait_for_overlap(offset, size);
+                current = acquire_buffer();
+                buffers[current].offset = offset;
+                buffers[current].length = 0;
+            }
+            Buffer& buffer = buffers[current];
+            size_t n = std::min(size, BUFFER_SIZE - buffer.length);
+            memcpy(buffer.data + buffer.length, src, n);
+            buffer.length += n;
+            src += n;
+            offset += n;
+            size -= n;
+            if (buffer.length == BUFFER_SIZE) {
+                submit_current();
+            }
+        }
+    }
+
+    void close() override {
+        wait_all();
+        int closing = fd;
+        fd = -1;
+        if (::close(closing) != 0) {
+            throw std::runtime_error("Closing tiff file failed");
+        }
+    }
+
+private:
+    struct Buffer {
+        uint8_t* data = nullptr;
+        uint64_t offset = 0;
+        size_t length = 0;
+        // Bytes of an in flight buffer already written, short writes are resubmitted
+        size_t written = 0;
+        bool in_flight = false;
+    };
+
+    void wait_all() {
+        if (current >= 0) {
+            submit_current();
+        }
+        while (in_flight > 0) {
+            wait_for_completion();
+        }
+        rethrow();
+    }
+
+    void rethrow() {
+        if (error != 0) {
+            throw std::runtime_error(std::string("Writing frame failed: ") + strerror(error));
+        }
+    }
+
+    int acquire_buffer() {
+        while (free_buffers.empty()) {
+            wait_for_completion();
+        }
+        int index = free_buffers.back();
+        free_buffers.pop_back();
+        return index;
+    }
+
+    void wait_for_overlap(uint64_t offset, size_t size) {
+        for (unsigned int i = 0; i < QUEUE_DEPTH; ++i) {
+            while (buffers[i].in_flight && offset < buffers[i].offset + buffers[i].length && buffers[i].offset < offset + size) {
+                wait_for_completion();
+            }
+        }
+    }
+
+    void submit_current() {
+        Buffer& buffer = buffers[current];
+        buffer.written = 0;
+        buffer.in_flight = true;
+        in_flight++;
+        submit(current);
+        current = -1;
+    }
+
+    void submit(int index) {
+        Buffer& buffer = buffers[index];
+        unsigned int tail = *sq_tail;
+        unsigned int slot = tail & sq_mask;
+        io_uring_sqe* sqe = &sqes[slot];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = fixed_buffers ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+        sqe->fd = fixed_file ? 0 : fd;
+        sqe->flags = fixed_file ? IOSQE_FIXED_FILE : 0;
+        sqe->addr = (uint64_t)(uintptr_t)(buffer.data + buffer.written);
+        sqe->len = (uint32_t)(buffer.length - buffer.written);
+        sqe->off = buffer.offset + buffer.written;
+        sqe->buf_index = fixed_buffers ? (uint16_t)index : 0;
+        sqe->user_data = (uint64_t)index;
+        sq_array[slot] = slot;
+        __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+        int ret;
+        do {
+            ret = io_uring_enter(ring_fd, 1, 0, 0);
+        } while (ret < 0 && errno == EINTR);
+        if (ret != 1) {
+            throw std::runtime_error("Submitting write to io_uring failed");
+        }
+    }
+
+    void wait_for_completion() {
+        unsigned int head = *cq_head;
+        while (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+            int ret = io_uring_enter(ring_fd, 0, 1, IORING_ENTER_GETEVENTS);
+            if (ret < 0 && errno != EINTR) {
+                throw std::runtime_error("Waiting for io_uring failed");
+            }
+        }
+        io_uring_cqe cqe = cqes[head & cq_mask];
+        __atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+
+        int index = (int)cqe.user_data;
+        Buffer& buffer = buffers[index];
+        if (cqe.res < 0) {
+            if (error == 0) {
+                error = -cqe.res;
+            }
+        } else if (cqe.res == 0) {
+            if (error == 0) {
+                error = EIO;
+            }
+        } else if (buffer.written + (size_t)cqe.res < buffer.length) {
+            buffer.written += (size_t)cqe.res;
+            submit(index);
+            return;
+        }
+        buffer.in_flight = false;
+        in_flight--;
+        free_buffers.push_back(index);
+    }
+
+    void release() {
+        for (Buffer& buffer : buffers) {
+            free(buffer.data);
+            buffer.data = nullptr;
+        }
+        if (sqes != nullptr) {
+            munmap(sqes, sqes_size);
+        }
+        if (cq_ring != nullptr && cq_ring != sq_ring) {
+            munmap(cq_ring, cq_ring_size);
+        }
+        if (sq_ring != nullptr) {
+            munmap(sq_ring, sq_ring_size);
+        }
+        sqes = nullptr;
+        sq_ring = cq_ring = nullptr;
+        if (ring_fd >= 0) {
+            ::close(ring_fd);
+            ring_fd = -1;
+        }
+        if (fd >= 0) {
+            ::close(fd);
+            fd = -1;
+        }
+    }
+
+    int fd;
+    int ring_fd;
+    void* sq_ring = nullptr;
+    void* cq_ring = nullptr;
+    size_t sq_ring_size = 0;
+    size_t cq_ring_size = 0;
+    io_uring_sqe* sqes = nullptr;
+    size_t sqes_size = 0;
+    unsigned int* sq_tail = nullptr;
+    unsigned int sq_mask = 0;
+    unsigned int* sq_array = nullptr;
+    unsigned int* cq_head = nullptr;
+    unsigned int* cq_tail = nullptr;
+    unsigned int cq_mask = 0;
+    io_uring_cqe* cqes = nullptr;
+
+    std::vector<Buffer> buffers;
+    std::vector<int> free_buffers;
+    // Buffer being filled, -1 if none
+    int current = -1;
+    unsigned int in_flight = 0;
+    bool fixed_buffers = false;
+    bool fixed_file = false;
+    // First errno reported by a completed write
+    int error = 0;
+};
+
+std::unique_ptr<TiffOutputFile> open_uring_file(const std::string& filename) {
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int ring_fd = io_uring_setup(QUEUE_DEPTH, &params);
+    if (ring_fd < 0) {
+        return nullptr;
+    }
+    int fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        ::close(ring_fd);
+        throw std::runtime_error("Could not open tiff file for writing");
+    }
+    return std::unique_ptr<TiffOutputFile>(new UringOutputFile(fd, ring_fd, params));
+}
+
+bool tiff_io_uring_available() {
+    static const bool available = []() {
+        io_uring_params params;
+        memset(&params, 0, sizeof(params));
+        int ring_fd = io_uring_setup(1, &params);
+        if (ring_fd < 0) {
+            return false;
+        }
+        ::close(ring_fd);
+        return true;
+    }();
+    return available;
+}
+
+#else
+
+std::unique_ptr<TiffOutputFile> open_uring_file(const std::string& filename) {
+    return nullptr;
+}
+
+bool tiff_io_uring_available() {
+    return false;
+}
+
+#endif
@@ -1,16 +1,44 @@
 #include "tiff_writer.hpp"
+#include <iostream>
 #include <stdexcept>
 
 #include "tinytiffwriter.h"
+#include "tiff_encoder.hpp"
+#include "tiff_ifd.hpp"
+#include "stack_index.hpp"
 
 class TiffWriterPimpl {
 public:
     TinyTIFFWriterFile* tif = nullptr;
+    // Used instead of TinyTIFF if the output is compressed, packed or written with io_uring
+    std::unique_ptr<TiffEncoder> encoder;
+    TiffWriterOptions options;
     std::string filename;
     unsigned int width;
     unsigned int height;
     unsigned int frames_written = 0;
     unsigned int file_number = 0;
+    bool any_frames = false;
+    bool closed = false;
+
+    void write_index();
+
+    TiffEncoder& open_encoder(unsigned int width_, unsigned int height_) {
+        if (!encoder) {
+            encoder.reset(new TiffEncoder(filename, options));
+            width = width_;
+            height = height_;
+        }
+        if (width != width_ || height != height_) {
+            throw std::runtime_error("Image size has to be the same for all frames in a tiff");
+        }
+        return *encoder;
+    }
+
+    bool use_encoder() const {
+        return options.compression != TiffCompression::none || options.bits_per_sample != 16
+            || (options.write_backend == TiffWriteBackend::io_uring && tiff_io_uring_available());
+    }
 };
 
 TiffWriter::TiffWriter(std::string filename)
@@ -19,12 +47,86 @@ TiffWriter::TiffWriter(std::string filename)
     p_impl->filename = filename;
 }
 
+TiffWriter::TiffWriter(std::string filename, TiffWriterOptions options)
+: p_impl(new TiffWriterPimpl())
+{
+    p_impl->filename = filename;
+    p_impl->options = options;
+}
+
 TiffWriter::~TiffWriter() {
+    try {
+        close();
+    }
+    catch (...) {
+        // Destructor must not throw, use close to get errors
+    }
+}
+
+void TiffWriter::close() {
+    if (p_impl->closed) {
+        return;
+    }
+    p_impl->closed = true;
     if (p_impl->tif != nullptr) {
         TinyTIFFWriter_close(p_impl->tif);
+        p_impl->tif = nullptr;
+    }
+    if (p_impl->encoder) {
+        p_impl->encoder->close();
+    }
+    if (p_impl->any_frames && p_impl->options.write_index) {
+        // The stack itself is complete, readers fall back to walking the IFDs without the index
+        try {
+            p_impl->write_index();
+        } catch (const std::exception& ex) {
+            std::cerr << "Could not write index of " << p_impl->filename << ": " << ex.what() << std::endl;
+        }
+    }
+}
+
+void TiffWriterPimpl::write_index() {
+    StackIndex index;
+    unsigned int num_files = encoder ? encoder->num_files() : file_number + 1;
+    for (unsigned int i = 0; i < num_files; ++i) {
+        index.files.push_back(stack_file_info(i == 0 ? filename : number_filename(filename, i)));
+    }
+    if (encoder) {
+        index.frames = encoder->frames();
+    } else {
+        // TinyTIFF does not tell where it put the frames, read them back from the IFDs once.
+        // Only the IFDs are touched, not the image data.
+        for (unsigned int i = 0; i < num_files; ++i) {
+            MappedFile file(i == 0 ? filename : number_filename(filename, i));
+            index_tiff_file(file, i, index.frames);
+        }
+    }
+    write_stack_index(stack_index_filename(filename), index);
+    if (options.write_index_json) {
+        write_stack_summary(filename, index);
     }
 }
 
+TiffCompression parse_tiff_compression(const std::string& name) {
+    if (name == "none") {
+        return TiffCompression::none;
+    } else if (name == "deflate") {
+        return TiffCompression::deflate;
+    } else if (name == "zstd") {
+        return TiffCompression::zstd;
+    }
+    throw std::runtime_error("Unknown tiff compression: " + name);
+}
+
+TiffWriteBackend parse_tiff_write_backend(const std::string& name) {
+    if (name == "stdio") {
+        return TiffWriteBackend::stdio;
+    } else if (name == "io_uring") {
+        return TiffWriteBackend::io_uring;
+    }
+    throw std::runtime_error("Unknown tiff write backend: " + name);
+}
+
 std::string number_filename(std::string filename, unsigned int number) {
     std::size_t found = filename.find_last_of(".");
     if (found == std::string::npos) {
@@ -34,8 +136,34 @@ std::string number_filename(std::string filename, unsigned int number) {
     }
 }
 
-void TiffWriter::write_frame(unsigned int width, unsigned int height, uint16_t* data) {
+void TiffWriter::write_frame32(unsigned int width, unsigned int height, const uint32_t* data) {
+    if (p_impl->closed) {
+        throw std::runtime_error("Tiff file already closed");
+    }
+    p_impl->open_encoder(width, height).write_frame32(width, height, data);
+    p_impl->any_frames = true;
+}
+
+void TiffWriter::write_frame8(unsigned int width, unsigned int height, const uint8_t* data) {
+    if (p_impl->closed) {
+        throw std::runtime_error("Tiff file already closed");
+    }
+    p_impl->open_encoder(width, height).write_frame8(width, height, data);
+    p_impl->any_frames = true;
+}
+
+void TiffWriter::write_frame(unsigned int width, unsigned int height, const uint16_t* data) {
+    if (p_impl->closed) {
+        throw std::runtime_error("Tiff file already closed");
+    }
+    if (p_impl->use_encoder()) {
+        p_impl->open_encoder(width, height).write_frame(width, height, data);
+        p_impl->any_frames = true;
+        return;
+    }
+
     if (p_impl->tif == nullptr) {
+        remove_split_files(p_impl->filename, 1);
         p_impl->tif = TinyTIFFWriter_open(p_impl->filename.c_str(), 16, TinyTIFFWriter_UInt, 0, width, height, TinyTIFFWriter_Greyscale);
         p_impl->width = width;
         p_impl->height = height;
@@ -65,4 +193,5 @@ void TiffWriter::write_frame(unsigned int width, unsigned int height, uint16_t*
         throw std::runtime_error("Writing frame failed");
     }
     p_impl->frames_written++;
+    p_impl->any_frames = true;
 }
@@ -0,0 +1,261 @@
+#include "zarr_writer.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <future>
+#include <sstream>
+#include <stdexcept>
+#include <vector>
+
+#ifdef _WIN32
+#include <direct.h>
+#else
+#include <sys/stat.h>
+#endif
+
+#include <zlib.h>
+#ifdef TIFF_WRITER_ZSTD
+#include <zstd.h>
+#endif
+
+#include "thread_pool.hpp"
+
+// chunks.frames images, collected until all their chunks can be written
+struct ZarrSlab {
+    std::vector<uint16_t> pixels;
+    unsigned int frames = 0;
+    std::vector<std::future<void>> jobs;
+};
+
+class ZarrWriterPimpl {
+public:
+    std::string path;
+    TiffWriterOptions options;
+    ZarrChunkShape chunks;
+    unsigned int width = 0;
+    unsigned int height = 0;
+    unsigned int frames_written = 0;
+    bool closed = false;
+
+    // One slab is filled while the chunks of the other one are compressed
+    ZarrSlab slabs[2];
+    unsigned int current = 0;
+    // Declared after the slabs so running jobs finish before the slabs are destroyed
+    ThreadPool pool;
+
+    ZarrWriterPimpl(TiffWriterOptions options)
+    : options(options), pool(options.compression_threads)
+    { }
+
+    void submit_slab(ZarrSlab& slab, unsigned int time_chunk);
+    void write_chunk(const ZarrSlab& slab, unsigned int time_chunk, unsigned int chunk_y, unsigned int chunk_x);
+    void write_metadata();
+};
+
+static void make_directory(const std::string& path) {
+#ifdef _WIN32
+    int err = _mkdir(path.c_str());
+#else
+    int err = mkdir(path.c_str(), 0777);
+#endif
+    if (err != 0 && errno != EEXIST) {
+        throw std::runtime_error("Could not create directory " + path);
+    }
+}
+
+static void write_file(const std::string& filename, const void* data, size_t size) {
+    FILE* f = fopen(filename.c_str(), "wb");
+    if (f == nullptr) {
+        throw std::runtime_error("Could not open " + filename + " for writing");
+    }
+    size_t written = fwrite(data, 1, size, f);
+    if (fclose(f) != 0 || written != size) {
+        throw std::runtime_error("Writing " + filename + " failed");
+    }
+}
+
+// Waits for all jobs, rethrows the first error after all of them are done
+static void wait_jobs(ZarrSlab& slab) {
+    std::exception_ptr error;
+    for (auto& job : slab.jobs) {
+        try {
+            job.get();
+        }
+        catch (...) {
+            if (!error) {
+                error = std::current_exception();
+            }
+        }
+    }
+    slab.jobs.clear();
+    slab.frames = 0;
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
+
+static int compression_level(const TiffWriterOptions& options) {
+    return options.compression_level > 0 ? options.compression_level : 1;
+}
+
+ZarrWriter::ZarrWriter(std::string path, TiffWriterOptions options, ZarrChunkShape chunks)
+: p_impl(new ZarrWriterPimpl(options))
+{
+#ifndef TIFF_WRITER_ZSTD
+    if (options.compression == TiffCompression::zstd) {
+        throw std::runtime_error("Zstd compression is not available, build with libzstd");
+    }
+#endif
+    if (options.bits_per_sample != 16) {
+        throw std::runtime_error("Zarr arrays are always written with 16 bits per sample");
+    }
+    if (chunks.frames == 0 || chunks.height == 0 || chunks.width == 0) {
+        throw std::runtime_error("Zarr chunk size has to be at least 1 in every dimension");
+    }
+    p_impl->path = path;
+    p_impl->chunks = chunks;
+    make_directory(path);
+}
+
+ZarrWriter::~ZarrWriter() {
+    try {
+        close();
+    }
+    catch (...) {
+        // Destructor must not throw, use close to get errors
+    }
+}
+
+void ZarrWriter::write_frame(unsigned int width, unsigned int height, const uint16_t* data) {
+    ZarrWriterPimpl& p = *p_impl;
+    if (p.closed) {
+        throw std::runtime_error("Zarr array already closed");
+    }
+    if (p.frames_written == 0) {
+        p.width = width;
+        p.height = height;
+        p.chunks.height = std::min(p.chunks.height, height);
+        p.chunks.width = std::min(p.chunks.width, width);
+    }
+    if (p.width != width || p.height != height) {
+        throw std::runtime_error("Image size has to be the same for all frames in a zarr array");
+    }
+
+    ZarrSlab& slab = p.slabs[p.current];
+    if (!slab.jobs.empty()) {
+        wait_jobs(slab);
+    }
+    size_t frame_size = (size_t)width * height;
+    slab.pixels.resize(frame_size * p.chunks.frames);
+    memcpy(slab.pixels.data() + frame_size * slab.frames, data, frame_size * sizeof(uint16_t));
+    slab.frames++;
+    p.frames_written++;
+
+    if (slab.frames == p.chunks.frames) {
+        p.submit_slab(slab, (p.frames_written - 1) / p.chunks.frames);
+        p.current = 1 - p.current;
+    }
+}
+
+void ZarrWriter::close() {
+    ZarrWriterPimpl& p = *p_impl;
+    if (p.closed) {
+        return;
+    }
+    p.closed = true;
+    ZarrSlab& slab = p.slabs[p.current];
+    if (slab.frames > 0 && slab.jobs.empty()) {
+        // Last chunks along t are only partially filled, the rest is fill value
+        p.submit_slab(slab, (p.frames_written - 1) / p.chunks.frames);
+    }
+    wait_jobs(p.slabs[0]);
+    wait_jobs(p.slabs[1]);
+    p.write_metadata();
+}
+
+void ZarrWriterPimpl::submit_slab(ZarrSlab& slab, unsigned int time_chunk) {
+    unsigned int chunks_y = (height + chunks.height - 1) / chunks.height;
+    unsigned int chunks_x = (width + chunks.width - 1) / chunks.width;
+    for (unsigned int cy = 0; cy < chunks_y; ++cy) {
+        for (unsigned int cx = 0; cx < chunks_x; ++cx) {
+            const ZarrSlab* s = &slab;
+            slab.jobs.push_back(pool.submit([this, s, time_chunk, cy, cx]() {
+                write_chunk(*s, time_chunk, cy, cx);
+            }));
+        }
+    }
+}
+
+void ZarrWriterPimpl::write_chunk(const ZarrSlab& slab, unsigned int time_chunk, unsigned int chunk_y, unsigned int chunk_x) {
+    // Chunks at the edges are padded to the full chunk size
+    std::vector<uint16_t> chunk((size_t)chunks.frames * chunks.height * chunks.width, 0);
+    unsigned int y0 = chunk_y * chunks.height;
+    unsigned int x0 = chunk_x * chunks.width;
+    unsigned int rows = std::min(chunks.height, height - y0);
+    unsigned int cols = std::min(chunks.width, width - x0);
+    for (unsigned int f = 0; f < slab.frames; ++f) {
+        for (unsigned int r = 0; r < rows; ++r) {
+            const uint16_t* src = slab.pixels.data() + ((size_t)f * height + y0 + r) * width + x0;
+            uint16_t* dest = chunk.data() + ((size_t)f * chunks.height + r) * chunks.width;
+            memcpy(dest, src, cols * sizeof(uint16_t));
+        }
+    }
+
+    std::ostringstream name;
+    name << path << "/" << time_chunk << "." << chunk_y << "." << chunk_x;
+    size_t size = chunk.size() * sizeof(uint16_t);
+
+    if (options.compression == TiffCompression::deflate) {
+        uLongf compressed_size = compressBound((uLong)size);
+        std::vector<uint8_t> out(compressed_size);
+        if (compress2(out.data(), &compressed_size, (const Bytef*)chunk.data(), (uLong)size, compression_level(options)) != Z_OK) {
+            throw std::runtime_error("Deflate compression failed");
+        }
+        write_file(name.str(), out.data(), compressed_size);
+    }
+#ifdef TIFF_WRITER_ZSTD
+    else if (options.compression == TiffCompression::zstd) {
+        std::vector<uint8_t> out(ZSTD_compressBound(size));
+        size_t compressed_size = ZSTD_compress(out.data(), out.size(), chunk.data(), size, compression_level(options));
+        if (ZSTD_isError(compressed_size)) {
+            throw std::runtime_error("Zstd compression failed");
+        }
+        write_file(name.str(), out.data(), compressed_size);
+    }
+#endif
+    else {
+        write_file(name.str(), chunk.data(), size);
+    }
+}
+
+void ZarrWriterPimpl::write_metadata() {
+    std::ostringstream compressor;
+    if (options.compression == TiffCompression::deflate) {
+        compressor << "{\"id\": \"zlib\", \"level\": " << compression_level(options) << "}";
+    } else if (options.compression == TiffCompression::zstd) {
+        compressor << "{\"id\": \"zstd\", \"level\": " << compression_level(options) << "}";
+    } else {
+        compressor << "null";
+    }
+
+    std::ostringstream zarray;
+    zarray << "{\n"
+        << "    \"zarr_format\": 2,\n"
+        << "    \"shape\": [" << frames_written << ", " << height << ", " << width << "],\n"
+        << "    \"chunks\": [" << chunks.frames << ", " << chunks.height << ", " << chunks.width << "],\n"
+        << "    \"dtype\": \"<u2\",\n"
+        << "    \"compressor\": " << compressor.str() << ",\n"
+        << "    \"fill_value\": 0,\n"
+        << "    \"order\": \"C\",\n"
+        << "    \"filters\": null,\n"
+        << "    \"dimension_separator\": \".\"\n"
+        << "}\n";
+    std::string zarray_str = zarray.str();
+    write_file(path + "/.zarray", zarray_str.data(), zarray_str.size());
+
+    // Axis names as used by xarray
+    std::string zattrs = "{\n    \"_ARRAY_DIMENSIONS\": [\"t\", \"y\", \"x\"]\n}\n";
+    write_file(path + "/.zattrs", zattrs.data(), zattrs.size());
+}